@@ -83,6 +83,8 @@ inline int recv_msg_client(char* buffer, size_t size)
 
 static int register_with_server()
 {   
+    char codec[16] = "";
+
     /*This function is called right after a connection to the server is made, and before the connection is registered to epoll. 
     Therefore, all send/recv here are still blocking, and thus all actions done here are synchronous. 
     Additionally, the client/server will not deal with partial send/recvs before registration is complete*/
@@ -94,7 +96,7 @@ static int register_with_server()
 
     //Register my desired username
     printf("Registering username \"%s\"...\n", my_username);
-    sprintf(buffer, "!regid=%s", my_username);
+    sprintf(buffer, "!regid=%s,codec=%s", my_username, XFER_CODEC_NAME);
     if(send_direct(my_socketfd, buffer, strlen(buffer)+1) <= 0)
         return 0;
 
@@ -105,8 +107,12 @@ static int register_with_server()
     //Did we receive an anticipated registration reply?
     if(strncmp(buffer, "!regid=", 7) == 0)
     {
-        sscanf(&buffer[7], "%s", my_username);
+        sscanf(&buffer[7], "%[^,],codec=%15s", my_username, codec);
         printf("Registered with server as \"%s\"\n", my_username);
+
+        //Longer messages (and group file transfers) are compressed from now on, if the server accepted our codec
+        if(strcmp(codec, XFER_CODEC_NAME) == 0)
+            pending_msg.codec = XFER_CODEC_LZ;
     }
     else
         goto register_with_server_failed;
@@ -166,8 +172,7 @@ register_with_server_failed:
 
 static void exit_cleanup()
 {
-    if(file_transfers)
-        cancel_transfer(file_transfers);
+    cancel_all_transfers();
     
     close(my_socketfd);
     pthread_cancel(connection_thread);
@@ -249,36 +254,40 @@ static void handle_main_socket_events(int events)
 }
 
 
-static void handle_transfer_connection_events(int events)
+static void handle_transfer_connection_events(XferStream *stream, int events)
 {
-    if(!file_transfers)
-        printf("No pending file transfers. Ignoring event...\n");
+    FileXferArgs *args = stream->xferargs;
 
     //The transfer connection has been terminated by the server (upon completion or failure)
     if(events & EPOLLRDHUP)
     {
         printf("Server has closed our transfer connection.\n");
         
-        if(file_transfers->transferred != file_transfers->filesize)
+        if(args->transferred != args->filesize)
             printf("Transferred %zu\\%zu bytes with \"%s\" before failure.\n", 
-                    file_transfers->transferred, file_transfers->filesize, file_transfers->target_name);
+                    args->transferred, args->filesize, args->target_name);
 
-        cancel_transfer(file_transfers);
+        //The server keeps dropped group uploads for a while
+        if(args->transferred != args->filesize && args->target_type == GROUP_TARGET && args->operation == SENDING_OP)
+            printf("The upload can be resumed with \"@@%s !resumefile %s %s\"\n", args->target_name, args->token, args->target_file);
+
+        cancel_transfer(args);
     }   
 
     //The transfer connection is ready for receiving
     else if(events & EPOLLIN)
-        file_recv_next(file_transfers);
+        file_recv_next(stream);
     
     //The transfer connection is ready for sending
     else if(events & EPOLLOUT)
-        file_send_next(file_transfers);
+        file_send_next(stream);
 }
 
 
 static inline void client_main_loop()
 {
      struct epoll_event events[MAX_EPOLL_EVENTS];
+     XferStream *xferstream;
      int ready_count, i;
      
     while(1)
@@ -299,15 +308,13 @@ static inline void client_main_loop()
             if(events[i].data.fd == my_socketfd)
                 handle_main_socket_events(events[i].events);
   
-            /* Transfer connections (and related fd's) */
-            else if (file_transfers)
-            {   
-                if(events[i].data.fd == file_transfers->socketfd)
-                    handle_transfer_connection_events(events[i].events);
-
-                else if(events[i].data.fd == file_transfers->timerfd)
-                    print_transfer_progress();
-            }
+            /* Periodic transfer progress notification */
+            else if(progress_timerfd && events[i].data.fd == progress_timerfd)
+                print_transfer_progress();
+  
+            /* Transfer connections */
+            else if((xferstream = find_transfer_connection(events[i].data.fd)))
+                handle_transfer_connection_events(xferstream, events[i].events);
         }
 
         pthread_mutex_unlock(&buffer_lock);
@@ -424,6 +431,10 @@ void client(const char* hostname, const unsigned int port,  char *username)
     if(!register_fd_with_epoll(epoll_fd, my_socketfd, CLIENT_EPOLL_FLAGS))
         return;   
 
+    /*Files being sent are prepared (checksummed) on a background thread*/
+    if(!file_prep_init())
+        return;
+
     /*Spawn the main network/event loop as a seperate thread*/
     if(pthread_create(&connection_thread, NULL, (void*) &client_main_loop, NULL) != 0)
     {
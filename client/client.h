@@ -15,6 +15,7 @@ extern int my_socketfd;
 extern struct sockaddr_in server_addr;
 extern int epoll_fd;
 extern char* my_username;
+extern Pending_Msg pending_msg;
 
 
 extern char *buffer;
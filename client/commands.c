@@ -25,18 +25,21 @@ int handle_user_command()
     else if(strncmp("!sendfile ", msg_body, 10) == 0)
         return outgoing_file();
     
-    else if(strcmp("!acceptfile", msg_body) == 0)
+    else if(strncmp("!acceptfile", msg_body, 11) == 0)
         return accept_incoming_file();
 
-    else if(strcmp("!rejectfile", msg_body) == 0)
+    else if(strncmp("!rejectfile", msg_body, 11) == 0)
         return reject_incoming_file();
 
-    else if(strcmp("!cancelfile", msg_body) == 0)
+    else if(strncmp("!cancelfile", msg_body, 11) == 0)
         return cancel_ongoing_file_transfer();
 
     else if(strncmp("!putfile ", msg_body, 9) == 0)   
         return outgoing_file_group();
 
+    else if(strncmp("!resumefile ", msg_body, 12) == 0)
+        return outgoing_resume_group();
+
     return 1;
 }
 
@@ -94,6 +97,22 @@ void parse_error_code()
             printf("Target has no valid pending transfer with you");
             break;
 
+        case ERR_QUOTA_EXCEEDED:
+            printf("The file does not fit in the group's (or the server's) storage quota");
+            break;
+
+        case ERR_QUEUE_FULL:
+            printf("The user is offline, and no more messages can be kept for them until they connect");
+            break;
+
+        case ERR_UPGRADING:
+            printf("The server is being upgraded. File transfers can start again once it is done");
+            break;
+
+        case ERR_FLOODING:
+            printf("You are sending messages too fast. Messages over the limit are dropped");
+            break;
+
         default:
             printf("Unknown error %u", err);
     }
@@ -104,6 +123,18 @@ void parse_error_code()
         printf(".\n");
 }
 
+void parse_offline_pms()
+{
+    unsigned int count, header_len = 0;
+
+    //The header is followed by one line per PM, already formatted by the server
+    sscanf(buffer, "!offlinepms=%u\n%n", &count, &header_len);
+    printf("%u private message(s) were sent to you while you were offline:\n", count);
+
+    if(header_len)
+        printf("%s", &buffer[header_len]);
+}
+
 void parse_control_message(char* cmd_buffer)
 {
     char *old_buffer = buffer;
@@ -112,6 +143,10 @@ void parse_control_message(char* cmd_buffer)
     if(strncmp("!err=", buffer, 5) == 0)
         parse_error_code();
 
+    //The server checks that idle clients are still there
+    else if(strcmp("!ping", buffer) == 0)
+        send_msg_client("!pong", 6);
+
     /*Group operations. Implemented in group.c*/
     else if(strncmp("!grouplist=", buffer, 10) == 0)
         parse_grouplist();
@@ -142,6 +177,9 @@ void parse_control_message(char* cmd_buffer)
     else if(strncmp("!sendfile=", buffer, 10) == 0)
         incoming_file();
 
+    else if(strncmp("!delivered=", buffer, 11) == 0)
+        transfer_delivered();
+
     else if(strncmp("!acceptfile=", buffer, 12) == 0)
         recver_accepted_file();
 
@@ -151,14 +189,44 @@ void parse_control_message(char* cmd_buffer)
     else if(strncmp("!cancelfile=", buffer, 12) == 0)
         file_transfer_cancelled();
 
+    else if(strncmp("!xfercrc=", buffer, 9) == 0)
+        checksum_trailer();
+
+    else if(strncmp("!xferchunks=", buffer, 12) == 0)
+        download_chunk_checksums();
+
+    else if(strncmp("!rechunk=", buffer, 9) == 0)
+        resend_upload_chunk();
+
     else if(strncmp("!filelist=", buffer, 10) == 0)
         parse_filelist();
 
+    else if(strncmp("!history=", buffer, 9) == 0)
+        parse_history();
+
+    else if(strncmp("!search=", buffer, 8) == 0)
+        parse_search_results();
+
+    else if(strncmp("!offlinepms=", buffer, 12) == 0)
+        parse_offline_pms();
+
     else if(strncmp("!putfile=", buffer, 9) == 0)
         new_group_file_ready();
 
+    else if(strncmp("!uploading=", buffer, 11) == 0)
+        group_file_uploading();
+
+    else if(strncmp("!uploadstatus=", buffer, 14) == 0)
+        group_upload_status();
+
     else if(strncmp("!getfile=", buffer, 9) == 0)
         incoming_group_file();
+
+    else if(strncmp("!resumefile=", buffer, 12) == 0)
+        resumed_file_sending();
+
+    else if(strncmp("!dedupfile=", buffer, 11) == 0)
+        deduplicated_file_sending();
     
     else
         printf("Received invalid control message \"%s\"\n", buffer);
@@ -5,6 +5,7 @@
 
 int handle_user_command();
 void parse_error_code();
+void parse_offline_pms();
 void parse_control_message(char* cmd_buffer);
 
 
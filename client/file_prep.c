@@ -0,0 +1,145 @@
+#include "file_prep.h"
+#include "client.h"
+
+
+static pthread_t prep_thread;
+static pthread_mutex_t prep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prep_ready = PTHREAD_COND_INITIALIZER;
+static FilePrepJob *prep_jobs = NULL;           //Queued jobs, oldest first
+static unsigned int last_prep_id = 0;
+
+
+
+/******************************/
+/*       Worker Thread        */
+/******************************/
+
+static int run_file_prep(FilePrepJob *job)
+{
+    unsigned char *filemap;
+    size_t offset, length;
+    unsigned int chunk;
+
+    job->checksum = CRC_INIT;
+    if(job->type == PREP_PUTFILE)
+    {
+        job->chunk_count = xfer_chunk_count(job->filesize);
+        job->chunk_crcs = malloc(job->chunk_count * sizeof(unsigned int));
+    }
+
+    if(job->filesize == 0)
+    {
+        if(job->type == PREP_PUTFILE)
+            content_hash(NULL, 0, job->hash);
+        return 1;
+    }
+
+    filemap = mmap(NULL, job->filesize, PROT_READ, MAP_SHARED, job->fd, 0);
+    if(filemap == MAP_FAILED)
+    {
+        perror("Failed to map file in memory for preparing.");
+        return 0;
+    }
+
+    //Checksum the file (crc32) one chunk at a time. Uploads keep each chunk's own checksum, and the file's checksum is composed from them without a second pass
+    for(chunk = 0, offset = 0; offset < job->filesize; chunk++, offset += length)
+    {
+        length = job->filesize - offset;
+        if(length > XFER_CHUNK_SIZE)
+            length = XFER_CHUNK_SIZE;
+
+        if(job->type == PREP_PUTFILE)
+        {
+            job->chunk_crcs[chunk] = xcrc32(&filemap[offset], length, CRC_INIT);
+            job->checksum = crc32_append(job->checksum, job->chunk_crcs[chunk], length);
+        }
+        else
+            job->checksum = xcrc32(&filemap[offset], length, job->checksum);
+    }
+
+    if(job->type == PREP_PUTFILE)
+        content_hash(filemap, job->filesize, job->hash);
+
+    munmap((void*)filemap, job->filesize);
+    return 1;
+}
+
+static void* file_prep_loop(void *arg)
+{
+    FilePrepJob *job;
+    int succeeded;
+
+    while(1)
+    {
+        pthread_mutex_lock(&prep_lock);
+        while(!prep_jobs)
+            pthread_cond_wait(&prep_ready, &prep_lock);
+
+        job = prep_jobs;
+        LL_DELETE(prep_jobs, job);
+        pthread_mutex_unlock(&prep_lock);
+
+        //The file is read without holding buffer_lock, so the network loop and user input are never held up by it
+        succeeded = run_file_prep(job);
+        close(job->fd);
+
+        pthread_mutex_lock(&buffer_lock);
+        file_prep_completed(job, succeeded);
+        pthread_mutex_unlock(&buffer_lock);
+
+        free(job->chunk_crcs);
+        free(job);
+    }
+
+    return NULL;
+}
+
+int file_prep_init()
+{
+    if(pthread_create(&prep_thread, NULL, &file_prep_loop, NULL) != 0)
+    {
+        printf("Failed to create file preparation thread\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+
+
+/******************************/
+/*        Queueing Jobs       */
+/******************************/
+
+//Queues a file to be prepared in the background. Returns the job's id (never 0), or 0 on failure
+unsigned int queue_file_prep(int fd, size_t filesize, enum file_prep_type type)
+{
+    FilePrepJob *job;
+    unsigned int id;
+
+    job = calloc(1, sizeof(FilePrepJob));
+    job->type = type;
+    job->filesize = filesize;
+
+    //The transfer may close its own descriptor while the job is still reading the file
+    job->fd = dup(fd);
+    if(job->fd < 0)
+    {
+        perror("Failed to duplicate file descriptor for preparing.");
+        free(job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&prep_lock);
+
+    if(++last_prep_id == 0)
+        ++last_prep_id;
+    id = job->id = last_prep_id;
+    LL_APPEND(prep_jobs, job);
+
+    pthread_cond_signal(&prep_ready);
+    pthread_mutex_unlock(&prep_lock);
+
+    //The job may already be done (and freed) by now
+    return id;
+}
@@ -0,0 +1,37 @@
+#ifndef _FILE_PREP_H_
+#define _FILE_PREP_H_
+
+#include "../common/common.h"
+#include <pthread.h>
+
+
+//What to compute for a file before (or while) it is sent
+enum file_prep_type {
+    PREP_CHECKSUM = 0,          //!sendfile: the checksum follows the request as a trailer
+    PREP_PUTFILE                //!putfile: the checksum, content hash and chunk checksums are needed before the request, to skip uploading known contents
+};
+
+typedef struct fileprepjob {
+    unsigned int id;                            //Matches FileXferArgs->prep_id. The transfer may be cancelled before the job finishes
+    enum file_prep_type type;
+    int fd;                                     //The job's own descriptor for the file, independent of the transfer's
+    size_t filesize;
+
+    //Results
+    unsigned int checksum;
+    char hash[CONTENT_HASH_SIZE+1];
+    unsigned int *chunk_crcs;                   //PREP_PUTFILE: checksum of every XFER_CHUNK_SIZE chunk. Taken over by the transfer, if it still exists
+    unsigned int chunk_count;
+
+    struct fileprepjob *next;
+} FilePrepJob;
+
+
+extern pthread_mutex_t buffer_lock;
+
+
+int file_prep_init();
+unsigned int queue_file_prep(int fd, size_t filesize, enum file_prep_type type);
+
+
+#endif
@@ -9,66 +9,157 @@
 
 
 FileInfo *incoming_transfers;                           //Outstanding incoming transfers that I can accept
-FileXferArgs *file_transfers;                           //The current file transfer that's in progress
+FileXferArgs *file_transfers;                           //Hashtable of my pending and ongoing transfers (key = token)
+XferStream *transfer_connections;                       //Streams of my transfers with an open transfer connection (key = socketfd)
+FileXferArgs *outgoing_transfers;                       //Outgoing transfers that the server hasn't assigned a token to yet
+int progress_timerfd;                                   //Timer that periodically notifies the progress of all transfers
 
 
 /******************************/
 /*           Helpers          */
-/******************************/ 
+/******************************/
+
+static void stop_progress_timer()
+{
+    if(!progress_timerfd)
+        return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, progress_timerfd, NULL);
+    close(progress_timerfd);
+    progress_timerfd = 0;
+}
+
+static void start_progress_timer()
+{
+    if(progress_timerfd)
+        return;
+
+    progress_timerfd = create_timerfd(PRINT_XFER_PROGRESS_PERIOD, 1, epoll_fd);
+}
+
+static void release_recv_window(XferStream *stream)
+{
+    if(!stream->window)
+        return;
+
+    //Start writing the received pages back in bulk, rather than whenever the kernel gets to them
+    if(msync(stream->window, stream->window_size, MS_ASYNC) < 0)
+        perror("Failed to flush received file window.");
+
+    munmap(stream->window, stream->window_size);
+    stream->window = NULL;
+}
+
+static void release_recv_windows(FileXferArgs *args)
+{
+    unsigned int i;
+
+    for(i=0; args->streams && i<args->stream_count; i++)
+        release_recv_window(&args->streams[i]);
+}
 
 void cancel_transfer(FileXferArgs *args)
 {
-    //Close network connections
-    if(args->socketfd)
+    FileXferArgs *existing;
+    XferStream *stream, *existing_stream;
+    unsigned int i;
+
+    //Close network connections of every stream
+    for(i=0; args->streams && i<args->stream_count; i++)
     {
-        if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, args->socketfd, NULL) < 0) 
+        stream = &args->streams[i];
+        if(!stream->socketfd)
+            continue;
+
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->socketfd, NULL) < 0)
             perror("Failed to unregister the disconnected client from epoll!");
-        close(args->socketfd);
-        
-        printf("Closing transfer connection (%s) with \"%s\" \n", 
-                (args->operation == SENDING_OP)? "SEND":"RECV", args->target_name);
+        close(stream->socketfd);
+
+        HASH_FIND_INT(transfer_connections, &stream->socketfd, existing_stream);
+        if(existing_stream == stream)
+            HASH_DEL(transfer_connections, stream);
     }
 
-    //Destroy the progress timer
-    if(args->timerfd)
+    if(args->streams_connected)
+        printf("Closing %u transfer connection(s) (%s) with \"%s\" (token: %s)\n",
+                args->streams_connected, (args->operation == SENDING_OP)? "SEND":"RECV", args->target_name, args->token);
+
+    //Remove the transfer from my list of transfers
+    HASH_FIND_STR(file_transfers, args->token, existing);
+    if(existing == args)
+        HASH_DEL(file_transfers, args);
+    else if(outgoing_transfers)
+        LL_DELETE(outgoing_transfers, args);
+
+    //Destroy the progress timer once no transfers are running
+    if(HASH_COUNT(transfer_connections) == 0)
+        stop_progress_timer();
+
+    //Free or unmap transfer buffers, and close files
+    release_recv_windows(args);
+    if(args->file_buffer)
     {
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, args->timerfd, NULL);
-        close(args->timerfd);
+        if(args->operation == SENDING_OP)
+            munmap((void*)args->file_buffer, args->filesize);
+        else
+            free(args->file_buffer);
     }
-    
-    //Free or unmap transfer buffers, and close files
-    if(args->operation == SENDING_OP)
-        munmap((void*)args->file_buffer, args->filesize);
-    else
-        free(args->file_buffer);
-    fclose(args->file_fp);
-    
+
+    if(args->file_fp)
+        fclose(args->file_fp);
+
     //Free the transfer args object
+    for(i=0; args->streams && i<args->stream_count; i++)
+    {
+        free_chunk_resends(&args->streams[i].resends);
+        free_xfer_frame(&args->streams[i].frame);
+    }
+    free(args->streams);
+    free(args->chunk_crcs);
+    free(args->chunks);
     free(args);
-    file_transfers = NULL;
 }
 
+void cancel_all_transfers()
+{
+    FileXferArgs *curr, *tmp;
 
-void print_transfer_progress()
+    HASH_ITER(hh, file_transfers, curr, tmp)
+    {
+        cancel_transfer(curr);
+    }
+
+    LL_FOREACH_SAFE(outgoing_transfers, curr, tmp)
+    {
+        cancel_transfer(curr);
+    }
+}
+
+XferStream* find_transfer_connection(int socketfd)
+{
+    XferStream *stream;
+
+    HASH_FIND_INT(transfer_connections, &socketfd, stream);
+    return stream;
+}
+
+
+static void print_transfer_progress_single(FileXferArgs *args)
 {
-    uint64_t timer_retval;
     float percent_completed;
 
     size_t transferred_this_period;
     float speed;
     char *speed_unit;
 
-    if(!read(file_transfers->timerfd, &timer_retval, sizeof(uint64_t)))
-        perror("Failed to read timer event.");
-
     //Print amount received so far, and completion percentage
-    percent_completed = ((float)file_transfers->transferred / file_transfers->filesize) * 100;
-    printf("%s %zu/%zu bytes (%.2f %%). ", 
-              (file_transfers->operation == SENDING_OP)? "Sent":"Received", file_transfers->transferred, file_transfers->filesize, percent_completed);
+    percent_completed = (args->filesize)? ((float)args->transferred / args->filesize) * 100 : 100;
+    printf("[%s] \"%s\" (%u streams) %s %zu/%zu bytes (%.2f %%). ", args->token, args->filename, args->stream_count,
+              (args->operation == SENDING_OP)? "Sent":"Received", args->transferred, args->filesize, percent_completed);
 
     //Estimate the current transfer speed
-    transferred_this_period = file_transfers->transferred - file_transfers->last_transferred;
-    file_transfers->last_transferred = file_transfers->transferred;
+    transferred_this_period = args->transferred - args->last_transferred;
+    args->last_transferred = args->transferred;
 
     if(transferred_this_period > 1000000)
     {
@@ -89,68 +180,180 @@ void print_transfer_progress()
     printf("%.2f %s\n", speed, speed_unit);
 }
 
+//How much smaller compression made a finished transfer on the wire
+static void print_transfer_compression(FileXferArgs *args)
+{
+    size_t wire_bytes = 0;
+    unsigned int i;
+
+    if(!args->codec || !args->filesize)
+        return;
 
-static int new_transfer_connection(FileXferArgs *args)
+    for(i=0; args->streams && i<args->stream_count; i++)
+        wire_bytes += args->streams[i].frame.wire_bytes;
+
+    printf("\"%s\" took %zu bytes on the wire for %zu bytes of file (%.1f%%).\n",
+            args->filename, wire_bytes, args->filesize, 100.0 * wire_bytes / args->filesize);
+}
+
+void print_transfer_progress()
 {
-    args->socketfd = socket(AF_INET, SOCK_STREAM, 0);
+    uint64_t timer_retval;
+    FileXferArgs *curr, *tmp;
 
-    if(!args->socketfd)
+    if(progress_timerfd && !read(progress_timerfd, &timer_retval, sizeof(uint64_t)))
+        perror("Failed to read timer event.");
+
+    HASH_ITER(hh, file_transfers, curr, tmp)
+    {
+        if(curr->streams_connected)
+            print_transfer_progress_single(curr);
+    }
+}
+
+
+static int new_transfer_connection(XferStream *stream)
+{
+    stream->socketfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(stream->socketfd < 0)
     {
         perror("Failed to create socket for new transfer connection.");
+        stream->socketfd = 0;
         return 0;
     }
 
-    if(connect(args->socketfd, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in)) < 0)
+    if(connect(stream->socketfd, (struct sockaddr*) &server_addr, sizeof(struct sockaddr_in)) < 0)
     {
         perror("Failed to connect for new transfer connection.");
+        close(stream->socketfd);
+        stream->socketfd = 0;
         return 0;
     }
 
-    //Wait for server greeting
-    if(recv_direct(args->socketfd, buffer, BUFSIZE) <= 0)
+    //Wait for server greeting. Only read up to the end of the greeting string
+    if(recv_direct_string(stream->socketfd, buffer, BUFSIZE) <= 0)
     {
-        cancel_transfer(args);
+        close(stream->socketfd);
+        stream->socketfd = 0;
         return 0;
     }
     printf("%s\n", buffer);
 
-    return args->socketfd;
+    return stream->socketfd;
 }
 
+//Registers a new transfer connection for a stream with the server, and begin transferring on it once accepted
+static int register_transfer_connection(XferStream *stream, char *registration_msg)
+{
+    FileXferArgs *args = stream->xferargs;
+
+    if(send_direct(stream->socketfd, registration_msg, strlen(registration_msg)+1) <= 0)
+    {
+        perror("Failed to send transfer registration.");
+        close(stream->socketfd);
+        stream->socketfd = 0;
+        return 0;
+    }
+
+    //Obtain a response from the server. File data may follow right after the response, so do not read past it
+    if(recv_direct_string(stream->socketfd, buffer, BUFSIZE) <= 0 || strcmp(buffer, "Accepted") != 0)
+    {
+        printf("Server did not accept transfer connection: \"%s\"\n", buffer);
+        close(stream->socketfd);
+        stream->socketfd = 0;
+        return 0;
+    }
+
+    //Register the new connection with epoll and set it as nonblocking
+    fcntl(stream->socketfd, F_SETFL, O_NONBLOCK);
+    if(!register_fd_with_epoll(epoll_fd, stream->socketfd, ((args->operation == SENDING_OP)? EPOLLOUT:EPOLLIN) | EPOLLRDHUP))
+    {
+        close(stream->socketfd);
+        stream->socketfd = 0;
+        return 0;
+    }
+    HASH_ADD_INT(transfer_connections, socketfd, stream);
+    ++args->streams_connected;
 
-static FileInfo* find_pending_xfer(char *sender_name)
+    //Create a timerfd to periodically print the transfer progress
+    start_progress_timer();
+
+    return stream->socketfd;
+}
+
+//Splits the transfer into byte ranges
+static void setup_transfer_streams(FileXferArgs *args)
 {
-    FileInfo *curr, *temp; 
+    XferStream *stream;
+    unsigned int i;
 
-    //Find the file associated with the sender
-    LL_FOREACH_SAFE(incoming_transfers, curr, temp)
+    if(args->stream_count < 1)
+        args->stream_count = 1;
+    else if(args->stream_count > XFER_MAX_STREAMS)
+        args->stream_count = XFER_MAX_STREAMS;
+
+    args->streams = calloc(args->stream_count, sizeof(XferStream));
+
+    for(i=0; i<args->stream_count; i++)
     {
-        if(strcmp(curr->target_name, sender_name) == 0)
-            break;
+        stream = &args->streams[i];
+        stream->index = i;
+        stream->xferargs = args;
+        xfer_stream_range(args->filesize, args->stream_count, i, &stream->offset, &stream->length);
+    }
+}
+
+//Opens a transfer connection for each byte range of the transfer
+static int open_transfer_streams(FileXferArgs *args)
+{
+    char registration_msg[MAX_MSG_LENG+1];
+    XferStream *stream;
+    unsigned int i;
+
+    //Resumed transfers have already set up their streams, and continue each range from its received prefix
+    if(!args->streams)
+        setup_transfer_streams(args);
+
+    for(i=0; i<args->stream_count; i++)
+    {
+        stream = &args->streams[i];
+
+        if(!new_transfer_connection(stream))
+            return 0;
+
+        //Tell server which transfer, and which (remaining) range of it, this connection is used for
+        if(args->operation == SENDING_OP)
+            sprintf(registration_msg, "!xfersend=%s,size=%zu,crc=%x,sender=%s,recver=%s,token=%s,stream=%u,offset=%zu,length=%zu",
+                    args->filename, args->filesize, args->checksum, my_username, args->target_name, args->token, 
+                    i, stream->offset + stream->transferred, stream->length - stream->transferred);
         else
-            curr = NULL;
+            sprintf(registration_msg, "!xferrecv=%s,size=%zu,crc=%x,sender=%s,recver=%s,token=%s,stream=%u,offset=%zu,length=%zu",
+                    args->filename, args->filesize, args->checksum, args->target_name, my_username, args->token, 
+                    i, stream->offset + stream->transferred, stream->length - stream->transferred);
+
+        if(!register_transfer_connection(stream, registration_msg))
+            return 0;
     }
-    
-    return curr;
+
+    return 1;
 }
 
 
-static unsigned int delete_pending_xfer(char *sender_name)
+static FileInfo* find_pending_xfer(char *sender_name, char *token)
 {
-    unsigned int count = 0;
-    FileInfo *curr, *temp; 
+    FileInfo *curr, *temp;
 
+    //Find the file associated with the sender. If a token is given, it must match as well
     LL_FOREACH_SAFE(incoming_transfers, curr, temp)
     {
-        if(strcmp(curr->target_name, sender_name) == 0)
-        {
-            LL_DELETE(incoming_transfers, curr);
-            free(curr);
-            ++count;
-        }
+        if(strcmp(curr->target_name, sender_name) == 0 && (!token || strcmp(curr->token, token) == 0))
+            break;
+        else
+            curr = NULL;
     }
-    
-    return count;
+
+    return curr;
 }
 
 
@@ -158,23 +361,13 @@ static unsigned int delete_pending_xfer(char *sender_name)
 
 /******************************/
 /*          File Send         */
-/******************************/ 
+/******************************/
 
-//Used by the sending client locally to parse its command into a FileXferArgs struct
-static void parse_send_cmd_sender(char *buffer, FileXferArgs *args, int target_is_group)
+//Extract the filename from the target file path
+static void filename_from_path(FileXferArgs *args)
 {
     char *filename_start;
 
-    memset(args, 0 ,sizeof(FileXferArgs));
-
-    if(target_is_group)
-        sscanf(buffer, "!putfile %[^$]", args->target_file);
-    else
-        sscanf(buffer, "!sendfile %[^$]", args->target_file);
-    
-    strcpy(args->target_name, msg_target);
-
-    //Extract the filename from the target file path
     filename_start = strrchr(args->target_file, '/');
     if(filename_start)
         strcpy(args->filename, ++filename_start);
@@ -182,17 +375,32 @@ static void parse_send_cmd_sender(char *buffer, FileXferArgs *args, int target_i
         strcpy(args->filename, args->target_file);
 }
 
-
 //Used by the sending client locally to parse its command into a FileXferArgs struct
-static void parse_accept_cmd(char *buffer, FileXferArgs *args)
+static void parse_send_cmd_sender(char *buffer, FileXferArgs *args, int target_is_group)
 {
+    char *target;
+
     memset(args, 0 ,sizeof(FileXferArgs));
-    sscanf(buffer, "!acceptfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%s", 
-            args->filename, &args->filesize, &args->checksum, args->target_name, args->token);
+
+    if(target_is_group)
+        sscanf(buffer, "!putfile %[^$]", args->target_file);
+    else
+        sscanf(buffer, "!sendfile %[^$]", args->target_file);
+
+    strcpy(args->target_name, msg_target);
+    args->target_type = (target_is_group)? GROUP_TARGET:USER_TARGET;
+
+    //A file sent to several users ("@user1,user2") lists them with a separator that is safe inside protocol messages
+    for(target = args->target_name; !target_is_group && *target; target++)
+        if(*target == ',')
+            *target = XFER_RECIPIENT_SEPARATOR[0];
+
+    filename_from_path(args);
 }
 
+
 static int load_sending_file(FileXferArgs *args)
-{    
+{
     //Attempt to open the file for reading (binary mode)
     args->file_fp = fopen(args->target_file, "rb");
     if(!args->file_fp)
@@ -206,6 +414,7 @@ static int load_sending_file(FileXferArgs *args)
     {
         printf("Cannot send \"%s\". This is not a regular file.\n", args->target_file);
         fclose(args->file_fp);
+        args->file_fp = NULL;
         return 0;
     }
 
@@ -220,15 +429,51 @@ static int load_sending_file(FileXferArgs *args)
     {
         perror("Failed to map sending file to memory.");
         fclose(args->file_fp);
+        args->file_fp = NULL;
+        args->file_buffer = NULL;
         return 0;
     }
 
-    //Calculate the file's checksum (crc32)
-    args->checksum = xcrc32(args->file_buffer, args->filesize, CRC_INIT);
-
     return 1;
 }
 
+static void unload_sending_file(FileXferArgs *args)
+{
+    munmap((void*)args->file_buffer, args->filesize);
+    fclose(args->file_fp);
+    args->file_buffer = NULL;
+    args->file_fp = NULL;
+}
+
+static void send_checksum_trailer(FileXferArgs *args)
+{
+    char trailer_msg[MAX_MSG_LENG+1];
+
+    sprintf(trailer_msg, "!xfercrc=%s,crc=%x", args->token, args->trailer_checksum);
+    send_msg_client(trailer_msg, strlen(trailer_msg)+1);
+}
+
+
+//Sends the checksum of every chunk of a file being uploaded, so the server can check each chunk as it arrives
+static void send_chunk_checksums(FileXferArgs *args)
+{
+    char chunks_msg[MAX_MSG_LENG+1];
+    unsigned int first = 0;
+
+    while(first < args->chunk_count)
+    {
+        first += format_chunk_checksums(chunks_msg, args->token, args->chunk_crcs, first, args->chunk_count);
+        send_msg_client(chunks_msg, strlen(chunks_msg)+1);
+    }
+}
+
+//Removes a finished chunk from the front of its stream's resends
+static void finish_chunk_resend(XferStream *stream)
+{
+    pop_chunk_resend(&stream->resends);
+    stream->resent = 0;
+}
+
 
 static int new_send_cmd(FileXferArgs *args)
 {
@@ -237,43 +482,122 @@ static int new_send_cmd(FileXferArgs *args)
 
     args->operation = SENDING_OP;
 
+    //Send the request right away. The checksum is computed in the background while the file is transferred, and follows as a trailer
+    args->prep_id = queue_file_prep(fileno(args->file_fp), args->filesize, PREP_CHECKSUM);
+    if(!args->prep_id)
+    {
+        unload_sending_file(args);
+        return 0;
+    }
+
     //Rewrite the existing message in buffer with the de-localized filename
-    sprintf(buffer, "@%s !sendfile=%s,size=%zu,crc=%x", 
-            file_transfers->target_name, file_transfers->filename, file_transfers->filesize, file_transfers->checksum);
-    printf("Initiating file transfer with user \"%s\" for file \"%s\" (%zu bytes, checksum: %x)\n", 
-            file_transfers->target_name, file_transfers->filename, file_transfers->filesize, file_transfers->checksum);
+    //Propose a number of parallel streams for this file. The receiver may settle on fewer
+    args->stream_count = xfer_stream_count(args->filesize, XFER_MAX_STREAMS);
+    sprintf(buffer, "@%s !sendfile=%s,size=%zu,crc=%x,streams=%u",
+            args->target_name, args->filename, args->filesize, args->checksum, args->stream_count);
+    printf("Initiating file transfer with user \"%s\" for file \"%s\" (%zu bytes). Its checksum will follow once computed.\n",
+            args->target_name, args->filename, args->filesize);
 
     //Since we're overwriting the original buffer, we must prevent the command handler from trying to concanate msg_target and msg_body together
     msg_target = NULL;
     msg_body = buffer;
-    
+
     //The new message in buffer will be sent automatically when this function returns back to client_main_loop()
 
     return 1;
 }
 
 
+//Finds an outgoing transfer that hasn't been assigned a token yet
+static FileXferArgs* find_outgoing_transfer(char *target_name, char *filename, size_t filesize, unsigned int checksum)
+{
+    FileXferArgs *curr, *tmp;
+
+    LL_FOREACH_SAFE(outgoing_transfers, curr, tmp)
+    {
+        if(strcmp(curr->target_name, target_name) == 0)
+            if(strcmp(curr->filename, filename) == 0)
+                if(curr->filesize == filesize)
+                    if(curr->checksum == checksum)
+                        return curr;
+    }
+
+    return NULL;
+}
+
+//Moves an outgoing transfer into my transfer table, once the server has assigned a token for it
+static void outgoing_transfer_assign_token(FileXferArgs *args, char *token)
+{
+    LL_DELETE(outgoing_transfers, args);
+    args->next = NULL;
+
+    strcpy(args->token, token);
+    HASH_ADD_STR(file_transfers, token, args);
+}
+
+
+int transfer_delivered()
+{
+    char filename[FILENAME_MAX+1];
+    size_t filesize;
+    unsigned int checksum;
+    char target_name[XFER_RECIPIENTS_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
+    FileXferArgs *args;
+
+    sscanf(buffer, "!delivered=%[^,],size=%zu,crc=%x,target=%[^,],token=%s",
+            filename, &filesize, &checksum, target_name, token);
+
+    args = find_outgoing_transfer(target_name, filename, filesize, checksum);
+    if(!args)
+    {
+        printf("No pending file send for file \"%s\" for user \"%s\".\n", filename, target_name);
+        return 0;
+    }
+
+    outgoing_transfer_assign_token(args, token);
+    printf("File transfer invitation for \"%s\" has been delivered to \"%s\" (token: %s).\n", filename, target_name, token);
+
+    //The checksum was computed before the token arrived
+    if(args->has_trailer)
+        send_checksum_trailer(args);
+
+    return 1;
+}
+
+
 int recver_accepted_file()
 {
     char accepted_filename[FILENAME_MAX+1];
     size_t accepted_filesize;
     unsigned int accepted_checksum;
-    char accepted_target_name[USERNAME_LENG+1];
+    char accepted_target_name[XFER_RECIPIENTS_LENG+1];
     char accepted_token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int accepted_streams = 1;
+    FileXferArgs *args;
 
     int matches = 0;
 
-    sscanf(buffer, "!acceptfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%s", 
-            accepted_filename, &accepted_filesize, &accepted_checksum, accepted_target_name, accepted_token);
+    sscanf(buffer, "!acceptfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%[^,],streams=%u",
+            accepted_filename, &accepted_filesize, &accepted_checksum, accepted_target_name, accepted_token, &accepted_streams);
+
+    //Locate the transfer by its token. Group uploads are accepted before a token is known, so look for them by their file info
+    HASH_FIND_STR(file_transfers, accepted_token, args);
+    if(!args)
+    {
+        args = find_outgoing_transfer(accepted_target_name, accepted_filename, accepted_filesize, accepted_checksum);
+        if(args)
+            outgoing_transfer_assign_token(args, accepted_token);
+    }
 
     //Validate this transfer matches what we intended to send
-    if(file_transfers)
-        if(strcmp(file_transfers->target_name, accepted_target_name) == 0)
-            if(strcmp(file_transfers->filename, accepted_filename) == 0)
-                if(file_transfers->filesize == accepted_filesize)
-                    if(file_transfers->checksum == accepted_checksum)
+    if(args && !args->streams && args->operation == SENDING_OP)
+        if(strcmp(args->target_name, accepted_target_name) == 0)
+            if(strcmp(args->filename, accepted_filename) == 0)
+                if(args->filesize == accepted_filesize)
+                    if(args->checksum == accepted_checksum)
                         matches = 1;
-    
+
     if(!matches)
     {
         printf("No pending file send for file \"%s\" (%zu bytes, checksum: %x) for user \"%s\".\n",
@@ -281,302 +605,828 @@ int recver_accepted_file()
         return 0;
     }
 
-    printf("Receiver \"%s\" has accepted to receive the file \"%s\" (%zu bytes, checksum: %x)!\n",
-            accepted_target_name, accepted_filename, accepted_filesize, accepted_checksum);
-    
-    //Record the server assigned token
-    strcpy(file_transfers->token, accepted_token);
+    printf("Receiver \"%s\" has accepted to receive the file \"%s\" (%zu bytes, checksum: %x, token: %s, streams: %u)!\n",
+            accepted_target_name, accepted_filename, accepted_filesize, accepted_checksum, accepted_token, accepted_streams);
+
+    //Use the stream count the server has settled on
+    args->stream_count = accepted_streams;
+
+    //Group uploads are compressed if the server agreed to it
+    if(args->target_type == GROUP_TARGET)
+        args->codec = parse_xfer_codec(buffer);
+
+
+    //Group uploads: the checksums go ahead of the data, so the server can check every chunk as it arrives
+    if(args->target_type == GROUP_TARGET)
+        send_chunk_checksums(args);
+
+
+    /********************************************************/
+    /* Open new connections to server for file transferring */
+    /********************************************************/
+
+    if(!open_transfer_streams(args))
+    {
+        cancel_transfer(args);
+        return 0;
+    }
+
+    printf("Sender has successfully established %u transfer connection(s) to the server!\n", args->stream_count);
+    return 1;
+}
+
+
+//Compressed transfers send the file one frame at a time. The next frame is encoded once the last one has been sent whole
+static int send_next_frame(XferStream *stream, size_t position, size_t remaining_size)
+{
+    FileXferArgs *args = stream->xferargs;
+    unsigned int limit = xfer_frame_limit(args->filesize, position);
+
+    if(stream->frame.moved == stream->frame.size)
+        encode_xfer_frame(&stream->frame, (unsigned char*) &args->file_buffer[position], (remaining_size < limit)? remaining_size:limit, position);
+
+    return send_xfer_frame(stream->socketfd, &stream->frame, XFER_QUANTUM_SIZE);
+}
+
+int file_send_next(XferStream *stream)
+{
+    FileXferArgs *args = stream->xferargs;
+    size_t position, remaining_size, chunk_offset, chunk_length = 0;
+    int resending = (stream->transferred >= stream->length);
+    int bytes;
+
+    //Once the range is done, send the chunks the server asked for again
+    if(resending)
+    {
+        if(!stream->resends)
+        {
+            update_epoll_events(epoll_fd, stream->socketfd, EPOLLRDHUP);
+            return 0;
+        }
+
+        xfer_chunk_range(args->filesize, stream->resends->chunk, &chunk_offset, &chunk_length);
+        position = chunk_offset + stream->resent;
+        remaining_size = chunk_length - stream->resent;
+    }
+    else
+    {
+        position = stream->offset + stream->transferred;
+        remaining_size = stream->length - stream->transferred;
+    }
+
+    //Only send up to a quantum at a time, so other concurrent transfers get their turns
+    if(remaining_size > XFER_QUANTUM_SIZE)
+        remaining_size = XFER_QUANTUM_SIZE;
+
+    //Send the next chunk of this stream's range to the server
+    if(args->codec)
+        bytes = send_next_frame(stream, position, remaining_size);
+    else
+        bytes = send_direct(stream->socketfd, &args->file_buffer[position], remaining_size);
+    //bytes = send_direct(stream->socketfd, &args->file_buffer[stream->offset + stream->transferred], (remaining_size < RECV_CHUNK_SIZE)? remaining_size:RECV_CHUNK_SIZE);
+
+    if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+
+    if(bytes < 0 || (bytes == 0 && remaining_size > 0))
+    {
+        perror("Failed to send file piece");
+        printf("Sent %zu\\%zu bytes to target \"%s\" before failure.\n", args->transferred, args->filesize, args->target_name);
+        cancel_transfer(args);
+        return 0;
+    }
+
+    //Only a whole frame counts, as the bytes of the file it holds
+    if(args->codec)
+    {
+        if(stream->frame.moved < stream->frame.size)
+            return bytes;
+        bytes = stream->frame.raw_length;
+    }
+
+    if(resending)
+    {
+        stream->resent += bytes;
+        if(stream->resent < chunk_length)
+            return bytes;
+
+        printf("Sent chunk %u of \"%s\" again.\n", stream->resends->chunk, args->filename);
+        finish_chunk_resend(stream);
+        if(!stream->resends)
+            update_epoll_events(epoll_fd, stream->socketfd, EPOLLRDHUP);
+        return bytes;
+    }
+
+    stream->transferred += bytes;
+    args->transferred += bytes;
+    //sleep(1);
+
+    if(stream->transferred < stream->length)
+        return bytes;
+
+    //Leave the completed stream's transfer connection idle, and wait for the server to close it (recver has received all pending byes).
+    //Unless the server has asked for some of its chunks again
+    if(!stream->resends)
+        update_epoll_events(epoll_fd, stream->socketfd, EPOLLRDHUP);
+
+    if(args->transferred < args->filesize)
+        return bytes;
+
+    //Transfer has completed!
+    print_transfer_progress_single(args);
+    print_transfer_compression(args);
+    printf("Completed file transfer! Waiting for server to close the transfer connection...\n");
+
+    return bytes;
+}
+
+
+
+
+
+/******************************/
+/*          File Recv         */
+/******************************/
+
+//Used by the receiver and server to parse its command into a FileXferArgs struct
+static void parse_send_cmd_recver(char *buffer, FileInfo *fileinfo)
+{
+    memset(fileinfo, 0 ,sizeof(FileInfo));
+    fileinfo->stream_count = 1;
+    sscanf(buffer, "!sendfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%[^,],streams=%u",
+            fileinfo->filename, &fileinfo->filesize, &fileinfo->checksum, fileinfo->target_name, fileinfo->token, &fileinfo->stream_count);
 
+    fileinfo->target_type = USER_TARGET;
+
+    //You must now fill args->socketfd yourself after calling this function, if you choose to accept the file afterwards
+}
 
 
-    /*******************************************************/
-    /* Open new connection to server for file transferring */
-    /*******************************************************/
+static int new_recv_connection(FileXferArgs *args)
+{
+    int retval;
 
-    if(!new_transfer_connection(file_transfers))
+    if(!make_folder_and_file_for_writing(CLIENT_RECV_FOLDER, args->target_name, args->filename, args->target_file, &args->file_fp))
     {
-        cancel_transfer(file_transfers);
+        cancel_transfer(args);
         return 0;
     }
 
-    //Tell server I'm using this connection to download a file
-    sprintf(buffer, "!xfersend=%s,size=%zu,crc=%x,sender=%s,recver=%s,token=%s", 
-            file_transfers->filename, file_transfers->filesize, file_transfers->checksum, my_username, file_transfers->target_name, file_transfers->token);
-    
-    if(send_direct(file_transfers->socketfd, buffer, strlen(buffer)+1) <= 0)
+    //Allocate the whole file, so each stream can receive its own range in place.
+    //Not left sparse, as writing to a mapped sparse file fails with SIGBUS once the disk is full
+    if(args->filesize && (retval = posix_fallocate(fileno(args->file_fp), 0, args->filesize)) != 0)
+    {
+        errno = retval;
+        perror("Failed to preallocate file for receiving.");
+        cancel_transfer(args);
+        return 0;
+    }
+
+    args->operation = RECVING_OP;
+
+
+    /********************************************************/
+    /* Open new connections to server for file transferring */
+    /********************************************************/
+
+    if(!open_transfer_streams(args))
+    {
+        cancel_transfer(args);
+        return 0;
+    }
+
+    printf("Receiver has successfully established %u transfer connection(s) to the server!\n", args->stream_count);
+    return 1;
+}
+
+
+//Returns where the stream's next bytes should be received to, and how many fit there. Returns NULL if the file cannot be mapped
+static char* map_recv_window(XferStream *stream, size_t *space_ret)
+{
+    static size_t page_size = 0;
+    size_t position = stream->offset + stream->transferred;
+    size_t stream_end = stream->offset + stream->length;
+
+    //Slide the window forward once it has been filled
+    if(stream->window && position >= stream->window_offset + stream->window_size)
+        release_recv_window(stream);
+
+    if(!stream->window)
+    {
+        if(!page_size)
+            page_size = sysconf(_SC_PAGESIZE);
+
+        //Mappings start on a page boundary, so the window may begin slightly before the stream's range
+        stream->window_offset = position - (position % page_size);
+        stream->window_size = stream_end - stream->window_offset;
+        if(stream->window_size > RECV_WINDOW_SIZE)
+            stream->window_size = RECV_WINDOW_SIZE;
+
+        //Fault the window in at once, instead of a page at a time as data arrives
+        stream->window = mmap(NULL, stream->window_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fileno(stream->xferargs->file_fp), stream->window_offset);
+        if(stream->window == MAP_FAILED)
+        {
+            stream->window = NULL;
+            return NULL;
+        }
+    }
+
+    *space_ret = stream->window_offset + stream->window_size - position;
+    return stream->window + (position - stream->window_offset);
+}
+
+//Verify file integrity, and then cleanup and close the transfer connections
+static void finish_received_file(FileXferArgs *args)
+{
+    release_recv_windows(args);
+
+    //Every chunk was already checked as it arrived
+    if(args->chunk_tree_valid)
+        printf("Received file \"%s\" is intact. All %u chunks passed their checks.\n", args->target_file, args->chunk_count);
+    else
+        verify_received_file(args->filesize, (args->target_type == USER_TARGET)? args->trailer_checksum : args->checksum, args->target_file);
+
+    cancel_transfer(args);
+}
+
+//Keeps the transfer connections open, without reading from them, until the checksums the file is verified with have arrived
+static void wait_for_checksums(FileXferArgs *args)
+{
+    unsigned int i;
+
+    release_recv_windows(args);
+    for(i=0; i<args->stream_count; i++)
+        if(args->streams[i].socketfd)
+            update_epoll_events(epoll_fd, args->streams[i].socketfd, EPOLLRDHUP);
+}
+
+static void drop_chunk_checksums(FileXferArgs *args)
+{
+    free(args->chunk_crcs);
+    free(args->chunks);
+    args->chunk_crcs = NULL;
+    args->chunks = NULL;
+    args->chunk_count = 0;
+}
+
+//Checks a whole received chunk against its checksum. A damaged chunk is requested again, on the stream that moved it.
+//Returns 0 if the transfer was cancelled
+static int check_received_chunk(FileXferArgs *args, unsigned int chunk)
+{
+    XferChunk *received = &args->chunks[chunk];
+    XferStream *stream;
+    char rechunk_msg[MAX_MSG_LENG+1];
+
+    if(received->crc == args->chunk_crcs[chunk])
+    {
+        received->status = CHUNK_VERIFIED;
+        return 1;
+    }
+
+    if(++received->retries > XFER_CHUNK_RETRIES)
+    {
+        printf("Chunk %u of \"%s\" failed its check %u times. Cancelling...\n", chunk, args->filename, received->retries);
+        cancel_transfer(args);
+        return 0;
+    }
+
+    received->status = CHUNK_FAILED;
+    ++args->chunks_failed;
+
+    //The server sends it once the rest of the stream's range has been sent
+    stream = &args->streams[xfer_chunk_stream(args->filesize, args->stream_count, chunk)];
+    append_chunk_resend(&stream->resends, chunk);
+    if(stream->socketfd)
+        update_epoll_events(epoll_fd, stream->socketfd, EPOLLIN | EPOLLRDHUP);
+
+    sprintf(rechunk_msg, "!rechunk=%s,chunk=%u", args->token, chunk);
+    send_msg_client(rechunk_msg, strlen(rechunk_msg)+1);
+    printf("Chunk %u of \"%s\" was damaged on the way. Requesting it again...\n", chunk, args->filename);
+
+    return 1;
+}
+
+int file_recv_next(XferStream *stream)
+{
+    FileXferArgs *args = stream->xferargs;
+    size_t position, remaining_size, space, chunk_offset, chunk_length;
+    int resending = (stream->transferred >= stream->length);
+    unsigned int chunk, frame_limit = 0;
+    char *dest;
+    int bytes;
+
+    if(resending)
+    {
+        //Chunks requested again follow the stream's range
+        if(!stream->resends)
+            return 0;
+
+        chunk = stream->resends->chunk;
+        xfer_chunk_range(args->filesize, chunk, &chunk_offset, &chunk_length);
+        position = chunk_offset + stream->resent;
+        remaining_size = chunk_length - stream->resent;
+    }
+    else
+    {
+        position = stream->offset + stream->transferred;
+        remaining_size = stream->length - stream->transferred;
+        chunk = position / XFER_CHUNK_SIZE;
+        xfer_chunk_range(args->filesize, chunk, &chunk_offset, &chunk_length);
+
+        //Stop at the end of the chunk, so it is checked as soon as it has arrived
+        if(args->chunks && remaining_size > chunk_offset + chunk_length - position)
+            remaining_size = chunk_offset + chunk_length - position;
+    }
+
+    //Compressed transfers receive the file one frame at a time, and decode it whole
+    if(args->codec)
+    {
+        frame_limit = xfer_frame_limit(args->filesize, position);
+        if(frame_limit > remaining_size)
+            frame_limit = remaining_size;
+    }
+
+    //Receive straight into the mapped file, as much as the socket has ready. Chunks received again are written in place with pwrite(),
+    //as are frames that would end past the mapped window
+    dest = (resending)? NULL : map_recv_window(stream, &space);
+    if(!dest || space < frame_limit)
+    {
+        if(!args->file_buffer)
+        {
+            if(!resending && !stream->window)
+                perror("Failed to map receiving file. Writing received data with pwrite() instead.");
+            args->file_buffer = malloc(RECV_BUFFER_SIZE);
+        }
+
+        dest = args->file_buffer;
+        space = RECV_BUFFER_SIZE;
+    }
+
+    if(args->codec)
+        bytes = recv_xfer_frame(stream->socketfd, &stream->frame, frame_limit, XFER_FRAME_MAX, (unsigned char*) dest);
+    else
+        bytes = recv(stream->socketfd, dest, (remaining_size < space)? remaining_size:space, 0);
+
+    if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+
+    //The frame is still arriving
+    if(args->codec && bytes == 0)
+        return 0;
+
+    if(bytes <= 0)
+    {
+        perror("Failed to receive file piece from server.");
+        printf("%zu\\%zu bytes received before failure.\n", args->transferred, args->filesize);
+        cancel_transfer(args);
+        return 0;
+    }
+
+    //Without a mapping, write the received chunk in place, within this stream's range of the local file
+    if(dest == args->file_buffer && pwrite(fileno(args->file_fp), args->file_buffer, bytes, position) != bytes)
+    {
+        perror("Failed to write correct number of bytes to receiving file.");
+    }
+
+    if(args->chunks)
+    {
+        if(position == chunk_offset)
+            stream->chunk_crc = CRC_INIT;
+        stream->chunk_crc = xcrc32((unsigned char*) dest, bytes, stream->chunk_crc);
+    }
+
+    if(resending)
+    {
+        stream->resent += bytes;
+        if(stream->resent == chunk_length)
+        {
+            finish_chunk_resend(stream);
+            --args->chunks_failed;
+        }
+    }
+    else
+    {
+        stream->transferred += bytes;
+        args->transferred += bytes;
+    }
+   // printf("Received %zu\\%zu bytes from \"%s\"\n", args->transferred, args->filesize, args->target_name);
+
+    //A whole chunk has arrived. Check it, or keep its checksum until the chunk checksums are known
+    if(args->chunks && position + bytes == chunk_offset + chunk_length)
+    {
+        args->chunks[chunk].crc = stream->chunk_crc;
+        args->chunks[chunk].status = CHUNK_RECEIVED;
+        if(args->chunk_tree_valid && !check_received_chunk(args, chunk))
+            return 0;
+    }
+
+    //Has every range been received?
+    if(args->transferred < args->filesize)
+        return bytes;
+
+    //Transfer has completed!
+    if(!resending)
     {
-        perror("Failed to send transfer registration.");
-        cancel_transfer(file_transfers);
-        return 0;
+        print_transfer_progress_single(args);
+        print_transfer_compression(args);
+        printf("Completed file transfer!\n");
     }
 
-    //Obtain a response from the server
-    if(recv_direct(file_transfers->socketfd, buffer, BUFSIZE) <= 0)
+    //Wait for the chunks that were requested again
+    if(args->chunks_failed)
+        return bytes;
+
+    //A file from another user is verified against the checksum its sender passes on. Keep the transfer connections open until it arrives
+    if(args->target_type == USER_TARGET && !args->has_trailer)
     {
-        cancel_transfer(file_transfers);
-        return 0;
+        wait_for_checksums(args);
+        printf("Waiting for \"%s\" to pass on the file's checksum...\n", args->target_name);
+        return bytes;
     }
 
-    if(strcmp(buffer, "Accepted") != 0)
+    //Likewise, a group file's chunks are checked once all of their checksums have arrived
+    if(args->chunks && !args->chunk_tree_valid)
     {
-        printf("Server did not accept transfer connection: \"%s\"\n", buffer);
-        cancel_transfer(file_transfers);
-        return 0;
+        wait_for_checksums(args);
+        printf("Waiting for the rest of the chunk checksums of \"%s\"...\n", args->filename);
+        return bytes;
     }
-        
-    printf("Sender has successfully established to the server!\n");
 
-    //Register the new connection with epoll and set it as nonblocking
-    fcntl(file_transfers->socketfd, F_SETFL, O_NONBLOCK);
-    register_fd_with_epoll(epoll_fd, file_transfers->socketfd, EPOLLOUT | EPOLLRDHUP);
+    finish_received_file(args);
+    return bytes;
+}
 
-    //Create a timerfd to periodically print the transfer progress
-    file_transfers->timerfd = create_timerfd(PRINT_XFER_PROGRESS_PERIOD, 1, epoll_fd);
 
-    return file_transfers->socketfd;
-}
 
 
-int file_send_next(FileXferArgs *args)
+
+/******************************/
+/* Client-Group File Sharing */
+/******************************/
+
+static int put_file_to_group(FileXferArgs *args)
 {
-    size_t remaining_size = args->filesize - args->transferred;
-    int bytes;
-     
-    //Send the next chunk to the client
-    bytes = send_direct(args->socketfd, &args->file_buffer[args->transferred], remaining_size);
-    //bytes = send_direct(args->socketfd, &args->file_buffer[args->transferred], (remaining_size < RECV_CHUNK_SIZE)? remaining_size:RECV_CHUNK_SIZE);
+    if(!load_sending_file(args))
+        return 0;
 
-    if(bytes <= 0)
+    args->operation = SENDING_OP;
+    args->stream_count = xfer_stream_count(args->filesize, XFER_MAX_STREAMS);
+
+    //The request offers the file's content hash, so the server can skip the transfer if it already stores the same contents.
+    //Compute it (and the checksum) in the background. The request is sent once they are ready
+    args->prep_id = queue_file_prep(fileno(args->file_fp), args->filesize, PREP_PUTFILE);
+    if(!args->prep_id)
     {
-        perror("Failed to send file piece");
-        printf("Sent %zu\\%zu bytes to target \"%s\" before failure.\n", args->transferred, args->filesize, args->target_name);
-        cancel_transfer(args);
+        unload_sending_file(args);
         return 0;
     }
 
-    args->transferred += bytes;
-    //sleep(1);
+    printf("Preparing \"%s\" (%zu bytes) for upload to group \"%s\"...\n", args->filename, args->filesize, args->target_name);
+    return 1;
+}
 
-    if(args->transferred < args->filesize)
-        return bytes;
+static FileXferArgs* find_preparing_transfer(unsigned int prep_id)
+{
+    FileXferArgs *curr, *tmp;
 
-    //Transfer has completed!
-    print_transfer_progress();
-    printf("Completed file transfer! Waiting for server to close the transfer connection...\n");
+    HASH_ITER(hh, file_transfers, curr, tmp)
+        if(curr->prep_id == prep_id)
+            return curr;
 
-    //Leave the sending transfer connection idle, and wait for the server to close it (recver has received all pending byes)
-    update_epoll_events(epoll_fd, args->socketfd, EPOLLRDHUP);
+    LL_FOREACH(outgoing_transfers, curr)
+        if(curr->prep_id == prep_id)
+            return curr;
 
-    return bytes;
+    return NULL;
 }
 
+//Runs on the file preparation thread, with buffer_lock held
+void file_prep_completed(FilePrepJob *job, int succeeded)
+{
+    char putfile_msg[MAX_MSG_LENG+1];
+    FileXferArgs *args;
 
+    //The transfer may have been cancelled while its file was being prepared
+    args = find_preparing_transfer(job->id);
+    if(!args)
+        return;
+    args->prep_id = 0;
 
+    if(!succeeded)
+    {
+        printf("Failed to prepare \"%s\" for sending. Cancelling...\n", args->filename);
+        if(args->token[0])
+        {
+            sprintf(putfile_msg, "!cancelfile=%s,reason=%s,token=%s", args->target_name, "SenderCancelled", args->token);
+            send_msg_client(putfile_msg, strlen(putfile_msg)+1);
+        }
+        cancel_transfer(args);
+        return;
+    }
 
+    if(job->type == PREP_PUTFILE)
+    {
+        args->checksum = job->checksum;
+        args->chunk_crcs = job->chunk_crcs;
+        args->chunk_count = job->chunk_count;
+        args->chunk_root = chunk_tree_root(args->chunk_crcs, args->chunk_count);
+        job->chunk_crcs = NULL;
+
+        //The chunk checksums follow once the server accepts the file. Only their root is sent with the request
+        if(snprintf(putfile_msg, sizeof(putfile_msg), "@@%s !putfile=%s,size=%zu,crc=%x,streams=%u,hash=%s,chunks=%u,root=%x%s",
+                args->target_name, args->filename, args->filesize, args->checksum, args->stream_count, job->hash, args->chunk_count, args->chunk_root,
+                (pending_msg.codec == XFER_CODEC_LZ)? ",codec="XFER_CODEC_NAME : "") >= (int)sizeof(putfile_msg))
+        {
+            printf("File put request for \"%s\" does not fit in a message. Cancelling...\n", args->filename);
+            cancel_transfer(args);
+            return;
+        }
 
-/******************************/
-/*          File Recv         */
-/******************************/ 
+        printf("Initiating file put with group \"%s\" for file \"%s\" (%zu bytes, checksum: %x)\n",
+                args->target_name, args->filename, args->filesize, args->checksum);
 
-//Used by the receiver and server to parse its command into a FileXferArgs struct
-static void parse_send_cmd_recver(char *buffer, FileInfo *fileinfo)
-{
-    memset(fileinfo, 0 ,sizeof(FileInfo));
-    sscanf(buffer, "!sendfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%s", 
-            fileinfo->filename, &fileinfo->filesize, &fileinfo->checksum, fileinfo->target_name, fileinfo->token);
+        send_msg_client(putfile_msg, strlen(putfile_msg)+1);
+        return;
+    }
 
-    fileinfo->target_type = USER_TARGET;
+    //Pass the checksum on to the recipients, once the server has assigned the transfer a token
+    args->trailer_checksum = job->checksum;
+    args->has_trailer = 1;
+    printf("Computed the checksum of \"%s\" (token: %s): %x\n", args->filename, (args->token[0])? args->token : "pending", args->trailer_checksum);
 
-    //You must now fill args->socketfd yourself after calling this function, if you choose to accept the file afterwards
+    if(args->token[0])
+        send_checksum_trailer(args);
 }
 
-
-static int new_recv_connection(FileXferArgs *args)
+//The server already had the file's contents, and attached them to the group without a transfer
+int deduplicated_file_sending()
 {
-    if(!make_folder_and_file_for_writing(CLIENT_RECV_FOLDER, args->target_name, args->filename, args->target_file, &args->file_fp))
+    char filename[MAX_FILENAME+1];
+    size_t filesize;
+    unsigned int checksum;
+    char target_name[USERNAME_LENG+1];
+    FileXferArgs *args;
+
+    sscanf(buffer, "!dedupfile=%[^,],size=%zu,crc=%x,target=%s", filename, &filesize, &checksum, target_name);
+
+    args = find_outgoing_transfer(target_name, filename, filesize, checksum);
+    if(!args)
     {
-        cancel_transfer(args);
+        printf("No pending file put for file \"%s\" for group \"%s\".\n", filename, target_name);
         return 0;
     }
 
-    args->file_buffer = malloc(RECV_CHUNK_SIZE);
-    args->operation = RECVING_OP;
-    
+    printf("The server already has the contents of \"%s\". It was added to group \"%s\" without uploading.\n", filename, target_name);
+    cancel_transfer(args);
 
-    /*******************************************************/
-    /* Open new connection to server for file transferring */
-    /*******************************************************/
+    return 1;
+}
 
-    if(!new_transfer_connection(args))
+//Continues an upload previously dropped by the server, from what the server has already received
+int resumed_file_sending()
+{
+    char filename[FILENAME_MAX+1];
+    size_t filesize, received;
+    unsigned int checksum, received_crc, i;
+    char target_name[USERNAME_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int stream_count = 1;
+    char *ranges;
+    int parsed;
+    FileXferArgs *args;
+    XferStream *stream;
+
+    sscanf(buffer, "!resumefile=%[^,],size=%zu,crc=%x,target=%[^,],token=%[^,],streams=%u",
+            filename, &filesize, &checksum, target_name, token, &stream_count);
+
+    args = find_outgoing_transfer(target_name, filename, filesize, checksum);
+    if(!args || strcmp(args->token, token) != 0)
     {
-        cancel_transfer(args);
+        printf("No pending upload to resume for file \"%s\" in group \"%s\" (token: %s).\n", filename, target_name, token);
         return 0;
     }
+    outgoing_transfer_assign_token(args, token);
 
-    //Tell server I'm using this connection to download a file
-    sprintf(buffer, "!xferrecv=%s,size=%zu,crc=%x,sender=%s,recver=%s,token=%s", 
-            file_transfers->filename, file_transfers->filesize, file_transfers->checksum, file_transfers->target_name, my_username, file_transfers->token);
-    if(send_direct(args->socketfd, buffer, strlen(buffer)+1) <= 0)
-    {
-        perror("Failed to send transfer registration.");
-        cancel_transfer(args);
-        return 0;
-    }
+    args->stream_count = stream_count;
+    args->codec = parse_xfer_codec(buffer);
+    setup_transfer_streams(args);
 
-    //Obtain a response from the server
-    if(recv_direct(args->socketfd, buffer, BUFSIZE) <= 0)
+    //Only continue a range from the server's received prefix if it matches my copy of the file. Otherwise resend the whole range
+    ranges = strstr(buffer, "ranges=");
+    if(ranges)
+        ranges += 7;
+
+    for(i=0; ranges && i<args->stream_count && sscanf(ranges, "%zu:%x%n", &received, &received_crc, &parsed) == 2; i++)
     {
-        cancel_transfer(args);
-        return 0;
+        stream = &args->streams[i];
+        if(received <= stream->length && xcrc32((unsigned char*)&args->file_buffer[stream->offset], received, CRC_INIT) == received_crc)
+        {
+            stream->transferred = received;
+            args->transferred += received;
+        }
+        else
+            printf("Range %u of \"%s\" does not match the server's copy. Resending the range...\n", i+1, filename);
+
+        ranges += parsed;
+        if(*ranges == ';')
+            ++ranges;
     }
 
-    if(strcmp(buffer, "Accepted") != 0)
+    printf("Resuming upload of \"%s\" to group \"%s\" from %zu/%zu bytes (token: %s)...\n", 
+            filename, target_name, args->transferred, args->filesize, token);
+
+    if(!open_transfer_streams(args))
     {
-        printf("Server did not accept transfer connection: \"%s\"\n", buffer);
         cancel_transfer(args);
         return 0;
     }
-        
-    printf("Receiver has successfully established to the server!\n");
 
-    //Register the new connection with epoll and set it as nonblocking
-    fcntl(args->socketfd, F_SETFL, O_NONBLOCK);
-    register_fd_with_epoll(epoll_fd, args->socketfd, EPOLLIN | EPOLLRDHUP);
+    return 1;
+}
+
 
-    //Create a timerfd to periodically print the transfer progress
-    file_transfers->timerfd = create_timerfd(PRINT_XFER_PROGRESS_PERIOD, 1, epoll_fd);
 
-    return args->socketfd;
+
+/**************************************/
+/*  Server Control Messages Handling  */
+/**************************************/
+
+int incoming_file()
+{
+    FileInfo *fileinfo = calloc(1,sizeof(FileInfo));
+
+    parse_send_cmd_recver(buffer, fileinfo);
+    printf("User \"%s\" would like to send you the file \"%s\" (%zu bytes, token: %s)\n",
+            fileinfo->target_name, fileinfo->filename, fileinfo->filesize, fileinfo->token);
+
+    //A user may offer several files at once. Each offer is identified by its token
+    LL_APPEND(incoming_transfers, fileinfo);
+
+    return 1;
 }
 
 
-int file_recv_next(FileXferArgs *args)
+//The sender of a file offered to me has finished computing its checksum
+int checksum_trailer()
 {
-    size_t remaining_size = args->filesize - args->transferred;
-    int bytes;
+    char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int checksum;
+    FileXferArgs *args;
+    FileInfo *pending_xfer;
 
-    bytes = recv(args->socketfd, args->file_buffer, (remaining_size < RECV_CHUNK_SIZE)? remaining_size:RECV_CHUNK_SIZE, 0);
+    sscanf(buffer, "!xfercrc=%16[^,],crc=%x", token, &checksum);
 
-    if(bytes <= 0)
+    HASH_FIND_STR(file_transfers, token, args);
+    if(args && args->operation == RECVING_OP && args->target_type == USER_TARGET)
     {
-        perror("Failed to receive file piece from server.");
-        printf("%zu\\%zu bytes received before failure.\n", args->transferred, args->filesize);
-        cancel_transfer(args);
-        return 0;
+        args->trailer_checksum = checksum;
+        args->has_trailer = 1;
+
+        //The whole file may have arrived already, only waiting for its checksum
+        if(args->transferred >= args->filesize)
+            finish_received_file(args);
+        return 1;
     }
-    
-    //Append the received chunk to local file
-    if(write(fileno(args->file_fp), args->file_buffer, bytes) != bytes)
+
+    //Or keep it with the offer, until the file is accepted
+    LL_FOREACH(incoming_transfers, pending_xfer)
     {
-        perror("Failed to write correct number of bytes to receiving file.");
+        if(strcmp(pending_xfer->token, token) == 0)
+        {
+            pending_xfer->trailer_checksum = checksum;
+            pending_xfer->has_trailer = 1;
+            return 1;
+        }
     }
 
-    args->transferred += bytes;
-   // printf("Received %zu\\%zu bytes from \"%s\"\n", args->transferred, args->filesize, args->target_name);
-
-    //Has the entire message been received?
-    if(args->transferred < args->filesize)
-        return bytes;
-    
-    //Transfer has completed!
-    print_transfer_progress();
-    printf("Completed file transfer!\n");
-    
-    //Verify file integrity, and then cleanup and close the transfer connection
-    verify_received_file(args->filesize, args->checksum, args->target_file);
-    cancel_transfer(args);
-    return bytes;
+    printf("No incoming file transfer with token \"%s\" for checksum %x.\n", token, checksum);
+    return 0;
 }
 
+//The server passes on the checksum of every chunk of a group file I'm downloading
+int download_chunk_checksums()
+{
+    char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int first = 0, i;
+    int parsed = 0;
+    FileXferArgs *args;
 
+    sscanf(buffer, "!xferchunks=%16[^,],first=%u,crcs=%n", token, &first, &parsed);
 
-
-
-/******************************/
-/* Client-Group File Sharing */
-/******************************/ 
-
-static int put_file_to_group(FileXferArgs *args)
-{
-    if(!load_sending_file(args))
+    HASH_FIND_STR(file_transfers, token, args);
+    if(!args || args->operation != RECVING_OP || !args->chunks || !parsed || first != args->chunks_known)
+    {
+        printf("No group download expecting chunk checksums from chunk %u (token: %s).\n", first, token);
         return 0;
+    }
 
-    args->operation = SENDING_OP;
+    args->chunks_known += parse_chunk_checksums(&buffer[parsed], args->chunk_crcs, first, args->chunk_count);
+    if(args->chunks_known < args->chunk_count)
+        return 1;
 
-    //Rewrite the existing message in buffer with the de-localized filename
-    sprintf(buffer, "@@%s !putfile=%s,size=%zu,crc=%x", 
-            file_transfers->target_name, file_transfers->filename, file_transfers->filesize, file_transfers->checksum);
-    printf("Initiating file put with group \"%s\" for file \"%s\" (%zu bytes, checksum: %x)\n", 
-            file_transfers->target_name, file_transfers->filename, file_transfers->filesize, file_transfers->checksum);
-    
-    //The new message in buffer will be sent automatically when this function returns back to client_main_loop()
+    //All of them are known. Only trust them if they match the root announced with the file
+    if(chunk_tree_root(args->chunk_crcs, args->chunk_count) != args->chunk_root)
+    {
+        printf("Chunk checksums of \"%s\" do not match their root. The file will be verified as a whole instead.\n", args->filename);
+        drop_chunk_checksums(args);
+    }
+    else
+    {
+        args->chunk_tree_valid = 1;
 
-    return 1;
-}
+        //Check the chunks that arrived ahead of their checksums
+        for(i=0; i<args->chunk_count; i++)
+            if(args->chunks[i].status == CHUNK_RECEIVED && !check_received_chunk(args, i))
+                return 0;
+    }
 
-static int get_file_from_group()
-{
+    //The whole file may have arrived already, only waiting for its chunk checksums
+    if(args->transferred >= args->filesize && !args->chunks_failed)
+        finish_received_file(args);
     return 1;
 }
 
-
-
-
-/**************************************/
-/*  Server Control Messages Handling  */
-/**************************************/
-
-int incoming_file()
+//The server received a damaged chunk of my upload. It is sent again once its stream's range is done
+int resend_upload_chunk()
 {
-    FileInfo *fileinfo = calloc(1,sizeof(FileInfo));
+    char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int chunk = 0;
+    FileXferArgs *args;
+    XferStream *stream;
 
-    parse_send_cmd_recver(buffer, fileinfo);
-    printf("User \"%s\" would like to send you the file \"%s\" (%zu bytes, crc: %x, token: %s)\n", 
-            fileinfo->target_name, fileinfo->filename, fileinfo->filesize,fileinfo->checksum, fileinfo->token);
+    sscanf(buffer, "!rechunk=%16[^,],chunk=%u", token, &chunk);
 
-    //If the same user has offered any other files previously, delete them
-    delete_pending_xfer(fileinfo->target_name);
-    LL_APPEND(incoming_transfers, fileinfo);
+    HASH_FIND_STR(file_transfers, token, args);
+    if(!args || args->operation != SENDING_OP || args->target_type != GROUP_TARGET || !args->streams || chunk >= xfer_chunk_count(args->filesize))
+    {
+        printf("No group upload to send chunk %u of again (token: %s).\n", chunk, token);
+        return 0;
+    }
+
+    stream = &args->streams[xfer_chunk_stream(args->filesize, args->stream_count, chunk)];
+    append_chunk_resend(&stream->resends, chunk);
+    if(stream->socketfd)
+        update_epoll_events(epoll_fd, stream->socketfd, EPOLLOUT | EPOLLRDHUP);
 
+    printf("Chunk %u of \"%s\" was damaged on the way to the server. Sending it again...\n", chunk, args->filename);
     return 1;
 }
 
-
 int rejected_file_sending()
 {
-    char target_name[USERNAME_LENG+1];
+    char target_name[XFER_RECIPIENTS_LENG+1];
     char reason[MAX_MSG_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
+    FileXferArgs *args;
 
-    if(!file_transfers)
+    sscanf(buffer, "!rejectfile=%[^,],reason=%[^,],token=%s", target_name, reason, token);
+
+    HASH_FIND_STR(file_transfers, token, args);
+    if(!args)
         return 0;
-    
-    sscanf(buffer, "!rejectfile=%[^,],reason=%s", target_name, reason);
-    printf("File Transfer with \"%s\" has been declined. Reason: \"%s\"\n", target_name, reason);
-    cancel_transfer(file_transfers);
+
+    //A single recipient of a file sent to several users declined. The others may still accept it
+    if(strcmp(args->target_name, target_name) != 0)
+    {
+        printf("\"%s\" has declined the file \"%s\" (token: %s). Reason: \"%s\"\n", target_name, args->filename, token, reason);
+        return 1;
+    }
+
+    printf("File Transfer with \"%s\" (token: %s) has been declined. Reason: \"%s\"\n", target_name, token, reason);
+    cancel_transfer(args);
 
     return 1;
 }
 
 void file_transfer_cancelled()
 {
-    char target_name[USERNAME_LENG+1];
+    char target_name[XFER_RECIPIENTS_LENG+1];
     char reason[MAX_MSG_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
+    FileXferArgs *args;
     FileInfo *curr, *temp;
 
-    sscanf(buffer, "!cancelfile=%[^,],reason=%s", target_name, reason);
+    sscanf(buffer, "!cancelfile=%[^,],reason=%[^,],token=%s", target_name, reason, token);
 
-    //If the ongoing transfer is being cancelled
-    if(file_transfers && strcmp(file_transfers->target_name, target_name) == 0)
+    //If an ongoing transfer is being cancelled
+    HASH_FIND_STR(file_transfers, token, args);
+    if(args && args->operation == SENDING_OP && strcmp(args->target_name, target_name) != 0)
+    {
+        //A single recipient of a file sent to several users left. The others keep receiving it
+        printf("\"%s\" is no longer receiving the file \"%s\" (token: %s). Reason: \"%s\"\n", target_name, args->filename, token, reason);
+        return;
+    }
+    else if(args)
     {
-        printf("File Transfer with \"%s\" has been cancelled. Reason: \"%s\"\n", target_name, reason);
-        cancel_transfer(file_transfers);
+        printf("File Transfer with \"%s\" (token: %s) has been cancelled. Reason: \"%s\"\n", target_name, token, reason);
+        cancel_transfer(args);
         return;
     }
-    
+
     //If a invitation is being cancelled
     LL_FOREACH_SAFE(incoming_transfers, curr, temp)
     {
-        if(strcmp(curr->target_name, target_name) == 0)
+        if(strcmp(curr->token, token) == 0)
         {
             LL_DELETE(incoming_transfers, curr);
             free(curr);
@@ -587,9 +1437,9 @@ void file_transfer_cancelled()
     }
 
     if(curr)
-        printf("File Transfer invitation with \"%s\" has been cancelled. Reason: \"%s\"\n", target_name, reason);
+        printf("File Transfer invitation with \"%s\" (token: %s) has been cancelled. Reason: \"%s\"\n", target_name, token, reason);
     else
-        printf("No file transfers with \"%s\" exists to be cancelled. \n", target_name);
+        printf("No file transfers with \"%s\" (token: %s) exists to be cancelled. \n", target_name, token);
 }
 
 
@@ -600,21 +1450,30 @@ int begin_file_sending()
 
 int incoming_group_file()
 {
-    if(file_transfers)
+    FileXferArgs *args = calloc(1,sizeof(FileXferArgs));
+
+    args->stream_count = 1;
+    sscanf(buffer, "!getfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%[^,],streams=%u,chunks=%u,root=%x",
+            args->filename, &args->filesize, &args->checksum, args->target_name, args->token, &args->stream_count, &args->chunk_count, &args->chunk_root);
+    args->target_type = GROUP_TARGET;
+    args->codec = parse_xfer_codec(buffer);
+
+    //The file's chunk checksums follow, and each chunk is checked as it arrives. Otherwise the file is verified as a whole
+    if(args->chunk_count && args->chunk_count == xfer_chunk_count(args->filesize))
     {
-        printf("Already have ongoing file transfers...\n");
-        return 0;
+        args->chunk_crcs = calloc(args->chunk_count, sizeof(unsigned int));
+        args->chunks = calloc(args->chunk_count, sizeof(XferChunk));
     }
+    else
+        args->chunk_count = 0;
 
-    file_transfers = calloc(1,sizeof(FileXferArgs)); 
-    sscanf(buffer, "!getfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%s", 
-            file_transfers->filename, &file_transfers->filesize, &file_transfers->checksum, file_transfers->target_name, file_transfers->token);    
+    printf("File \"%s\" (%zu bytes, crc: %x, token: %s) from group \"%s\" is ready for download.\n",
+            args->filename, args->filesize, args->checksum, args->token, args->target_name);
 
-    printf("File \"%s\" (%zu bytes, crc: %x, token: %s) from group \"%s\" is ready for download.\n", 
-            file_transfers->filename, file_transfers->filesize, file_transfers->checksum, file_transfers->token, file_transfers->target_name);
+    HASH_ADD_STR(file_transfers, token, args);
 
     //Directly open a new connection to accept the file
-    new_recv_connection(file_transfers);
+    new_recv_connection(args);
 
     return 0;
 }
@@ -625,7 +1484,7 @@ int new_group_file_ready()
     unsigned int fileid;
     size_t filesize;
 
-    sscanf(buffer, "!putfile=%[^,],filename=%[^,],id=%u,size=%zu,uploader=%s", 
+    sscanf(buffer, "!putfile=%[^,],filename=%[^,],id=%u,size=%zu,uploader=%s",
             groupname, filename, &fileid, &filesize, uploader);
 
     printf("Group \"%s\" has a new file available for download. \"%s\" (fileid: %u, %zu bytes), Uploaded by \"%s\".\n",
@@ -634,6 +1493,34 @@ int new_group_file_ready()
     return 1;
 }
 
+int group_file_uploading()
+{
+    char groupname[USERNAME_LENG+1], uploader[USERNAME_LENG+1], filename[MAX_FILENAME+1];
+    unsigned int fileid;
+    size_t filesize;
+
+    sscanf(buffer, "!uploading=%[^,],filename=%[^,],id=%u,size=%zu,uploader=%s",
+            groupname, filename, &fileid, &filesize, uploader);
+
+    printf("\"%s\" is uploading \"%s\" (fileid: %u, %zu bytes) to group \"%s\". It can be downloaded while it arrives.\n",
+             uploader, filename, fileid, filesize, groupname);
+
+    return 1;
+}
+
+//The server has finished receiving a file this client started downloading while it was still being uploaded
+int group_upload_status()
+{
+    char filename[MAX_FILENAME+1], status[DISCONNECT_REASON_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int checksum;
+
+    sscanf(buffer, "!uploadstatus=%[^,],token=%[^,],crc=%x,status=%s", filename, token, &checksum, status);
+
+    printf("The upload of \"%s\" (token: %s, checksum: %x) has ended on the server. Status: \"%s\"\n", filename, token, checksum, status);
+    return 1;
+}
+
 
 
 /******************************/
@@ -642,6 +1529,8 @@ int new_group_file_ready()
 
 int outgoing_file()
 {
+    FileXferArgs *args;
+
     //Do not continue if there is no target, the target doesn't start with '@', or is a group target (starts with '@@')
     if(!msg_target || msg_target[0] != '@' || msg_target[1] == '@')
     {
@@ -650,24 +1539,64 @@ int outgoing_file()
     }
     ++msg_target;
 
-    
-    if(file_transfers)
+    if(strlen(msg_target) > XFER_RECIPIENTS_LENG)
     {
-        printf("A pending file transfer already exist. Cannot continue...\n");
+        printf("Too many recipients.\n");
         return 0;
     }
-    file_transfers = calloc(1, sizeof(FileXferArgs));
-
 
-    parse_send_cmd_sender(msg_body, file_transfers, 0);
-    if(!new_send_cmd(file_transfers))
+    args = calloc(1, sizeof(FileXferArgs));
+    parse_send_cmd_sender(msg_body, args, 0);
+    if(!new_send_cmd(args))
+    {
+        free(args);
         return 0;
+    }
 
+    //Wait for the server to assign a token to this transfer
+    LL_APPEND(outgoing_transfers, args);
     return 1;
 }
 
 int outgoing_file_group()
 {
+    FileXferArgs *args;
+
+    //Do not continue if there is no target, or target is not a group
+    if(!msg_target || strncmp(msg_target, "@@", 2) != 0)
+    {
+        printf("Invalid group target.\n");
+        return 0;
+    }
+    msg_target += 2;
+
+    args = calloc(1, sizeof(FileXferArgs));
+    parse_send_cmd_sender(msg_body, args, 1);
+    if(!put_file_to_group(args))
+    {
+        free(args);
+        return 0;
+    }
+
+    //Wait for the file to be prepared, and then for the server to accept it and assign a token to this transfer.
+    //The request is sent by file_prep_completed(), not with this command
+    LL_APPEND(outgoing_transfers, args);
+    return 0;
+}
+
+//Reads the optional token following a command, e.g. "!acceptfile <token>"
+static char* command_token(char *cmd_body, char *token_ret)
+{
+    token_ret[0] = '\0';
+    sscanf(cmd_body, "%*s %16s", token_ret);
+
+    return (strlen(token_ret) > 0)? token_ret : NULL;
+}
+
+int outgoing_resume_group()
+{
+    FileXferArgs *args;
+
     //Do not continue if there is no target, or target is not a group
     if(!msg_target || strncmp(msg_target, "@@", 2) != 0)
     {
@@ -675,26 +1604,48 @@ int outgoing_file_group()
         return 0;
     }
     msg_target += 2;
-    
 
-    if(file_transfers)
+    args = calloc(1, sizeof(FileXferArgs));
+    if(sscanf(msg_body, "!resumefile %16s %[^$]", args->token, args->target_file) != 2)
     {
-        printf("A pending file transfer already exist. Cannot continue...\n");
+        printf("Usage: \"@@<group> !resumefile <token> <filepath>\"\n");
+        free(args);
         return 0;
     }
-    file_transfers = calloc(1, sizeof(FileXferArgs));
 
+    strcpy(args->target_name, msg_target);
+    args->target_type = GROUP_TARGET;
+    filename_from_path(args);
 
-    parse_send_cmd_sender(msg_body, file_transfers, 1);
-    if(!put_file_to_group(file_transfers))
+    if(!load_sending_file(args))
+    {
+        free(args);
         return 0;
+    }
+    args->operation = SENDING_OP;
+
+    //The server matches the upload by its checksum before telling which ranges it still needs
+    args->checksum = xcrc32((unsigned char*)args->file_buffer, args->filesize, CRC_INIT);
+
+    //Ask the server how much of the file it has already received
+    sprintf(buffer, "@@%s !resumefile=%s,size=%zu,crc=%x",
+            args->target_name, args->token, args->filesize, args->checksum);
+    printf("Requesting to resume upload of \"%s\" to group \"%s\" (token: %s)\n", args->filename, args->target_name, args->token);
+
+    //Since we're overwriting the original buffer, we must prevent the command handler from trying to concanate msg_target and msg_body together
+    msg_target = NULL;
+    msg_body = buffer;
 
+    //Wait for the server to tell which parts of the file are still needed
+    LL_APPEND(outgoing_transfers, args);
     return 1;
 }
 
 int accept_incoming_file()
 {
     FileInfo *pending_xfer;
+    FileXferArgs *args;
+    char token[TRANSFER_TOKEN_SIZE+1];
 
     if(!msg_target)
         return 0;
@@ -706,31 +1657,36 @@ int accept_incoming_file()
             ++msg_target;
     }
 
-    //Find the file associated with the sender
-    pending_xfer = find_pending_xfer(msg_target);
+    //Find the file associated with the sender (and the token, if specified)
+    pending_xfer = find_pending_xfer(msg_target, command_token(msg_body, token));
     if(!pending_xfer)
     {
         printf("Target \"%s\" hasn't offered any files.\n", msg_target);
         return 0;
     }
 
-    file_transfers = calloc(1, sizeof(FileXferArgs));
-    strcpy(file_transfers->target_name, msg_target);
-    strcpy(file_transfers->filename, pending_xfer->filename);
-    strcpy(file_transfers->token, pending_xfer->token);
-    file_transfers->filesize = pending_xfer->filesize;
-    file_transfers->checksum = pending_xfer->checksum;
+    args = calloc(1, sizeof(FileXferArgs));
+    strcpy(args->target_name, msg_target);
+    strcpy(args->filename, pending_xfer->filename);
+    strcpy(args->token, pending_xfer->token);
+    args->filesize = pending_xfer->filesize;
+    args->checksum = pending_xfer->checksum;
+    args->trailer_checksum = pending_xfer->trailer_checksum;
+    args->has_trailer = pending_xfer->has_trailer;
+    args->target_type = USER_TARGET;
+    args->stream_count = (pending_xfer->stream_count < XFER_MAX_STREAMS)? pending_xfer->stream_count : XFER_MAX_STREAMS;
+    HASH_ADD_STR(file_transfers, token, args);
 
     LL_DELETE(incoming_transfers, pending_xfer);
     free(pending_xfer);
 
     //Tell the server I am accepting this file
-    sprintf(buffer, "!acceptfile=%s,size=%zu,crc=%x,target=%s,token=%s", 
-            file_transfers->filename, file_transfers->filesize, file_transfers->checksum, file_transfers->target_name, file_transfers->token);
+    sprintf(buffer, "!acceptfile=%s,size=%zu,crc=%x,target=%s,token=%s,streams=%u",
+            args->filename, args->filesize, args->checksum, args->target_name, args->token, args->stream_count);
     send_msg_client(buffer, strlen(buffer)+1);
 
     //Dial a new connection for the file transfer
-    new_recv_connection(file_transfers);
+    new_recv_connection(args);
 
     return 0;
 }
@@ -739,6 +1695,10 @@ int accept_incoming_file()
 int reject_incoming_file()
 {
     char target_name[USERNAME_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
+    char *requested_token;
+    FileInfo *pending_xfer;
+    int count = 0;
 
     if(!msg_target)
         return 0;
@@ -751,14 +1711,21 @@ int reject_incoming_file()
     }
 
     strcpy(target_name, msg_target);
-    if(delete_pending_xfer(target_name) == 0)
+    requested_token = command_token(msg_body, token);
+
+    //Reject the offer with the specified token, or every offer from the target user if no token is specified
+    while((pending_xfer = find_pending_xfer(target_name, requested_token)))
     {
-        printf("User \"%s\" hasn't offered any files.\n", target_name);
-        return 0;
+        sprintf(buffer, "!rejectfile=%s,reason=%s,token=%s", target_name, "RecverDeclined", pending_xfer->token);
+        send_msg_client(buffer, strlen(buffer)+1);
+
+        LL_DELETE(incoming_transfers, pending_xfer);
+        free(pending_xfer);
+        ++count;
     }
 
-    sprintf(buffer, "!rejectfile=%s,reason=%s", target_name, "RecverDeclined");
-    send_msg_client(buffer, strlen(buffer)+1);
+    if(count == 0)
+        printf("User \"%s\" hasn't offered any files.\n", target_name);
 
     return 0;
 }
@@ -766,17 +1733,31 @@ int reject_incoming_file()
 
 int cancel_ongoing_file_transfer()
 {
-    if(!file_transfers)
+    char token[TRANSFER_TOKEN_SIZE+1];
+    FileXferArgs *args;
+
+    //Without a token, the command is only unambiguous when there is exactly one transfer
+    if(command_token(msg_body, token))
+        HASH_FIND_STR(file_transfers, token, args);
+    else if(HASH_COUNT(file_transfers) == 1)
+        args = file_transfers;
+    else
+    {
+        printf("Please specify which transfer to cancel: \"!cancelfile <token>\"\n");
+        return 0;
+    }
+
+    if(!args)
     {
-        printf("No file transfers are in progress.\n");
+        printf("No such file transfer is in progress.\n");
         return 0;
     }
 
-    printf("Ongoing transfer has been cancelled.\n");
-    sprintf(buffer,"!cancelfile=%s,reason=%s", 
-            file_transfers->target_name, (file_transfers->operation == SENDING_OP)? "SenderCancelled":"RecverCancelled");
+    printf("Transfer \"%s\" has been cancelled.\n", args->token);
+    sprintf(buffer,"!cancelfile=%s,reason=%s,token=%s",
+            args->target_name, (args->operation == SENDING_OP)? "SenderCancelled":"RecverCancelled", args->token);
     send_msg_client(buffer, strlen(buffer)+1);
-    cancel_transfer(file_transfers);
+    cancel_transfer(args);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -2,6 +2,7 @@
 #define _FILE_TRANSFER_CLIENT_H_
 
 #include "../common/common.h"
+#include "file_prep.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,17 +12,47 @@
 
 #define RECV_CHUNK_SIZE             BUFSIZE
 //#define RECV_CHUNK_SIZE           64
+#define RECV_WINDOW_SIZE            (8*1024*1024)       //Bytes of a stream's range that are mapped at once while receiving
+#define RECV_BUFFER_SIZE            (1024*1024)         //Used instead of a mapping if the receiving file cannot be mapped
 #define CLIENT_RECV_FOLDER          "files_received"
 #define PRINT_XFER_PROGRESS_PERIOD  1
 
 
-typedef struct {
+//A single byte range of a transfer, served by its own transfer connection
+typedef struct xferstream {
+
+    int socketfd;
+    unsigned int index;
+    size_t offset;
+    size_t length;
+    size_t transferred;
+
+    //Receiving: the mapped part of this stream's range, which data is received straight into
+    char *window;
+    size_t window_offset;           //File offset of the window (page aligned)
+    size_t window_size;
+
+    //Group transfers: chunks are checked as they are received, and failed chunks are moved again once the range is done
+    unsigned int chunk_crc;         //Receiving: running checksum of the chunk being received
+    ChunkResend *resends;           //Oldest first
+    size_t resent;                  //Bytes of the oldest of them moved so far
+
+    //Compressed group transfers: the frame being moved
+    XferFrame frame;
+
+    struct filexferargs *xferargs;
+    UT_hash_handle hh;              //Key: socketfd, in transfer_connections
+
+} XferStream;
+
+
+typedef struct filexferargs {
 
     enum sendrecv_op operation;
-    char target_name[USERNAME_LENG+1];
+    enum sendrecv_target target_type;
+    char target_name[XFER_RECIPIENTS_LENG+1];   //A file sent to several users at once names all of them ("user1+user2+...")
     char filename[MAX_FILENAME+1];
 
-    int socketfd;
     char token[TRANSFER_TOKEN_SIZE+1];
 
     char target_file[MAX_FILE_PATH+1];
@@ -29,12 +60,36 @@ typedef struct {
     char *file_buffer;
     size_t filesize;
     size_t transferred;
-    unsigned int checksum;
-
-    //Timer that periodically notifies the current transfer's progress
-    int timerfd;
+    unsigned int checksum;          //As announced with the request. Files sent to users announce 0, and their checksum follows as a trailer
+
+    //Client-client transfers: the checksum is computed while the file is sent, and passed on once ready
+    unsigned int prep_id;           //The sending file's background preparation, while it is still running
+    unsigned int trailer_checksum;
+    int has_trailer;
+
+    //Group transfers: checksums of every XFER_CHUNK_SIZE chunk of the file. They are the leaves of a hash tree, announced by its root
+    unsigned int chunk_count;       //0 if the file is only checked as a whole
+    unsigned int chunk_root;
+    unsigned int *chunk_crcs;
+    unsigned int chunks_known;      //Receiving: checksums received so far, in order
+    int chunk_tree_valid;           //Receiving: all checksums are known and match the root. Chunks are only checked from then on
+    XferChunk *chunks;              //Receiving: how each chunk was received
+    unsigned int chunks_failed;     //Receiving: chunks requested again, and not received yet
+
+    //Group transfers: the file is moved in compressed frames, if the server agreed to it (enum xfer_codec)
+    unsigned char codec;
+
+    //Parallel streams (byte ranges) of this transfer
+    unsigned int stream_count;
+    unsigned int streams_connected;
+    XferStream *streams;
+
+    //Used to print the transfer's progress periodically
     size_t last_transferred;        
 
+    UT_hash_handle hh;              //Key: token, in file_transfers
+    struct filexferargs *next;      //Outgoing transfers waiting for the server to assign a token
+
 } FileXferArgs;         //Also see FileXferArgs_Server
 
 
@@ -47,6 +102,11 @@ typedef struct fileinfo{
     size_t filesize;
     unsigned int checksum;
     char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int stream_count;
+
+    //The sender's checksum may arrive before the offer is accepted
+    unsigned int trailer_checksum;
+    int has_trailer;
 
     struct fileinfo *next;
 
@@ -54,31 +114,45 @@ typedef struct fileinfo{
 
 
 extern FileXferArgs *file_transfers;
+extern XferStream *transfer_connections;
 extern FileInfo *incoming_transfers; 
+extern int progress_timerfd;
 
 
 /*Connection and helpers*/
 void cancel_transfer(FileXferArgs *args);
+void cancel_all_transfers();
+XferStream* find_transfer_connection(int socketfd);
 void print_transfer_progress();
+void file_prep_completed(FilePrepJob *job, int succeeded);
 
 
 /*Ongoing sending and receiving*/
-int file_send_next(FileXferArgs *args);
-int file_recv_next(FileXferArgs *args);
+int file_send_next(XferStream *stream);
+int file_recv_next(XferStream *stream);
 
 
 /*Handle Server control messages*/
 int incoming_file();
+int transfer_delivered();
 int recver_accepted_file();
 int rejected_file_sending();
 void file_transfer_cancelled();
 int new_group_file_ready();
+int group_file_uploading();
+int group_upload_status();
 int incoming_group_file();
+int resumed_file_sending();
+int deduplicated_file_sending();
+int checksum_trailer();
+int download_chunk_checksums();
+int resend_upload_chunk();
 
 
 /*Handle Client-side Operations*/
 int outgoing_file();
 int outgoing_file_group();
+int outgoing_resume_group();
 int accept_incoming_file();
 int reject_incoming_file();
 int cancel_ongoing_file_transfer();
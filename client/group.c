@@ -184,7 +184,7 @@ int parse_filelist()
     unsigned int fileid;
     char uploader[USERNAME_LENG+1];
     char filename[MAX_FILENAME+1];
-    size_t filesize;
+    size_t filesize, received;
 
     //Parse the header
     sscanf(buffer, "!filelist=%u,group=%[^,],%n", &file_count, group_name, &header_len);
@@ -201,14 +201,58 @@ int parse_filelist()
         
         current_fileinfo_idx = current_fileinfo - buffer + 1;
         
-        sscanf(current_fileinfo, "[%u,%[^,],%zu,%[^]]]", &fileid, filename, &filesize, uploader);
-        printf("FileID: %u \t \"%s\" (%zu bytes) \t Uploader: %s\n", fileid, filename, filesize, uploader);
+        received = 0;
+        sscanf(current_fileinfo, "[%u,%[^,],%zu,%[^],],%zu]", &fileid, filename, &filesize, uploader, &received);
+
+        //Files still being uploaded can already be downloaded
+        if(received < filesize)
+            printf("FileID: %u \t \"%s\" (%zu bytes) \t Uploader: %s \t (uploading: %zu/%zu bytes)\n", fileid, filename, filesize, uploader, received, filesize);
+        else
+            printf("FileID: %u \t \"%s\" (%zu bytes) \t Uploader: %s\n", fileid, filename, filesize, uploader);
     }
      
 
     return file_count;
 }
 
+int parse_search_results()
+{
+    char target[USERNAME_LENG+3];
+    unsigned int count, header_len = 0;
+
+    //The header is followed by one line per matching message, like !history
+    sscanf(buffer, "!search=%u,target=%[^\n]\n%n", &count, target, &header_len);
+
+    if(target[1] == '@')
+        printf("%u message(s) found in the group \"%s\":\n", count, &target[2]);
+    else
+        printf("%u message(s) found with \"%s\":\n", count, &target[1]);
+
+    if(header_len)
+        printf("%s", &buffer[header_len]);
+
+    return count;
+}
+
+int parse_history()
+{
+    char target[USERNAME_LENG+3];
+    unsigned int count, header_len = 0;
+
+    //The header is followed by one line per message, already formatted by the server
+    sscanf(buffer, "!history=%u,target=%[^\n]\n%n", &count, target, &header_len);
+
+    if(target[1] == '@')
+        printf("%u archived message(s) in the group \"%s\":\n", count, &target[2]);
+    else
+        printf("%u archived message(s) with \"%s\":\n", count, &target[1]);
+
+    if(header_len)
+        printf("%s", &buffer[header_len]);
+
+    return count;
+}
+
 
 /******************************/
 /*   Client-side Operations   */
@@ -21,6 +21,8 @@ void group_banned();
 void user_left_group();
 void user_joined_group();
 int parse_filelist();
+int parse_history();
+int parse_search_results();
 
 /*Handle Client-side Operations*/
 int leaving_group();
@@ -1,5 +1,8 @@
 #include "common.h"
+#include "../library/sha256/sha256.h"                 //https://github.com/B-Con/crypto-algorithms
+#include "../library/lz/lz.h"
 #include <sys/stat.h>
+#include <time.h>
 
 
 int hostname_to_ip(const char* hostname, const char* port, char* ip_return)
@@ -243,10 +246,9 @@ int make_folder_and_file_for_writing(char* root_dir, char* target_name, char *fi
     }
     printf("Created file \"%s\" for writing...\n", target_file_ret);
 
-    //mmap write is currently broken for WSL. We'll just append the received data for now. 
-    
-    //Create a target file for writing (binary mode)
-    *file_fp_ret = fopen(target_file_ret, "ab");
+    //Create a target file for writing (binary mode). Not opened for appending, as pwrite() would ignore the offset.
+    //Opened for reading as well, as a writable shared mapping of the file needs it
+    *file_fp_ret = fopen(target_file_ret, "wb+");
     if(!*file_fp_ret)
     {
         perror("Cannot create file for writing.");
@@ -350,4 +352,434 @@ void print_char_by_char(char *str, size_t len)
     for(i=0; i<len; i++)
         printf("%c", str[i]);
     printf("\n");
-}
\ No newline at end of file
+}
+
+
+//Decides how many parallel streams to split a file of this size into
+unsigned int xfer_stream_count(size_t filesize, unsigned int max_streams)
+{
+    size_t streams = filesize / XFER_MIN_STREAM_SIZE;
+
+    if(max_streams > XFER_MAX_STREAMS)
+        max_streams = XFER_MAX_STREAMS;
+
+    if(streams < 1)
+        streams = 1;
+    else if(streams > max_streams)
+        streams = max_streams;
+
+    return streams;
+}
+
+//Finds the byte range covered by a single stream. The last stream also covers the remainder
+void xfer_stream_range(size_t filesize, unsigned int stream_count, unsigned int index, size_t *offset_ret, size_t *length_ret)
+{
+    size_t range_size = filesize / stream_count;
+
+    //Ranges start on a chunk boundary, so every chunk is moved (and resent) by a single stream
+    range_size -= range_size % XFER_CHUNK_SIZE;
+
+    *offset_ret = range_size * index;
+    *length_ret = (index == stream_count - 1)? filesize - *offset_ret : range_size;
+}
+
+
+/*Chunk Checksums*/
+
+unsigned int xfer_chunk_count(size_t filesize)
+{
+    return (filesize + XFER_CHUNK_SIZE - 1) / XFER_CHUNK_SIZE;
+}
+
+void xfer_chunk_range(size_t filesize, unsigned int chunk, size_t *offset_ret, size_t *length_ret)
+{
+    *offset_ret = (size_t) chunk * XFER_CHUNK_SIZE;
+    *length_ret = (filesize - *offset_ret < XFER_CHUNK_SIZE)? filesize - *offset_ret : XFER_CHUNK_SIZE;
+}
+
+//Finds the stream whose range holds a chunk
+unsigned int xfer_chunk_stream(size_t filesize, unsigned int stream_count, unsigned int chunk)
+{
+    size_t chunk_offset = (size_t) chunk * XFER_CHUNK_SIZE;
+    size_t offset, length;
+    unsigned int index;
+
+    for(index = stream_count - 1; index > 0; index--)
+    {
+        xfer_stream_range(filesize, stream_count, index, &offset, &length);
+        if(chunk_offset >= offset)
+            break;
+    }
+
+    return index;
+}
+
+//Multiplies two polynomials modulo the CRC-32 polynomial, in xcrc32's bit order (not reflected)
+static unsigned int crc32_multiply(unsigned int a, unsigned int b)
+{
+    unsigned int product = 0;
+    int i;
+
+    for(i=31; i>=0; i--)
+    {
+        product = (product << 1) ^ ((product & 0x80000000)? CRC32_POLYNOMIAL : 0);
+        if(a & (1U << i))
+            product ^= b;
+    }
+
+    return product;
+}
+
+//The checksum of some data followed by a block, from the data's checksum and the block's own checksum (started from CRC_INIT).
+//xcrc32 has no reflection or final XOR, so running "block_length" zero bytes through it is a multiplication by x^(8*block_length)
+unsigned int crc32_append(unsigned int crc, unsigned int block_crc, size_t block_length)
+{
+    unsigned int zeros = 1, power = 0x100;
+
+    for(; block_length; block_length >>= 1)
+    {
+        if(block_length & 1)
+            zeros = crc32_multiply(zeros, power);
+        power = crc32_multiply(power, power);
+    }
+
+    return crc32_multiply(crc ^ CRC_INIT, zeros) ^ block_crc;
+}
+
+//Root of a hash tree over a file's chunk checksums. Each node is the checksum of its two children, and a node without a pair moves up as is.
+//Announced along with the file, so the chunk checksums that follow can be trusted before checking any chunk against them
+unsigned int chunk_tree_root(unsigned int *chunk_crcs, unsigned int chunk_count)
+{
+    unsigned int *level, root, width, i;
+    unsigned char pair[8];
+
+    if(chunk_count == 0)
+        return CRC_INIT;
+
+    level = malloc(chunk_count * sizeof(unsigned int));
+    memcpy(level, chunk_crcs, chunk_count * sizeof(unsigned int));
+
+    for(width = chunk_count; width > 1; width = (width + 1) / 2)
+    {
+        for(i=0; i<width; i+=2)
+        {
+            if(i+1 == width)
+            {
+                level[i/2] = level[i];
+                continue;
+            }
+
+            //Same byte order on every host
+            pair[0] = level[i] >> 24;   pair[1] = level[i] >> 16;   pair[2] = level[i] >> 8;   pair[3] = level[i];
+            pair[4] = level[i+1] >> 24; pair[5] = level[i+1] >> 16; pair[6] = level[i+1] >> 8; pair[7] = level[i+1];
+            level[i/2] = xcrc32(pair, sizeof(pair), CRC_INIT);
+        }
+    }
+
+    root = level[0];
+    free(level);
+    return root;
+}
+
+//Writes a "!xferchunks" message holding up to XFER_CHUNKS_PER_MSG chunk checksums, starting from chunk "first". Returns how many it holds
+unsigned int format_chunk_checksums(char *msg_ret, char *token, unsigned int *chunk_crcs, unsigned int first, unsigned int count)
+{
+    unsigned int i, last = first + XFER_CHUNKS_PER_MSG;
+    int msg_size;
+
+    if(last > count)
+        last = count;
+
+    msg_size = sprintf(msg_ret, "!xferchunks=%s,first=%u,crcs=", token, first);
+    for(i=first; i<last; i++)
+        msg_size += sprintf(&msg_ret[msg_size], (i == first)? "%x" : ";%x", chunk_crcs[i]);
+
+    return last - first;
+}
+
+//Reads the checksum list of a "!xferchunks" message into chunk_crcs, starting from chunk "first". Returns how many were read
+unsigned int parse_chunk_checksums(char *list, unsigned int *chunk_crcs, unsigned int first, unsigned int chunk_count)
+{
+    unsigned int i = first;
+    int parsed;
+
+    while(i < chunk_count && sscanf(list, "%x%n", &chunk_crcs[i], &parsed) == 1)
+    {
+        ++i;
+        list += parsed;
+        if(*list != ';')
+            break;
+        ++list;
+    }
+
+    return i - first;
+}
+
+void append_chunk_resend(ChunkResend **resends, unsigned int chunk)
+{
+    ChunkResend *resend = malloc(sizeof(ChunkResend));
+
+    resend->chunk = chunk;
+    LL_APPEND(*resends, resend);
+}
+
+//Removes the chunk at the front, once it has been moved again
+void pop_chunk_resend(ChunkResend **resends)
+{
+    ChunkResend *resend = *resends;
+
+    LL_DELETE(*resends, resend);
+    free(resend);
+}
+
+void free_chunk_resends(ChunkResend **resends)
+{
+    ChunkResend *curr, *tmp;
+
+    LL_FOREACH_SAFE(*resends, curr, tmp)
+    {
+        LL_DELETE(*resends, curr);
+        free(curr);
+    }
+}
+
+
+//Finds the codec a transfer command names (",codec=<codec>"), if it is one this build supports
+enum xfer_codec parse_xfer_codec(char *cmd)
+{
+    char *codec = strstr(cmd, ",codec=");
+
+    if(codec && strncmp(&codec[7], XFER_CODEC_NAME, strlen(XFER_CODEC_NAME)) == 0 && (codec[7+strlen(XFER_CODEC_NAME)] == ',' || codec[7+strlen(XFER_CODEC_NAME)] == '\0'))
+        return XFER_CODEC_LZ;
+
+    return XFER_CODEC_NONE;
+}
+
+//Bytes of the file a frame starting at "position" may hold: up to XFER_FRAME_BLOCK, without crossing into the next chunk
+unsigned int xfer_frame_limit(size_t filesize, size_t position)
+{
+    size_t chunk_offset, chunk_length;
+
+    xfer_chunk_range(filesize, position / XFER_CHUNK_SIZE, &chunk_offset, &chunk_length);
+    return (chunk_offset + chunk_length - position < XFER_FRAME_BLOCK)? chunk_offset + chunk_length - position : XFER_FRAME_BLOCK;
+}
+
+//Encodes a block of the file at "position" into a frame, compressed unless that would not make it smaller.
+//Once a block of a chunk turns out incompressible, the chunk's other blocks are sent as is without trying
+void encode_xfer_frame(XferFrame *frame, const unsigned char *block, unsigned int length, size_t position)
+{
+    unsigned int chunk = position / XFER_CHUNK_SIZE;
+    int payload_length = 0;
+
+    if(!frame->buffer)
+        frame->buffer = malloc(XFER_FRAME_MAX);
+
+    if(frame->stored_chunk != chunk + 1)
+    {
+        payload_length = lz_compress(block, length, &frame->buffer[XFER_FRAME_HEADER_SIZE], length - 1);
+        if(!payload_length)
+            frame->stored_chunk = chunk + 1;
+    }
+
+    if(!payload_length)
+    {
+        memcpy(&frame->buffer[XFER_FRAME_HEADER_SIZE], block, length);
+        payload_length = length;
+    }
+
+    *((uint32_t*)&frame->buffer[0]) = htonl(length);
+    *((uint32_t*)&frame->buffer[4]) = htonl(payload_length);
+    frame->raw_length = length;
+    frame->size = XFER_FRAME_HEADER_SIZE + payload_length;
+    frame->moved = 0;
+}
+
+//Sends as much of the current frame as the socket takes, up to "max" bytes. Returns the bytes sent, or -1 as send() does. The frame is done once all of its size has moved
+int send_xfer_frame(int socketfd, XferFrame *frame, size_t max)
+{
+    int bytes = send_direct(socketfd, (char*) &frame->buffer[frame->moved], (frame->size - frame->moved < max)? frame->size - frame->moved : max);
+
+    if(bytes > 0)
+    {
+        frame->moved += bytes;
+        frame->wire_bytes += bytes;
+    }
+
+    return bytes;
+}
+
+//Receives more of the next frame, holding at most "limit" bytes of the file, and reading up to "max" bytes of it. Returns the length of its block once
+//the frame is whole (decoded into "block_ret"), 0 while it is still arriving, or -1 as recv() does. A malformed frame fails with EPROTO
+int recv_xfer_frame(int socketfd, XferFrame *frame, unsigned int limit, size_t max, unsigned char *block_ret)
+{
+    size_t wanted, payload_length;
+    int bytes;
+
+    if(!frame->buffer)
+        frame->buffer = malloc(XFER_FRAME_MAX);
+
+    //The header first, then the rest of the frame it announces
+    wanted = (frame->moved < XFER_FRAME_HEADER_SIZE)? XFER_FRAME_HEADER_SIZE : frame->size;
+    bytes = recv_direct(socketfd, (char*) &frame->buffer[frame->moved], (wanted - frame->moved < max)? wanted - frame->moved : max);
+    if(bytes <= 0)
+    {
+        if(bytes == 0)
+            errno = ECONNRESET;
+        return -1;
+    }
+    frame->moved += bytes;
+    frame->wire_bytes += bytes;
+
+    //The header may arrive in pieces too. Before the first frame (or a resume), "size" does not describe any frame yet
+    if(frame->moved < XFER_FRAME_HEADER_SIZE)
+        return 0;
+
+    if(frame->moved == XFER_FRAME_HEADER_SIZE && wanted == XFER_FRAME_HEADER_SIZE)
+    {
+        frame->raw_length = ntohl(*((uint32_t*)&frame->buffer[0]));
+        payload_length = ntohl(*((uint32_t*)&frame->buffer[4]));
+        if(frame->raw_length == 0 || frame->raw_length > limit || payload_length == 0 || payload_length > frame->raw_length)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+
+        frame->size = XFER_FRAME_HEADER_SIZE + payload_length;
+        return 0;
+    }
+
+    if(frame->moved < frame->size)
+        return 0;
+
+    //Whole. The frame stays in the buffer until the next one starts arriving
+    frame->moved = 0;
+    payload_length = frame->size - XFER_FRAME_HEADER_SIZE;
+
+    if(payload_length == frame->raw_length)
+        memcpy(block_ret, &frame->buffer[XFER_FRAME_HEADER_SIZE], payload_length);
+    else if(lz_decompress(&frame->buffer[XFER_FRAME_HEADER_SIZE], payload_length, block_ret, frame->raw_length) != (int) frame->raw_length)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return frame->raw_length;
+}
+
+void free_xfer_frame(XferFrame *frame)
+{
+    free(frame->buffer);
+    memset(frame, 0, sizeof(XferFrame));
+}
+
+
+//Hashes a file's contents (SHA-256) into a hex string. Used to identify identical files regardless of their names
+void content_hash(const unsigned char *buf, size_t len, char *hash_ret)
+{
+    SHA256_CTX ctx;
+    unsigned char digest[SHA256_BLOCK_SIZE];
+    int i;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, buf, len);
+    sha256_final(&ctx, digest);
+
+    for(i=0; i<SHA256_BLOCK_SIZE; i++)
+        sprintf(&hash_ret[i*2], "%02x", digest[i]);
+}
+
+int file_content_hash(char *filepath, char *hash_ret)
+{
+    int filefd;
+    struct stat fileinfo;
+    unsigned char *filemap;
+
+    filefd = open(filepath, O_RDONLY);
+    if(filefd < 0)
+    {
+        perror("Failed to open file for hashing.");
+        return 0;
+    }
+
+    fstat(filefd, &fileinfo);
+    if(fileinfo.st_size == 0)
+    {
+        close(filefd);
+        content_hash(NULL, 0, hash_ret);
+        return 1;
+    }
+
+    filemap = mmap(NULL, fileinfo.st_size, PROT_READ, MAP_SHARED, filefd, 0);
+    close(filefd);
+    if(filemap == MAP_FAILED)
+    {
+        perror("Failed to map file in memory for hashing.");
+        return 0;
+    }
+
+    content_hash(filemap, fileinfo.st_size, hash_ret);
+    munmap((void*)filemap, fileinfo.st_size);
+
+    return 1;
+}
+
+
+uint64_t monotonic_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void token_bucket_init(TokenBucket *bucket, uint64_t rate, uint64_t burst)
+{
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->fraction = 0;
+    bucket->last_refill = monotonic_ms();
+}
+
+//Refills the bucket for the time passed since the last refill, and returns the number of tokens available (none while in debt)
+uint64_t token_bucket_available(TokenBucket *bucket)
+{
+    uint64_t now, elapsed, earned;
+
+    if(bucket->rate == 0)
+        return UINT64_MAX;
+
+    now = monotonic_ms();
+    elapsed = now - bucket->last_refill;
+    bucket->last_refill = now;
+
+    //Count in thousandths of a token, so that time earning less than a whole token is not lost between calls.
+    //Long enough to fill the bucket is simply full, and can't overflow the count
+    if(elapsed > (bucket->burst - bucket->tokens) * 1000 / bucket->rate)
+        bucket->tokens = bucket->burst;
+    else
+    {
+        earned = elapsed * bucket->rate + bucket->fraction;
+        bucket->tokens += earned / 1000;
+        bucket->fraction = earned % 1000;
+    }
+
+    //A full bucket earns nothing more
+    if(bucket->tokens >= (int64_t)bucket->burst)
+    {
+        bucket->tokens = bucket->burst;
+        bucket->fraction = 0;
+    }
+
+    return (bucket->tokens > 0)? bucket->tokens : 0;
+}
+
+//Takes the tokens even if fewer are available. Callers that can only check afterwards how much they used (such as whole
+//transfer frames) are then held back until the overdraft is paid back, rather than having it forgiven
+void token_bucket_consume(TokenBucket *bucket, uint64_t tokens)
+{
+    if(bucket->rate == 0)
+        return;
+
+    bucket->tokens -= tokens;
+}
@@ -31,6 +31,7 @@
 #define USERNAME_LENG           64                                  //Maximum length of usernames and group names
 #define BUFSIZE                 4096                                //Buffer size used to hold a single received message
 #define XFER_BUFSIZE            1048576                             //Buffer size used to hold a piece of data during file transfer
+#define XFER_QUANTUM_SIZE       262144                              //Maximum bytes moved for a single transfer connection per event, so concurrent transfers take turns
 #define MAX_MSG_LENG            512                                 //Maximum size of messages can be entered by the user
 #define DISCONNECT_REASON_LENG  64
 
@@ -42,7 +43,21 @@
 #define MAX_FILE_PATH           512 + MAX_FILENAME
 #define TRANSFER_TOKEN_SIZE     16
 #define CRC_INIT                0xffffffff
+#define CRC32_POLYNOMIAL        0x04c11db7                           //xcrc32's polynomial
 #define XFER_REQUEST_TIMEOUT    600                                  //seconds
+#define XFER_MAX_STREAMS        4                                    //Maximum number of parallel transfer connections (byte ranges) for a single transfer
+#define XFER_MIN_STREAM_SIZE    4194304                              //A file is only split into more streams if each range is at least this large
+#define XFER_MAX_RECIPIENTS     16                                   //Maximum number of users a single file can be sent to at once
+#define XFER_RECIPIENTS_LENG    255                                  //Maximum length of a recipient list ("user1+user2+...")
+#define XFER_RECIPIENT_SEPARATOR "+"                                 //Separates recipients on the wire. Never part of a valid username
+#define CONTENT_HASH_SIZE       64                                   //Length of a file's content hash (SHA-256, in hex)
+#define XFER_CHUNK_SIZE         1048576                              //Group transfers are checked (and resent on failure) one chunk of this size at a time
+#define XFER_CHUNKS_PER_MSG     32                                   //Chunk checksums sent in a single "!xferchunks" message
+#define XFER_CHUNK_RETRIES      3                                    //Times a single chunk may fail its check before the transfer is given up on
+#define XFER_CODEC_NAME         "lz"                                 //Compression offered for chat messages (at "!regid") and group transfers (library/lz)
+#define XFER_FRAME_BLOCK        65536                                //Compressed group transfers send up to this many bytes of the file per frame, never across a chunk
+#define XFER_FRAME_HEADER_SIZE  8                                    //Raw length and payload length of a frame (network order)
+#define XFER_FRAME_MAX          (XFER_FRAME_HEADER_SIZE + XFER_FRAME_BLOCK)
 
 #define LOCAL_FOLDER_PERMISSION 600
 
@@ -56,15 +71,50 @@
 
 enum sendrecv_target {NO_TARGET = 0, USER_TARGET, GROUP_TARGET};
 
+enum xfer_codec {XFER_CODEC_NONE = 0, XFER_CODEC_LZ};
+
 enum error_codes   {ERR_NONE = 0, ERR_INVALID_CMD, ERR_INVALID_NAME, ERR_USER_NOT_FOUND, 
                     ERR_GROUP_NOT_FOUND, ERR_NO_PERMISSION, ERR_ALREADY_JOINED, ERR_IP_BANNED,
-                    ERR_INCORRECT_INFO, ERR_NO_XFER_FOUND};
+                    ERR_INCORRECT_INFO, ERR_NO_XFER_FOUND, ERR_QUOTA_EXCEEDED, ERR_QUEUE_FULL,
+                    ERR_UPGRADING, ERR_FLOODING};
+
+
+//How a single chunk of a group transfer was received
+enum xfer_chunk_status {CHUNK_MISSING = 0, CHUNK_RECEIVED, CHUNK_VERIFIED, CHUNK_FAILED};
+
+typedef struct {
+    unsigned int crc;           //Checksum of the chunk as received. Checked once the sender's chunk checksums are known (and match their root)
+    unsigned char status;
+    unsigned char retries;
+} XferChunk;
+
+//A chunk to be moved again on its stream's transfer connection, once the rest of the stream's range has been
+typedef struct chunkresend {
+    unsigned int chunk;
+    struct chunkresend *next;
+} ChunkResend;
+
+
+//A frame of a compressed group transfer, being sent or received on a stream. A frame whose payload is as long as its block holds the block as is
+typedef struct {
+    unsigned char *buffer;      //XFER_FRAME_MAX bytes, allocated on first use
+    size_t size;                //Bytes of the whole frame. Receiving: known once its header has arrived
+    size_t moved;               //Bytes of it sent or received so far
+    unsigned int raw_length;    //Bytes of the file it holds
+    unsigned int stored_chunk;  //Sending: chunk (+1) found incompressible. Its other blocks are sent as is, without trying again
+    size_t wire_bytes;          //Bytes of all frames moved on this stream
+} XferFrame;
 
 
+//Refills "rate" tokens per second, up to "burst" tokens. A rate of 0 is unlimited.
+//Consuming more tokens than are available leaves the bucket in debt, which later refills pay back first
 typedef struct {
-    uint32_t ipaddr;            //copy from sockaddr_in->sin_addr->s_addr
-    UT_hash_handle hh;
-} IP_List;
+    uint64_t rate;
+    uint64_t burst;
+    int64_t tokens;
+    uint64_t fraction;          //Thousandths of a token earned since the last whole one
+    uint64_t last_refill;       //Monotonic time (ms)
+} TokenBucket;
 
 
 extern unsigned int xcrc32 (const unsigned char *buf, int len, unsigned int init);          //Defined in library/crc32/crc32.c
@@ -79,6 +129,31 @@ int path_is_file(const char *path);
 int create_timerfd(int period_sec, int is_periodic, int epoll_fd);
 int make_folder_and_file_for_writing(char* root_dir, char* target_name, char *filename, char* target_file_ret, FILE **file_fp_ret);
 int verify_received_file(size_t expected_size, unsigned int expected_crc, char* filepath);
+unsigned int xfer_stream_count(size_t filesize, unsigned int max_streams);
+void xfer_stream_range(size_t filesize, unsigned int stream_count, unsigned int index, size_t *offset_ret, size_t *length_ret);
+unsigned int xfer_chunk_count(size_t filesize);
+void xfer_chunk_range(size_t filesize, unsigned int chunk, size_t *offset_ret, size_t *length_ret);
+unsigned int xfer_chunk_stream(size_t filesize, unsigned int stream_count, unsigned int chunk);
+unsigned int crc32_append(unsigned int crc, unsigned int block_crc, size_t block_length);
+unsigned int chunk_tree_root(unsigned int *chunk_crcs, unsigned int chunk_count);
+unsigned int format_chunk_checksums(char *msg_ret, char *token, unsigned int *chunk_crcs, unsigned int first, unsigned int count);
+unsigned int parse_chunk_checksums(char *list, unsigned int *chunk_crcs, unsigned int first, unsigned int chunk_count);
+void append_chunk_resend(ChunkResend **resends, unsigned int chunk);
+void pop_chunk_resend(ChunkResend **resends);
+void free_chunk_resends(ChunkResend **resends);
+enum xfer_codec parse_xfer_codec(char *cmd);
+unsigned int xfer_frame_limit(size_t filesize, size_t position);
+void encode_xfer_frame(XferFrame *frame, const unsigned char *block, unsigned int length, size_t position);
+int send_xfer_frame(int socketfd, XferFrame *frame, size_t max);
+int recv_xfer_frame(int socketfd, XferFrame *frame, unsigned int limit, size_t max, unsigned char *block_ret);
+void free_xfer_frame(XferFrame *frame);
+void content_hash(const unsigned char *buf, size_t len, char *hash_ret);
+
+uint64_t monotonic_ms();
+void token_bucket_init(TokenBucket *bucket, uint64_t rate, uint64_t burst);
+uint64_t token_bucket_available(TokenBucket *bucket);
+void token_bucket_consume(TokenBucket *bucket, uint64_t tokens);
+int file_content_hash(char *filepath, char *hash_ret);
 
 void seperate_target_command(char* buffer, char** msg_target_ret, char** msg_body_ret);
 char* plain_name(char *name);
@@ -1,6 +1,10 @@
 #include "sendrecv.h"
+#include "../library/lz/lz.h"
 
 #define SENDRECV_HEADER_SIZE (2 + sizeof(uint16_t))
+#define SENDRECV_RAW_MSG        0x2             //'STX'
+#define SENDRECV_COMPRESSED_MSG 0xE             //'SO': the message's text is compressed
+#define SENDRECV_COMPRESS_MIN   128             //Shorter messages are always sent as is
 
 
 /****************************/
@@ -9,19 +13,48 @@
 
 void clean_pending_msg(Pending_Msg *p)
 {
+    unsigned char codec;
+
     if(!p)
         return;
     
     if(p->pending_buffer)
         free(p->pending_buffer);
 
+    //The connection's codec outlives its messages
+    codec = p->codec;
     memset(p, 0, sizeof(Pending_Msg));
+    p->codec = codec;
 }
 
-int transfer_next_common(int socket, Pending_Msg *p)
+//Decodes a compressed message into "buffer", truncated to "size" bytes like any other message. Returns its size, or -1 if it is malformed
+static int decode_msg(char *payload, size_t payload_size, char *buffer, size_t size)
 {
+    char *decoded = malloc(MAX_MSG_SIZE);
     int bytes;
+
+    bytes = lz_decompress((unsigned char*) payload, payload_size, (unsigned char*) decoded, MAX_MSG_SIZE);
+    if(bytes <= 0)
+    {
+        printf("Received a malformed compressed message.\n");
+        free(decoded);
+        return -1;
+    }
+
+    if(bytes > size)
+        bytes = size;
+    memcpy(buffer, decoded, bytes);
+    buffer[bytes-1] = '\0';
+
+    free(decoded);
+    return bytes;
+}
+
+int transfer_next_common(int socket, Pending_Msg *p)
+{
+    int bytes, decoded_size;
     size_t remaining_size;
+    char *decoded;
 
     if(!p || p->pending_op == NO_XFER_OP)
     {
@@ -65,6 +98,21 @@ int transfer_next_common(int socket, Pending_Msg *p)
         printf("Completed long transfer. %zu/%zu bytes transferred.\n", p->pending_transferred, p->pending_size);
         p->pending_op = NO_XFER_OP;
     }
+
+    //A compressed message is handed over decoded
+    if(p->pending_op == NO_XFER_OP && p->compressed_msg)
+    {
+        decoded = malloc(MAX_MSG_SIZE);
+        decoded[0] = '\0';
+        decoded_size = decode_msg(p->pending_buffer, p->pending_size, decoded, MAX_MSG_SIZE);
+        free(p->pending_buffer);
+
+        p->pending_buffer = decoded;
+        p->pending_size = (decoded_size > 0)? decoded_size : 0;
+        p->compressed_msg = 0;
+        if(decoded_size < 0)
+            return -1;
+    }
         
     return bytes;
 }
@@ -79,11 +127,20 @@ int send_direct(int socketfd, char* buffer, size_t size)
     return send(socketfd, buffer, size, 0);
 }
 
+//Compresses a message for a connection that negotiated a codec. Returns the compressed size, or 0 to send the message as is
+static size_t compress_msg(char *buffer, size_t size, char *payload_ret, Pending_Msg *p)
+{
+    if(p->codec != XFER_CODEC_LZ || size < SENDRECV_COMPRESS_MIN || buffer[size-1] != '\0')
+        return 0;
+
+    return lz_compress((unsigned char*) buffer, size, (unsigned char*) payload_ret, size - 1);
+}
+
 static int send_msg_common_internal(int socket, char* buffer, size_t size, Pending_Msg *p)
 {
     int bytes;
     char *headered_buf;
-    size_t total_size;
+    size_t total_size, payload_size;
 
     //Only send a new message if there's no pending operation? We can also consider some kind of queueing...
     if(p->pending_op != NO_XFER_OP)
@@ -92,17 +149,22 @@ static int send_msg_common_internal(int socket, char* buffer, size_t size, Pendi
         return 0;
     } 
 
-    total_size = SENDRECV_HEADER_SIZE + size;
+    //Create a new headered message for sending. Its text is compressed if the connection negotiated a codec, and that makes it smaller
+    headered_buf = malloc(SENDRECV_HEADER_SIZE + size);
+    payload_size = compress_msg(buffer, size, &headered_buf[SENDRECV_HEADER_SIZE], p);
+    total_size = SENDRECV_HEADER_SIZE + ((payload_size)? payload_size : size);
 
-    //Create a new headered message for sending
-    headered_buf = malloc(total_size);
     headered_buf[0] = 0x1;                                                      //'SOH'
-    *((uint16_t*)&headered_buf[1]) = htons(size);                                   //Message Size      
-    headered_buf[1+sizeof(uint16_t)] = 0x2;                                     //'STX'
-    memcpy(&headered_buf[SENDRECV_HEADER_SIZE], buffer, size);                  //Text
+    *((uint16_t*)&headered_buf[1]) = htons(total_size - SENDRECV_HEADER_SIZE);  //Message Size      
+    headered_buf[1+sizeof(uint16_t)] = (payload_size)? SENDRECV_COMPRESSED_MSG : SENDRECV_RAW_MSG;
+
+    if(!payload_size)
+    {
+        memcpy(&headered_buf[SENDRECV_HEADER_SIZE], buffer, size);              //Text
     
-    if(headered_buf[total_size-1] != '\0')
-        headered_buf[total_size-1] = '\0';
+        if(headered_buf[total_size-1] != '\0')
+            headered_buf[total_size-1] = '\0';
+    }
 
     //Now try and send all of the headered buffer to the server
     bytes = send(socket, headered_buf, total_size, 0);
@@ -163,6 +225,36 @@ int recv_direct(int socketfd, char* buffer, size_t size)
     return recv(socketfd, buffer, size, 0);
 }
 
+//Receives a single null terminated string, without consuming any bytes that follow it on the socket (blocking sockets only)
+int recv_direct_string(int socketfd, char* buffer, size_t size)
+{
+    int bytes;
+    size_t received = 0;
+    char *terminator;
+
+    while(received < size)
+    {
+        //Peek at what has arrived so far, and only consume up to the string's terminator
+        bytes = recv(socketfd, &buffer[received], size - received, MSG_PEEK);
+        if(bytes <= 0)
+            return bytes;
+
+        terminator = memchr(&buffer[received], '\0', bytes);
+        if(terminator)
+            bytes = terminator - &buffer[received] + 1;
+
+        bytes = recv(socketfd, &buffer[received], bytes, 0);
+        if(bytes <= 0)
+            return bytes;
+        
+        received += bytes;
+        if(terminator)
+            break;
+    }
+
+    return received;
+}
+
 static int recv_msg_internal(int socket, char* buffer, size_t expected_length, Pending_Msg *p)
 {
     int bytes;
@@ -200,6 +292,22 @@ static int recv_msg_internal(int socket, char* buffer, size_t expected_length, P
     return bytes;
 }
 
+//The whole compressed text must be received before it can be decoded (and truncated)
+static int recv_compressed_msg(int socket, char* buffer, size_t size, size_t expected_length, Pending_Msg *p)
+{
+    char *payload = malloc(expected_length);
+    int bytes;
+
+    bytes = recv_msg_internal(socket, payload, expected_length, p);
+    if(bytes > 0 && p->pending_op == RECVING_OP)
+        p->compressed_msg = 1;
+    else if(bytes > 0)
+        bytes = decode_msg(payload, expected_length, buffer, size);
+
+    free(payload);
+    return bytes;
+}
+
 int recv_msg_common(int socket, char* buffer, size_t size, Pending_Msg *p)
 {
     int bytes;
@@ -222,11 +330,14 @@ int recv_msg_common(int socket, char* buffer, size_t size, Pending_Msg *p)
     }
 
     //Validate header format and read the expected message length
-    if(header[0] == 0x1 && header[SENDRECV_HEADER_SIZE-1] == 0x2)
+    if(header[0] == 0x1 && (header[SENDRECV_HEADER_SIZE-1] == SENDRECV_RAW_MSG || header[SENDRECV_HEADER_SIZE-1] == SENDRECV_COMPRESSED_MSG))
         expected_length = ntohs(*((uint16_t*)&header[1]));
     else
         return 0;
 
+    if(header[SENDRECV_HEADER_SIZE-1] == SENDRECV_COMPRESSED_MSG)
+        return recv_compressed_msg(socket, buffer, size, expected_length, p);
+
     if(expected_length > size)
         expected_length = size;
 
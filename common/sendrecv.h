@@ -14,11 +14,15 @@ typedef struct {
     size_t pending_size;
     size_t pending_transferred;
     int segmented_msg :1;
+    int compressed_msg :1;          //The message being received is compressed. Decoded once all of it has arrived
+
+    unsigned char codec;            //Negotiated at registration (enum xfer_codec). Longer messages are sent compressed, if that makes them smaller
 
 } Pending_Msg;
 
 int send_direct(int socketfd, char* buffer, size_t size);
 int recv_direct(int socketfd, char* buffer, size_t size);
+int recv_direct_string(int socketfd, char* buffer, size_t size);
 
 int send_msg_common(int socket, char* buffer, size_t size, Pending_Msg *p);
 int recv_msg_common(int socket, char* buffer, size_t size, Pending_Msg *p);
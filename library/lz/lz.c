@@ -0,0 +1,225 @@
+/*********************************************************************
+* Filename:   lz.c
+* Details:    Implementation of a small LZ77 block codec, in the LZ4
+              block format. Each sequence is a token (4 bits of literal
+              length, 4 bits of match length), optional extra literal
+              length bytes, the literals, a 2 byte little endian match
+              offset, and optional extra match length bytes. The last
+              sequence holds only literals.
+              The compressor finds matches through a single hash table
+              of 4 byte sequences, and speeds up over data it finds no
+              matches in.
+*********************************************************************/
+
+/*************************** HEADER FILES ***************************/
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+/****************************** MACROS ******************************/
+#define HASH_LOG        12
+#define MIN_MATCH       4
+#define MAX_OFFSET      65535
+#define LAST_LITERALS   5           // The block always ends with at least this many literals
+#define MATCH_LIMIT     12          // No match starts within this many bytes of the end
+#define SKIP_TRIGGER    6           // Every 2^SKIP_TRIGGER misses, search one byte further ahead
+
+/*********************** FUNCTION DEFINITIONS ***********************/
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline unsigned int hash32(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Writes the extra bytes of a length above 15. Returns NULL if they do not fit
+static unsigned char *write_length(unsigned char *op, const unsigned char *oend, size_t length)
+{
+	for (; length >= 255; length -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op >= oend)
+		return NULL;
+	*op++ = (unsigned char)length;
+	return op;
+}
+
+// Writes a sequence: literals from anchor up to ip, then a match (none if match_length is 0)
+static unsigned char *write_sequence(unsigned char *op, const unsigned char *oend, const unsigned char *anchor,
+                                     const unsigned char *ip, size_t offset, size_t match_length)
+{
+	size_t literal_length = ip - anchor;
+	unsigned char *token;
+
+	if (op >= oend)
+		return NULL;
+	token = op++;
+
+	*token = (literal_length >= 15) ? 15 << 4 : literal_length << 4;
+	if (literal_length >= 15 && !(op = write_length(op, oend, literal_length - 15)))
+		return NULL;
+
+	if ((size_t)(oend - op) < literal_length)
+		return NULL;
+	memcpy(op, anchor, literal_length);
+	op += literal_length;
+
+	if (!match_length)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = (unsigned char)offset;
+	*op++ = (unsigned char)(offset >> 8);
+
+	match_length -= MIN_MATCH;
+	*token |= (match_length >= 15) ? 15 : match_length;
+	if (match_length >= 15 && !(op = write_length(op, oend, match_length - 15)))
+		return NULL;
+
+	return op;
+}
+
+int lz_compress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity)
+{
+	uint32_t table[1 << HASH_LOG];                  // Position + 1 of the last sequence with each hash, 0 if none
+	const unsigned char *ip = src, *anchor = src, *ref, *mp, *rp;
+	const unsigned char *iend = src + src_size;
+	const unsigned char *match_end = iend - LAST_LITERALS;
+	unsigned char *op = dst;
+	const unsigned char *oend = dst + dst_capacity;
+	unsigned int misses = 0, h;
+	uint32_t sequence;
+
+	if (src_size < 0 || dst_capacity <= 0)
+		return 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (src_size > MATCH_LIMIT && ip < iend - MATCH_LIMIT) {
+		sequence = read32(ip);
+		h = hash32(sequence);
+		ref = (table[h]) ? src + table[h] - 1 : NULL;
+		table[h] = (uint32_t)(ip - src) + 1;
+
+		if (!ref || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+			ip += 1 + (misses++ >> SKIP_TRIGGER);
+			continue;
+		}
+		misses = 0;
+
+		// Extend the match forwards (8 bytes at a time while they all match), then backwards over the pending literals
+		mp = ip + MIN_MATCH;
+		rp = ref + MIN_MATCH;
+		while (mp + 8 <= match_end && read64(mp) == read64(rp)) {
+			mp += 8;
+			rp += 8;
+		}
+		while (mp < match_end && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		op = write_sequence(op, oend, anchor, ip, ip - ref, mp - ip);
+		if (!op)
+			return 0;
+
+		ip = anchor = mp;
+
+		// Runs of matches are common in text. Index the position just behind this match
+		if (ip < iend - MATCH_LIMIT)
+			table[hash32(read32(ip - 2))] = (uint32_t)(ip - 2 - src) + 1;
+	}
+
+	op = write_sequence(op, oend, anchor, iend, 0, 0);
+	return (op) ? (int)(op - dst) : 0;
+}
+
+int lz_decompress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity)
+{
+	const unsigned char *ip = src, *iend = src + src_size, *match;
+	unsigned char *op = dst, *oend = dst + dst_capacity;
+	size_t length, offset;
+	unsigned char token, extra;
+
+	if (src_size <= 0 || dst_capacity < 0)
+		return -1;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		length = token >> 4;
+		if (length == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				extra = *ip++;
+				length += extra;
+			} while (extra == 255);
+		}
+
+		if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, length);
+		op += length;
+		ip += length;
+
+		// The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst))
+			return -1;
+
+		length = token & 15;
+		if (length == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				extra = *ip++;
+				length += extra;
+			} while (extra == 255);
+		}
+		length += MIN_MATCH;
+
+		if (length > (size_t)(oend - op))
+			return -1;
+
+		// Matches may overlap their own output (runs), so copy forwards one byte at a time unless they don't
+		match = op - offset;
+		if (offset >= length) {
+			memcpy(op, match, length);
+			op += length;
+		} else {
+			while (length--)
+				*op++ = *match++;
+		}
+	}
+
+	return (int)(op - dst);
+}
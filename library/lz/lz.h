@@ -0,0 +1,24 @@
+/*********************************************************************
+* Filename:   lz.h
+* Details:    Defines the API for a small LZ77 block codec. Its block
+              format is the one used by LZ4: sequences of literals
+              followed by a (offset, length) match into the previous
+              64 KiB of output.
+*********************************************************************/
+
+#ifndef LZ_H
+#define LZ_H
+
+/****************************** MACROS ******************************/
+#define LZ_COMPRESS_BOUND(size)   ((size) + (size) / 255 + 16)   // Worst case size of a compressed block
+
+/*********************** FUNCTION DECLARATIONS **********************/
+// Returns the size of the compressed block, or 0 if it does not fit in dst_capacity bytes.
+// Passing a capacity below src_size finds out whether the data is worth compressing at all.
+int lz_compress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity);
+
+// Returns the size of the decompressed block, or -1 if the block is malformed or does not fit.
+// Never reads or writes out of bounds, whatever the input.
+int lz_decompress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity);
+
+#endif   // LZ_H
@@ -0,0 +1,333 @@
+#include "admission.h"
+#include "server.h"
+
+
+IPTrie connection_ips;                              //Addresses of all active connections, and of recent ones (data = AddressState)
+static unsigned int unregistered_connections = 0;
+static int spare_fd = -1;                           //Given up to accept (and close) a connection once the server runs out of descriptors
+static TimerEvent *admission_sweep_timer;
+
+static unsigned int max_per_address = ADMISSION_MAX_PER_ADDRESS;
+static uint64_t connect_rate = ADMISSION_CONNECT_RATE, connect_burst = ADMISSION_CONNECT_BURST;
+static unsigned int max_unregistered = ADMISSION_MAX_UNREGISTERED;
+
+//Totals since the server started, shown by !connstats
+static uint64_t verdicts[ADMISSION_VERDICTS];
+static const char *verdict_names[] = {"accepted", "banned", "too many from address", "address too fast", "too many unregistered", "out of descriptors"};
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static AddressState* find_address(IPPrefix *addr)
+{
+    IPTrieNode *node = ip_trie_find(&connection_ips, addr);
+    return (node)? node->data : NULL;
+}
+
+static AddressState* add_address(IPPrefix *addr)
+{
+    IPTrieNode *node;
+    AddressState *state;
+
+    node = ip_trie_insert(&connection_ips, addr, NULL);
+    if(!node->data)
+    {
+        state = calloc(1, sizeof(AddressState));
+        token_bucket_init(&state->connect_bucket, connect_rate, connect_burst);
+        node->data = state;
+    }
+    return node->data;
+}
+
+//An address with no connections is kept until its connect rate is back to full, so that reconnecting doesn't reset it
+static int address_is_idle(AddressState *state)
+{
+    return state->connection_count == 0 && token_bucket_available(&state->connect_bucket) >= state->connect_bucket.burst;
+}
+
+static void forget_address(IPPrefix *addr)
+{
+    AddressState *state = find_address(addr);
+
+    ip_trie_remove(&connection_ips, addr);
+    free(state);
+}
+
+static enum admission_verdict check_connection(struct sockaddr_in *sockaddr, IPTrieNode **ban_ret)
+{
+    IPPrefix addr;
+    AddressState *state;
+
+    sockaddr_prefix(sockaddr, &addr);
+    *ban_ret = ip_trie_match(&banned_ips, &addr);
+    if(*ban_ret)
+        return REJECT_BANNED;
+
+    if(max_unregistered && unregistered_connections >= max_unregistered)
+        return REJECT_UNREGISTERED;
+
+    state = find_address(&addr);
+    if(state && max_per_address && state->connection_count >= max_per_address)
+        return REJECT_ADDRESS_CONNECTIONS;
+
+    if(!state)
+        state = add_address(&addr);
+    if(token_bucket_available(&state->connect_bucket) == 0)
+        return REJECT_ADDRESS_RATE;
+    token_bucket_consume(&state->connect_bucket, 1);
+
+    return ADMIT_CONNECTION;
+}
+
+
+
+/******************************/
+/*         Admission          */
+/******************************/
+
+int admission_init()
+{
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    admission_sweep_timer = calloc(1, sizeof(TimerEvent));
+    admission_sweep_timer->event_type = ADMISSION_SWEEP;
+
+    admission_sweep_timer->timerfd = create_timerfd(ADMISSION_SWEEP_PERIOD, 1, timers_epollfd);
+    if(!admission_sweep_timer->timerfd)
+    {
+        free(admission_sweep_timer);
+        return 0;
+    }
+    HASH_ADD_INT(timers, timerfd, admission_sweep_timer);
+
+    return 1;
+}
+
+//Accepts the next connection on the server socket. Connections that may not be served are closed right away, before the server
+//keeps anything for them. Returns the socket of an admitted connection, or -1
+int accept_connection(struct sockaddr_in *sockaddr_ret)
+{
+    socklen_t sockaddr_leng = sizeof(struct sockaddr_in);
+    enum admission_verdict verdict;
+    IPTrieNode *ban_entry = NULL;
+    char range_str[IP_PREFIX_STRLEN];
+    int socketfd;
+
+    socketfd = accept(server_socketfd, (struct sockaddr*) sockaddr_ret, &sockaddr_leng);
+    if(socketfd < 0)
+    {
+        //Otherwise the connection stays queued, and wakes the server up again right away. Make room to turn it away
+        if((errno == EMFILE || errno == ENFILE) && spare_fd >= 0)
+        {
+            close(spare_fd);
+            socketfd = accept(server_socketfd, NULL, NULL);
+            if(socketfd >= 0)
+                close(socketfd);
+            spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+            ++verdicts[REJECT_NO_DESCRIPTORS];
+            printf("Dropped a new connection. The server is out of file descriptors.\n");
+            return -1;
+        }
+
+        perror("Error accepting client!");
+        return -1;
+    }
+
+    verdict = check_connection(sockaddr_ret, &ban_entry);
+    ++verdicts[verdict];
+    if(verdict == ADMIT_CONNECTION)
+        return socketfd;
+
+    if(verdict == REJECT_BANNED)
+        printf("Dropping new connection on %s:%d. IP address has been banned (%s).\n",
+                inet_ntoa(sockaddr_ret->sin_addr), ntohs(sockaddr_ret->sin_port), format_ip_prefix(&ban_entry->prefix, range_str));
+    else
+        printf("Dropping new connection on %s:%d (%s).\n", inet_ntoa(sockaddr_ret->sin_addr), ntohs(sockaddr_ret->sin_port), verdict_names[verdict]);
+
+    close(socketfd);
+    return -1;
+}
+
+//Adds the connection under its address, so that those in a range can be found without going through all of them
+void index_connection(Client *c)
+{
+    IPPrefix addr;
+    AddressState *state;
+
+    sockaddr_prefix(&c->sockaddr, &addr);
+    state = add_address(&addr);
+    DL_APPEND2(state->connections, c, ip_prev, ip_next);
+    ++state->connection_count;
+    metrics_gauge_add(METRIC_UNREGISTERED_CONNECTIONS + c->connection_type, 1);
+
+    if(c->connection_type == UNREGISTERED_CONNECTION)
+        ++unregistered_connections;
+}
+
+void unindex_connection(Client *c)
+{
+    IPPrefix addr;
+    AddressState *state;
+
+    if(c->connection_type == UNREGISTERED_CONNECTION)
+        --unregistered_connections;
+    metrics_gauge_add(METRIC_UNREGISTERED_CONNECTIONS + c->connection_type, -1);
+
+    sockaddr_prefix(&c->sockaddr, &addr);
+    state = find_address(&addr);
+    if(!state)
+        return;
+
+    DL_DELETE2(state->connections, c, ip_prev, ip_next);
+    --state->connection_count;
+    if(address_is_idle(state))
+        forget_address(&addr);
+}
+
+//Connections change type once, when they register
+void set_connection_type(Client *c, enum connection_type type)
+{
+    if(c->connection_type == UNREGISTERED_CONNECTION && type != UNREGISTERED_CONNECTION)
+        --unregistered_connections;
+
+    metrics_gauge_add(METRIC_UNREGISTERED_CONNECTIONS + c->connection_type, -1);
+    metrics_gauge_add(METRIC_UNREGISTERED_CONNECTIONS + type, 1);
+    c->connection_type = type;
+}
+
+typedef struct {
+    int *socketfds;
+    unsigned int count;
+    unsigned int capacity;
+} ConnectionsInRange;
+
+static void collect_connections(void *arg, IPTrieNode *node)
+{
+    ConnectionsInRange *found = arg;
+    AddressState *state = node->data;
+    Client *c;
+
+    DL_FOREACH2(state->connections, c, ip_next)
+    {
+        if(found->count == found->capacity)
+        {
+            found->capacity = (found->capacity)? found->capacity * 2 : 16;
+            found->socketfds = realloc(found->socketfds, found->capacity * sizeof(int));
+        }
+        found->socketfds[found->count++] = c->socketfd;
+    }
+}
+
+//Returns the socketfds (to be freed) of all connections inside the range. Disconnecting one client may close others,
+//so callers look each of them up in active_connections again before acting on it
+int* connections_in_range(IPPrefix *range, unsigned int *count_ret)
+{
+    ConnectionsInRange found = {0};
+
+    ip_trie_walk(&connection_ips, range, collect_connections, &found);
+    *count_ret = found.count;
+    return found.socketfds;
+}
+
+typedef struct {
+    IPPrefix *idle;
+    unsigned int count;
+    unsigned int capacity;
+} IdleAddresses;
+
+static void collect_idle_address(void *arg, IPTrieNode *node)
+{
+    IdleAddresses *found = arg;
+
+    if(!address_is_idle(node->data))
+        return;
+
+    if(found->count == found->capacity)
+    {
+        found->capacity = (found->capacity)? found->capacity * 2 : 64;
+        found->idle = realloc(found->idle, found->capacity * sizeof(IPPrefix));
+    }
+    found->idle[found->count++] = node->prefix;
+}
+
+//Forgets the addresses that were still refilling their connect rate when their last connection closed
+void admission_sweep()
+{
+    IdleAddresses found = {0};
+    unsigned int i;
+
+    ip_trie_walk(&connection_ips, NULL, collect_idle_address, &found);
+    for(i=0; i<found.count; i++)
+        forget_address(&found.idle[i]);
+
+    free(found.idle);
+}
+
+
+
+/******************************/
+/*       Administration       */
+/******************************/
+
+static void reset_connect_bucket(void *arg, IPTrieNode *node)
+{
+    AddressState *state = node->data;
+    token_bucket_init(&state->connect_bucket, connect_rate, connect_burst);
+}
+
+//Sets one of the admission limits: "address" (connections open per address), "rate" (new connections per second per address,
+//with a burst) or "unregistered" (connections yet to register). 0 is unlimited
+int admission_set_limit(char *limit, uint64_t value, uint64_t burst)
+{
+    if(strcmp(limit, "address") == 0)
+    {
+        max_per_address = value;
+        printf("Each address may now keep %u connections open (0 is unlimited).\n", max_per_address);
+    }
+    else if(strcmp(limit, "rate") == 0)
+    {
+        connect_rate = value;
+        connect_burst = (burst > 0)? burst : ((value > 0)? value * 2 : 1);
+        ip_trie_walk(&connection_ips, NULL, reset_connect_bucket, NULL);
+        printf("Each address may now open %lu connections per second, %lu at once (0 is unlimited).\n", connect_rate, connect_burst);
+    }
+    else if(strcmp(limit, "unregistered") == 0)
+    {
+        max_unregistered = value;
+        printf("Up to %u connections may now wait to register (0 is unlimited).\n", max_unregistered);
+    }
+    else
+    {
+        printf("Connection limits are \"address\", \"rate\" or \"unregistered\".\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+//Prints the admission limits, and how many connections were turned away for each reason. Also sent back to a remote admin
+void admission_stats()
+{
+    char stats_msg[1024];
+    int msg_size = 0, printed = 0;
+    unsigned int i;
+
+    sprintf(stats_msg, "Connection limits: %u per address, %lu/s per address (burst: %lu), %u unregistered\n"
+            "Connections: %u active, %u unregistered, %u addresses tracked%n",
+            max_per_address, connect_rate, connect_burst, max_unregistered,
+            HASH_COUNT(active_connections), unregistered_connections, connection_ips.count, &msg_size);
+
+    for(i=0; i<ADMISSION_VERDICTS; i++)
+    {
+        sprintf(&stats_msg[msg_size], "\n  %s: %lu%n", verdict_names[i], verdicts[i], &printed);
+        msg_size += printed;
+    }
+
+    printf("%s\n", stats_msg);
+    if(current_client && current_client->connection_type == USER_CONNECTION)
+        send_long_msg(current_client, stats_msg, msg_size+1);
+}
@@ -0,0 +1,45 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include "server_common.h"
+#include "ip_trie.h"
+
+#define ADMISSION_MAX_PER_ADDRESS   32                  //Connections open at once from one address, transfer connections included. 0 is unlimited
+#define ADMISSION_CONNECT_RATE      10                  //New connections per second from one address. 0 is unlimited
+#define ADMISSION_CONNECT_BURST     20                  //New connections a quiet address may open at once
+#define ADMISSION_MAX_UNREGISTERED  256                 //Connections yet to register, from all addresses together. 0 is unlimited
+#define ADMISSION_SWEEP_PERIOD      60                  //Seconds between forgetting addresses that have no connections left
+
+
+//Why a new connection was turned away (or not)
+enum admission_verdict {
+    ADMIT_CONNECTION = 0,
+    REJECT_BANNED,
+    REJECT_ADDRESS_CONNECTIONS,         //Too many connections open from its address
+    REJECT_ADDRESS_RATE,                //Its address is connecting too fast
+    REJECT_UNREGISTERED,                //Too many connections have yet to register
+    REJECT_NO_DESCRIPTORS,              //The server ran out of file descriptors
+    ADMISSION_VERDICTS
+};
+
+//What is known about one address: its open connections, and how fast it has been connecting
+typedef struct {
+    Client *connections;                //Linked through ip_prev/ip_next
+    unsigned int connection_count;
+    TokenBucket connect_bucket;
+} AddressState;
+
+
+int admission_init();
+int accept_connection(struct sockaddr_in *sockaddr_ret);
+void index_connection(Client *c);
+void unindex_connection(Client *c);
+void set_connection_type(Client *c, enum connection_type type);
+int* connections_in_range(IPPrefix *range, unsigned int *count_ret);
+void admission_sweep();
+
+int admission_set_limit(char *limit, uint64_t value, uint64_t burst);
+void admission_stats();
+
+
+#endif
@@ -0,0 +1,290 @@
+#include "blob_store.h"
+#include "state_journal.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+Blob *blobs;
+size_t blob_store_size;                         //Total bytes of all stored blobs
+Blob *mapped_blobs;                             //LRU list of blobs with an open mapping
+size_t mapped_blobs_size;                       //Total bytes of all open mappings
+
+
+static void blob_key(char *hash, size_t filesize, char *key_ret)
+{
+    sprintf(key_ret, "%.*s_%zu", CONTENT_HASH_SIZE, hash, filesize);
+}
+
+
+Blob* find_blob(char *hash, size_t filesize)
+{
+    char key[BLOB_KEY_SIZE+1];
+    Blob *blob;
+
+    blob_key(hash, filesize, key);
+    HASH_FIND_STR(blobs, key, blob);
+
+    return blob;
+}
+
+
+//Moves a completely received (and verified) upload into the store. Returns the blob holding the same contents
+Blob* store_blob(char *uploaded_file, size_t filesize, unsigned int checksum)
+{
+    char hash[CONTENT_HASH_SIZE+1];
+    Blob *blob;
+    int retval;
+
+    if(!file_content_hash(uploaded_file, hash))
+        return NULL;
+
+    //Another upload may have stored the same contents while this one was in progress. Keep only one copy
+    blob = find_blob(hash, filesize);
+    if(blob)
+    {
+        printf("Contents of \"%s\" are already stored as \"%s\". Removing the duplicate copy.\n", uploaded_file, blob->blob_file);
+        if(remove(uploaded_file) < 0)
+            perror("Failed to delete duplicate file.");
+
+        return blob;
+    }
+
+    retval = mkdir(BLOB_STORE_ROOT, LOCAL_FOLDER_PERMISSION);
+    if(retval < 0 && errno != EEXIST)
+    {
+        perror("Failed to create directory for the blob store.");
+        return NULL;
+    }
+
+    blob = calloc(1, sizeof(Blob));
+    blob_key(hash, filesize, blob->key);
+    blob->filesize = filesize;
+    blob->checksum = checksum;
+    sprintf(blob->blob_file, "%s/%s", BLOB_STORE_ROOT, blob->key);
+
+    if(rename(uploaded_file, blob->blob_file) < 0)
+    {
+        perror("Failed to move uploaded file into the blob store.");
+        free(blob);
+        return NULL;
+    }
+
+    HASH_ADD_STR(blobs, key, blob);
+    blob_store_size += blob->filesize;
+    printf("Stored new blob \"%s\" (%zu bytes, checksum: %x)\n", blob->blob_file, blob->filesize, blob->checksum);
+
+    return blob;
+}
+
+
+//The first reference records the blob in the journal, along with the chunk checksums and frames it was given by then
+void acquire_blob(Blob *blob)
+{
+    if(blob->refcount++ == 0)
+        journal_blob(blob);
+}
+
+//Keeps the compressed frames an upload of the blob's contents arrived in (one for every block, in "frames_file"), so compressed downloads can send them as they are.
+//Returns 1 if the blob took them over
+int store_blob_frames(Blob *blob, char *frames_file, StoredFrame *frames, size_t frames_size)
+{
+    char blob_frames_file[MAX_FILE_PATH+sizeof(BLOB_FRAMES_SUFFIX)];
+
+    //Not worth the disk space if the contents hardly compressed
+    if(blob->frames || frames_size >= blob->filesize)
+        return 0;
+
+    sprintf(blob_frames_file, "%s%s", blob->blob_file, BLOB_FRAMES_SUFFIX);
+    if(rename(frames_file, blob_frames_file) < 0)
+    {
+        perror("Failed to move compressed frames into the blob store.");
+        return 0;
+    }
+
+    blob->frames = frames;
+    blob->frames_size = frames_size;
+    printf("Stored compressed frames of blob \"%s\" (%zu bytes for %zu bytes of file)\n", blob->blob_file, blob->frames_size, blob->filesize);
+
+    return 1;
+}
+
+//Opens the blob's stored frames for a new compressed download. Returns the descriptor, or 0 if they cannot be read
+int open_blob_frames(Blob *blob)
+{
+    char blob_frames_file[MAX_FILE_PATH+sizeof(BLOB_FRAMES_SUFFIX)];
+    int fd;
+
+    sprintf(blob_frames_file, "%s%s", blob->blob_file, BLOB_FRAMES_SUFFIX);
+    fd = open(blob_frames_file, O_RDONLY);
+    if(fd < 0)
+    {
+        perror("Failed to open compressed frames for sending.");
+        return 0;
+    }
+
+    return fd;
+}
+
+
+
+/******************************/
+/*    Blob Mapping Cache     */
+/******************************/
+
+static void close_blob_mapping(Blob *blob)
+{
+    DL_DELETE(mapped_blobs, blob);
+    mapped_blobs_size -= blob->filesize;
+
+    munmap((void*)blob->map, blob->filesize);
+    close(blob->fd);
+    blob->map = NULL;
+    blob->fd = 0;
+}
+
+//Closes idle mappings, least recently used first, until the cache fits its budget
+static void trim_blob_cache()
+{
+    Blob *curr, *prev;
+
+    for(curr = (mapped_blobs)? mapped_blobs->prev : NULL; curr && mapped_blobs_size > BLOB_CACHE_BUDGET; curr = prev)
+    {
+        prev = (curr == mapped_blobs)? NULL : curr->prev;
+        if(curr->map_users == 0)
+            close_blob_mapping(curr);
+    }
+}
+
+//Returns the blob's contents mapped in memory for a new download. Concurrent downloads of the same blob share one descriptor and mapping
+char* map_blob(Blob *blob)
+{
+    if(!blob->map)
+    {
+        blob->fd = open(blob->blob_file, O_RDONLY);
+        if(blob->fd < 0)
+        {
+            perror("Failed to open blob for sending.");
+            blob->fd = 0;
+            return NULL;
+        }
+
+        blob->map = mmap(NULL, blob->filesize, PROT_READ, MAP_SHARED, blob->fd, 0);
+        if(blob->map == MAP_FAILED)
+        {
+            perror("Failed to map blob to memory.");
+            close(blob->fd);
+            blob->map = NULL;
+            blob->fd = 0;
+            return NULL;
+        }
+
+        //Downloads read each range front to back
+        posix_fadvise(blob->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        madvise(blob->map, blob->filesize, MADV_SEQUENTIAL);
+
+        mapped_blobs_size += blob->filesize;
+        DL_PREPEND(mapped_blobs, blob);
+        trim_blob_cache();
+    }
+    else
+    {
+        DL_DELETE(mapped_blobs, blob);
+        DL_PREPEND(mapped_blobs, blob);
+    }
+
+    //Popular blobs are read ahead in full, so concurrent downloads don't wait on the disk for the same pages
+    if(++blob->map_users == BLOB_CACHE_HOT)
+    {
+        printf("Blob \"%s\" is being downloaded by %u users. Reading ahead.\n", blob->blob_file, blob->map_users);
+        posix_fadvise(blob->fd, 0, 0, POSIX_FADV_WILLNEED);
+        madvise(blob->map, blob->filesize, MADV_WILLNEED);
+    }
+
+    return blob->map;
+}
+
+//Called when a download finishes with the blob's mapping. The mapping stays cached for later downloads while it fits the budget
+void unmap_blob(Blob *blob)
+{
+    --blob->map_users;
+
+    //The blob was removed from the store during the download
+    if(blob->refcount == 0)
+    {
+        if(blob->map_users == 0)
+        {
+            close_blob_mapping(blob);
+            free(blob->chunk_crcs);
+            free(blob->frames);
+            free(blob);
+        }
+        return;
+    }
+
+    trim_blob_cache();
+}
+
+//Drops a reference to a blob. The blob's file is deleted once no group file list refers to it anymore
+void release_blob(Blob *blob)
+{
+    char blob_frames_file[MAX_FILE_PATH+sizeof(BLOB_FRAMES_SUFFIX)];
+
+    if(--blob->refcount > 0)
+        return;
+
+    printf("Removing unreferenced blob \"%s\"\n", blob->blob_file);
+    journal_blob_removed(blob);
+    if(remove(blob->blob_file) < 0)
+        perror("Failed to delete blob.");
+
+    sprintf(blob_frames_file, "%s%s", blob->blob_file, BLOB_FRAMES_SUFFIX);
+    if(blob->frames && remove(blob_frames_file) < 0)
+        perror("Failed to delete compressed frames of blob.");
+
+    HASH_DEL(blobs, blob);
+    blob_store_size -= blob->filesize;
+
+    //Ongoing downloads keep using their mapping. The blob is freed when the last of them finishes
+    if(blob->map_users > 0)
+        return;
+
+    if(blob->map)
+        close_blob_mapping(blob);
+    free(blob->chunk_crcs);
+    free(blob->frames);
+    free(blob);
+}
+
+
+
+/******************************/
+/*     Restoring the Store    */
+/******************************/
+
+//Lists contents already in the store, as the server's state is restored (see state_journal.c). The files listing them acquire their references
+Blob* restore_blob(char *key, size_t filesize, unsigned int checksum)
+{
+    Blob *blob = calloc(1, sizeof(Blob));
+
+    strcpy(blob->key, key);
+    blob->filesize = filesize;
+    blob->checksum = checksum;
+    sprintf(blob->blob_file, "%s/%s", BLOB_STORE_ROOT, blob->key);
+
+    HASH_ADD_STR(blobs, key, blob);
+    blob_store_size += blob->filesize;
+
+    return blob;
+}
+
+//Unlists a restored blob that was removed later on. Its files were deleted back then
+void forget_blob(Blob *blob)
+{
+    HASH_DEL(blobs, blob);
+    blob_store_size -= blob->filesize;
+
+    free(blob->chunk_crcs);
+    free(blob->frames);
+    free(blob);
+}
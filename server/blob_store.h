@@ -0,0 +1,69 @@
+#ifndef _BLOB_STORE_H_
+#define _BLOB_STORE_H_
+
+#include "server_common.h"
+
+#define BLOB_STORE_ROOT     "BLOB_STORE"
+#define BLOB_KEY_SIZE       (CONTENT_HASH_SIZE + 21)        //"<content hash>_<size>"
+#define BLOB_CACHE_BUDGET   1073741824                      //Bytes of blob mappings kept open. Idle mappings are closed (least recently used first) beyond this
+#define BLOB_CACHE_HOT      2                               //Number of concurrent downloads that makes a blob "hot", and worth reading ahead
+#define BLOB_STORE_FRAMES   1                               //Keep the compressed frames of uploads received compressed, so compressed downloads never compress them again. 0 stores the file only
+#define BLOB_FRAMES_SUFFIX  ".lz"                           //Stored frames are kept next to the file they were received for
+
+
+//Where a block's compressed frame (header included) is kept in a stored frames file
+typedef struct {
+    off_t offset;
+    unsigned int length;                        //0 if the block has no stored frame
+} StoredFrame;
+
+
+//A single copy of an uploaded file's contents, shared by every group file list entry with the same contents
+typedef struct blob {
+
+    char key[BLOB_KEY_SIZE+1];
+    size_t filesize;
+    unsigned int checksum;
+    unsigned int refcount;                      //Number of File_List entries referring to this blob
+    char blob_file[MAX_FILE_PATH+1];
+
+    //Checksums of every XFER_CHUNK_SIZE chunk, passed on to downloads so they can check each chunk as it arrives. NULL if unknown
+    unsigned int *chunk_crcs;
+    unsigned int chunk_count;
+    unsigned int chunk_root;
+
+    //Compressed frames of every XFER_FRAME_BLOCK block, as they were uploaded (at blob_file + BLOB_FRAMES_SUFFIX). NULL if not stored
+    StoredFrame *frames;
+    size_t frames_size;
+
+    //Open descriptor and mapping of the blob, shared by all of its downloads and cached after they finish
+    int fd;
+    char *map;
+    unsigned int map_users;                     //Number of ongoing downloads using the mapping
+    struct blob *prev, *next;                   //Position in the mapping cache's LRU list (most recently used first)
+
+    unsigned int snapshot_index;                //Position among the blob records of the last state snapshot (see state_journal.c)
+
+    UT_hash_handle hh;                          //Key: key
+
+} Blob;
+
+
+extern Blob *blobs;                             //Hashtable of all stored blobs (key = "<content hash>_<size>")
+extern size_t blob_store_size;
+
+
+Blob* find_blob(char *hash, size_t filesize);
+Blob* store_blob(char *uploaded_file, size_t filesize, unsigned int checksum);
+void acquire_blob(Blob *blob);
+void release_blob(Blob *blob);
+char* map_blob(Blob *blob);
+void unmap_blob(Blob *blob);
+int store_blob_frames(Blob *blob, char *frames_file, StoredFrame *frames, size_t frames_size);
+int open_blob_frames(Blob *blob);
+
+Blob* restore_blob(char *key, size_t filesize, unsigned int checksum);
+void forget_blob(Blob *blob);
+
+
+#endif
@@ -0,0 +1,770 @@
+#include "chat_history.h"
+#include "server.h"
+
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+static pthread_t history_thread;
+static int history_started;
+
+static pthread_mutex_t history_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t history_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t history_idle = PTHREAD_COND_INITIALIZER;
+static HistoryEntry *history_queue;             //Messages waiting to be written, oldest first
+static size_t history_queue_size;               //Bytes of their text
+static int history_writing;                     //The history thread is writing a batch
+static unsigned long history_dropped;           //Messages not archived, because too many were waiting
+
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;    //Guards the streams and their segment lists, which queries read from the chat thread
+static HistoryStream *history_streams;          //Hashtable of every stream used since startup (key = name)
+
+static HistoryStream *open_streams;             //History thread only: streams with open segments
+static unsigned int open_stream_count;
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static void segment_path(char *stream, uint64_t first_seq, char *ext, char *path_ret)
+{
+    sprintf(path_ret, "%s/%s/%020lu.%s", HISTORY_ROOT, stream, first_seq, ext);
+}
+
+//PMs between two users are kept in a single stream, whoever sent them. They are archived for the record only: usernames are
+//not authenticated, so whoever registers a name later must not be able to read them back
+static void pm_stream_name(char *user1, char *user2, char *name_ret)
+{
+    if(strcmp(user1, user2) < 0)
+        sprintf(name_ret, "~%s~%s", user1, user2);
+    else
+        sprintf(name_ret, "~%s~%s", user2, user1);
+}
+
+//Returns the size of the message at "offset" of a mapped log, or 0 if there is no complete message there
+static size_t parse_history_record(char *map, size_t size, size_t offset, HistoryRecord *record, char **sender_ret, char **text_ret)
+{
+    char *payload, *nul;
+
+    if(offset > size || size - offset < sizeof(HistoryRecord))
+        return 0;
+
+    memcpy(record, &map[offset], sizeof(HistoryRecord));
+    if(record->length < 2 || record->length > size - offset - sizeof(HistoryRecord))
+        return 0;
+
+    //Both the sender and the text must be NUL terminated
+    payload = &map[offset + sizeof(HistoryRecord)];
+    nul = memchr(payload, '\0', record->length);
+    if(!nul || nul == &payload[record->length-1] || payload[record->length-1] != '\0')
+        return 0;
+
+    *sender_ret = payload;
+    *text_ret = nul + 1;
+    return sizeof(HistoryRecord) + record->length;
+}
+
+//Maps a segment file. Returns NULL if it is empty or cannot be read
+static char* map_segment_file(char *path, size_t *size_ret)
+{
+    struct stat file_stat;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &file_stat) < 0 || file_stat.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    *size_ret = file_stat.st_size;
+    map = mmap(NULL, *size_ret, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (map == MAP_FAILED)? NULL : map;
+}
+
+
+
+/******************************/
+/*       Loading Streams      */
+/******************************/
+
+static void add_segment(HistoryStream *stream, uint64_t first_seq, time_t first_time)
+{
+    if(stream->segment_count == stream->segment_capacity)
+    {
+        stream->segment_capacity = (stream->segment_capacity)? stream->segment_capacity * 2 : 8;
+        stream->segments = realloc(stream->segments, stream->segment_capacity * sizeof(HistorySegment));
+    }
+
+    stream->segments[stream->segment_count].first_seq = first_seq;
+    stream->segments[stream->segment_count].first_time = first_time;
+    ++stream->segment_count;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+    const HistorySegment *seg_a = a, *seg_b = b;
+
+    return (seg_a->first_seq > seg_b->first_seq) - (seg_a->first_seq < seg_b->first_seq);
+}
+
+//Finds where the last complete message of the stream's last segment ends, and numbers the next message after it.
+//Anything after it was torn by a crash, and is cut off. Returns 0 if the segment has no message at all
+static int recover_last_segment(HistoryStream *stream)
+{
+    HistorySegment *segment = &stream->segments[stream->segment_count-1];
+    HistoryIndexEntry entry = {segment->first_seq, 0, 0};
+    HistoryRecord record;
+    char log_path[MAX_FILE_PATH+1], idx_path[MAX_FILE_PATH+1], *map, *sender, *text;
+    size_t map_size = 0, offset, record_size, entries = 0;
+    struct stat idx_stat;
+    int fd, found = 0;
+
+    segment_path(stream->name, segment->first_seq, "log", log_path);
+    segment_path(stream->name, segment->first_seq, "idx", idx_path);
+
+    //Start from the last indexed message, dropping a torn index entry
+    fd = open(idx_path, O_RDWR);
+    if(fd >= 0 && fstat(fd, &idx_stat) == 0)
+    {
+        entries = idx_stat.st_size / sizeof(HistoryIndexEntry);
+        if(entries > 0 && pread(fd, &entry, sizeof(HistoryIndexEntry), (entries-1) * sizeof(HistoryIndexEntry)) != sizeof(HistoryIndexEntry))
+            entries = 0;
+        if((size_t)idx_stat.st_size != entries * sizeof(HistoryIndexEntry) && ftruncate(fd, entries * sizeof(HistoryIndexEntry)) < 0)
+            perror("Failed to truncate history index.");
+    }
+    if(fd >= 0)
+        close(fd);
+
+    if(entries == 0)
+        entry = (HistoryIndexEntry){segment->first_seq, 0, 0};
+
+    stream->next_seq = entry.seq;
+    stream->indexed_size = entry.offset;
+    offset = entry.offset;
+
+    map = map_segment_file(log_path, &map_size);
+    while(map && (record_size = parse_history_record(map, map_size, offset, &record, &sender, &text)) > 0 && record.seq == stream->next_seq)
+    {
+        if(!found && offset == 0)
+            segment->first_time = record.timestamp;
+
+        offset += record_size;
+        ++stream->next_seq;
+        found = 1;
+    }
+    if(map)
+        munmap(map, map_size);
+
+    stream->log_size = (found || entries > 0)? offset : 0;
+    if(map_size > stream->log_size)
+    {
+        printf("Dropping %zu bytes of torn messages from history \"%s\".\n", map_size - stream->log_size, log_path);
+        if(truncate(log_path, stream->log_size) < 0)
+            perror("Failed to truncate history log.");
+    }
+
+    return stream->log_size > 0;
+}
+
+//Time of a segment's first message, which is always indexed (0 if the index is still empty)
+static time_t segment_first_time(char *stream, uint64_t first_seq)
+{
+    char idx_path[MAX_FILE_PATH+1];
+    HistoryIndexEntry entry = {0};
+    int fd;
+
+    segment_path(stream, first_seq, "idx", idx_path);
+    fd = open(idx_path, O_RDONLY);
+    if(fd < 0)
+        return 0;
+
+    if(pread(fd, &entry, sizeof(HistoryIndexEntry), 0) != sizeof(HistoryIndexEntry))
+        entry.timestamp = 0;
+    close(fd);
+
+    return entry.timestamp;
+}
+
+//Lists the segments a stream has on disk. Called with history_lock held, the first time the stream is used
+static HistoryStream* load_stream(char *name)
+{
+    HistoryStream *stream;
+    char dir_path[MAX_FILE_PATH+1], log_path[MAX_FILE_PATH+1], idx_path[MAX_FILE_PATH+1];
+    struct dirent *dir_entry;
+    uint64_t first_seq;
+    unsigned int i;
+    DIR *dir;
+
+    stream = calloc(1, sizeof(HistoryStream));
+    strcpy(stream->name, name);
+    stream->next_seq = 1;
+
+    sprintf(dir_path, "%s/%s", HISTORY_ROOT, name);
+    dir = opendir(dir_path);
+    while(dir && (dir_entry = readdir(dir)))
+    {
+        if(strlen(dir_entry->d_name) == 24 && sscanf(dir_entry->d_name, "%lu.log", &first_seq) == 1 && strcmp(&dir_entry->d_name[20], ".log") == 0)
+            add_segment(stream, first_seq, 0);
+    }
+    if(dir)
+        closedir(dir);
+
+    if(stream->segment_count > 0)
+    {
+        qsort(stream->segments, stream->segment_count, sizeof(HistorySegment), compare_segments);
+        for(i = 0; i < stream->segment_count; i++)
+            stream->segments[i].first_time = segment_first_time(name, stream->segments[i].first_seq);
+
+        //The last segment may have been left empty. It is started again with the next message
+        if(!recover_last_segment(stream))
+        {
+            first_seq = stream->segments[--stream->segment_count].first_seq;
+            segment_path(name, first_seq, "log", log_path);
+            segment_path(name, first_seq, "idx", idx_path);
+            remove(log_path);
+            remove(idx_path);
+        }
+    }
+
+    stream->written_seq = stream->next_seq;
+    HASH_ADD_STR(history_streams, name, stream);
+
+    return stream;
+}
+
+//Queries pass "create" as 0, so that streams without any history are not loaded for them
+static HistoryStream* find_stream(char *name, int create)
+{
+    HistoryStream *stream;
+    char dir_path[MAX_FILE_PATH+1];
+
+    HASH_FIND_STR(history_streams, name, stream);
+    if(stream)
+        return stream;
+
+    sprintf(dir_path, "%s/%s", HISTORY_ROOT, name);
+    if(!create && access(dir_path, F_OK) < 0)
+        return NULL;
+
+    return load_stream(name);
+}
+
+
+
+/******************************/
+/*       History Thread       */
+/******************************/
+
+static void close_segment(HistoryStream *stream)
+{
+    if(stream->dirty)
+    {
+        fdatasync(stream->log_fd);
+        fdatasync(stream->idx_fd);
+
+        pthread_mutex_lock(&history_lock);
+        stream->written_seq = stream->next_seq;
+        pthread_mutex_unlock(&history_lock);
+        stream->dirty = 0;
+        search_history_committed(stream->name);
+    }
+
+    close(stream->log_fd);
+    close(stream->idx_fd);
+    stream->log_fd = stream->idx_fd = 0;
+
+    DL_DELETE2(open_streams, stream, open_prev, open_next);
+    --open_stream_count;
+}
+
+//Opens the stream's last segment for appending, or starts a new one if "new_segment" is set (or there is none yet)
+static int open_segment(HistoryStream *stream, int new_segment, time_t timestamp)
+{
+    char path[MAX_FILE_PATH+1];
+    int retval;
+
+    if(new_segment || stream->segment_count == 0)
+    {
+        sprintf(path, "%s/%s", HISTORY_ROOT, stream->name);
+        retval = mkdir(path, S_IRWXU);
+        if(retval < 0 && errno != EEXIST)
+        {
+            perror("Failed to create history directory.");
+            return 0;
+        }
+
+        pthread_mutex_lock(&history_lock);
+        add_segment(stream, stream->next_seq, timestamp);
+        pthread_mutex_unlock(&history_lock);
+
+        stream->log_size = stream->indexed_size = 0;
+    }
+
+    segment_path(stream->name, stream->segments[stream->segment_count-1].first_seq, "log", path);
+    stream->log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    segment_path(stream->name, stream->segments[stream->segment_count-1].first_seq, "idx", path);
+    stream->idx_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+
+    if(stream->log_fd < 0 || stream->idx_fd < 0)
+    {
+        perror("Failed to open history segment.");
+        if(stream->log_fd >= 0)
+            close(stream->log_fd);
+        if(stream->idx_fd >= 0)
+            close(stream->idx_fd);
+        stream->log_fd = stream->idx_fd = 0;
+        return 0;
+    }
+
+    DL_PREPEND2(open_streams, stream, open_prev, open_next);
+    ++open_stream_count;
+    return 1;
+}
+
+static void write_history_entry(HistoryEntry *entry)
+{
+    HistoryStream *stream;
+    HistoryRecord record = {0};
+    HistoryIndexEntry index_entry;
+    struct iovec parts[3];
+    size_t sender_length = strlen(entry->sender) + 1;
+    size_t record_size = sizeof(HistoryRecord) + sender_length + entry->length;
+    int segment_full;
+
+    pthread_mutex_lock(&history_lock);
+    stream = find_stream(entry->stream, 1);
+    pthread_mutex_unlock(&history_lock);
+
+    segment_full = stream->log_size > 0 && stream->log_size + record_size > HISTORY_SEGMENT_SIZE;
+    if(stream->log_fd && segment_full)
+        close_segment(stream);
+
+    if(!stream->log_fd)
+    {
+        if(!open_segment(stream, segment_full, entry->timestamp))
+            return;
+    }
+    else
+    {
+        DL_DELETE2(open_streams, stream, open_prev, open_next);
+        DL_PREPEND2(open_streams, stream, open_prev, open_next);
+    }
+
+    record.seq = stream->next_seq;
+    record.timestamp = entry->timestamp;
+    record.length = sender_length + entry->length;
+
+    parts[0] = (struct iovec){&record, sizeof(HistoryRecord)};
+    parts[1] = (struct iovec){entry->sender, sender_length};
+    parts[2] = (struct iovec){entry->text, entry->length};
+    if(writev(stream->log_fd, parts, 3) != (ssize_t)record_size)
+    {
+        perror("Failed to archive message.");
+        return;
+    }
+
+    //Index the message after it is written, so the index never points past the log
+    if(stream->log_size == 0 || stream->log_size - stream->indexed_size >= HISTORY_INDEX_INTERVAL)
+    {
+        index_entry = (HistoryIndexEntry){record.seq, record.timestamp, stream->log_size};
+        if(write(stream->idx_fd, &index_entry, sizeof(HistoryIndexEntry)) != sizeof(HistoryIndexEntry))
+            perror("Failed to index archived message.");
+        stream->indexed_size = stream->log_size;
+    }
+
+    stream->log_size += record_size;
+    ++stream->next_seq;
+    stream->dirty = 1;
+}
+
+//Group commit: every stream written by the batch is synced once, and its messages become visible to queries
+static void commit_history()
+{
+    HistoryStream *stream;
+
+    DL_FOREACH2(open_streams, stream, open_next)
+    {
+        if(!stream->dirty)
+            continue;
+
+        if(fdatasync(stream->log_fd) < 0 || fdatasync(stream->idx_fd) < 0)
+            perror("Failed to sync history.");
+
+        pthread_mutex_lock(&history_lock);
+        stream->written_seq = stream->next_seq;
+        pthread_mutex_unlock(&history_lock);
+        stream->dirty = 0;
+        search_history_committed(stream->name);
+    }
+
+    //Close the least recently written segments beyond the limit
+    while(open_stream_count > HISTORY_OPEN_STREAMS)
+        close_segment(open_streams->open_prev);
+}
+
+static void* history_loop(void *arg)
+{
+    HistoryEntry *batch, *entry, *tmp;
+
+    while(1)
+    {
+        pthread_mutex_lock(&history_queue_lock);
+        while(!history_queue)
+        {
+            history_writing = 0;
+            pthread_cond_broadcast(&history_idle);
+            pthread_cond_wait(&history_queued, &history_queue_lock);
+        }
+
+        //Everything queued while the last batch was being written is written together
+        batch = history_queue;
+        history_queue = NULL;
+        history_queue_size = 0;
+        history_writing = 1;
+        pthread_mutex_unlock(&history_queue_lock);
+
+        DL_FOREACH_SAFE(batch, entry, tmp)
+        {
+            write_history_entry(entry);
+            DL_DELETE(batch, entry);
+            free(entry);
+        }
+
+        commit_history();
+    }
+
+    return NULL;
+}
+
+int history_init()
+{
+    int retval;
+
+    if(!HISTORY_ARCHIVE)
+        return 1;
+
+    retval = mkdir(HISTORY_ROOT, S_IRWXU);
+    if(retval < 0 && errno != EEXIST)
+    {
+        perror("Failed to create directory for chat history.");
+        return 0;
+    }
+
+    if(pthread_create(&history_thread, NULL, &history_loop, NULL) != 0)
+    {
+        printf("Failed to create chat history thread\n");
+        return 0;
+    }
+    history_started = 1;
+
+    return 1;
+}
+
+//Waits (for a few seconds at most) until every queued message is on disk
+void history_close()
+{
+    struct timespec deadline;
+
+    if(!history_started)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 3;
+
+    pthread_mutex_lock(&history_queue_lock);
+    while(history_queue || history_writing)
+    {
+        if(pthread_cond_timedwait(&history_idle, &history_queue_lock, &deadline) != 0)
+            break;
+    }
+    pthread_mutex_unlock(&history_queue_lock);
+}
+
+
+
+/******************************/
+/*     Archiving Messages     */
+/******************************/
+
+//Called from the chat thread. Only queues the message, which the history thread writes later on
+static void queue_history_entry(char *stream, char *sender, char *text)
+{
+    HistoryEntry *entry;
+    size_t length = strlen(text) + 1;
+
+    if(!history_started)
+        return;
+
+    entry = malloc(sizeof(HistoryEntry) + length);
+    strcpy(entry->stream, stream);
+    strcpy(entry->sender, sender);
+    entry->timestamp = time(NULL);
+    entry->length = length;
+    memcpy(entry->text, text, length);
+
+    pthread_mutex_lock(&history_queue_lock);
+
+    if(history_queue_size + length > HISTORY_QUEUE_BUDGET)
+    {
+        if(++history_dropped % 1000 == 1)
+            printf("Chat history is not keeping up. %lu messages were not archived.\n", history_dropped);
+        pthread_mutex_unlock(&history_queue_lock);
+        free(entry);
+        return;
+    }
+
+    DL_APPEND(history_queue, entry);
+    history_queue_size += length;
+    pthread_cond_signal(&history_queued);
+
+    pthread_mutex_unlock(&history_queue_lock);
+}
+
+//A group's archive is named after its history id rather than its name. It follows the group through renames, and a later
+//group of the same name starts an archive of its own. The lobby is never removed, so its archive keeps the lobby's name
+void group_stream_name(Group *group, char *name_ret)
+{
+    if(group->history_id)
+        sprintf(name_ret, "#%016lx", group->history_id);
+    else
+        strcpy(name_ret, group->groupname);
+}
+
+void archive_group_msg(Group *group, char *sender, char *text)
+{
+    char stream[HISTORY_STREAM_LENG+1];
+
+    group_stream_name(group, stream);
+    queue_history_entry(stream, sender, text);
+}
+
+void archive_pm(char *sender, char *recipient, char *text)
+{
+    char stream[HISTORY_STREAM_LENG+1];
+
+    pm_stream_name(sender, recipient, stream);
+    queue_history_entry(stream, sender, text);
+}
+
+
+
+/******************************/
+/*       Reading History      */
+/******************************/
+
+//Where to start reading a segment: at the last indexed message before the requested time (or sequence number)
+static size_t segment_start_offset(char *stream, HistorySegment *segment, int by_time, time_t since, uint64_t from_seq)
+{
+    char idx_path[MAX_FILE_PATH+1];
+    HistoryIndexEntry *entries;
+    size_t map_size = 0, count, low, high, mid, offset = 0;
+
+    segment_path(stream, segment->first_seq, "idx", idx_path);
+    entries = (HistoryIndexEntry*)map_segment_file(idx_path, &map_size);
+    if(!entries)
+        return 0;
+
+    count = map_size / sizeof(HistoryIndexEntry);
+    low = 0;
+    high = count;
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+        if((by_time)? entries[mid].timestamp < since : entries[mid].seq <= from_seq)
+        {
+            offset = entries[mid].offset;
+            low = mid + 1;
+        }
+        else
+            high = mid;
+    }
+
+    munmap(entries, map_size);
+    return offset;
+}
+
+//Passes up to "limit" committed messages of a stream to "visit", starting at the first one at or after "since" (or at "from_seq").
+//A "from_seq" of 0 passes the last "limit" messages. Returns how many were passed
+unsigned int scan_history(char *stream_name, int by_time, time_t since, uint64_t from_seq, unsigned int limit, history_visitor visit, void *arg)
+{
+    char log_path[MAX_FILE_PATH+1], *map, *sender, *text;
+    unsigned int count = 0, segment, low, high, mid;
+    size_t map_size = 0, offset, record_size;
+    HistoryStream *stream;
+    HistoryRecord record;
+
+    pthread_mutex_lock(&history_lock);
+
+    stream = find_stream(stream_name, 0);
+    if(!stream || stream->segment_count == 0)
+    {
+        pthread_mutex_unlock(&history_lock);
+        return 0;
+    }
+
+    if(!by_time && from_seq == 0)
+        from_seq = (stream->written_seq > limit)? stream->written_seq - limit : 1;
+
+    //The last segment starting before the requested time (messages of the same second may span segments), or at or before the requested message
+    segment = 0;
+    low = 0;
+    high = stream->segment_count;
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+        if((by_time)? stream->segments[mid].first_time < since : stream->segments[mid].first_seq <= from_seq)
+        {
+            segment = mid;
+            low = mid + 1;
+        }
+        else
+            high = mid;
+    }
+
+    offset = segment_start_offset(stream->name, &stream->segments[segment], by_time, since, from_seq);
+    for(; segment < stream->segment_count && count < limit; segment++, offset = 0)
+    {
+        segment_path(stream->name, stream->segments[segment].first_seq, "log", log_path);
+        map = map_segment_file(log_path, &map_size);
+        if(!map)
+            continue;
+
+        while(count < limit && (record_size = parse_history_record(map, map_size, offset, &record, &sender, &text)) > 0)
+        {
+            offset += record_size;
+
+            //Messages not committed yet are not shown
+            if(record.seq >= stream->written_seq)
+                break;
+            if((by_time)? record.timestamp < since : record.seq < from_seq)
+                continue;
+
+            visit(arg, &record, sender, text);
+            ++count;
+        }
+
+        munmap(map, map_size);
+    }
+
+    pthread_mutex_unlock(&history_lock);
+    return count;
+}
+
+//Visitor for scan_history(). "lines" must have room for HISTORY_LINE_LENG more bytes
+void append_history_line(void *lines, HistoryRecord *record, char *sender, char *text)
+{
+    HistoryLines *out = lines;
+    char time_str[32];
+    struct tm tm;
+    int printed;
+
+    localtime_r(&(time_t){record->timestamp}, &tm);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+    sprintf(&out->buffer[out->size], "[%s] #%lu %.*s: %.*s\n%n", time_str, record->seq, USERNAME_LENG, sender, MAX_MSG_LENG, text, &printed);
+    out->size += printed;
+}
+
+//Finds the stream of a "@@<group>" target, for the current client. Sends the error if it may not read it. PMs are never read back
+int history_stream_for_target(char *target, char *stream_name_ret)
+{
+    Group *group;
+    Group_Member *member;
+
+    if(strncmp(target, "@@", 2) != 0)
+    {
+        printf("User \"%s\" asked for the archive of \"%s\", which is not a group\n", current_client->user->username, target);
+        send_error_code(current_client, ERR_INVALID_CMD, target);
+        return 0;
+    }
+
+    if(!basic_group_permission_check(target, &group, &member))
+        return 0;
+    if(!(member->permissions & GRP_PERM_HAS_JOINED))
+    {
+        printf("User \"%s\" has not joined \"%s\"\n", current_client->user->username, group->groupname);
+        send_error_code(current_client, ERR_NO_PERMISSION, group->groupname);
+        return 0;
+    }
+    group_stream_name(group, stream_name_ret);
+
+    return 1;
+}
+
+//"@@<group> !history [since=<time>] [limit=<n>]" (the lobby without a target).
+//"since" is a unix time, or a number of seconds ago if negative. Without it, the last messages are returned
+int history_query()
+{
+    char stream_name[HISTORY_STREAM_LENG+1], lobby_target[USERNAME_LENG+3], *history_msg, *token;
+    HistoryLines lines;
+    long long since_arg;
+    time_t since = 0;
+    unsigned int limit = HISTORY_DEFAULT_LIMIT, count;
+    int by_time = 0, msg_size = 0;
+
+    if(!history_started)
+    {
+        send_error_code(current_client, ERR_INVALID_CMD, NULL);
+        return 0;
+    }
+
+    //Like messages, a query without a target is for the lobby
+    if(!msg_target)
+    {
+        sprintf(lobby_target, "@@%s", lobby->groupname);
+        msg_target = lobby_target;
+    }
+
+    if(!history_stream_for_target(msg_target, stream_name))
+        return 0;
+
+    token = strtok(msg_body, " ");                      //Skip the command header "!history"
+    token = strtok(NULL, " ");
+    while(token)
+    {
+        if(sscanf(token, "since=%lld", &since_arg) == 1)
+        {
+            since = (since_arg < 0)? time(NULL) + since_arg : since_arg;
+            by_time = 1;
+        }
+        else if(sscanf(token, "limit=%u", &limit) != 1)
+        {
+            printf("Unknown history option \"%s\"\n", token);
+            send_error_code(current_client, ERR_INVALID_CMD, token);
+            return 0;
+        }
+
+        token = strtok(NULL, " ");
+    }
+
+    if(limit == 0 || limit > HISTORY_MAX_LIMIT)
+        limit = HISTORY_MAX_LIMIT;
+
+    lines.buffer = malloc(limit * HISTORY_LINE_LENG);
+    lines.size = 0;
+
+    //Without a time, the last "limit" messages
+    count = scan_history(stream_name, by_time, since, 0, limit, append_history_line, &lines);
+
+    history_msg = malloc(lines.size + HISTORY_STREAM_LENG + 64);
+    sprintf(history_msg, "!history=%u,target=%s\n%n", count, msg_target, &msg_size);
+    memcpy(&history_msg[msg_size], lines.buffer, lines.size);
+    msg_size += lines.size;
+    history_msg[msg_size] = '\0';
+    free(lines.buffer);
+
+    send_long_msg(current_client, history_msg, msg_size+1);
+    free(history_msg);
+
+    return count;
+}
@@ -0,0 +1,93 @@
+#ifndef _CHAT_HISTORY_H_
+#define _CHAT_HISTORY_H_
+
+#include "server_common.h"
+#include <pthread.h>
+
+#define HISTORY_ARCHIVE             1                   //Archive every group message and PM on disk, for !history. 0 keeps no history
+#define HISTORY_ROOT                "HISTORY"
+#define HISTORY_STREAM_LENG         (2*USERNAME_LENG + 2)   //"#<history id>" of a group (the lobby's name for the lobby), or "~<user>~<user>" for the PMs between two users
+#define HISTORY_SEGMENT_SIZE        16777216            //Bytes of messages in a segment file, before the next one is started
+#define HISTORY_INDEX_INTERVAL      4096                //Bytes of messages between two entries of a segment's sparse index
+#define HISTORY_QUEUE_BUDGET        67108864            //Bytes of messages waiting to be written. Messages beyond this are not archived
+#define HISTORY_OPEN_STREAMS        256                 //Streams whose segment files are kept open for appending. Least recently written ones are closed beyond this
+#define HISTORY_DEFAULT_LIMIT       20                  //Messages returned by !history if no limit is given
+#define HISTORY_MAX_LIMIT           100
+#define HISTORY_LINE_LENG           (USERNAME_LENG + MAX_MSG_LENG + 64)     //Bytes of a message, as listed to clients
+
+
+//Header of every archived message in a segment's log file. The sender and text follow, both NUL terminated
+typedef struct {
+    uint64_t seq;               //Numbered from 1 in each stream
+    int64_t timestamp;
+    uint32_t length;            //Bytes of sender and text
+    uint32_t reserved;
+} HistoryRecord;
+
+//Sparse index of a segment (its ".idx" file): where some of its messages start, at least every HISTORY_INDEX_INTERVAL bytes. The first message is always indexed
+typedef struct {
+    uint64_t seq;
+    int64_t timestamp;
+    uint64_t offset;
+} HistoryIndexEntry;
+
+
+//A message waiting to be archived by the history thread
+typedef struct historyentry {
+    char stream[HISTORY_STREAM_LENG+1];
+    char sender[USERNAME_LENG+1];
+    time_t timestamp;
+    unsigned int length;                        //Bytes of text, NUL included
+    struct historyentry *prev, *next;
+    char text[];
+} HistoryEntry;
+
+//A segment of a stream, named after its first message's sequence number ("<seq>.log" and "<seq>.idx")
+typedef struct {
+    uint64_t first_seq;
+    time_t first_time;
+} HistorySegment;
+
+//The history of a group, or of the PMs between two users. Kept in its own directory of segments
+typedef struct historystream {
+    char name[HISTORY_STREAM_LENG+1];
+    HistorySegment *segments;                   //Oldest first
+    unsigned int segment_count, segment_capacity;
+    uint64_t written_seq;                       //Messages before this one are on disk, and can be queried
+
+    //Only used by the history thread
+    uint64_t next_seq;
+    int log_fd, idx_fd;                         //Last segment, while it is open for appending
+    size_t log_size, indexed_size;              //Size of the last segment, and where its last indexed message starts
+    int dirty;                                  //Written to since the last commit
+    struct historystream *open_prev, *open_next;    //Position in the LRU list of streams with open segments (most recently written first)
+
+    UT_hash_handle hh;                          //Key: name
+} HistoryStream;
+
+
+//Collects the messages passed by scan_history() as lines of text, for replies to clients
+typedef struct {
+    char *buffer;
+    int size;
+} HistoryLines;
+
+typedef void (*history_visitor)(void *arg, HistoryRecord *record, char *sender, char *text);
+
+
+struct group;
+
+
+int history_init();
+void history_close();
+void group_stream_name(struct group *group, char *name_ret);
+void archive_group_msg(struct group *group, char *sender, char *text);
+void archive_pm(char *sender, char *recipient, char *text);
+
+unsigned int scan_history(char *stream_name, int by_time, time_t since, uint64_t from_seq, unsigned int limit, history_visitor visit, void *arg);
+void append_history_line(void *lines, HistoryRecord *record, char *sender, char *text);
+int history_stream_for_target(char *target, char *stream_name_ret);
+int history_query();
+
+
+#endif
@@ -0,0 +1,698 @@
+#include "chat_search.h"
+#include "server.h"
+
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+
+static pthread_t search_thread;
+static int search_started;
+
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;    //Guards the request lists below
+static pthread_cond_t search_requested = PTHREAD_COND_INITIALIZER;
+static SearchRequest *search_queries;           //Queries from the chat thread
+static SearchRequest *search_updates;           //Streams the history thread has committed new messages to
+static SearchRequest *search_results;           //Answered queries, for the chat thread to send
+int search_events_fd;                           //Signals the chat thread that search_results has new entries
+
+static SearchStream *search_streams;            //Search thread only: hashtable of the streams indexed since startup (key = name)
+static unsigned long delta_postings_total;      //Postings of all streams not written to index segments yet
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static void index_segment_path(char *stream, uint64_t first_seq, char *path_ret)
+{
+    sprintf(path_ret, "%s/%s/%020lu.terms", HISTORY_ROOT, stream, first_seq);
+}
+
+//Letters, digits and any non-ASCII byte (so UTF-8 words stay whole)
+static inline int is_term_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (unsigned char)c >= 0x80;
+}
+
+//Reads the next word of a text as a lowercase term, skipping words too short to be indexed. Returns 0 at the end of the text
+static int next_term(char **cursor, char *term_ret)
+{
+    char *c = *cursor;
+    unsigned int length;
+
+    while(1)
+    {
+        while(*c && !is_term_char(*c))
+            c++;
+        if(!*c)
+        {
+            *cursor = c;
+            return 0;
+        }
+
+        for(length = 0; is_term_char(*c); c++)
+        {
+            if(length < SEARCH_TERM_LENG)
+                term_ret[length++] = (*c >= 'A' && *c <= 'Z')? *c - 'A' + 'a' : *c;
+        }
+
+        if(length >= SEARCH_MIN_TERM_LENG)
+        {
+            term_ret[length] = '\0';
+            *cursor = c;
+            return 1;
+        }
+    }
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value)
+{
+    size_t length = 0;
+
+    while(value >= 0x80)
+    {
+        out[length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+
+    return length;
+}
+
+static int get_varint(uint8_t *data, size_t size, size_t *offset, uint64_t *value_ret)
+{
+    uint64_t value = 0;
+    unsigned int shift;
+
+    for(shift = 0; *offset < size && shift < 64; shift += 7)
+    {
+        value |= (uint64_t)(data[*offset] & 0x7F) << shift;
+        if(!(data[(*offset)++] & 0x80))
+        {
+            *value_ret = value;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int compare_terms(const void *a, const void *b)
+{
+    return strcmp((*(SearchPostings**)a)->term, (*(SearchPostings**)b)->term);
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t seq_a = *(uint64_t*)a, seq_b = *(uint64_t*)b;
+
+    return (seq_a > seq_b) - (seq_a < seq_b);
+}
+
+static int contains_seq(uint64_t *seqs, unsigned int count, uint64_t seq)
+{
+    return bsearch(&seq, seqs, count, sizeof(uint64_t), compare_uint64) != NULL;
+}
+
+
+
+/******************************/
+/*       Index Segments       */
+/******************************/
+
+static void add_index_segment(SearchStream *stream, uint64_t first_seq, uint64_t last_seq, char *map, size_t size)
+{
+    if(stream->segment_count == stream->segment_capacity)
+    {
+        stream->segment_capacity = (stream->segment_capacity)? stream->segment_capacity * 2 : 8;
+        stream->segments = realloc(stream->segments, stream->segment_capacity * sizeof(SearchSegment));
+    }
+
+    stream->segments[stream->segment_count++] = (SearchSegment){first_seq, last_seq, map, size};
+}
+
+static char* map_index_segment(char *path, size_t *size_ret)
+{
+    struct stat file_stat;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &file_stat) < 0 || (size_t)file_stat.st_size < sizeof(SearchSegmentHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    *size_ret = file_stat.st_size;
+    map = mmap(NULL, *size_ret, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (map == MAP_FAILED)? NULL : map;
+}
+
+//Writes the postings gathered in memory as a new index segment
+static void flush_delta(SearchStream *stream)
+{
+    SearchPostings **sorted, *postings, *tmp;
+    SearchSegmentHeader header;
+    SearchTermEntry *entries;
+    char path[MAX_FILE_PATH+1], tmp_path[MAX_FILE_PATH+1], *map;
+    uint8_t *lists;
+    size_t lists_size = 0, lists_capacity, list_start, map_size;
+    unsigned int term_count, i, j;
+    uint64_t prev;
+    int fd;
+
+    if(stream->delta_postings == 0)
+        return;
+
+    //Terms in order, each followed by its gaps (at most 10 bytes each)
+    term_count = HASH_COUNT(stream->delta);
+    sorted = malloc(term_count * sizeof(SearchPostings*));
+    i = 0;
+    HASH_ITER(hh, stream->delta, postings, tmp)
+        sorted[i++] = postings;
+    qsort(sorted, term_count, sizeof(SearchPostings*), compare_terms);
+
+    header = (SearchSegmentHeader){SEARCH_MAGIC, term_count, stream->delta_first_seq, stream->indexed_seq - 1};
+    entries = calloc(term_count, sizeof(SearchTermEntry));
+    lists_capacity = (size_t)stream->delta_postings * 10;
+    lists = malloc(lists_capacity);
+
+    for(i = 0; i < term_count; i++)
+    {
+        memcpy(entries[i].term, sorted[i]->term, strlen(sorted[i]->term));
+        entries[i].count = sorted[i]->count;
+        entries[i].offset = sizeof(SearchSegmentHeader) + term_count * sizeof(SearchTermEntry) + lists_size;
+
+        list_start = lists_size;
+        prev = stream->delta_first_seq;
+        for(j = 0; j < sorted[i]->count; j++)
+        {
+            lists_size += put_varint(&lists[lists_size], sorted[i]->seqs[j] - prev);
+            prev = sorted[i]->seqs[j];
+        }
+        entries[i].size = lists_size - list_start;
+    }
+
+    //Write it under another name first, so that a segment that exists is always complete
+    index_segment_path(stream->name, stream->delta_first_seq, path);
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+        fd = -1;
+    else
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if(fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header)
+        || write(fd, entries, term_count * sizeof(SearchTermEntry)) != (ssize_t)(term_count * sizeof(SearchTermEntry))
+        || write(fd, lists, lists_size) != (ssize_t)lists_size || fdatasync(fd) < 0 || rename(tmp_path, path) < 0)
+    {
+        //Keep the postings in memory, and try again later
+        perror("Failed to write search index segment.");
+        if(fd >= 0)
+            close(fd);
+        remove(tmp_path);
+        free(sorted);
+        free(entries);
+        free(lists);
+        return;
+    }
+    close(fd);
+
+    map = map_index_segment(path, &map_size);
+    if(map)
+        add_index_segment(stream, header.first_seq, header.last_seq, map, map_size);
+
+    HASH_ITER(hh, stream->delta, postings, tmp)
+    {
+        HASH_DEL(stream->delta, postings);
+        free(postings->seqs);
+        free(postings);
+    }
+    delta_postings_total -= stream->delta_postings;
+    stream->delta_postings = 0;
+    stream->delta_first_seq = stream->indexed_seq;
+
+    free(sorted);
+    free(entries);
+    free(lists);
+}
+
+//Decodes the posting list of a term in an index segment. Returns its count, or 0 if the segment does not have the term
+static unsigned int segment_postings(SearchSegment *segment, char *term, uint64_t **seqs_ret)
+{
+    SearchSegmentHeader *header = (SearchSegmentHeader*)segment->map;
+    SearchTermEntry *entries = (SearchTermEntry*)&segment->map[sizeof(SearchSegmentHeader)];
+    size_t low = 0, high = header->term_count, mid, offset;
+    uint64_t gap, seq = segment->first_seq;
+    unsigned int i;
+    int cmp;
+
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+        cmp = strncmp(entries[mid].term, term, SEARCH_TERM_LENG);
+        if(cmp == 0)
+            break;
+        else if(cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if(low >= high || entries[mid].count == 0 || entries[mid].offset + entries[mid].size > segment->size)
+        return 0;
+
+    *seqs_ret = malloc(entries[mid].count * sizeof(uint64_t));
+    offset = entries[mid].offset;
+    for(i = 0; i < entries[mid].count; i++)
+    {
+        if(!get_varint((uint8_t*)segment->map, entries[mid].offset + entries[mid].size, &offset, &gap))
+            break;
+        seq += gap;
+        (*seqs_ret)[i] = seq;
+    }
+
+    if(i == 0)
+        free(*seqs_ret);
+    return i;
+}
+
+
+
+/******************************/
+/*          Indexing          */
+/******************************/
+
+static void add_posting(SearchStream *stream, char *term, uint64_t seq)
+{
+    SearchPostings *postings;
+
+    HASH_FIND_STR(stream->delta, term, postings);
+    if(!postings)
+    {
+        postings = calloc(1, sizeof(SearchPostings));
+        strcpy(postings->term, term);
+        HASH_ADD_STR(stream->delta, term, postings);
+    }
+    else if(postings->seqs[postings->count-1] == seq)
+        return;                                 //Repeated in the same message
+
+    if(postings->count == postings->capacity)
+    {
+        postings->capacity = (postings->capacity)? postings->capacity * 2 : 4;
+        postings->seqs = realloc(postings->seqs, postings->capacity * sizeof(uint64_t));
+    }
+
+    postings->seqs[postings->count++] = seq;
+    ++stream->delta_postings;
+    ++delta_postings_total;
+}
+
+//Visitor for scan_history()
+static void index_message(void *arg, HistoryRecord *record, char *sender, char *text)
+{
+    SearchStream *stream = arg;
+    char term[SEARCH_TERM_LENG+1];
+
+    while(next_term(&text, term))
+        add_posting(stream, term, record->seq);
+
+    stream->indexed_seq = record->seq + 1;
+}
+
+//Maps the index segments a stream has on disk. They must follow each other from its first message on; anything after a gap is dropped, and indexed again
+static SearchStream* load_search_stream(char *name)
+{
+    SearchStream *stream;
+    SearchSegmentHeader *header;
+    char dir_path[MAX_FILE_PATH+1], path[MAX_FILE_PATH+1], *map;
+    struct dirent *dir_entry;
+    uint64_t *first_seqs = NULL, first_seq;
+    unsigned int count = 0, capacity = 0, i;
+    size_t map_size = 0;
+    DIR *dir;
+
+    stream = calloc(1, sizeof(SearchStream));
+    strcpy(stream->name, name);
+    stream->indexed_seq = 1;
+
+    sprintf(dir_path, "%s/%s", HISTORY_ROOT, name);
+    dir = opendir(dir_path);
+    while(dir && (dir_entry = readdir(dir)))
+    {
+        if(strlen(dir_entry->d_name) == 26 && strcmp(&dir_entry->d_name[20], ".terms") == 0 && sscanf(dir_entry->d_name, "%lu", &first_seq) == 1)
+        {
+            if(count == capacity)
+            {
+                capacity = (capacity)? capacity * 2 : 8;
+                first_seqs = realloc(first_seqs, capacity * sizeof(uint64_t));
+            }
+            first_seqs[count++] = first_seq;
+        }
+        else if(strstr(dir_entry->d_name, ".terms.tmp"))
+        {
+            if(snprintf(path, sizeof(path), "%s/%s", dir_path, dir_entry->d_name) < (int)sizeof(path))
+                remove(path);
+        }
+    }
+    if(dir)
+        closedir(dir);
+
+    if(count > 0)
+        qsort(first_seqs, count, sizeof(uint64_t), compare_uint64);
+
+    for(i = 0; i < count; i++)
+    {
+        index_segment_path(name, first_seqs[i], path);
+        map = (first_seqs[i] == stream->indexed_seq)? map_index_segment(path, &map_size) : NULL;
+        header = (SearchSegmentHeader*)map;
+
+        if(!map || header->magic != SEARCH_MAGIC || header->first_seq != first_seqs[i] || header->last_seq < header->first_seq
+            || map_size < sizeof(SearchSegmentHeader) + (size_t)header->term_count * sizeof(SearchTermEntry))
+        {
+            printf("Dropping search index segment \"%s\", to be indexed again.\n", path);
+            if(map)
+                munmap(map, map_size);
+            remove(path);
+            continue;
+        }
+
+        add_index_segment(stream, header->first_seq, header->last_seq, map, map_size);
+        stream->indexed_seq = header->last_seq + 1;
+    }
+    free(first_seqs);
+
+    stream->delta_first_seq = stream->indexed_seq;
+    HASH_ADD_STR(search_streams, name, stream);
+
+    return stream;
+}
+
+static SearchStream* find_search_stream(char *name)
+{
+    SearchStream *stream;
+
+    HASH_FIND_STR(search_streams, name, stream);
+    if(!stream)
+        stream = load_search_stream(name);
+
+    return stream;
+}
+
+//Indexes the messages committed to the stream since it was last indexed
+static void catch_up(SearchStream *stream)
+{
+    SearchStream *curr, *tmp;
+    unsigned int count;
+
+    do
+    {
+        count = scan_history(stream->name, 0, 0, stream->indexed_seq, SEARCH_CATCHUP_BATCH, index_message, stream);
+        if(stream->delta_postings >= SEARCH_SEGMENT_POSTINGS)
+            flush_delta(stream);
+    } while(count == SEARCH_CATCHUP_BATCH);
+
+    if(delta_postings_total >= SEARCH_MEMORY_POSTINGS)
+    {
+        HASH_ITER(hh, search_streams, curr, tmp)
+            flush_delta(curr);
+    }
+}
+
+
+
+/******************************/
+/*          Queries           */
+/******************************/
+
+//Adds the newest messages containing every term to "results", from one part of the index. The lists are ascending
+static unsigned int intersect_postings(uint64_t **lists, unsigned int *counts, unsigned int list_count, uint64_t *results, unsigned int max_results)
+{
+    unsigned int shortest = 0, found = 0, i, j;
+
+    for(i = 1; i < list_count; i++)
+    {
+        if(counts[i] < counts[shortest])
+            shortest = i;
+    }
+
+    for(i = counts[shortest]; i-- > 0 && found < max_results;)
+    {
+        for(j = 0; j < list_count; j++)
+        {
+            if(j != shortest && !contains_seq(lists[j], counts[j], lists[shortest][i]))
+                break;
+        }
+
+        if(j == list_count)
+            results[found++] = lists[shortest][i];
+    }
+
+    return found;
+}
+
+static void run_query(SearchRequest *request)
+{
+    SearchStream *stream;
+    SearchPostings *postings;
+    uint64_t results[SEARCH_MAX_RESULTS], *lists[SEARCH_MAX_TERMS];
+    unsigned int counts[SEARCH_MAX_TERMS], found = 0, segment, i, j;
+    struct timespec start, end;
+    HistoryLines lines;
+    int header_size;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    stream = find_search_stream(request->stream);
+    catch_up(stream);
+
+    //The newest messages are still in memory
+    for(i = 0; i < request->term_count; i++)
+    {
+        HASH_FIND_STR(stream->delta, request->terms[i], postings);
+        if(!postings)
+            break;
+        lists[i] = postings->seqs;
+        counts[i] = postings->count;
+    }
+    if(i == request->term_count)
+        found += intersect_postings(lists, counts, request->term_count, results, SEARCH_MAX_RESULTS);
+
+    //Then the index segments, newest first
+    for(segment = stream->segment_count; segment-- > 0 && found < SEARCH_MAX_RESULTS;)
+    {
+        for(i = 0; i < request->term_count; i++)
+        {
+            counts[i] = segment_postings(&stream->segments[segment], request->terms[i], &lists[i]);
+            if(counts[i] == 0)
+                break;
+        }
+        if(i == request->term_count)
+            found += intersect_postings(lists, counts, request->term_count, &results[found], SEARCH_MAX_RESULTS - found);
+
+        for(j = 0; j < i; j++)
+            free(lists[j]);
+    }
+
+    //List them oldest first, like !history
+    lines.buffer = malloc(found * HISTORY_LINE_LENG + HISTORY_STREAM_LENG + 64);
+    sprintf(lines.buffer, "!search=%u,target=%s\n%n", found, request->target, &header_size);
+    lines.size = header_size;
+    for(i = found; i-- > 0;)
+        scan_history(stream->name, 0, 0, results[i], 1, append_history_line, &lines);
+
+    request->reply = lines.buffer;
+    request->reply_size = lines.size + 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Searched \"%s\" for %u term(s): %u result(s) in %.3f ms.\n", stream->name, request->term_count, found,
+        (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+}
+
+static void* search_loop(void *arg)
+{
+    SearchRequest *queries, *updates, *request, *tmp;
+
+    while(1)
+    {
+        pthread_mutex_lock(&search_lock);
+        while(!search_queries && !search_updates)
+            pthread_cond_wait(&search_requested, &search_lock);
+
+        queries = search_queries;
+        updates = search_updates;
+        search_queries = search_updates = NULL;
+        pthread_mutex_unlock(&search_lock);
+
+        //Queries first, so they do not wait behind indexing
+        LL_FOREACH_SAFE(queries, request, tmp)
+        {
+            LL_DELETE(queries, request);
+            run_query(request);
+
+            pthread_mutex_lock(&search_lock);
+            LL_APPEND(search_results, request);
+            pthread_mutex_unlock(&search_lock);
+
+            if(eventfd_write(search_events_fd, 1) < 0)
+                perror("Failed to signal search results.");
+        }
+
+        LL_FOREACH_SAFE(updates, request, tmp)
+        {
+            LL_DELETE(updates, request);
+            catch_up(find_search_stream(request->stream));
+            free(request);
+        }
+    }
+
+    return NULL;
+}
+
+int chat_search_init()
+{
+    if(!HISTORY_ARCHIVE)
+        return 1;
+
+    search_events_fd = eventfd(0, EFD_NONBLOCK);
+    if(search_events_fd < 0)
+    {
+        perror("Failed to create search event fd.");
+        return 0;
+    }
+    if(!register_fd_with_epoll(connections_epollfd, search_events_fd, EPOLLIN))
+        return 0;
+
+    if(pthread_create(&search_thread, NULL, &search_loop, NULL) != 0)
+    {
+        printf("Failed to create search thread\n");
+        return 0;
+    }
+    search_started = 1;
+
+    return 1;
+}
+
+//Called by the history thread once new messages of a stream are on disk
+void search_history_committed(char *stream)
+{
+    SearchRequest *request;
+
+    //PM streams can't be searched, so they are not indexed either
+    if(!search_started || stream[0] == '~')
+        return;
+
+    pthread_mutex_lock(&search_lock);
+
+    //A stream already waiting to be indexed will be indexed up to its latest messages
+    LL_FOREACH(search_updates, request)
+    {
+        if(strcmp(request->stream, stream) == 0)
+            break;
+    }
+    if(!request)
+    {
+        request = calloc(1, sizeof(SearchRequest));
+        strcpy(request->stream, stream);
+        LL_APPEND(search_updates, request);
+        pthread_cond_signal(&search_requested);
+    }
+
+    pthread_mutex_unlock(&search_lock);
+}
+
+//"!search @@<group> <terms>" ("@@<group> !search <terms>" works too).
+//Finds the newest messages containing all of the terms. Answered by the search thread
+int search_query()
+{
+    SearchRequest *request;
+    char *target, *text, term[SEARCH_TERM_LENG+1];
+    unsigned int i;
+
+    if(!search_started)
+    {
+        send_error_code(current_client, ERR_INVALID_CMD, NULL);
+        return 0;
+    }
+
+    target = msg_target;
+    text = &msg_body[7];                                //Skips the command header "!search"
+    if(!target)
+    {
+        target = strtok(text, " ");
+        text = strtok(NULL, "");
+    }
+
+    if(!target || !text || strlen(target) > USERNAME_LENG+2)
+    {
+        printf("Invalid search \"%s\"\n", msg_body);
+        send_error_code(current_client, ERR_INVALID_CMD, NULL);
+        return 0;
+    }
+
+    request = calloc(1, sizeof(SearchRequest));
+    if(!history_stream_for_target(target, request->stream))
+    {
+        free(request);
+        return 0;
+    }
+
+    //Terms are split like messages are when indexed. Repeated ones count once
+    while(request->term_count < SEARCH_MAX_TERMS && next_term(&text, term))
+    {
+        for(i = 0; i < request->term_count && strcmp(request->terms[i], term) != 0; i++);
+        if(i == request->term_count)
+            strcpy(request->terms[request->term_count++], term);
+    }
+    if(request->term_count == 0)
+    {
+        printf("No search terms in \"%s\"\n", msg_body);
+        send_error_code(current_client, ERR_INVALID_CMD, NULL);
+        free(request);
+        return 0;
+    }
+
+    request->socketfd = current_client->socketfd;
+    strcpy(request->username, current_client->user->username);
+    strcpy(request->target, target);
+
+    pthread_mutex_lock(&search_lock);
+    LL_APPEND(search_queries, request);
+    pthread_cond_signal(&search_requested);
+    pthread_mutex_unlock(&search_lock);
+
+    return 1;
+}
+
+//Sends the answers of the search thread. Runs on the chat thread, with client_lock held
+void handle_search_results()
+{
+    SearchRequest *results, *request, *tmp;
+    Client *c;
+    eventfd_t count;
+
+    if(eventfd_read(search_events_fd, &count) < 0 && errno != EAGAIN)
+        perror("Failed to read search events.");
+
+    pthread_mutex_lock(&search_lock);
+    results = search_results;
+    search_results = NULL;
+    pthread_mutex_unlock(&search_lock);
+
+    LL_FOREACH_SAFE(results, request, tmp)
+    {
+        //The user may have left in the meantime
+        HASH_FIND_INT(active_connections, &request->socketfd, c);
+        if(c && c->user && strcmp(c->user->username, request->username) == 0)
+            send_long_msg(c, request->reply, request->reply_size);
+
+        LL_DELETE(results, request);
+        free(request->reply);
+        free(request);
+    }
+}
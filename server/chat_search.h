@@ -0,0 +1,90 @@
+#ifndef _CHAT_SEARCH_H_
+#define _CHAT_SEARCH_H_
+
+#include "server_common.h"
+#include "chat_history.h"
+#include <pthread.h>
+
+#define SEARCH_MAGIC                0x54435358          //"TCSX"
+#define SEARCH_TERM_LENG            24                  //Longer words are indexed (and searched) by their first SEARCH_TERM_LENG bytes
+#define SEARCH_MIN_TERM_LENG        2                   //Shorter words are not indexed
+#define SEARCH_MAX_TERMS            8                   //Terms of a query. All of them must appear in a message
+#define SEARCH_MAX_RESULTS          20                  //Messages returned by a query, newest first
+#define SEARCH_SEGMENT_POSTINGS     524288              //Postings gathered in memory for a stream, before they are written as an index segment
+#define SEARCH_MEMORY_POSTINGS      4194304             //Postings gathered in memory for all streams. Beyond this, every stream's are written out
+#define SEARCH_CATCHUP_BATCH        4096                //Messages read from the history at a time, while indexing
+
+
+//An index segment ("<first_seq>.terms", next to the stream's history) covers the messages first_seq to last_seq.
+//Its term table is sorted, and each term's posting list holds the sequence numbers of the messages containing it,
+//as varint encoded gaps (the first one from first_seq)
+typedef struct {
+    uint32_t magic;
+    uint32_t term_count;
+    uint64_t first_seq;
+    uint64_t last_seq;
+} SearchSegmentHeader;
+
+typedef struct {
+    char term[SEARCH_TERM_LENG];                //NUL padded, not terminated at full length
+    uint32_t count;                             //Messages containing the term
+    uint64_t offset;                            //Of its posting list in the file
+    uint32_t size;                              //Bytes of its posting list
+    uint32_t reserved;
+} SearchTermEntry;
+
+
+//Postings of one term not written to an index segment yet
+typedef struct {
+    char term[SEARCH_TERM_LENG+1];
+    uint64_t *seqs;                             //Ascending
+    unsigned int count, capacity;
+    UT_hash_handle hh;                          //Key: term
+} SearchPostings;
+
+//An index segment mapped in memory
+typedef struct {
+    uint64_t first_seq, last_seq;
+    char *map;
+    size_t size;
+} SearchSegment;
+
+//The search index of a history stream. Only used by the search thread
+typedef struct searchstream {
+    char name[HISTORY_STREAM_LENG+1];
+    SearchSegment *segments;                    //Oldest first, covering the messages before delta_first_seq
+    unsigned int segment_count, segment_capacity;
+
+    SearchPostings *delta;                      //Hashtable of the postings of the messages from delta_first_seq on
+    uint64_t delta_first_seq;
+    unsigned int delta_postings;
+    uint64_t indexed_seq;                       //Messages before this one are indexed
+
+    UT_hash_handle hh;                          //Key: name
+} SearchStream;
+
+
+//Work for the search thread
+typedef struct searchrequest {
+    char stream[HISTORY_STREAM_LENG+1];
+    int socketfd;                               //Queries only: who asked. 0 for streams with new messages to index
+    char username[USERNAME_LENG+1];             //Validates the connection, as its fd may be reused by the time the reply is ready
+    char target[USERNAME_LENG+3];
+    char terms[SEARCH_MAX_TERMS][SEARCH_TERM_LENG+1];
+    unsigned int term_count;
+    char *reply;                                //Filled in by the search thread
+    size_t reply_size;
+    struct searchrequest *next;
+} SearchRequest;
+
+
+extern int search_events_fd;
+
+
+int chat_search_init();
+void search_history_committed(char *stream);
+int search_query();
+void handle_search_results();
+
+
+#endif
@@ -136,6 +136,14 @@ int parse_client_command()
         return set_group_permission();
 
 
+    /*No new file transfers are started while an upgrade waits for the others to finish. Implemented in upgrade.c*/
+    else if(upgrade_draining && (strncmp(msg_body, "!sendfile=", 10) == 0 || strncmp(msg_body, "!putfile=", 9) == 0 || strncmp(msg_body, "!getfile ", 9) == 0))
+    {
+        send_error_code(current_client, ERR_UPGRADING, NULL);
+        return 0;
+    }
+
+
     /*File Transfer Commands. Implemented in file_transfer_server.c*/
     else if(strncmp(msg_body, "!sendfile=", 10) == 0)
         return new_client_transfer();
@@ -149,6 +157,9 @@ int parse_client_command()
     else if(strncmp(msg_body, "!cancelfile", 11) == 0)
         return user_cancelled_transfer();
 
+    else if(strncmp(msg_body, "!xfercrc=", 9) == 0)
+        return forward_checksum_trailer();
+
 
     /*File Transfer for Groups*/
     else if(strcmp(msg_body, "!filelist") == 0)
@@ -157,11 +168,28 @@ int parse_client_command()
     else if(strncmp(msg_body, "!putfile=", 9) == 0)
         return put_new_file_to_group();
 
+    else if(strncmp(msg_body, "!xferchunks=", 12) == 0)
+        return upload_chunk_checksums();
+
+    else if(strncmp(msg_body, "!rechunk=", 9) == 0)
+        return resend_download_chunk();
+
     else if(strncmp(msg_body, "!getfile ", 9) == 0)
         return get_new_file_from_group();
 
+    else if(strncmp(msg_body, "!resumefile=", 12) == 0)
+        return resume_file_to_group();
+
     else if(strncmp(msg_body, "!removefile ", 12) == 0)
         return remove_file_from_group();
+
+
+    /*Chat History*/
+    else if(strcmp(msg_body, "!history") == 0 || strncmp(msg_body, "!history ", 9) == 0)
+        return history_query();                                 //Implemented in chat_history.c
+
+    else if(strncmp(msg_body, "!search ", 8) == 0)
+        return search_query();                                  //Implemented in chat_search.c
     
     
     else
@@ -201,81 +229,72 @@ static void admin_delete_group(char *buffer)
 
 static void admin_unban_user(char *buffer)
 {
-    char unban_target[USERNAME_LENG+1];
-    IP_List *ban_entry;
-    char ipaddr_str[INET_ADDRSTRLEN];
-    uint32_t target_ipaddr;
+    char unban_target[USERNAME_LENG+IP_PREFIX_STRLEN+1];
+    char range_str[IP_PREFIX_STRLEN];
+    IPPrefix range;
+    IPTrieNode *ban_entry;
 
     sscanf(buffer, "!unbanip %s", unban_target);
 
-    //We only allow banned hostname/IP addresses to be entered  
-    if(hostname_to_ip(unban_target, "0", ipaddr_str))
-        target_ipaddr = inet_addr(ipaddr_str);
-    else
+    //Banned usernames are not kept, so the target is read as an IP address/range first. A connected user or a hostname
+    //is unbanned by its current address
+    if(!parse_ip_prefix(unban_target, &range) && !ban_target_prefix(unban_target, &range, NULL))
     {
         printf("Target \"%s\" was not found or not banned.\n", unban_target);
         return;
     }
+    format_ip_prefix(&range, range_str);
 
-    //Unban the IP address, if an entry was located
-    HASH_FIND_INT(banned_ips, &target_ipaddr, ban_entry);
-    if(ban_entry)
-    {
-        HASH_DEL(banned_ips, ban_entry);
-        free(ban_entry);
-        printf("Target \"%s\"has been unbanned.\n", unban_target);
-    }
+    //Unban the IP address/range, if it was banned as such
+    if(ip_trie_remove(&banned_ips, &range))
+        printf("Target \"%s\" has been unbanned (%s).\n", unban_target, range_str);
     else
-        printf("Target \"%s\" was not found or not banned.\n", unban_target);
+        printf("Target \"%s\" (%s) was not found or not banned.\n", unban_target, range_str);
+
+    //A wider range may still cover it
+    ban_entry = ip_trie_match(&banned_ips, &range);
+    if(ban_entry)
+        printf("Note: \"%s\" is still banned as part of the range %s.\n", unban_target, format_ip_prefix(&ban_entry->prefix, range_str));
 }
 
 static void admin_ban_user(char *buffer)
 {
-    char target_name[USERNAME_LENG+1], *target_name_plain;
-    User *target_user;
-    Client *curr, *tmp;
+    char target_name[USERNAME_LENG+IP_PREFIX_STRLEN+1];
+    char range_str[IP_PREFIX_STRLEN];
+    IPPrefix range;
+    Client *c;
 
-    char ipaddr_str[INET_ADDRSTRLEN];
-    uint32_t target_ipaddr;
-    IP_List *ban_entry;
+    int *socketfds;
+    unsigned int count, i, dropped = 0;
 
     sscanf(buffer, "!banip %s", target_name);
-    target_name_plain = plain_name(target_name);
     
-    //Locate the member to be banned
-    HASH_FIND_STR(active_users, target_name_plain, target_user);
-    if(target_user)
-    {
-        target_ipaddr = target_user->c->sockaddr.sin_addr.s_addr;
-        strcpy(ipaddr_str, inet_ntoa(target_user->c->sockaddr.sin_addr));
-    }
-
-    //We also allow IP/hostnames to be directly specified
-    else if(hostname_to_ip(target_name, "0", ipaddr_str))
-        target_ipaddr = inet_addr(ipaddr_str);
-    
-    else
+    //Locate the member (or IP address/range, or hostname) to be banned
+    if(!ban_target_prefix(target_name, &range, NULL))
     {
         printf("Target \"%s\" was not found.\n", target_name);
         return;
     }
 
-    //Add the user's associated IP address to the global ban list if it doesn't already exist
-    HASH_FIND_INT(banned_ips, &target_ipaddr, ban_entry);
-    if(!ban_entry)
-    {
-        ban_entry = calloc(1, sizeof(IP_List));
-        ban_entry->ipaddr = target_ipaddr;
-        HASH_ADD_INT(banned_ips, ipaddr, ban_entry);
-    }
-    printf("Target \"%s\" has been IP banned (%s).\n", target_name, ipaddr_str);
+    //Add the address range to the global ban list if it doesn't already exist
+    ip_trie_insert(&banned_ips, &range, NULL);
+    printf("Target \"%s\" has been IP banned (%s).\n", target_name, format_ip_prefix(&range, range_str));
 
-    //Drop every user currently connect with the banned IP address
-    HASH_ITER(hh, active_connections, curr, tmp)
+    //Drop every connection from inside the banned range
+    socketfds = connections_in_range(&range, &count);
+    for(i=0; i<count; i++)
     {
-        if(curr->sockaddr.sin_addr.s_addr == target_ipaddr)
-            disconnect_client(curr, "IP Banned");
+        HASH_FIND_INT(active_connections, &socketfds[i], c);
+        if(c)
+        {
+            disconnect_client(c, "IP Banned");
+            ++dropped;
+        }
     }
+    free(socketfds);
+
+    if(dropped)
+        printf("Dropped %u connections from %s.\n", dropped, range_str);
 }
 
 static void admin_drop_user(char *buffer)
@@ -349,6 +368,119 @@ static void admin_demote_user(char *buffer)
 }
 
 
+static void admin_transfer_limit(char *buffer)
+{
+    char target_name[USERNAME_LENG+1];
+    unsigned long rate = 0;
+
+    if(sscanf(buffer, "!xferlimit %s %lu", target_name, &rate) < 2)
+    {
+        printf("Usage: !xferlimit <user|*> <bytes_per_sec>\n");
+        return;
+    }
+
+    xfer_set_rate(plain_name(target_name), rate);
+}
+
+static void admin_transfer_weight(char *buffer)
+{
+    char target_name[USERNAME_LENG+1];
+    unsigned int weight = 0;
+
+    if(sscanf(buffer, "!xferweight %s %u", target_name, &weight) < 2)
+    {
+        printf("Usage: !xferweight <user> <weight>\n");
+        return;
+    }
+
+    xfer_set_weight(plain_name(target_name), weight);
+}
+
+static void admin_storage_quota(char *buffer)
+{
+    char target_name[USERNAME_LENG+1];
+    uint64_t quota = 0;
+
+    if(sscanf(buffer, "!storagequota %s %lu", target_name, &quota) < 2)
+    {
+        printf("Usage: !storagequota <group|*> <bytes>\n");
+        return;
+    }
+
+    storage_set_quota(plain_name(target_name), quota);
+}
+
+static void admin_file_ttl(char *buffer)
+{
+    char target_name[USERNAME_LENG+1];
+    unsigned int ttl = 0;
+
+    if(sscanf(buffer, "!filettl %s %u", target_name, &ttl) < 2)
+    {
+        printf("Usage: !filettl <group> <seconds>\n");
+        return;
+    }
+
+    storage_set_ttl(plain_name(target_name), ttl);
+}
+
+
+static void admin_connection_limit(char *buffer)
+{
+    char limit[16];
+    unsigned long value = 0, burst = 0;
+
+    if(sscanf(buffer, "!connlimit %15s %lu %lu", limit, &value, &burst) < 2)
+    {
+        printf("Usage: !connlimit <address|rate|unregistered> <limit> [burst]\n");
+        return;
+    }
+
+    admission_set_limit(limit, value, burst);
+}
+
+static void admin_flood_limit(char *buffer)
+{
+    char target[16];
+    unsigned long rate = 0, burst = 0;
+
+    if(sscanf(buffer, "!floodlimit %15s %lu %lu", target, &rate, &burst) < 2)
+    {
+        printf("Usage: !floodlimit <users|groups> <msgs_per_sec> [burst]\n");
+        return;
+    }
+
+    flood_set_limit(target, rate, burst);
+}
+
+static void admin_flood_penalty(char *buffer)
+{
+    char penalty[16];
+    unsigned int mute_seconds = 0;
+
+    if(sscanf(buffer, "!floodpenalty %15s %u", penalty, &mute_seconds) < 1)
+    {
+        printf("Usage: !floodpenalty <drop|delay|mute|disconnect> [mute_seconds]\n");
+        return;
+    }
+
+    flood_set_penalty(penalty, mute_seconds);
+}
+
+static void admin_heartbeat_limit(char *buffer)
+{
+    char limit[16];
+    unsigned int seconds = 0;
+
+    if(sscanf(buffer, "!heartbeatlimit %15s %u", limit, &seconds) < 2)
+    {
+        printf("Usage: !heartbeatlimit <idle|timeout|stall> <seconds>\n");
+        return;
+    }
+
+    heartbeat_set_limit(limit, seconds);
+}
+
 int handle_admin_commands(char *buffer)
 {
     char *new_msg;
@@ -377,6 +509,51 @@ int handle_admin_commands(char *buffer)
     else if(strncmp(buffer, "!demoteuser ", 12) == 0)
         admin_demote_user(buffer);
 
+    else if(strcmp(buffer, "!xferstats") == 0)
+        xfer_stats();
+
+    else if(strncmp(buffer, "!xferlimit ", 11) == 0)
+        admin_transfer_limit(buffer);
+
+    else if(strncmp(buffer, "!xferweight ", 12) == 0)
+        admin_transfer_weight(buffer);
+
+    else if(strcmp(buffer, "!storagestats") == 0)
+        storage_stats();
+
+    else if(strncmp(buffer, "!storagequota ", 14) == 0)
+        admin_storage_quota(buffer);
+
+    else if(strncmp(buffer, "!filettl ", 9) == 0)
+        admin_file_ttl(buffer);
+
+    else if(strcmp(buffer, "!connstats") == 0)
+        admission_stats();
+
+    else if(strncmp(buffer, "!connlimit ", 11) == 0)
+        admin_connection_limit(buffer);
+
+    else if(strcmp(buffer, "!floodstats") == 0)
+        flood_stats();
+
+    else if(strncmp(buffer, "!floodlimit ", 12) == 0)
+        admin_flood_limit(buffer);
+
+    else if(strncmp(buffer, "!floodpenalty ", 14) == 0)
+        admin_flood_penalty(buffer);
+
+    else if(strcmp(buffer, "!stats") == 0)
+        metrics_stats();
+
+    else if(strcmp(buffer, "!heartbeatstats") == 0)
+        heartbeat_stats();
+
+    else if(strncmp(buffer, "!heartbeatlimit ", 16) == 0)
+        admin_heartbeat_limit(buffer);
+
+    else if(strcmp(buffer, "!upgrade") == 0 || strncmp(buffer, "!upgrade ", 9) == 0)
+        upgrade_server(&buffer[8]);
+
     else
     {
         if(buffer[0] == '!')
@@ -5,10 +5,10 @@
 #include <sys/timerfd.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
 
 
-#define XFER_SENDER_EPOLL_EVENTS    (EPOLLRDHUP | EPOLLIN | EPOLLONESHOT)
-#define XFER_RECVER_EPOLL_EVENTS    (EPOLLRDHUP | EPOLLOUT | EPOLLONESHOT)
+FileXferArgs_Server *resumable_transfers = NULL;        //Dropped group uploads that can still be resumed (key = token)
 
 
 /******************************/
@@ -18,20 +18,54 @@
 //Defined in library/crc32/crc32.c
 extern unsigned int xcrc32 (const unsigned char *buf, int len, unsigned int init);
 
+static inline char* transfer_target_name(FileXferArgs_Server *args)
+{
+    if(args->target_type == GROUP_TARGET)
+        return args->target_group->groupname;
+
+    //The sender's half names every recipient
+    return (args->recipients)? args->recipients_name : args->target_user->username;
+}
+
+//Locates a user among the recipients of a client-client transfer (sender's half)
+static XferRecipient* find_recipient(FileXferArgs_Server *xferargs, char *username)
+{
+    unsigned int i;
+
+    for(i=0; i<xferargs->recipient_count; i++)
+        if(strcmp(xferargs->recipients[i].username, username) == 0)
+            return &xferargs->recipients[i];
+
+    return NULL;
+}
+
+//A one-to-many transfer matches both its whole recipient list, and each single recipient
+static inline int transfer_has_target(FileXferArgs_Server *xferargs, char *target_name)
+{
+    return strcmp(transfer_target_name(xferargs), target_name) == 0 || find_recipient(xferargs, target_name);
+}
+
 void print_server_xferargs(FileXferArgs_Server *args)
 {    
-    printf("Me: \"%s\" (fd=%d), Target: \"%s\", OP: %s, Filename: \"%s\", Filesize: %zu, Checksum: %x, Transferred: %zu, Token: %s\n", 
-            args->myself->username, args->xfer_socketfd, args->target_user->username, (args->operation == SENDING_OP)? "Send":"Recv", args->filename, args->filesize, args->checksum, args->transferred, args->token);
+    printf("Me: \"%s\" (streams: %u/%u), Target: \"%s\", OP: %s, Filename: \"%s\", Filesize: %zu, Checksum: %x, Transferred: %zu, Token: %s\n", 
+            args->myself->username, args->streams_connected, args->stream_count, transfer_target_name(args), (args->operation == SENDING_OP)? "Send":"Recv", args->filename, args->filesize, args->checksum, args->transferred, args->token);
 }
 
 void generate_token(char* dest, size_t bytes)
 {
     const unsigned int smallest_val = '0', largest_val = 'z';
     unsigned int val, count = 0;
+    static int seeded = 0;
     time_t t;
     
-    srand((unsigned) time(&t));
+    //Only seed once. Reseeding with the same second would hand out identical tokens to concurrent transfers
+    if(!seeded)
+    {
+        srand((unsigned) time(&t) ^ getpid());
+        seeded = 1;
+    }
 
+    dest[bytes] = '\0';
     while(count < bytes)
     {
         val = rand() % (largest_val + 1 - smallest_val) + smallest_val;
@@ -42,6 +76,303 @@ void generate_token(char* dest, size_t bytes)
     }
 }
 
+static FileXferArgs_Server* find_resumable_transfer(char *token)
+{
+    FileXferArgs_Server *xferargs;
+
+    HASH_FIND_STR(resumable_transfers, token, xferargs);
+    return xferargs;
+}
+
+static int token_used_by_recipients(char *token, XferRecipient *recipients, unsigned int recipient_count)
+{
+    User *recipient;
+    unsigned int i;
+
+    for(i=0; i<recipient_count; i++)
+    {
+        HASH_FIND_STR(active_users, recipients[i].username, recipient);
+        if(recipient && find_transfer(recipient->c, token))
+            return 1;
+    }
+
+    return 0;
+}
+
+//Generates a token that is not already used by any side of a new transfer
+static void generate_transfer_token(char* dest, Client *owner, XferRecipient *recipients, unsigned int recipient_count)
+{
+    do
+        generate_token(dest, TRANSFER_TOKEN_SIZE);
+    while(find_transfer(owner, dest) || token_used_by_recipients(dest, recipients, recipient_count) || find_resumable_transfer(dest));
+}
+
+FileXferArgs_Server* find_transfer(Client *c, char *token)
+{
+    FileXferArgs_Server *xferargs = NULL;
+
+    if(c && token)
+        HASH_FIND_STR(c->file_transfers, token, xferargs);
+    return xferargs;
+}
+
+//Splits a transfer into its byte ranges. Each range is served by its own transfer connection.
+//The count asked for is only an upper bound: small files are never split into ranges below XFER_MIN_STREAM_SIZE
+static void allocate_transfer_streams(FileXferArgs_Server *xferargs, unsigned int stream_count)
+{
+    unsigned int i;
+
+    if(stream_count < 1)
+        stream_count = 1;
+    stream_count = xfer_stream_count(xferargs->filesize, stream_count);
+
+    xferargs->stream_count = stream_count;
+    xferargs->streams_connected = 0;
+    xferargs->streams = calloc(stream_count, sizeof(XferStream_Server));
+
+    for(i=0; i<stream_count; i++)
+    {
+        xfer_stream_range(xferargs->filesize, stream_count, i, &xferargs->streams[i].offset, &xferargs->streams[i].length);
+        xferargs->streams[i].crc = CRC_INIT;
+        xferargs->streams[i].window = RELAY_WINDOW_INITIAL;
+    }
+}
+
+static inline unsigned int xfer_frame_count(size_t filesize)
+{
+    return (filesize + XFER_FRAME_BLOCK - 1) / XFER_FRAME_BLOCK;
+}
+
+//Compressed group uploads store every frame they receive, so their blob can keep them (see BLOB_STORE_FRAMES). Storing them is optional, and never fails the upload
+static void open_upload_frames(FileXferArgs_Server *xferargs)
+{
+    char frames_file[MAX_FILE_PATH+sizeof(BLOB_FRAMES_SUFFIX)];
+
+    if(!BLOB_STORE_FRAMES || !xferargs->codec || xferargs->filesize == 0)
+        return;
+
+    sprintf(frames_file, "%s%s", xferargs->target_file, BLOB_FRAMES_SUFFIX);
+    xferargs->frames_fd = open(frames_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(xferargs->frames_fd < 0)
+    {
+        perror("Failed to create file for compressed frames. The upload is stored uncompressed.");
+        xferargs->frames_fd = 0;
+        return;
+    }
+
+    xferargs->frames = calloc(xfer_frame_count(xferargs->filesize), sizeof(StoredFrame));
+}
+
+//Closes a GET's stored frames, or deletes an upload's unless its blob has taken them over
+static void close_transfer_frames(FileXferArgs_Server *xferargs)
+{
+    char frames_file[MAX_FILE_PATH+sizeof(BLOB_FRAMES_SUFFIX)];
+
+    if(xferargs->frames_fd > 0)
+        close(xferargs->frames_fd);
+    xferargs->frames_fd = 0;
+
+    if(!xferargs->frames)
+        return;
+
+    sprintf(frames_file, "%s%s", xferargs->target_file, BLOB_FRAMES_SUFFIX);
+    if(remove(frames_file) < 0)
+        perror("Failed to delete compressed frames.");
+
+    free(xferargs->frames);
+    xferargs->frames = NULL;
+}
+
+static void free_transfer_streams(FileXferArgs_Server *xferargs)
+{
+    unsigned int i;
+
+    if(!xferargs->streams)
+        return;
+
+    //Return any pieces that were never forwarded to the pool
+    for(i=0; i<xferargs->stream_count; i++)
+    {
+        relay_chunks_release(&xferargs->streams[i].pieces);
+        free_chunk_resends(&xferargs->streams[i].resends);
+        free_xfer_frame(&xferargs->streams[i].frame);
+    }
+
+    free(xferargs->streams);
+    xferargs->streams = NULL;
+
+    //Along with the state of the chunks moved by them. A stored upload's chunk checksums are kept by its blob instead
+    free(xferargs->chunk_crcs);
+    free(xferargs->chunks);
+    xferargs->chunk_crcs = NULL;
+    xferargs->chunks = NULL;
+
+    close_transfer_frames(xferargs);
+}
+
+//Sends the checksums of a group file's chunks, from chunk "first" up to "count", to a user downloading it
+static void send_chunk_checksums(Client *c, char *token, unsigned int *chunk_crcs, unsigned int first, unsigned int count)
+{
+    char chunks_msg[MAX_MSG_LENG+1];
+
+    while(first < count)
+    {
+        first += format_chunk_checksums(chunks_msg, token, chunk_crcs, first, count);
+        send_msg(c, chunks_msg, strlen(chunks_msg)+1);
+    }
+}
+
+//Asks the uploader for a chunk of a group upload again, which follows on the stream that moves it. Runs on the chat thread, with the transfer's thread lock held.
+//The chat thread is the only one adding resends, so the uploader is asked for them in the order they are expected
+static void request_chunk_resend(FileXferArgs_Server *xferargs, unsigned int chunk)
+{
+    XferStream_Server *stream = &xferargs->streams[xfer_chunk_stream(xferargs->filesize, xferargs->stream_count, chunk)];
+    char rechunk_msg[MAX_MSG_LENG+1];
+    ChunkResend *resend;
+
+    LL_FOREACH(stream->resends, resend)
+        if(resend->chunk == chunk)
+            return;
+
+    append_chunk_resend(&stream->resends, chunk);
+
+    printf("Asking \"%s\" for chunk %u of \"%s\" again (token: %s).\n", xferargs->myself->username, chunk, xferargs->filename, xferargs->token);
+    sprintf(rechunk_msg, "!rechunk=%s,chunk=%u", xferargs->token, chunk);
+    send_msg(xferargs->myself->c, rechunk_msg, strlen(rechunk_msg)+1);
+}
+
+//Checks a whole received chunk of a group upload against its checksum. A damaged chunk is marked to be received again.
+//Returns 0 if the chunk has failed too many times. Runs with the transfer's thread lock held
+static int check_upload_chunk(FileXferArgs_Server *xferargs, unsigned int chunk)
+{
+    XferChunk *received = &xferargs->chunks[chunk];
+
+    if(received->crc == xferargs->chunk_crcs[chunk])
+    {
+        received->status = CHUNK_VERIFIED;
+        return 1;
+    }
+
+    printf("Chunk %u of \"%s\" (token: %s) failed its check.\n", chunk, xferargs->filename, xferargs->token);
+    if(++received->retries > XFER_CHUNK_RETRIES)
+        return 0;
+
+    received->status = CHUNK_FAILED;
+    ++xferargs->chunks_failed;
+    return 1;
+}
+
+//Returns the oldest pieces of a relayed stream to the pool, once every recipient has forwarded them
+static void release_forwarded_pieces(XferStream_Server *stream)
+{
+    RelayChunk *piece;
+
+    while(stream->pieces && stream->pieces->pending == 0)
+    {
+        piece = stream->pieces;
+        LL_DELETE(stream->pieces, piece);
+        --stream->pieces_queued;
+        relay_chunk_release(piece);
+    }
+}
+
+//Closes every remaining stream connection of a transfer
+static void close_transfer_streams(FileXferArgs_Server *xferargs)
+{
+    Client *stream_connection;
+    unsigned int i;
+
+    for(i=0; xferargs->streams && i<xferargs->stream_count; i++)
+    {
+        if(!xferargs->streams[i].socketfd)
+            continue;
+
+        HASH_FIND_INT(active_connections, &xferargs->streams[i].socketfd, stream_connection);
+        xferargs->streams[i].socketfd = 0;
+
+        //Detach the connection first, so closing it does not cleanup this transfer again
+        if(stream_connection && stream_connection->xferargs == xferargs)
+        {
+            stream_connection->xferargs = NULL;
+            disconnect_client(stream_connection, NULL);
+        }
+    }
+
+    xferargs->streams_connected = 0;
+}
+
+static int attach_transfer_stream_locked(FileXferArgs_Server *xferargs, unsigned int index, size_t offset, size_t length)
+{
+    XferStream_Server *stream;
+    unsigned int chunk;
+    int restart;
+
+    if(!xferargs->streams || index >= xferargs->stream_count)
+    {
+        printf("Transfer \"%s\" has no stream %u.\n", xferargs->token, index);
+        return 0;
+    }
+
+    //Each stream may only have one transfer connection
+    stream = &xferargs->streams[index];
+    if(stream->socketfd)
+    {
+        printf("Stream %u of transfer \"%s\" is already connected.\n", index, xferargs->token);
+        return 0;
+    }
+
+    //The connection must continue the range from its received prefix, or restart the range from its beginning
+    restart = (offset == stream->offset && length == stream->length);
+    if(restart)
+    {
+        xferargs->transferred -= stream->transferred;
+        stream->transferred = 0;
+        stream->crc = CRC_INIT;
+    }
+    else if(offset != stream->offset + stream->transferred || length != stream->length - stream->transferred)
+    {
+        printf("Stream %u of transfer \"%s\" has a mismatched range.\n", index, xferargs->token);
+        return 0;
+    }
+
+    //Chunks asked for again on the stream's previous connection are asked for on this one. A restarted range has them all received again anyway
+    free_chunk_resends(&stream->resends);
+    stream->resent = 0;
+
+    for(chunk = stream->offset / XFER_CHUNK_SIZE; xferargs->chunks && chunk < xfer_chunk_count(stream->offset + stream->length); chunk++)
+    {
+        if(xferargs->chunks[chunk].status != CHUNK_FAILED)
+            continue;
+
+        if(restart)
+        {
+            xferargs->chunks[chunk].status = CHUNK_MISSING;
+            --xferargs->chunks_failed;
+        }
+        else
+            request_chunk_resend(xferargs, chunk);
+    }
+
+    stream->socketfd = current_client->socketfd;
+    ++xferargs->streams_connected;
+
+    current_client->xfer_stream = index;
+    return 1;
+}
+
+//Attaches the current (newly registered) transfer connection to one stream of its transfer
+static int attach_transfer_stream(FileXferArgs_Server *xferargs, unsigned int index, size_t offset, size_t length)
+{
+    int attached;
+
+    //The transfer's other streams may be moving data on a transfer thread right now
+    xfer_thread_lock_transfer(xferargs);
+    attached = attach_transfer_stream_locked(xferargs, index, offset, length);
+    xfer_thread_unlock_transfer(xferargs);
+
+    return attached;
+}
+
 
 static int validate_transfer_user (FileXferArgs_Server *request, char* username, char* target_username, XferTarget* requester_ret)
 {
@@ -69,15 +400,14 @@ static int validate_transfer_user (FileXferArgs_Server *request, char* username,
         }   
 
         //Match the information in the target user's transfer args with this request
-        xferargs = request_user->c->file_transfers;
+        xferargs = find_transfer(request_user->c, request->token);
         if(xferargs && xferargs->operation == request->operation)
             if(strcmp(xferargs->token, request->token) == 0)
-                if(strcmp(xferargs->target_user->username, target_username) == 0)
+                if(transfer_has_target(xferargs, target_username))
                     if(strcmp(xferargs->filename, request->filename) == 0)
                         if(xferargs->filesize == request->filesize)
                             if(xferargs->checksum == request->checksum)
-                                if(xferargs->transferred == 0)
-                                    matches = 1;
+                                matches = 1;
     }
     else if(request_group)
     {
@@ -125,6 +455,14 @@ static int validate_transfer(FileXferArgs_Server *request, char* request_usernam
     if(!retval)
         return 0;
 
+    //A one-to-many sender registers with its whole recipient list, which has no single transfer args to match against
+    if(request->operation == SENDING_OP && strstr(target_username, XFER_RECIPIENT_SEPARATOR))
+    {
+        target_ret->target_type = USER_TARGET;
+        target_ret->user = NULL;
+        return 1;
+    }
+
     /*Validate against transfer target*/
     retval = validate_transfer_target(request, request_username, target_username, target_ret);
     if(!retval)
@@ -139,13 +477,252 @@ static int validate_transfer(FileXferArgs_Server *request, char* request_usernam
 /*        Disconnection       */
 /******************************/ 
 
+//Lets the downloads following a group upload know how it ended. From now on they read the rest of the file on their own
+static void release_upload_tails(FileXferArgs_Server *xferargs, int verified)
+{
+    FileXferArgs_Server *tail, *tmp;
+    char status_msg[MAX_MSG_LENG+1];
+
+    LL_FOREACH_SAFE2(xferargs->tails, tail, tmp, next_tail)
+    {
+        LL_DELETE2(xferargs->tails, tail, next_tail);
+
+        //The download may be sending on the upload's transfer thread right now
+        xfer_thread_lock_transfer(xferargs);
+        tail->upload = NULL;
+        xfer_thread_unlock_transfer(xferargs);
+
+        sprintf(status_msg, "!uploadstatus=%s,token=%s,crc=%x,status=%s", tail->filename, tail->token, tail->checksum, (verified)? "Verified":"Failed");
+        send_msg(tail->myself->c, status_msg, strlen(status_msg)+1);
+
+        if(!verified)
+            cancel_transfer_direct(tail->myself->c, tail);
+    }
+}
+
+//A group upload ended without being stored. Unlists its file, and cancels the downloads following it
+static void abandon_group_upload(FileXferArgs_Server *xferargs)
+{
+    remove_uploading_file(xferargs->target_group, xferargs->fileid);
+    release_upload_tails(xferargs, 0);
+}
+
+//A download stops following the upload it started early on
+static void detach_upload_tail(FileXferArgs_Server *xferargs)
+{
+    if(!xferargs->upload)
+        return;
+
+    LL_DELETE2(xferargs->upload->tails, xferargs, next_tail);
+    xferargs->upload = NULL;
+}
+
+//Detaches a dropped group upload from its uploader, and keeps its received ranges for XFER_RESUME_PERIOD
+static int suspend_group_upload(FileXferArgs_Server *xferargs)
+{
+    //Make the received prefix of every range durable before offering to resume from it
+    if(fflush(xferargs->file_fp) != 0 || fsync(fileno(xferargs->file_fp)) < 0)
+    {
+        perror("Failed to flush partially uploaded file.");
+        return 0;
+    }
+
+    xferargs->timeout = calloc(1, sizeof(TimerEvent));
+    xferargs->timeout->event_type = EXPIRING_RESUMABLE_XFER;
+    xferargs->timeout->xferargs = xferargs;
+    xferargs->timeout->timerfd = create_timerfd(XFER_RESUME_PERIOD, 0, timers_epollfd);
+    if(!xferargs->timeout->timerfd)
+    {
+        free(xferargs->timeout);
+        xferargs->timeout = NULL;
+        return 0;
+    }
+    HASH_ADD_INT(timers, timerfd, xferargs->timeout);
+
+    //The uploader may reconnect as a new client. Only remember its name
+    strcpy(xferargs->owner_name, xferargs->myself->username);
+    xferargs->myself = NULL;
+    HASH_ADD_STR(resumable_transfers, token, xferargs);
+
+    printf("Suspended upload of \"%s\" to group \"%s\" at %zu/%zu bytes. It can be resumed by \"%s\" for %d seconds (token: %s).\n",
+            xferargs->filename, xferargs->target_group->groupname, xferargs->transferred, xferargs->filesize, xferargs->owner_name, XFER_RESUME_PERIOD, xferargs->token);
+
+    return 1;
+}
+
+//Deletes a suspended upload and its partially uploaded file
+static void discard_suspended_upload(FileXferArgs_Server *xferargs)
+{
+    HASH_DEL(resumable_transfers, xferargs);
+
+    if(xferargs->timeout)
+        cleanup_timer_event(xferargs->timeout);
+
+    fclose(xferargs->file_fp);
+    if(remove(xferargs->target_file) < 0)
+        perror("Failed to delete file.");
+
+    abandon_group_upload(xferargs);
+    free_transfer_streams(xferargs);
+    free(xferargs);
+}
+
+void resumable_transfer_expired(TimerEvent *event)
+{
+    FileXferArgs_Server *xferargs = event->xferargs;
+
+    printf("Suspended upload of \"%s\" by \"%s\" (token: %s) was not resumed in time. Discarding...\n", 
+            xferargs->filename, xferargs->owner_name, xferargs->token);
+    discard_suspended_upload(xferargs);
+}
+
+//Finds an upload or download of the group's files, owned by any user
+static FileXferArgs_Server* find_group_transfer(Group *group)
+{
+    User *user, *tmp_user;
+    FileXferArgs_Server *curr, *tmp;
+
+    HASH_ITER(hh, active_users, user, tmp_user)
+    {
+        HASH_ITER(hh, user->c->file_transfers, curr, tmp)
+        {
+            if(curr->target_type == GROUP_TARGET && curr->target_group == group)
+                return curr;
+        }
+    }
+
+    return NULL;
+}
+
+//Cancels every transfer to or from a group that is being removed, including suspended uploads, which can no longer be resumed
+void cancel_group_transfers(Group *group)
+{
+    char cancel_msg[MAX_MSG_LENG+1];
+    FileXferArgs_Server *curr, *tmp;
+    Client *owner;
+
+    //Cancelling an upload also cancels the downloads following it, which may be anyone's. So look again after each one
+    while((curr = find_group_transfer(group)))
+    {
+        printf("Cancelling transfer of \"%s\" for \"%s\", as group \"%s\" is removed (token: %s).\n",
+                curr->filename, curr->myself->username, group->groupname, curr->token);
+        sprintf(cancel_msg, "!cancelfile=%s,reason=%s,token=%s", group->groupname, "GroupRemoved", curr->token);
+        owner = curr->myself->c;
+
+        //Tell the owner before its transfer connections close. Failing to disconnects it, which already cancels the transfer
+        if((int)send_msg(owner, cancel_msg, strlen(cancel_msg)+1) < 0)
+            continue;
+        cancel_transfer_direct(owner, curr);
+    }
+
+    //Live uploads with received ranges were suspended as they were cancelled
+    HASH_ITER(hh, resumable_transfers, curr, tmp)
+    {
+        if(curr->target_group == group)
+            discard_suspended_upload(curr);
+    }
+}
+
+
+//Sends a message to the recipients of a client-client transfer that are still waiting for (or receiving) the file
+static void notify_recipients(FileXferArgs_Server *xferargs, char *msg, int pending_only)
+{
+    User *recipient;
+    unsigned int i;
+
+    for(i=0; i<xferargs->recipient_count; i++)
+    {
+        if(xferargs->recipients[i].answered && (pending_only || !xferargs->recipients[i].xferargs))
+            continue;
+
+        HASH_FIND_STR(active_users, xferargs->recipients[i].username, recipient);
+        if(recipient)
+            send_msg(recipient->c, msg, strlen(msg)+1);
+    }
+}
+
+//Removes a recipient's half from its sender's transfer. The other recipients keep receiving
+static void detach_recipient(FileXferArgs_Server *xferargs)
+{
+    FileXferArgs_Server *sender_xferargs = xferargs->peer;
+    XferRecipient *recipient;
+    RelayChunk *piece;
+    unsigned int i;
+
+    if(!sender_xferargs)
+        return;
+    xferargs->peer = NULL;
+
+    //The sender's streams may still be relaying to the other recipients on a transfer thread
+    xfer_thread_lock_transfer(sender_xferargs);
+
+    //Pieces this recipient hasn't forwarded yet no longer wait for it
+    for(i=0; sender_xferargs->streams && xferargs->streams && i<sender_xferargs->stream_count; i++)
+    {
+        LL_FOREACH(sender_xferargs->streams[i].pieces, piece)
+            if(piece->offset + piece->size > xferargs->streams[i].transferred && piece->pending > 0)
+                --piece->pending;
+
+        release_forwarded_pieces(&sender_xferargs->streams[i]);
+    }
+
+    if(sender_xferargs->recipients_receiving > 0)
+        --sender_xferargs->recipients_receiving;
+
+    xfer_thread_unlock_transfer(sender_xferargs);
+
+    recipient = find_recipient(sender_xferargs, xferargs->myself->username);
+    if(recipient)
+        recipient->xferargs = NULL;
+
+    //The sender's half cannot continue without anyone left to send to
+    if(!sender_xferargs->recipients_receiving && !sender_xferargs->recipients_pending)
+        cancel_transfer_direct(sender_xferargs->myself->c, sender_xferargs);
+}
+
+//Unlinks one half of a client-client transfer from the rest of it, before it is freed
+static void unlink_user_transfer(FileXferArgs_Server *xferargs)
+{
+    FileXferArgs_Server *recipient_xferargs;
+    unsigned int i;
+
+    if(xferargs->operation == RECVING_OP)
+    {
+        detach_recipient(xferargs);
+        return;
+    }
+
+    //The recipients cannot continue without the sender's half. Close their transfer connections (or pending transfers) as well
+    for(i=0; i<xferargs->recipient_count; i++)
+    {
+        recipient_xferargs = xferargs->recipients[i].xferargs;
+        xferargs->recipients[i].xferargs = NULL;
+
+        if(recipient_xferargs)
+        {
+            recipient_xferargs->peer = NULL;
+            cancel_transfer_direct(recipient_xferargs->myself->c, recipient_xferargs);
+        }
+    }
+
+    if(xferargs->spool_fd > 0)
+    {
+        close(xferargs->spool_fd);
+        if(remove(xferargs->target_file) < 0)
+            perror("Failed to delete spool file.");
+    }
+
+    free(xferargs->recipients);
+    xferargs->recipients = NULL;
+    xferargs->recipient_count = 0;
+}
+
+
 //Client "c" MUST be a transfer connection!
 void cleanup_transfer_connection(Client *c)
 {
-    FileXferArgs_Server *xferargs = c->file_transfers;
-    FileXferArgs_Server *target_xferargs;
-
-    Client *target_xfer_connection;
+    FileXferArgs_Server *xferargs = c->xferargs;
+    Client *owner;
 
     if(c->connection_type != TRANSFER_CONNECTION)
     {
@@ -153,6 +730,11 @@ void cleanup_transfer_connection(Client *c)
         return;
     }
 
+    //Take the connection, and the rest of its transfer, back from the transfer threads before tearing anything down
+    xfer_thread_reclaim(c);
+    if(xferargs)
+        xfer_thread_reclaim_transfer(xferargs);
+
     //Check if the transfer connection has been terminated already (usually when the user quits while transferring files)
     if(!xferargs)
     {
@@ -160,16 +742,28 @@ void cleanup_transfer_connection(Client *c)
         return;
     }
 
-    printf("Closing transfer connection (%s) for \"%s\"...\n", 
-            (xferargs->operation == SENDING_OP)? "SEND":"RECV", xferargs->myself->username);
+    printf("Closing transfer connection (%s, stream %u) for \"%s\" (token: %s)...\n", 
+            (xferargs->operation == SENDING_OP)? "SEND":"RECV", c->xfer_stream, xferargs->myself->username, xferargs->token);
+
+    if(xferargs->timeout)
+        cleanup_timer_event(xferargs->timeout);
     
-    //Also remove the transfer args at my main connection, if this is a client-client file transfer
-    xferargs->myself->c->file_transfers = NULL;                 
+    //Detach the transfer from this connection, and remove it from the user's transfer table
+    owner = xferargs->myself->c;
+    c->xferargs = NULL;
+    HASH_DEL(owner->file_transfers, xferargs);
     
     kill_connection(&c->socketfd);
-    
-    if(xferargs->piece_buffer)
-        free(xferargs->piece_buffer);
+    if(xferargs->streams)
+        xferargs->streams[c->xfer_stream].socketfd = 0;
+
+    //The transfer cannot continue with missing ranges. Close its other streams as well
+    close_transfer_streams(xferargs);
+
+    //Keep a dropped group upload around, so the uploader can resume it later
+    if(xferargs->target_type == GROUP_TARGET && xferargs->operation == SENDING_OP && xferargs->resumable && xferargs->transferred < xferargs->filesize)
+        if(suspend_group_upload(xferargs))
+            return;
 
     if(xferargs->file_fp)
         fclose(xferargs->file_fp);
@@ -177,41 +771,99 @@ void cleanup_transfer_connection(Client *c)
     //Cleanup for group transfers
     if(xferargs->target_type == GROUP_TARGET)
     {
+        free_transfer_streams(xferargs);
+
         //Delete the local file if the previous PUT operation failed
-        if(xferargs->operation == SENDING_OP && xferargs->transferred < xferargs->filesize)
+        if(xferargs->operation == SENDING_OP && (xferargs->transferred < xferargs->filesize || xferargs->chunks_failed))
         {
             if(remove(xferargs->target_file) < 0)
                 perror("Failed to delete file.");
         }
 
+        //Unlist a PUT operation's file unless it was stored
+        if(xferargs->operation == SENDING_OP)
+            abandon_group_upload(xferargs);
+
+        //Release the stored file's mapping used by a GET operation
+        if(xferargs->operation == RECVING_OP && xferargs->blob)
+            unmap_blob(xferargs->blob);
+        detach_upload_tail(xferargs);
+
         free(xferargs);
-        c->file_transfers = NULL;
         return;
     }
 
 
     /*Cleanup for client-client transfers*/
 
-    target_xferargs = xferargs->target_user->c->file_transfers;
+    //The recipient's received prefix is needed to unlink it from the sender's pieces, so free the streams afterwards
+    unlink_user_transfer(xferargs);
+    free_transfer_streams(xferargs);
     free(xferargs);
-    c->file_transfers = NULL;
+}
+
+//Cancels a single pending or ongoing transfer owned by the user connection "owner"
+void cancel_transfer_direct(Client *owner, FileXferArgs_Server *xferargs)
+{
+    Client *xfer_connection;
+    unsigned int i;
 
-    //Close the target's transfer connection if it's still open
-    if(target_xferargs && fcntl(target_xferargs->xfer_socketfd, F_GETFD) != -1)
+    xfer_thread_reclaim_transfer(xferargs);
+
+    //If the transfer already has transfer connections, closing any of them will cleanup the transfer
+    for(i=0; xferargs->streams_connected && i<xferargs->stream_count; i++)
     {
-        HASH_FIND_INT(active_connections, &target_xferargs->xfer_socketfd, target_xfer_connection);
+        if(!xferargs->streams[i].socketfd)
+            continue;
 
-        if(target_xfer_connection)
-            cleanup_transfer_connection(target_xfer_connection);
-        else
-            printf("Did not find target transfer connection!\n");
+        HASH_FIND_INT(active_connections, &xferargs->streams[i].socketfd, xfer_connection);
+        if(xfer_connection && xfer_connection->xferargs == xferargs)
+        {
+            printf("Disconnecting ongoing transfer connections for user %s (token: %s).\n", owner->user->username, xferargs->token);
+            disconnect_client(xfer_connection, "Cancelled");
+            return;
+        }
+
+        printf("Cannot find user \"%s\"'s transfer socket.\n ", owner->user->username);
     }
+
+    //The transfer is still pending, and has no transfer connection yet
+    HASH_DEL(owner->file_transfers, xferargs);
+
+    if(xferargs->timeout)
+        cleanup_timer_event(xferargs->timeout);
+    xferargs->timeout = NULL;
+
+    //A resumed upload that hasn't reconnected yet is suspended again, rather than losing its received ranges
+    if(xferargs->target_type == GROUP_TARGET && xferargs->operation == SENDING_OP && xferargs->resumable && xferargs->transferred > 0)
+        if(suspend_group_upload(xferargs))
+            return;
+
+    if(xferargs->file_fp)
+        fclose(xferargs->file_fp);
+
+    //Remove the empty file created for a pending PUT operation
+    if(xferargs->target_type == GROUP_TARGET && xferargs->operation == SENDING_OP)
+    {
+        remove(xferargs->target_file);
+        abandon_group_upload(xferargs);
+    }
+    
+    if(xferargs->target_type == GROUP_TARGET && xferargs->operation == RECVING_OP && xferargs->blob)
+        unmap_blob(xferargs->blob);
+    detach_upload_tail(xferargs);
+
+    if(xferargs->target_type == USER_TARGET)
+        unlink_user_transfer(xferargs);
+
+    free_transfer_streams(xferargs);
+    free(xferargs);
 }
 
-//Client "c" MUST be a USER connection!
+//Client "c" MUST be a USER connection! Cancels every transfer the user is involved with
 void cancel_user_transfer(Client *c)
 {
-    Client *xfer_connection;
+    FileXferArgs_Server *curr;
 
     if(!c->file_transfers)
     {
@@ -219,48 +871,104 @@ void cancel_user_transfer(Client *c)
         return;
     }
 
-    //If the client already has an ongoing file transfer in progress, close the connection
-    if(c->file_transfers->xfer_socketfd)
+    //Cancelling a transfer may also remove other entries from this table (its peer), so always restart from the head
+    while(c->file_transfers)
     {
-        HASH_FIND_INT(active_connections, &c->file_transfers->xfer_socketfd, xfer_connection);
-        if(xfer_connection)
-        {
-            printf("Disconnecting ongoing transfer connection for user %s.\n", c->user->username);
-            cleanup_transfer_connection(xfer_connection);
-            c->file_transfers = NULL;
-            return;
-        }
-
-        printf("Cannot find user \"%s\"'s transfer socket.\n ", c->user->username);
+        curr = c->file_transfers;
+        cancel_transfer_direct(c, curr);
     }
+}
 
 
-    //If the client only has pending transfer invites
-    if(c->file_transfers->timeout)
-        cleanup_timer_event(c->file_transfers->timeout);
-        
+//Slower recipients of a one-to-many transfer read the pieces they fell behind on back from here
+static int open_transfer_spool(FileXferArgs_Server *xferargs)
+{
+    int retval;
+
+    retval = mkdir(XFER_SPOOL_ROOT, LOCAL_FOLDER_PERMISSION);
+    if(retval < 0 && errno != EEXIST)
+    {
+        perror("Failed to create directory for transfer spools.");
+        return 0;
+    }
+
+    sprintf(xferargs->target_file, "%s/%s", XFER_SPOOL_ROOT, xferargs->token);
+    xferargs->spool_fd = open(xferargs->target_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(xferargs->spool_fd < 0)
+    {
+        perror("Failed to create transfer spool file.");
+        xferargs->spool_fd = 0;
+        return 0;
+    }
 
-    free(c->file_transfers);
-    c->file_transfers = NULL;
+    return 1;
 }
 
+//Every recipient has answered the invite. Starts the transfer if anyone accepted it, or cancels it otherwise
+static void recipients_answered(FileXferArgs_Server *xferargs, char *reason)
+{
+    char answer_msg[MAX_MSG_LENG+1];
+    Client *owner = xferargs->myself->c;
+
+    if(xferargs->recipients_pending > 0)
+        return;
+
+    if(!xferargs->recipients_receiving)
+    {
+        sprintf(answer_msg, "!rejectfile=%s,reason=%s,token=%s", xferargs->recipients_name, reason, xferargs->token);
+        send_msg(owner, answer_msg, strlen(answer_msg)+1);
+
+        cancel_transfer_direct(owner, xferargs);
+        return;
+    }
+
+    //Cancel the timeout timer on the sender side
+    if(xferargs->timeout)
+        cleanup_timer_event(xferargs->timeout);
+    xferargs->timeout = NULL;
+
+    //The file is received from the sender only once. Without a spool, the slowest recipient paces the others
+    allocate_transfer_streams(xferargs, xferargs->stream_count);
+    if(xferargs->recipient_count > 1 && !open_transfer_spool(xferargs))
+        printf("Transfer \"%s\" continues without a spool.\n", xferargs->token);
+
+    //Let the sender start sending
+    sprintf(answer_msg, "!acceptfile=%s,size=%zu,crc=%x,target=%s,token=%s,streams=%u", 
+            xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->recipients_name, xferargs->token, xferargs->stream_count);
+    send_msg(owner, answer_msg, strlen(answer_msg)+1);
+}
 
-void transfer_invite_expired(Client *c)
+void transfer_invite_expired(TimerEvent *event)
 {
     char expire_msg[MAX_MSG_LENG+1];
+    FileXferArgs_Server *xferargs = event->xferargs;
+    Client *c = event->c;
+    unsigned int i;
     
-    if(!c->file_transfers)
+    if(!xferargs)
         return;
-    
-    //Notify the sender of file expiry
-    sprintf(expire_msg, "!rejectfile=%s,reason=%s", c->file_transfers->target_user->username, "Expired");
-    send_msg(c, expire_msg, strlen(expire_msg)+1);
 
-    //Notify the receiver of file expiry
-    sprintf(expire_msg, "!cancelfile=%s,reason=%s", c->user->username, "Expired");
-    send_msg(c->file_transfers->target_user->c, expire_msg, strlen(expire_msg)+1);
+    //Notify the recipients that haven't answered of file expiry
+    sprintf(expire_msg, "!cancelfile=%s,reason=%s,token=%s", c->user->username, "Expired", xferargs->token);
+    notify_recipients(xferargs, expire_msg, 1);
 
-    cancel_user_transfer(c);
+    for(i=0; i<xferargs->recipient_count; i++)
+    {
+        if(xferargs->recipients[i].answered)
+            continue;
+        xferargs->recipients[i].answered = 1;
+
+        //Let the sender of a one-to-many transfer know who missed out. The others may still receive the file
+        if(xferargs->recipient_count > 1)
+        {
+            sprintf(expire_msg, "!rejectfile=%s,reason=%s,token=%s", xferargs->recipients[i].username, "Expired", xferargs->token);
+            send_msg(c, expire_msg, strlen(expire_msg)+1);
+        }
+    }
+    xferargs->recipients_pending = 0;
+
+    //The sender is notified of file expiry if nobody accepted it
+    recipients_answered(xferargs, "Expired");
 }
 
 
@@ -274,9 +982,11 @@ void transfer_invite_expired(Client *c)
 int register_send_transfer_connection()
 {
     char accept_msg[MAX_MSG_LENG+1];
-    char sender_name[USERNAME_LENG+1], recver_name[USERNAME_LENG+1];
+    char sender_name[USERNAME_LENG+1], recver_name[XFER_RECIPIENTS_LENG+1];
     XferTarget myself_ret, target_ret;
     FileXferArgs_Server request_args, *xferargs;
+    unsigned int stream_index = 0;
+    size_t stream_offset = 0, stream_length = 0;
 
     if(current_client->connection_type != UNREGISTERED_CONNECTION)
     {
@@ -289,8 +999,9 @@ int register_send_transfer_connection()
     printf("\"%s\"\n", buffer);
 
     
-    sscanf(buffer, "!xfersend=%[^,],size=%zu,crc=%x,sender=%[^,],recver=%[^,],token=%[^,]", 
-            request_args.filename, &request_args.filesize, &request_args.checksum, sender_name, recver_name, request_args.token);
+    sscanf(buffer, "!xfersend=%[^,],size=%zu,crc=%x,sender=%[^,],recver=%[^,],token=%[^,],stream=%u,offset=%zu,length=%zu", 
+            request_args.filename, &request_args.filesize, &request_args.checksum, sender_name, recver_name, request_args.token,
+            &stream_index, &stream_offset, &stream_length);
     
     request_args.operation = SENDING_OP;
 
@@ -312,12 +1023,17 @@ int register_send_transfer_connection()
         return 0;
     }
 
-    //Update my original FileXferArgs
-    xferargs =  myself_ret.user->c->file_transfers;
-    xferargs->myself =  myself_ret.user;
-    xferargs->xfer_socketfd =  current_client->socketfd;
+    //Update my original FileXferArgs. Each stream of a transfer may only have one transfer connection
+    xferargs = find_transfer(myself_ret.user->c, request_args.token);
     xferargs->operation = SENDING_OP;
-    xferargs->piece_buffer = malloc(XFER_BUFSIZE);
+    if(!attach_transfer_stream(xferargs, stream_index, stream_offset, stream_length))
+    {
+        send_direct(current_client->socketfd, "WrongInfo", 10);
+        disconnect_client(current_client, "Error");
+        return 0;
+    }
+
+    xferargs->myself =  myself_ret.user;
 
     if(target_ret.target_type == USER_TARGET)
     {
@@ -337,21 +1053,23 @@ int register_send_transfer_connection()
         return 0;
     }
 
-    current_client->connection_type = TRANSFER_CONNECTION;
-    current_client->file_transfers = xferargs;
+    set_connection_type(current_client, TRANSFER_CONNECTION);
+    current_client->xferargs = xferargs;
 
     sprintf(accept_msg, "Accepted");
     send_direct(current_client->socketfd, accept_msg, strlen(accept_msg)+1);
 
-    printf("Accepted SENDING transfer connection for file \"%s\" (%zu bytes, token: %s, checksum: %x), from \"%s\" to \"%s\".\n",
-            xferargs->filename, xferargs->filesize, xferargs->token, xferargs->checksum, sender_name, recver_name);
-
-    update_epoll_events(connections_epollfd, current_client->socketfd, XFER_SENDER_EPOLL_EVENTS);
+    printf("Accepted SENDING transfer connection (stream %u/%u, %zu bytes at offset %zu) for file \"%s\" (%zu bytes, token: %s, checksum: %x), from \"%s\" to \"%s\".\n",
+            stream_index+1, xferargs->stream_count, stream_length, stream_offset, xferargs->filename, xferargs->filesize, xferargs->token, xferargs->checksum, sender_name, recver_name);
 
     //Cancel the idle timer
     cleanup_timer_event(current_client->idle_timer);
     current_client->idle_timer = NULL;
 
+    //From here on, the connection is served by a transfer thread
+    heartbeat_track(current_client);
+    xfer_thread_handoff(current_client);
+
     return 0;
 }
 
@@ -360,6 +1078,8 @@ int register_recv_transfer_connection()
     char sender_name[USERNAME_LENG+1], recver_name[USERNAME_LENG+1];
     XferTarget myself_ret, target_ret;
     FileXferArgs_Server request_args, *xferargs;
+    unsigned int stream_index = 0;
+    size_t stream_offset = 0, stream_length = 0;
 
     if(current_client->connection_type != UNREGISTERED_CONNECTION)
     {
@@ -370,11 +1090,11 @@ int register_recv_transfer_connection()
 
     printf("Got a new transfer connection (RECV) request!\n");
 
-    request_args.xfer_socketfd = current_client->socketfd;
     request_args.operation = RECVING_OP;
 
-    sscanf(buffer, "!xferrecv=%[^,],size=%zu,crc=%x,sender=%[^,],recver=%[^,],token=%[^,]", 
-            request_args.filename, &request_args.filesize, &request_args.checksum, sender_name, recver_name, request_args.token);
+    sscanf(buffer, "!xferrecv=%[^,],size=%zu,crc=%x,sender=%[^,],recver=%[^,],token=%[^,],stream=%u,offset=%zu,length=%zu", 
+            request_args.filename, &request_args.filesize, &request_args.checksum, sender_name, recver_name, request_args.token,
+            &stream_index, &stream_offset, &stream_length);
 
     //Validate if the registration information matches the one the requester and target's user info
     if(!validate_transfer(&request_args, recver_name, sender_name, &myself_ret, &target_ret))
@@ -386,11 +1106,25 @@ int register_recv_transfer_connection()
     }
 
 
-    //Update my original FileXferArgs
-    xferargs =  myself_ret.user->c->file_transfers;
-    xferargs->myself =  myself_ret.user;
-    xferargs->xfer_socketfd =  current_client->socketfd;
+    if(myself_ret.target_type != USER_TARGET)
+    {
+        printf("Receiver is not a user!\n");
+        send_direct(current_client->socketfd, "WrongInfo", 10);
+        disconnect_client(current_client, "Error");
+        return 0;
+    }
+
+    //Update my original FileXferArgs. Each stream of a transfer may only have one transfer connection
+    xferargs = find_transfer(myself_ret.user->c, request_args.token);
     xferargs->operation = RECVING_OP;
+    if(!attach_transfer_stream(xferargs, stream_index, stream_offset, stream_length))
+    {
+        send_direct(current_client->socketfd, "WrongInfo", 10);
+        disconnect_client(current_client, "Error");
+        return 0;
+    }
+
+    xferargs->myself =  myself_ret.user;
 
     if(target_ret.target_type == USER_TARGET)
     {
@@ -410,19 +1144,21 @@ int register_recv_transfer_connection()
         return 0;
     }
 
-    current_client->connection_type = TRANSFER_CONNECTION;
-    current_client->file_transfers = xferargs;
+    set_connection_type(current_client, TRANSFER_CONNECTION);
+    current_client->xferargs = xferargs;
 
     send_direct(current_client->socketfd, "Accepted", 9);
-    printf("Accepted RECEIVING transfer connection for file \"%s\" (%zu bytes, token: %s), from \"%s\" to \"%s\".\n", 
-            xferargs->filename, xferargs->filesize, xferargs->token, sender_name, recver_name);
-
-    update_epoll_events(connections_epollfd, current_client->socketfd, XFER_RECVER_EPOLL_EVENTS);
+    printf("Accepted RECEIVING transfer connection (stream %u/%u, %zu bytes at offset %zu) for file \"%s\" (%zu bytes, token: %s), from \"%s\" to \"%s\".\n", 
+            stream_index+1, xferargs->stream_count, stream_length, stream_offset, xferargs->filename, xferargs->filesize, xferargs->token, sender_name, recver_name);
 
     //Cancel the idle timer
     cleanup_timer_event(current_client->idle_timer);
     current_client->idle_timer = NULL;
 
+    //From here on, the connection is served by a transfer thread
+    heartbeat_track(current_client);
+    xfer_thread_handoff(current_client);
+
     return 0;
 }
 
@@ -432,60 +1168,122 @@ int register_recv_transfer_connection()
 /* Client-Client File Sharing */
 /******************************/ 
 
+//Splits "user1+user2+..." into the recipients of a new transfer. Each recipient must be online, and may only be named once
+static int parse_transfer_recipients(FileXferArgs_Server *xferargs, char *target_list)
+{
+    char recipients_name[XFER_RECIPIENTS_LENG+1];
+    char *recipient_name, *saveptr;
+    User *recipient;
+
+    if(strlen(target_list) > XFER_RECIPIENTS_LENG)
+    {
+        printf("Recipient list \"%s\" is too long\n", target_list);
+        send_error_code(current_client, ERR_INVALID_NAME, NULL);
+        return 0;
+    }
+    strcpy(recipients_name, target_list);
+    xferargs->recipients = calloc(XFER_MAX_RECIPIENTS, sizeof(XferRecipient));
+
+    for(recipient_name = strtok_r(recipients_name, XFER_RECIPIENT_SEPARATOR, &saveptr); recipient_name; recipient_name = strtok_r(NULL, XFER_RECIPIENT_SEPARATOR, &saveptr))
+    {
+        HASH_FIND_STR(active_users, recipient_name, recipient);
+        if(!recipient)
+        {
+            printf("User \"%s\" not found\n", recipient_name);
+            send_error_code(current_client, ERR_USER_NOT_FOUND, recipient_name);
+            return 0;
+        }
+
+        if(recipient == current_client->user || find_recipient(xferargs, recipient_name) || xferargs->recipient_count >= XFER_MAX_RECIPIENTS)
+        {
+            printf("Invalid recipient \"%s\" in \"%s\"\n", recipient_name, target_list);
+            send_error_code(current_client, ERR_INVALID_NAME, recipient_name);
+            return 0;
+        }
+
+        strcpy(xferargs->recipients[xferargs->recipient_count++].username, recipient_name);
+    }
+
+    if(!xferargs->recipient_count)
+    {
+        send_error_code(current_client, ERR_INVALID_NAME, NULL);
+        return 0;
+    }
+
+    strcpy(xferargs->recipients_name, target_list);
+    xferargs->recipients_pending = xferargs->recipient_count;
+
+    //A single recipient is also the transfer's target user
+    if(xferargs->recipient_count == 1)
+        HASH_FIND_STR(active_users, target_list, xferargs->target_user);
+
+    return 1;
+}
+
 int new_client_transfer()
 {
     FileXferArgs_Server *xferargs;
     char sendfile_msg[MAX_MSG_LENG+1];
-    char target_name[USERNAME_LENG+1];
 
     if(!msg_target)
         return 0;
     ++msg_target;
 
     xferargs = calloc(1, sizeof(FileXferArgs_Server));
-    sscanf(msg_body, "!sendfile=%[^,],size=%zu,crc=%x", 
-            xferargs->filename, &xferargs->filesize, &xferargs->checksum);
-    strcpy(target_name, msg_target);
+    xferargs->stream_count = 1;
+    sscanf(msg_body, "!sendfile=%[^,],size=%zu,crc=%x,streams=%u", 
+            xferargs->filename, &xferargs->filesize, &xferargs->checksum, &xferargs->stream_count);
 
-    //Find the target user specified
-    HASH_FIND_STR(active_users, msg_target, xferargs->target_user);
-    if(!xferargs->target_user)
+    //Find the target user(s) specified
+    if(!parse_transfer_recipients(xferargs, msg_target))
     {
-        printf("User \"%s\" not found\n", msg_target);
+        free(xferargs->recipients);
         free(xferargs);
-        send_error_code(current_client, ERR_USER_NOT_FOUND, NULL);
         return 0;
     }
 
-    current_client->file_transfers = xferargs;
+    xferargs->myself = current_client->user;
     xferargs->operation = SENDING_OP;
     xferargs->target_type = USER_TARGET;
 
-    //Generate an unique token for this transfer
-    generate_token(xferargs->token, TRANSFER_TOKEN_SIZE);
+    //The number of streams proposed by the sender, bounded by what the file's size warrants. The final count is settled once the recipients accept
+    if(xferargs->stream_count < 1)
+        xferargs->stream_count = 1;
+    xferargs->stream_count = xfer_stream_count(xferargs->filesize, xferargs->stream_count);
 
-    //Send out a file transfer request to the target
-    sprintf(sendfile_msg, "!sendfile=%s,size=%zu,crc=%x,target=%s,token=%s", 
-            xferargs->filename, xferargs->filesize, xferargs->checksum, current_client->user->username, xferargs->token);
-    printf("Forwarding file transfer request from user \"%s\" to  user \"%s\", for file \"%s\" (%zu bytes, token: %s, checksum: %x)\n", 
-            current_client->user->username, xferargs->target_user->username, xferargs->filename, xferargs->filesize, xferargs->token, xferargs->checksum);
-
-    send_msg(xferargs->target_user->c, sendfile_msg, strlen(sendfile_msg)+1);
-    send_msg(current_client, "Delivered", 10);
+    //Generate an unique token for this transfer, and keep it alongside the user's other transfers
+    generate_transfer_token(xferargs->token, current_client, xferargs->recipients, xferargs->recipient_count);
 
     //Set a timeout event for the request
     xferargs->timeout = calloc(1, sizeof(TimerEvent));
     xferargs->timeout->event_type = EXPIRING_TRANSFER_REQ;
     xferargs->timeout->c = current_client;
+    xferargs->timeout->xferargs = xferargs;
 
     //Create a timerfd to keep track of this transfer invite's expiry
     xferargs->timeout->timerfd = create_timerfd(XFER_REQUEST_TIMEOUT, 0, timers_epollfd);
     if(!xferargs->timeout->timerfd)
     {
+        free(xferargs->timeout);
+        free(xferargs->recipients);
         free(xferargs);
         return 0;
     }
     HASH_ADD_INT(timers, timerfd, xferargs->timeout);
+    HASH_ADD_STR(current_client->file_transfers, token, xferargs);
+
+    //Send out a file transfer request to every recipient. The file is received from the sender only once, however many accept it
+    sprintf(sendfile_msg, "!sendfile=%s,size=%zu,crc=%x,target=%s,token=%s,streams=%u", 
+            xferargs->filename, xferargs->filesize, xferargs->checksum, current_client->user->username, xferargs->token, xferargs->stream_count);
+    printf("Forwarding file transfer request from user \"%s\" to  user \"%s\", for file \"%s\" (%zu bytes, token: %s, checksum: %x)\n", 
+            current_client->user->username, xferargs->recipients_name, xferargs->filename, xferargs->filesize, xferargs->token, xferargs->checksum);
+
+    notify_recipients(xferargs, sendfile_msg, 1);
+
+    //Let the sender know which token was assigned to this transfer
+    sprintf(sendfile_msg, "!delivered=%s,size=%zu,crc=%x,target=%s,token=%s", 
+            xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->recipients_name, xferargs->token);
+    send_msg(current_client, sendfile_msg, strlen(sendfile_msg)+1);
 
     return 1;
 }
@@ -493,14 +1291,15 @@ int new_client_transfer()
 int accepted_file_transfer()
 {
     char target_username[USERNAME_LENG+1];
-    char accept_msg[MAX_MSG_LENG+1];
     XferTarget target_ret;
-    User *target;
+    FileXferArgs_Server *target_xferargs;
+    XferRecipient *recipient;
     FileXferArgs_Server *xferargs = calloc(1, sizeof(FileXferArgs_Server));
+    unsigned int stream_count = 1;
 
 
-    sscanf(buffer, "!acceptfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%s", 
-            xferargs->filename, &xferargs->filesize, &xferargs->checksum, target_username, xferargs->token);
+    sscanf(buffer, "!acceptfile=%[^,],size=%zu,crc=%x,target=%[^,],token=%[^,],streams=%u", 
+            xferargs->filename, &xferargs->filesize, &xferargs->checksum, target_username, xferargs->token, &stream_count);
     printf("User \"%s\" has accepted the file \"%s\" (%zu bytes, token: %s, checksum: %x) from user \"%s\"\n", 
             current_client->user->username, xferargs->filename, xferargs->filesize, xferargs->token, xferargs->checksum, target_username);
 
@@ -517,26 +1316,46 @@ int accepted_file_transfer()
         return 0;
     }
 
-    if(target_ret.target_type != USER_TARGET)
+    if(target_ret.target_type != USER_TARGET || find_transfer(current_client, xferargs->token))
     {
-        printf("Target is not a user. Cancelling...\n");
+        printf("Target is not a user, or the transfer was already accepted. Cancelling...\n");
         send_error_code(current_client, ERR_INCORRECT_INFO, NULL);
         free(xferargs);
         return 0;
     }
 
-    target = target_ret.user;
-    xferargs->target_user = target;
-    current_client->file_transfers = xferargs;
+    //A single recipient settles on the smaller stream count proposed by either side. Recipients of a one-to-many transfer share the sender's streams
+    target_xferargs = find_transfer(target_ret.user->c, xferargs->token);
+    recipient = find_recipient(target_xferargs, current_client->user->username);
+    if(stream_count < 1)
+        stream_count = 1;
+    else if(stream_count > target_xferargs->stream_count)
+        stream_count = target_xferargs->stream_count;
 
-    //Cancel the timeout timer on the sender side
-    cleanup_timer_event(target->c->file_transfers->timeout);
-    target->c->file_transfers->timeout = NULL;
-    
-    //Forward the accept message to the sender
-    sprintf(accept_msg, "!acceptfile=%s,size=%zu,crc=%x,target=%s,token=%s", 
-            xferargs->filename, xferargs->filesize, xferargs->checksum, current_client->user->username, xferargs->token);
-    send_msg(xferargs->target_user->c, accept_msg, strlen(accept_msg)+1);
+    if(!recipient || recipient->answered || (target_xferargs->recipient_count > 1 && stream_count != target_xferargs->stream_count))
+    {
+        printf("The transfer was already answered, or proposed mismatched streams. Cancelling...\n");
+        send_error_code(current_client, ERR_INCORRECT_INFO, NULL);
+        free(xferargs);
+        return 0;
+    }
+
+    xferargs->target_user = target_ret.user;
+    xferargs->myself = current_client->user;
+    HASH_ADD_STR(current_client->file_transfers, token, xferargs);
+
+    //Split both halves of the transfer the same way
+    target_xferargs->stream_count = stream_count;
+    allocate_transfer_streams(xferargs, stream_count);
+    xferargs->peer = target_xferargs;
+
+    recipient->answered = 1;
+    recipient->xferargs = xferargs;
+    --target_xferargs->recipients_pending;
+    ++target_xferargs->recipients_receiving;
+
+    //The sender starts sending once every recipient has answered
+    recipients_answered(target_xferargs, "Declined");
 
     return 1;
 }
@@ -546,162 +1365,454 @@ int rejected_file_transfer()
 {
     char target_name[USERNAME_LENG+1];
     char reason[DISCONNECT_REASON_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
     char reject_msg[MAX_MSG_LENG+1];
+    FileXferArgs_Server *target_xferargs = NULL;
+    XferRecipient *recipient = NULL;
     User *target;
 
-    sscanf(buffer, "!rejectfile=%[^,],reason=%s", target_name, reason);
+    sscanf(buffer, "!rejectfile=%[^,],reason=%[^,],token=%s", target_name, reason, token);
 
+    //Locate the sender's pending invitation by its token
     HASH_FIND_STR(active_users, target_name, target);
-    if(!target || !target->c->file_transfers || strcmp(target->c->file_transfers->target_user->username, current_client->user->username) != 0)
+    if(target)
+        target_xferargs = find_transfer(target->c, token);
+    if(target_xferargs && target_xferargs->target_type == USER_TARGET && target_xferargs->operation == SENDING_OP)
+        recipient = find_recipient(target_xferargs, current_client->user->username);
+
+    if(!recipient || recipient->answered)
     {
         printf("User has no pending file transfer.\n");
-        send_error_code(current_client, ERR_NO_XFER_FOUND, target->c->user->username);
+        send_error_code(current_client, ERR_NO_XFER_FOUND, target_name);
         return 0;
     }
 
     printf("File Transfer with \"%s\" has been cancelled. Reason: \"%s\"\n", target_name, reason);
     send_msg(current_client, "Cancelled", 10); 
 
-    //Notify the target 
-    sprintf(reject_msg, "!rejectfile=%s,reason=%s", current_client->user->username, reason);
-    send_msg(target->c, reject_msg, strlen(reject_msg)+1);
+    //Notify the target. The whole transfer is rejected once nobody is left to accept it, the rest of a one-to-many transfer may still go ahead
+    if(target_xferargs->recipient_count > 1)
+    {
+        sprintf(reject_msg, "!rejectfile=%s,reason=%s,token=%s", current_client->user->username, reason, token);
+        send_msg(target->c, reject_msg, strlen(reject_msg)+1);
+    }
+
+    recipient->answered = 1;
+    --target_xferargs->recipients_pending;
+    recipients_answered(target_xferargs, reason);
 
-    cancel_user_transfer(target->c);
     return 1;
 }
 
 
 int user_cancelled_transfer()
 {
-    char target_name[USERNAME_LENG+1];
+    char target_name[XFER_RECIPIENTS_LENG+1];
     char reason[DISCONNECT_REASON_LENG+1];
+    char token[TRANSFER_TOKEN_SIZE+1];
     char reject_msg[MAX_MSG_LENG+1];
+    FileXferArgs_Server *xferargs;
     
-    sscanf(buffer, "!cancelfile=%[^,],reason=%s", target_name, reason);
+    sscanf(buffer, "!cancelfile=%[^,],reason=%[^,],token=%s", target_name, reason, token);
 
-    if(!current_client->file_transfers)
+    xferargs = find_transfer(current_client, token);
+    if(!xferargs)
     {
         printf("User has no pending or ongoing file transfer to cancel.\n");
-        send_error_code(current_client, ERR_NO_XFER_FOUND, NULL);
+        send_error_code(current_client, ERR_NO_XFER_FOUND, token);
         return 0;
     }
-    printf("File Transfer with \"%s\" has been cancelled. Reason: \"%s\"\n", target_name, reason);
+    printf("File Transfer with \"%s\" (token: %s) has been cancelled. Reason: \"%s\"\n", target_name, token, reason);
     send_msg(current_client, "Cancelled", 10); 
 
-    //Notify the target 
-    sprintf(reject_msg, "!cancelfile=%s,reason=%s", current_client->user->username, reason);
-    send_msg(current_client->file_transfers->target_user->c, reject_msg, strlen(reject_msg)+1);  
+    //A transfer cancelled on purpose is not kept around for resuming
+    xferargs->resumable = 0;
+
+    //Notify the target user(s). Group transfers have nobody else to notify. A recipient leaving a one-to-many transfer only leaves its own half
+    if(xferargs->target_type == USER_TARGET)
+    {
+        sprintf(reject_msg, "!cancelfile=%s,reason=%s,token=%s", current_client->user->username, reason, token);
+        if(xferargs->operation == SENDING_OP)
+            notify_recipients(xferargs, reject_msg, 0);
+        else
+            send_msg(xferargs->target_user->c, reject_msg, strlen(reject_msg)+1);  
+    }
+
+    cancel_transfer_direct(current_client, xferargs);
+    return 1;
+}
+
+//The sender computes a file's checksum while sending it. Pass it on to every recipient still receiving (or yet to answer) the file
+int forward_checksum_trailer()
+{
+    char token[TRANSFER_TOKEN_SIZE+1];
+    char trailer_msg[MAX_MSG_LENG+1];
+    unsigned int checksum;
+    FileXferArgs_Server *xferargs;
+
+    sscanf(buffer, "!xfercrc=%16[^,],crc=%x", token, &checksum);
+
+    xferargs = find_transfer(current_client, token);
+    if(!xferargs || xferargs->operation != SENDING_OP || xferargs->target_type != USER_TARGET)
+    {
+        printf("User has no file transfer to pass a checksum on for (token: %s).\n", token);
+        send_error_code(current_client, ERR_NO_XFER_FOUND, token);
+        return 0;
+    }
+
+    printf("Forwarding checksum %x of file \"%s\" (token: %s) from user \"%s\" to \"%s\"\n", 
+            checksum, xferargs->filename, token, current_client->user->username, xferargs->recipients_name);
+
+    sprintf(trailer_msg, "!xfercrc=%s,crc=%x", token, checksum);
+    notify_recipients(xferargs, trailer_msg, 0);
 
-    cancel_user_transfer(current_client);
     return 1;
 }
 
+//All of a group upload's chunk checksums have arrived. Only trust them if they match the root announced with the file, then check the chunks that arrived ahead of them
+static void validate_chunk_tree(FileXferArgs_Server *xferargs)
+{
+    unsigned int i;
+    int gave_up = 0;
+
+    xfer_thread_lock_transfer(xferargs);
+
+    if(chunk_tree_root(xferargs->chunk_crcs, xferargs->chunk_count) != xferargs->chunk_root)
+    {
+        printf("Chunk checksums of \"%s\" (token: %s) do not match their root. The file will be verified as a whole instead.\n", xferargs->filename, xferargs->token);
+        free(xferargs->chunk_crcs);
+        free(xferargs->chunks);
+        xferargs->chunk_crcs = NULL;
+        xferargs->chunks = NULL;
+        xferargs->chunk_count = 0;
+
+        xfer_thread_unlock_transfer(xferargs);
+        return;
+    }
+
+    xferargs->chunk_tree_valid = 1;
+    for(i=0; i<xferargs->chunk_count && !gave_up; i++)
+    {
+        if(xferargs->chunks[i].status != CHUNK_RECEIVED)
+            continue;
+
+        if(!check_upload_chunk(xferargs, i))
+            gave_up = 1;
+        else if(xferargs->chunks[i].status == CHUNK_FAILED)
+            request_chunk_resend(xferargs, i);
+    }
+
+    xfer_thread_unlock_transfer(xferargs);
+
+    if(gave_up)
+        cancel_transfer_direct(xferargs->myself->c, xferargs);
+}
+
+//The uploader sends the checksums of a group upload's chunks ahead of its data. Downloads following the upload get them as well
+int upload_chunk_checksums()
+{
+    char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int first = 0, known;
+    int parsed = 0;
+    FileXferArgs_Server *xferargs, *tail;
+
+    sscanf(buffer, "!xferchunks=%16[^,],first=%u,crcs=%n", token, &first, &parsed);
+
+    xferargs = find_transfer(current_client, token);
+    if(!xferargs || xferargs->operation != SENDING_OP || xferargs->target_type != GROUP_TARGET || !xferargs->chunk_crcs || !parsed || first != xferargs->chunks_known)
+    {
+        printf("User has no group upload expecting chunk checksums from chunk %u (token: %s).\n", first, token);
+        return 0;
+    }
+
+    //Not read by the transfer thread until they are all known
+    known = parse_chunk_checksums(&buffer[parsed], xferargs->chunk_crcs, first, xferargs->chunk_count);
+    xferargs->chunks_known += known;
+
+    LL_FOREACH2(xferargs->tails, tail, next_tail)
+        send_chunk_checksums(tail->myself->c, tail->token, xferargs->chunk_crcs, first, first + known);
+
+    if(xferargs->chunks_known == xferargs->chunk_count)
+        validate_chunk_tree(xferargs);
+
+    return 1;
+}
+
+//A chunk of a group upload failed its check on the transfer thread. Ask the uploader for it again
+void upload_chunk_failed(FileXferArgs_Server *xferargs, unsigned int chunk)
+{
+    xfer_thread_lock_transfer(xferargs);
+
+    //A resumed upload may have restarted the chunk's range since
+    if(xferargs->chunks && xferargs->chunks[chunk].status == CHUNK_FAILED)
+        request_chunk_resend(xferargs, chunk);
+
+    xfer_thread_unlock_transfer(xferargs);
+}
+
+//A downloader received a damaged chunk. It is sent again once its stream's range has been sent
+int resend_download_chunk()
+{
+    char token[TRANSFER_TOKEN_SIZE+1];
+    unsigned int chunk = 0;
+    FileXferArgs_Server *xferargs;
+    XferStream_Server *stream;
+
+    sscanf(buffer, "!rechunk=%16[^,],chunk=%u", token, &chunk);
+
+    xferargs = find_transfer(current_client, token);
+    if(!xferargs || xferargs->operation != RECVING_OP || xferargs->target_type != GROUP_TARGET || !xferargs->streams || chunk >= xfer_chunk_count(xferargs->filesize))
+    {
+        printf("User has no group download to send chunk %u of again (token: %s).\n", chunk, token);
+        send_error_code(current_client, ERR_NO_XFER_FOUND, token);
+        return 0;
+    }
+
+    printf("User \"%s\" received chunk %u of \"%s\" damaged. Sending it again...\n", current_client->user->username, chunk, xferargs->filename);
+
+    stream = &xferargs->streams[xfer_chunk_stream(xferargs->filesize, xferargs->stream_count, chunk)];
+    xfer_thread_lock_transfer(xferargs);
+    append_chunk_resend(&stream->resends, chunk);
+    xfer_thread_unlock_transfer(xferargs);
+
+    //The stream's connection may be idle, waiting for the client to close it
+    xfer_thread_wake_transfer(xferargs);
+    return 1;
+}
 
 /* FORWARDING FILE PIECES */
 
-static int group_send_next_piece();
-static int group_recv_next_piece();
+//Note: These run on transfer threads. They may only use the connection's own transfer (and its sender's half), never the chat thread's tables
 
-//The receiver is ready for receiving the next piece (EPOLLOUT received)
-int client_data_forward_recver_ready()
+static int group_send_next_piece(Client *c);
+static int group_recv_next_piece(Client *c, RelayChunk *piece, size_t quantum);
+
+//One-to-many transfers: once the fastest recipient is done with the oldest piece, moves it to the spool file, so the slowest recipient does not hold the sender back
+static int spool_oldest_piece(FileXferArgs_Server *xferargs, XferStream_Server *stream)
 {
-    FileXferArgs_Server *xferargs = current_client->file_transfers;
-    FileXferArgs_Server *sender_xferargs;
-    size_t bytes_remaining;
-    int bytes_sent;
+    RelayChunk *piece = stream->pieces;
 
-    if(!xferargs)
+    if(xferargs->spool_fd <= 0 || !piece || piece->pending >= xferargs->recipients_receiving)
+        return 0;
+
+    if(pwrite(xferargs->spool_fd, piece->data, piece->size, stream->offset + piece->offset) != (ssize_t) piece->size)
+    {
+        perror("Failed to spool a piece");
         return 0;
+    }
+
+    //Recipients behind this point read from the spool file from now on
+    stream->spooled = piece->offset + piece->size;
+    LL_DELETE(stream->pieces, piece);
+    --stream->pieces_queued;
+    relay_chunk_release(piece);
+
+    return 1;
+}
+
+//The receiver is ready for receiving the next piece (EPOLLOUT received)
+int client_data_forward_recver_ready(Client *c)
+{
+    FileXferArgs_Server *xferargs = c->xferargs;
+    FileXferArgs_Server *sender_xferargs;
+    XferStream_Server *stream, *sender_stream = NULL;
+    RelayChunk *piece = NULL;
+    size_t position, bytes_remaining;
+    off_t spool_offset;
+    ssize_t bytes_sent;
 
     if(xferargs->target_type == GROUP_TARGET)
-        return group_send_next_piece();
+        return group_send_next_piece(c);
     
-    sender_xferargs = current_client->file_transfers->target_user->c->file_transfers;
+    //Each receiving stream is paired with the sending stream covering the same range. Every recipient forwards from its own position in it
+    stream = &xferargs->streams[c->xfer_stream];
+    sender_xferargs = xferargs->peer;
+    if(sender_xferargs && sender_xferargs->streams)
+        sender_stream = &sender_xferargs->streams[c->xfer_stream];
 
-    //Nothing to send if the last piece has been completely forwarded
-    if(sender_xferargs->piece_size == 0)
+    position = stream->transferred;
+    if(!sender_stream || position >= stream->length)
+        return XFER_IO_WAITING;
+
+    if(position < sender_stream->spooled)
     {
-        //Rearm epoll notifications for both sender and receiver for the next piece
-        update_epoll_events(connections_epollfd, sender_xferargs->xfer_socketfd, XFER_SENDER_EPOLL_EVENTS);
-        update_epoll_events(connections_epollfd, current_client->socketfd, XFER_RECVER_EPOLL_EVENTS);
-        return 0;
+        //This recipient fell behind, and its next pieces were moved to the spool file
+        bytes_remaining = sender_stream->spooled - position;
+        if(bytes_remaining > XFER_QUANTUM_SIZE)
+            bytes_remaining = XFER_QUANTUM_SIZE;
+
+        spool_offset = stream->offset + position;
+        bytes_sent = sendfile(c->socketfd, sender_xferargs->spool_fd, &spool_offset, bytes_remaining);
     }
-       
-    bytes_remaining = sender_xferargs->piece_size - sender_xferargs->piece_transferred;
-    if(bytes_remaining <= 0)
+    else
     {
-        sender_xferargs->piece_size = 0;
-        sender_xferargs->piece_transferred = 0;
-        return 0;
+        //Nothing to send yet. The sender's connection will deliver the next piece
+        LL_FOREACH(sender_stream->pieces, piece)
+            if(position < piece->offset + piece->size)
+                break;
+        if(!piece)
+            return XFER_IO_WAITING;
+
+        bytes_sent = send_direct(c->socketfd, (char*) &piece->data[position - piece->offset], piece->offset + piece->size - position);
     }
 
-    bytes_sent = send_direct(current_client->socketfd, &sender_xferargs->piece_buffer[sender_xferargs->piece_transferred], bytes_remaining);
-    //bytes_sent = send_direct(current_client->socketfd, &sender_xferargs->piece_buffer[sender_xferargs->piece_transferred], (LONG_RECV_PAGE_SIZE > bytes_remaining)? bytes_remaining:LONG_RECV_PAGE_SIZE);
-    if(bytes_sent < 0)
+    if(bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        //A receiver that can't keep up with a full window only needs a smaller one
+        if(sender_stream->pieces_queued >= sender_stream->window && sender_stream->window > RELAY_WINDOW_MIN)
+            sender_stream->window /= 2;
+        return XFER_IO_WOULDBLOCK;
+    }
+    else if(bytes_sent <= 0)
     {
         perror("Failed to send the current piece");
-        return -1;
+        return XFER_IO_FAILED;
     }
 
+    stream->transferred += bytes_sent;
     xferargs->transferred += bytes_sent;
-    sender_xferargs->transferred += bytes_sent;
-    sender_xferargs->piece_transferred += bytes_sent;
 
-    //Were we able to forward the entire received piece?
-    if(sender_xferargs->piece_transferred >= sender_xferargs->piece_size)
+    //Were we able to forward the entire piece? It returns to the pool once every recipient has
+    if(piece && stream->transferred >= piece->offset + piece->size)
     {
-        sender_xferargs->piece_size = 0;
-        sender_xferargs->piece_transferred = 0;
+        --piece->pending;
+        release_forwarded_pieces(sender_stream);
 
-        //Rearm epoll notifications for sender (to send the next piece)
-        update_epoll_events(connections_epollfd, sender_xferargs->xfer_socketfd, XFER_SENDER_EPOLL_EVENTS);
+        //The receivers drained everything the window allowed, so they can be trusted with a bigger window
+        if(!sender_stream->pieces && sender_stream->window_filled)
+        {
+            sender_stream->window_filled = 0;
+            if(sender_stream->window < RELAY_WINDOW_MAX)
+                sender_stream->window *= 2;
+        }
     }
 
     if(xferargs->transferred >= xferargs->filesize)
-        printf("All bytes for file transfer has been forwarded. Waiting for receiver \"%s\" to close the connection...\n", xferargs->target_user->username);
-
-    //Rearm epoll notifications for receiver (to receive the next chunk/piece, or to close the connection when complete)
-    update_epoll_events(connections_epollfd, current_client->socketfd, XFER_RECVER_EPOLL_EVENTS);
+        printf("All bytes for file transfer has been forwarded. Waiting for receiver \"%s\" to close the connection...\n", xferargs->myself->username);
 
-    return bytes_sent;
+    return XFER_IO_PROGRESS;
 }
 
 
 //The sender has a new piece ready (EPOLLIN received)
-int client_data_forward_sender_ready()
+int client_data_forward_sender_ready(Client *c)
 {
-    FileXferArgs_Server *xferargs = current_client->file_transfers;
-    FileXferArgs_Server *recver_xferargs;
+    FileXferArgs_Server *xferargs = c->xferargs;
+    XferStream_Server *stream;
+    RelayChunk *piece;
+    size_t bytes_remaining, quantum;
     int bytes_recvd;
 
-    //Do not receive a new piece from the sender if the last piece hasn't been fully forwarded yet
-    if(!xferargs || xferargs->piece_size > 0)
-        return 0;
+    //Never accept more than this stream's range
+    stream = &xferargs->streams[c->xfer_stream];
+    bytes_remaining = stream->length - stream->transferred;
+    if(bytes_remaining == 0 && !stream->resends)
+        return XFER_IO_WAITING;
+
+    //Do not receive more from the sender than its receivers are allowed to have in flight, unless the oldest piece can be spooled
+    if(xferargs->target_type == USER_TARGET && stream->pieces_queued >= stream->window && !spool_oldest_piece(xferargs, stream))
+    {
+        stream->window_filled = 1;
+        return XFER_IO_WAITING;
+    }
+
+    //Wait for the sender's share of the bandwidth before receiving more
+    quantum = xfer_quantum(c);
+    if(!quantum)
+        return XFER_IO_THROTTLED;
+
+    //Wait for other transfers to return their pieces once the pool's budget is used up
+    piece = relay_chunk_alloc();
+    if(!piece)
+        return XFER_IO_THROTTLED;
     
     if(xferargs->target_type == GROUP_TARGET)
+        return group_recv_next_piece(c, piece, quantum);
+
+    if(bytes_remaining > quantum)
+        bytes_remaining = quantum;
+    if(bytes_remaining > RELAY_CHUNK_SIZE)
+        bytes_remaining = RELAY_CHUNK_SIZE;
+
+    //Receive a new piece of data that was sent by the sender
+    bytes_recvd = recv_direct(c->socketfd, (char*) piece->data, bytes_remaining);
+    if(bytes_recvd <= 0)
     {
-        bytes_recvd = group_recv_next_piece();
-        if(!bytes_recvd)
-        {
-            disconnect_client(current_client, "Connection Failed");
+        relay_chunk_release(piece);
+        return (bytes_recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))? XFER_IO_WOULDBLOCK : XFER_IO_FAILED;
+    }
+    xfer_charge(c, bytes_recvd);
+
+    //Each recipient's connection forwards the piece when it's ready. Recipients may not have opened their transfer connections yet
+    piece->size = bytes_recvd;
+    piece->offset = stream->transferred;
+    piece->pending = xferargs->recipients_receiving;
+    LL_APPEND(stream->pieces, piece);
+    ++stream->pieces_queued;
+
+    stream->transferred += bytes_recvd;
+    xferargs->transferred += bytes_recvd;
+
+    return XFER_IO_PROGRESS;
+}
+
+
+static int upload_frames_complete(FileXferArgs_Server *xferargs)
+{
+    unsigned int i, frame_count = xfer_frame_count(xferargs->filesize);
+
+    for(i=0; i<frame_count; i++)
+        if(!xferargs->frames[i].length)
             return 0;
-        }
-        
-        return bytes_recvd;
+
+    return 1;
+}
+
+//A group upload has received all of its bytes. Runs on the chat thread, once the transfer thread has released the connection
+void transfer_connection_completed(Client *c)
+{
+    FileXferArgs_Server *xferargs = c->xferargs;
+    char frames_file[MAX_FILE_PATH+sizeof(BLOB_FRAMES_SUFFIX)];
+    Blob *blob;
+
+    sprintf(frames_file, "%s%s", xferargs->target_file, BLOB_FRAMES_SUFFIX);
+
+    //Every chunk passed its check as it arrived, so the file needs no second pass. Downloads following this upload are cancelled along with it
+    if(xferargs->chunk_tree_valid && !xferargs->chunks_failed)
+        printf("All %u chunks of \"%s\" (token: %s) passed their checks.\n", xferargs->chunk_count, xferargs->filename, xferargs->token);
+    else if(!verify_received_file(xferargs->filesize, xferargs->checksum, xferargs->target_file))
+    {
+        disconnect_client(c, "Connection Failed");
+        return;
     }
-        
 
-    //Receive a new piece of data that was sent by the sender, if the old piece has been completely forwarded already
-    bytes_recvd = recv_direct(current_client->socketfd, xferargs->piece_buffer, XFER_BUFSIZE);
-    if(!bytes_recvd)
-        return 0;
+    //Keep the contents in the blob store, so later uploads of the same file need no transfer
+    blob = store_blob(xferargs->target_file, xferargs->filesize, xferargs->checksum);
+    if(!blob)
+    {
+        disconnect_client(c, "Connection Failed");
+        return;
+    }
+
+    //Later downloads check each chunk with the same checksums
+    if(!blob->chunk_crcs && xferargs->chunk_tree_valid)
+    {
+        blob->chunk_crcs = xferargs->chunk_crcs;
+        blob->chunk_count = xferargs->chunk_count;
+        blob->chunk_root = xferargs->chunk_root;
+        xferargs->chunk_crcs = NULL;
+    }
 
-    //If the receiver is a user, rearm the receiver's epoll events and forward the piece to the receiver when ready
-    xferargs->piece_size = bytes_recvd;
-    recver_xferargs = current_client->file_transfers->target_user->c->file_transfers;
-    update_epoll_events(connections_epollfd, recver_xferargs->xfer_socketfd, XFER_RECVER_EPOLL_EVENTS);
+    //Compressed downloads send the frames the file arrived in, if every block of it has one
+    if(xferargs->frames && upload_frames_complete(xferargs) && store_blob_frames(blob, frames_file, xferargs->frames, xferargs->frames_size))
+        xferargs->frames = NULL;
 
-   return bytes_recvd;
+    if(!complete_uploading_file(xferargs->target_group, xferargs->fileid, blob))
+        add_file_to_group(xferargs->target_group, xferargs->myself->username, xferargs->filename, blob);
+
+    //Downloads following this upload already have most of the file. Their files are still readable, even though it was moved (or dropped as a duplicate)
+    release_upload_tails(xferargs, 1);
+    disconnect_client(c, NULL);
 }
 
 
@@ -715,14 +1826,17 @@ int put_new_file_to_group()
     FileXferArgs_Server *xferargs;
     Group_Member *target_member;
     char putfile_msg[MAX_MSG_LENG+1];
+    unsigned int stream_count = 1, chunk_count = 0;
+    char hash[CONTENT_HASH_SIZE+1] = "";
+    Blob *blob;
 
     if(!msg_target)
         return 0;
     msg_target += 2;
     
     xferargs = calloc(1, sizeof(FileXferArgs_Server));
-    sscanf(msg_body, "!putfile=%[^,],size=%zu,crc=%x", 
-            xferargs->filename, &xferargs->filesize, &xferargs->checksum);
+    sscanf(msg_body, "!putfile=%[^,],size=%zu,crc=%x,streams=%u,hash=%64[^,],chunks=%u,root=%x", 
+            xferargs->filename, &xferargs->filesize, &xferargs->checksum, &stream_count, hash, &chunk_count, &xferargs->chunk_root);
 
     //Check if group exists and user is a member
     if(!basic_group_permission_check(msg_target, &xferargs->target_group, &target_member))
@@ -740,20 +1854,79 @@ int put_new_file_to_group()
         return 0;
     }
 
+    //Look for a stored file with the same contents
+    blob = (hash[0])? find_blob(hash, xferargs->filesize) : NULL;
+    if(blob && blob->checksum != xferargs->checksum)
+        blob = NULL;
+
+    //Make room for the file before accepting any of it. Contents the server already stores take no more of its space
+    if(!admit_group_upload(xferargs->target_group, xferargs->filesize, blob))
+    {
+        send_error_code(current_client, ERR_QUOTA_EXCEEDED, msg_target);
+        free(xferargs);
+        return 0;
+    }
+
+    //If the server already stores a file with the same contents, attach it to the group without any data transfer
+    if(blob)
+    {
+        printf("User \"%s\" uploaded \"%s\" to group \"%s\", which is already stored as \"%s\".\n", 
+                current_client->user->username, xferargs->filename, xferargs->target_group->groupname, blob->blob_file);
+
+        sprintf(putfile_msg, "!dedupfile=%s,size=%zu,crc=%x,target=%s", 
+                xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->target_group->groupname);
+        send_msg(current_client, putfile_msg, strlen(putfile_msg)+1);
+
+        add_file_to_group(xferargs->target_group, current_client->user->username, xferargs->filename, blob);
+        free(xferargs);
+        return 1;
+    }
+
+    //Accept the file. Preallocate it, so each stream can write its own range in place
+    if(!make_folder_and_file_for_writing(GROUP_XFER_ROOT, xferargs->target_group->groupname, xferargs->filename, xferargs->target_file, &xferargs->file_fp))
+    {
+        free(xferargs);
+        return 0;
+    }
+
+    if(ftruncate(fileno(xferargs->file_fp), xferargs->filesize) < 0)
+    {
+        perror("Failed to preallocate file for receiving.");
+        fclose(xferargs->file_fp);
+        remove(xferargs->target_file);
+        free(xferargs);
+        return 0;
+    }
+
     //Generate an unique token for this transfer
-    generate_token(xferargs->token, TRANSFER_TOKEN_SIZE);
+    generate_transfer_token(xferargs->token, current_client, NULL, 0);
     
     xferargs->myself = get_current_client_user();
     xferargs->operation = SENDING_OP;
     xferargs->target_type = GROUP_TARGET; 
-    current_client->file_transfers = xferargs;
+    xferargs->resumable = 1;
+    allocate_transfer_streams(xferargs, stream_count);
+    HASH_ADD_STR(current_client->file_transfers, token, xferargs);
 
-    //Accept the file
-    if(!make_folder_and_file_for_writing(GROUP_XFER_ROOT, xferargs->target_group->groupname, xferargs->filename, xferargs->target_file, &xferargs->file_fp))
-        return 0;
+    //Each chunk is checked as it arrives, once the uploader has sent their checksums. Otherwise the file is only verified as a whole
+    if(chunk_count > 0 && chunk_count == xfer_chunk_count(xferargs->filesize))
+    {
+        xferargs->chunk_count = chunk_count;
+        xferargs->chunk_crcs = calloc(chunk_count, sizeof(unsigned int));
+        xferargs->chunks = calloc(chunk_count, sizeof(XferChunk));
+    }
+
+    //List the file right away. Members may download it while it is being uploaded
+    xferargs->fileid = add_uploading_file_to_group(xferargs->target_group, current_client->user->username, xferargs->filename, 
+                                                   xferargs->filesize, xferargs->checksum, xferargs);
 
-    sprintf(putfile_msg, "!acceptfile=%s,size=%zu,crc=%x,target=%s,token=%s", 
-            xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->target_group->groupname, xferargs->token);
+    //Receive the file in compressed frames, if the uploader offered to
+    xferargs->codec = parse_xfer_codec(msg_body);
+    open_upload_frames(xferargs);
+
+    sprintf(putfile_msg, "!acceptfile=%s,size=%zu,crc=%x,target=%s,token=%s,streams=%u%s", 
+            xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->target_group->groupname, xferargs->token, xferargs->stream_count,
+            (xferargs->codec)? ",codec="XFER_CODEC_NAME : "");
     send_msg(current_client, putfile_msg, strlen(putfile_msg)+1);
 
     return 1;
@@ -768,6 +1941,7 @@ int get_new_file_from_group()
     File_List *requested_file;
     unsigned int requested_fileid;
     char getfile_msg[MAX_MSG_LENG+1];
+    unsigned int *chunk_crcs = NULL, chunk_count = 0, chunk_root = 0, chunks_known = 0;
 
 
     if(!msg_target)
@@ -804,111 +1978,542 @@ int get_new_file_from_group()
         return 0;
     }
 
-    //Generate an unique token for this transfer
-    generate_token(xferargs->token, TRANSFER_TOKEN_SIZE);
+    requested_file->last_download = time(NULL);
 
     //Copy the file information found into my xferargs
-    strcpy(xferargs->target_file, requested_file->target_file);
     strcpy(xferargs->filename, requested_file->filename);
     xferargs->filesize = requested_file->filesize;
     xferargs->checksum = requested_file->checksum;
 
+    if(requested_file->upload)
+    {
+        //The file is still being uploaded. Follow the upload, reading each range as far as it has been written
+        strcpy(xferargs->target_file, requested_file->upload->target_file);
+        xferargs->file_fp = fopen(xferargs->target_file, "rb");
+        if(!xferargs->file_fp)
+        {
+            perror("Failed to open file being uploaded.");
+            free(xferargs);
+            return 0;
+        }
+    }
+    else
+    {
+        //Map the stored file for reading. Concurrent downloads of the same file share the mapping
+        strcpy(xferargs->target_file, requested_file->blob->blob_file);
+        xferargs->file_buffer = map_blob(requested_file->blob);
+        if(!xferargs->file_buffer)
+        {
+            free(xferargs);
+            return 0;
+        }
+        xferargs->blob = requested_file->blob;
+    }
+
+    //Generate an unique token for this transfer
+    generate_transfer_token(xferargs->token, current_client, NULL, 0);
+
     xferargs->myself = get_current_client_user();
     xferargs->operation = RECVING_OP;
     xferargs->target_type = GROUP_TARGET; 
-    current_client->file_transfers = xferargs;
 
+    //A download following an upload uses the upload's ranges, and is served by the upload's transfer thread
+    if(requested_file->upload)
+    {
+        xferargs->upload = requested_file->upload;
+        strcpy(xferargs->thread_token, xferargs->upload->token);
+        LL_APPEND2(xferargs->upload->tails, xferargs, next_tail);
+        allocate_transfer_streams(xferargs, xferargs->upload->stream_count);
+    }
+    else
+        allocate_transfer_streams(xferargs, xfer_stream_count(xferargs->filesize, XFER_MAX_STREAMS));
+    HASH_ADD_STR(current_client->file_transfers, token, xferargs);
+
+    //The chunk checksums of a stored file, or as many as the upload it follows has received. The upload passes on the rest
+    if(requested_file->blob && requested_file->blob->chunk_crcs)
+    {
+        chunk_crcs = requested_file->blob->chunk_crcs;
+        chunk_count = chunks_known = requested_file->blob->chunk_count;
+        chunk_root = requested_file->blob->chunk_root;
+    }
+    else if(requested_file->upload && requested_file->upload->chunk_crcs)
+    {
+        chunk_crcs = requested_file->upload->chunk_crcs;
+        chunk_count = requested_file->upload->chunk_count;
+        chunks_known = requested_file->upload->chunks_known;
+        chunk_root = requested_file->upload->chunk_root;
+    }
+
+    //Send the file in compressed frames if the user's connection agreed to a codec. A stored file's frames may be stored already
+    xferargs->codec = current_client->user->pending_msg.codec;
+    if(xferargs->codec && xferargs->blob && xferargs->blob->frames)
+        xferargs->frames_fd = open_blob_frames(xferargs->blob);
+
+    //Provide additional information about the file to the client so it can open its transfer connections, and check each chunk
+    sprintf(getfile_msg, "!getfile=%s,size=%zu,crc=%x,target=%s,token=%s,streams=%u,chunks=%u,root=%x%s", 
+            xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->target_group->groupname, xferargs->token, xferargs->stream_count,
+            chunk_count, chunk_root, (xferargs->codec)? ",codec="XFER_CODEC_NAME : "");
+    send_msg(current_client, getfile_msg, strlen(getfile_msg)+1);
+
+    send_chunk_checksums(current_client, xferargs->token, chunk_crcs, 0, chunks_known);
+
+    return 1;
+}
+
+
+//Checksum of the prefix a stream has received: its whole chunks, followed by the part of the chunk it stopped in
+static unsigned int received_prefix_crc(FileXferArgs_Server *xferargs, unsigned int index)
+{
+    XferStream_Server *stream = &xferargs->streams[index];
+    size_t partial = stream->transferred % XFER_CHUNK_SIZE;
+
+    //The range's last chunk may be shorter, and is already folded in once the range is complete
+    if(!partial || stream->transferred == stream->length)
+        return stream->crc;
+
+    return crc32_append(stream->crc, stream->chunk_crc, partial);
+}
+
+int resume_file_to_group()
+{
+    FileXferArgs_Server *xferargs;
+    Group *group;
+    Group_Member *target_member;
+    char token[TRANSFER_TOKEN_SIZE+1];
+    size_t filesize;
+    unsigned int checksum, i;
+    char resume_msg[MAX_MSG_LENG+1];
+
+    if(!msg_target)
+        return 0;
+    msg_target += 2;
+
+    sscanf(msg_body, "!resumefile=%[^,],size=%zu,crc=%x", token, &filesize, &checksum);
 
-    //Open the target file for reading
-    xferargs->file_fp = fopen(xferargs->target_file, "rb");
-    if(!xferargs->file_fp)
+    //Check if group exists and user is a member
+    if(!basic_group_permission_check(msg_target, &group, &target_member))
+        return 0;
+
+    //Only the original uploader may resume the same file to the same group
+    xferargs = find_resumable_transfer(token);
+    if(!xferargs || xferargs->target_group != group || strcmp(xferargs->owner_name, current_client->user->username) != 0 ||
+        xferargs->filesize != filesize || xferargs->checksum != checksum)
     {
-        perror("Failed to open file for sending.");
+        printf("No resumable upload with token \"%s\" for user \"%s\" in group \"%s\".\n", token, current_client->user->username, msg_target);
+        send_error_code(current_client, ERR_NO_XFER_FOUND, token);
         return 0;
     }
-    
-    //Open the file with mmap for reading
-    xferargs->file_buffer = mmap(NULL, xferargs->filesize, PROT_READ, MAP_SHARED, fileno(xferargs->file_fp), 0);
-    if(xferargs->file_buffer == MAP_FAILED)
+
+    //Check if group still allows file transfers and the user still has such permission.
+    if( !(group->group_flags & GRP_FLAG_ALLOW_XFER) || !(target_member->permissions & GRP_PERM_CAN_PUTFILE) )
     {
-        perror("Failed to map sending file to memory.");
-        fclose(xferargs->file_fp);
+        printf("User \"%s\" is not permitted to upload files to group \"%s\"\n", current_client->user->username, msg_target);
+        send_error_code(current_client, ERR_NO_PERMISSION, msg_target);
         return 0;
     }
 
-    //Provide additional information about the file to the client so it can open a transfer connection
-    sprintf(getfile_msg, "!getfile=%s,size=%zu,crc=%x,target=%s,token=%s", 
-            xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->target_group->groupname, xferargs->token);
-    send_msg(current_client, getfile_msg, strlen(getfile_msg)+1);
+    //Reattach the upload to the uploader
+    HASH_DEL(resumable_transfers, xferargs);
+    cleanup_timer_event(xferargs->timeout);
+    xferargs->timeout = NULL;
+    xferargs->myself = current_client->user;
+    HASH_ADD_STR(current_client->file_transfers, token, xferargs);
+
+    printf("User \"%s\" is resuming the upload of \"%s\" to group \"%s\" from %zu/%zu bytes (token: %s).\n", 
+            current_client->user->username, xferargs->filename, group->groupname, xferargs->transferred, xferargs->filesize, xferargs->token);
+
+    //Only whole frames were counted as received. The rest of the file uses the codec of the uploader's new connection
+    xferargs->codec = current_client->user->pending_msg.codec;
+    for(i=0; i<xferargs->stream_count; i++)
+        xferargs->streams[i].frame.moved = xferargs->streams[i].frame.size = 0;
+
+    //Tell the uploader how much of each range was received, and the checksum of each received prefix to verify against
+    sprintf(resume_msg, "!resumefile=%s,size=%zu,crc=%x,target=%s,token=%s,streams=%u%s,ranges=", 
+            xferargs->filename, xferargs->filesize, xferargs->checksum, group->groupname, xferargs->token, xferargs->stream_count,
+            (xferargs->codec)? ",codec="XFER_CODEC_NAME : "");
+    for(i=0; i<xferargs->stream_count; i++)
+        sprintf(&resume_msg[strlen(resume_msg)], "%s%zu:%x", (i > 0)? ";":"", xferargs->streams[i].transferred, received_prefix_crc(xferargs, i));
+
+    send_msg(current_client, resume_msg, strlen(resume_msg)+1);
 
     return 1;
 }
 
 
-//For ongoing getfile operations
-static int group_send_next_piece()
+//Prepares a compressed download's next frame, holding up to "length" bytes of the file at "position". The block's stored frame is sent as it is, if the blob has one.
+//Otherwise the block is compressed now, from the blob's mapping or (following an upload) read from the file being uploaded
+static int prepare_send_frame(FileXferArgs_Server *xferargs, XferStream_Server *stream, size_t position, size_t length)
 {
-    FileXferArgs_Server *xferargs = current_client->file_transfers;
-    size_t bytes_remaining = xferargs->filesize - xferargs->transferred;
-    int bytes_sent;
-    
-    bytes_sent = send_direct(current_client->socketfd, &xferargs->file_buffer[xferargs->transferred], bytes_remaining);
-    //bytes_sent = send_direct(current_client->socketfd, &xferargs->file_buffer[xferargs->transferred], (LONG_RECV_PAGE_SIZE > bytes_remaining)? bytes_remaining:LONG_RECV_PAGE_SIZE);
-    if(bytes_sent < 0)
+    unsigned int limit = xfer_frame_limit(xferargs->filesize, position);
+    StoredFrame *stored;
+    RelayChunk *piece;
+
+    if(length > limit)
+        length = limit;
+
+    //Stored frames hold whole blocks only
+    stream->frame_stored = (xferargs->frames_fd > 0 && position % XFER_FRAME_BLOCK == 0 && length == limit);
+    if(stream->frame_stored)
     {
-        perror("Failed to send the current piece");
-        return -1;
+        stored = &xferargs->blob->frames[position / XFER_FRAME_BLOCK];
+        stream->stored_offset = stored->offset;
+        stream->frame.size = stored->length;
+        stream->frame.moved = 0;
+        stream->frame.raw_length = length;
+        return XFER_IO_PROGRESS;
     }
-    //sleep(1);
 
-    xferargs->transferred += bytes_sent;
+    if(xferargs->file_buffer)
+    {
+        encode_xfer_frame(&stream->frame, (unsigned char*) &xferargs->file_buffer[position], length, position);
+        return XFER_IO_PROGRESS;
+    }
 
-    //Has the entire file been sent yet?
-    if(xferargs->transferred >= xferargs->filesize)
+    //Wait for other transfers to return their pieces once the pool's budget is used up. RELAY_CHUNK_SIZE holds a whole block
+    piece = relay_chunk_alloc();
+    if(!piece)
+        return XFER_IO_THROTTLED;
+
+    if(pread(fileno(xferargs->file_fp), piece->data, length, position) != (ssize_t) length)
+    {
+        perror("Failed to read a block for compressing");
+        relay_chunk_release(piece);
+        return XFER_IO_FAILED;
+    }
+
+    encode_xfer_frame(&stream->frame, piece->data, length, position);
+    relay_chunk_release(piece);
+    return XFER_IO_PROGRESS;
+}
+
+//Sends more of a compressed download's current frame, preparing the next one once the last has been sent whole.
+//"moved_ret" is set to the bytes of the file the frame holds once all of it has been sent, and 0 until then
+static int send_next_frame(Client *c, XferStream_Server *stream, size_t position, size_t length, size_t quantum, size_t *moved_ret)
+{
+    FileXferArgs_Server *xferargs = c->xferargs;
+    size_t bytes_remaining;
+    off_t frame_offset;
+    ssize_t bytes_sent;
+    int result;
+
+    *moved_ret = 0;
+    if(stream->frame.moved == stream->frame.size && (result = prepare_send_frame(xferargs, stream, position, length)) != XFER_IO_PROGRESS)
+        return result;
+
+    if(stream->frame_stored)
+    {
+        bytes_remaining = stream->frame.size - stream->frame.moved;
+        if(bytes_remaining > quantum)
+            bytes_remaining = quantum;
+
+        frame_offset = stream->stored_offset + stream->frame.moved;
+        bytes_sent = sendfile(c->socketfd, xferargs->frames_fd, &frame_offset, bytes_remaining);
+        if(bytes_sent > 0)
+        {
+            stream->frame.moved += bytes_sent;
+            stream->frame.wire_bytes += bytes_sent;
+        }
+    }
+    else
+        bytes_sent = send_xfer_frame(c->socketfd, &stream->frame, quantum);
+
+    if(bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return XFER_IO_WOULDBLOCK;
+    else if(bytes_sent <= 0)
+    {
+        perror("Failed to send the current frame");
+        return XFER_IO_FAILED;
+    }
+    xfer_charge(c, bytes_sent);
+
+    if(stream->frame.moved == stream->frame.size)
+        *moved_ret = stream->frame.raw_length;
+
+    return XFER_IO_PROGRESS;
+}
+
+//Sends the chunk at the front of a download stream's resends, once the stream's range has been sent
+static int group_resend_next_piece(Client *c, XferStream_Server *stream)
+{
+    FileXferArgs_Server *xferargs = c->xferargs;
+    FileXferArgs_Server *upload = xferargs->upload;
+    unsigned int chunk = stream->resends->chunk;
+    size_t chunk_offset, chunk_length, bytes_remaining, quantum, bytes_moved;
+    off_t file_offset;
+    ssize_t bytes_sent;
+    int result;
+
+    //Following an upload in progress: the chunk may have arrived damaged at the server as well. Wait for it to be received again
+    if(upload && upload->chunks && upload->chunk_tree_valid && upload->chunks[chunk].status != CHUNK_VERIFIED)
+        return XFER_IO_WAITING;
+
+    quantum = xfer_quantum(c);
+    if(!quantum)
+        return XFER_IO_THROTTLED;
+
+    xfer_chunk_range(xferargs->filesize, chunk, &chunk_offset, &chunk_length);
+    bytes_remaining = chunk_length - stream->resent;
+    if(bytes_remaining > quantum)
+        bytes_remaining = quantum;
+
+    if(xferargs->codec)
+    {
+        result = send_next_frame(c, stream, chunk_offset + stream->resent, chunk_length - stream->resent, quantum, &bytes_moved);
+        if(result != XFER_IO_PROGRESS || !bytes_moved)
+            return result;
+
+        stream->resent += bytes_moved;
+    }
+    else
+    {
+        if(xferargs->file_buffer)
+            bytes_sent = send_direct(c->socketfd, &xferargs->file_buffer[chunk_offset + stream->resent], bytes_remaining);
+        else
+        {
+            file_offset = chunk_offset + stream->resent;
+            bytes_sent = sendfile(c->socketfd, fileno(xferargs->file_fp), &file_offset, bytes_remaining);
+        }
+
+        if(bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return XFER_IO_WOULDBLOCK;
+        else if(bytes_sent < 0)
+        {
+            perror("Failed to send the current piece");
+            return XFER_IO_FAILED;
+        }
+        xfer_charge(c, bytes_sent);
+
+        stream->resent += bytes_sent;
+    }
+
+    if(stream->resent >= chunk_length)
     {
-        printf("All bytes for file transfer has been forwarded. Waiting for receiver \"%s\" to close the connection...\n", xferargs->target_user->username);
-        update_epoll_events(connections_epollfd, current_client->socketfd, EPOLLRDHUP);
+        printf("Sent chunk %u of \"%s\" to \"%s\" again.\n", chunk, xferargs->filename, xferargs->myself->username);
+        pop_chunk_resend(&stream->resends);
+        stream->resent = 0;
+    }
+
+    return XFER_IO_PROGRESS;
+}
+
+//For ongoing getfile operations
+static int group_send_next_piece(Client *c)
+{
+    FileXferArgs_Server *xferargs = c->xferargs;
+    XferStream_Server *stream = &xferargs->streams[c->xfer_stream];
+    size_t available = stream->length;
+    size_t bytes_remaining, quantum, bytes_moved;
+    off_t file_offset;
+    ssize_t bytes_sent;
+    int result;
+
+    //Chunks the receiver asked for again follow the stream's range
+    if(stream->transferred >= stream->length && stream->resends)
+        return group_resend_next_piece(c, stream);
+
+    //Following an upload in progress: only the part of the range it has written so far can be sent
+    if(xferargs->upload && xferargs->upload->streams)
+        available = xferargs->upload->streams[c->xfer_stream].transferred;
+
+    //This stream's entire range (or all of it that is available) has been sent. Wait for the upload, or for the receiver to close the connection
+    if(stream->transferred >= available)
+        return XFER_IO_WAITING;
+    bytes_remaining = available - stream->transferred;
+
+    //Wait for the receiver's share of the bandwidth before sending more
+    quantum = xfer_quantum(c);
+    if(!quantum)
+        return XFER_IO_THROTTLED;
+
+    //Compressed downloads count the file's bytes once each whole frame has been sent
+    if(xferargs->codec)
+    {
+        result = send_next_frame(c, stream, stream->offset + stream->transferred, bytes_remaining, quantum, &bytes_moved);
+        if(result != XFER_IO_PROGRESS || !bytes_moved)
+            return result;
+        bytes_sent = bytes_moved;
     }
     else
-        update_epoll_events(connections_epollfd, current_client->socketfd, XFER_RECVER_EPOLL_EVENTS);
+    {
+        if(bytes_remaining > quantum)
+            bytes_remaining = quantum;
     
+        if(xferargs->file_buffer)
+            bytes_sent = send_direct(c->socketfd, &xferargs->file_buffer[stream->offset + stream->transferred], bytes_remaining);
+        else
+        {
+            file_offset = stream->offset + stream->transferred;
+            bytes_sent = sendfile(c->socketfd, fileno(xferargs->file_fp), &file_offset, bytes_remaining);
+        }
+
+        if(bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return XFER_IO_WOULDBLOCK;
+        else if(bytes_sent < 0)
+        {
+            perror("Failed to send the current piece");
+            return XFER_IO_FAILED;
+        }
+        xfer_charge(c, bytes_sent);
+    }
+
+    stream->transferred += bytes_sent;
+    xferargs->transferred += bytes_sent;
+
+    if(xferargs->transferred >= xferargs->filesize)
+        printf("All bytes for file transfer has been forwarded. Waiting for receiver \"%s\" to close the connection...\n", xferargs->myself->username);
+    
+    return XFER_IO_PROGRESS;
+}
+
+
+//A whole chunk of a group upload has arrived. Runs on the transfer thread. Returns 0 once the chunk has failed too many times
+static int upload_chunk_received(Client *c, unsigned int chunk, unsigned int crc)
+{
+    FileXferArgs_Server *xferargs = c->xferargs;
+
+    xferargs->chunks[chunk].crc = crc;
+    xferargs->chunks[chunk].status = CHUNK_RECEIVED;
+
+    //Chunks arriving ahead of the uploader's checksums are checked once they are all known
+    if(!xferargs->chunk_tree_valid)
+        return 1;
+
+    if(!check_upload_chunk(xferargs, chunk))
+        return 0;
+
+    if(xferargs->chunks[chunk].status == CHUNK_FAILED)
+        xfer_thread_chunk_failed(c, chunk);
+
     return 1;
 }
 
+//Stores a compressed upload's frame as the latest for its block. A chunk received again replaces its earlier frames.
+//Only frames holding a whole block are stored. A file with any block missing is stored uncompressed only
+static void store_upload_frame(FileXferArgs_Server *xferargs, XferFrame *frame, size_t position)
+{
+    StoredFrame *stored = &xferargs->frames[position / XFER_FRAME_BLOCK];
+
+    if(position % XFER_FRAME_BLOCK != 0 || frame->raw_length != xfer_frame_limit(xferargs->filesize, position))
+        return;
+
+    if(pwrite(xferargs->frames_fd, frame->buffer, frame->size, xferargs->frames_size) != (ssize_t) frame->size)
+    {
+        perror("Failed to store a compressed frame.");
+        stored->length = 0;
+        return;
+    }
+
+    stored->offset = xferargs->frames_size;
+    stored->length = frame->size;
+    xferargs->frames_size += frame->size;
+}
 
-//For ongoing putfile operations
-static int group_recv_next_piece()
+//For ongoing putfile operations. The piece is written out right away, and returned to the pool
+static int group_recv_next_piece(Client *c, RelayChunk *piece, size_t quantum)
 {
-    FileXferArgs_Server *xferargs = current_client->file_transfers;
+    FileXferArgs_Server *xferargs = c->xferargs;
+    XferStream_Server *stream = &xferargs->streams[c->xfer_stream];
+    int resending = (stream->transferred >= stream->length);
+    size_t position, bytes_remaining, chunk_offset, chunk_length, wire_bytes;
+    unsigned int chunk;
     int bytes_recvd;
 
-    //Receive a new piece of data that was sent by the sender, if the old piece has been completely forwarded already
-    bytes_recvd = recv_direct(current_client->socketfd, xferargs->piece_buffer, XFER_BUFSIZE);
-    if(!bytes_recvd)
-        return 0;
+    //Chunks asked for again follow the stream's range
+    if(resending)
+    {
+        chunk = stream->resends->chunk;
+        xfer_chunk_range(xferargs->filesize, chunk, &chunk_offset, &chunk_length);
+        position = chunk_offset + stream->resent;
+    }
+    else
+    {
+        position = stream->offset + stream->transferred;
+        chunk = position / XFER_CHUNK_SIZE;
+        xfer_chunk_range(xferargs->filesize, chunk, &chunk_offset, &chunk_length);
+    }
+
+    //Stop at the end of the chunk, so it can be checked as soon as it has arrived
+    bytes_remaining = chunk_offset + chunk_length - position;
+    if(bytes_remaining > quantum)
+        bytes_remaining = quantum;
+    if(bytes_remaining > RELAY_CHUNK_SIZE)
+        bytes_remaining = RELAY_CHUNK_SIZE;
+
+    //Compressed uploads arrive one frame at a time. A frame is decoded into the piece, and written out, once all of it has arrived.
+    //A frame can be larger than the sender's share, so it may take several quanta to arrive
+    if(xferargs->codec)
+    {
+        wire_bytes = stream->frame.wire_bytes;
+        bytes_recvd = recv_xfer_frame(c->socketfd, &stream->frame, xfer_frame_limit(xferargs->filesize, position), quantum, piece->data);
+        xfer_charge(c, stream->frame.wire_bytes - wire_bytes);
+
+        if(bytes_recvd == 0)
+        {
+            relay_chunk_release(piece);
+            return XFER_IO_PROGRESS;
+        }
+    }
+    else
+        bytes_recvd = recv_direct(c->socketfd, (char*) piece->data, bytes_remaining);
+
+    if(bytes_recvd <= 0)
+    {
+        if(bytes_recvd < 0 && errno == EPROTO)
+            printf("Received a malformed frame for \"%s\" (token: %s).\n", xferargs->filename, xferargs->token);
+
+        relay_chunk_release(piece);
+        return (bytes_recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))? XFER_IO_WOULDBLOCK : XFER_IO_FAILED;
+    }
+    if(!xferargs->codec)
+        xfer_charge(c, bytes_recvd);
 
-    //Save the new piece to the target file
-    if(write(fileno(xferargs->file_fp), xferargs->piece_buffer, bytes_recvd) != bytes_recvd)
+    //Save the new piece in place, within this stream's range of the target file
+    if(pwrite(fileno(xferargs->file_fp), piece->data, bytes_recvd, position) != bytes_recvd)
     {
         perror("Failed to write correct number of bytes to receiving file.");
-        return 0;
+        relay_chunk_release(piece);
+        return XFER_IO_FAILED;
     }
 
-    //Did the file transfer complete?
-    xferargs->transferred += bytes_recvd;
-    if(xferargs->transferred >= xferargs->filesize)
+    if(xferargs->frames)
+        store_upload_frame(xferargs, &stream->frame, position);
+
+    if(position == chunk_offset)
+        stream->chunk_crc = CRC_INIT;
+    stream->chunk_crc = xcrc32(piece->data, bytes_recvd, stream->chunk_crc);
+
+    if(resending)
+        stream->resent += bytes_recvd;
+    else
     {
-        if(!verify_received_file(xferargs->filesize, xferargs->checksum, xferargs->target_file))
-            return 0;
+        stream->transferred += bytes_recvd;
+        xferargs->transferred += bytes_recvd;
+    }
+    relay_chunk_release(piece);
+
+    if(position + bytes_recvd == chunk_offset + chunk_length)
+    {
+        //Only the range's own chunks make up the prefix a resumed upload continues from. Ranges start on a chunk boundary
+        if(!resending)
+            stream->crc = crc32_append(stream->crc, stream->chunk_crc, chunk_length);
 
-        add_file_to_group(xferargs->target_group, xferargs->myself->username, xferargs->filename, xferargs->filesize, xferargs->checksum, xferargs->target_file);
+        if(resending)
+        {
+            pop_chunk_resend(&stream->resends);
+            stream->resent = 0;
+            --xferargs->chunks_failed;
+        }
 
-        disconnect_client(current_client, NULL);
-        return bytes_recvd;
+        if(xferargs->chunks && !upload_chunk_received(c, chunk, stream->chunk_crc))
+        {
+            printf("Chunk %u of \"%s\" (token: %s) failed too many times.\n", chunk, xferargs->filename, xferargs->token);
+            return XFER_IO_FAILED;
+        }
     }
 
-    //Rearm epoll notifications for sender (to send the next piece)
-    update_epoll_events(connections_epollfd, xferargs->xfer_socketfd, XFER_SENDER_EPOLL_EVENTS);
+    //Did the file transfer complete? All streams must have received their ranges, and every failed chunk again. The chat thread stores the file
+    if(xferargs->transferred >= xferargs->filesize && !xferargs->chunks_failed)
+        return XFER_IO_COMPLETED;
 
-    return bytes_recvd;
-}
\ No newline at end of file
+    return XFER_IO_PROGRESS;
+}
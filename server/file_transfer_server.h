@@ -3,8 +3,12 @@
 
 #include "server_common.h"
 #include "group.h"
+#include "relay_pool.h"
+#include "blob_store.h"
 
 #define GROUP_XFER_ROOT     "GROUP_FILES"
+#define XFER_RESUME_PERIOD  600                 //Seconds a dropped group upload is kept around for the uploader to resume it
+#define XFER_SPOOL_ROOT     "XFER_SPOOL"        //Pieces of one-to-many transfers that slower recipients still need, once they no longer fit in memory
 
 
 typedef struct {
@@ -18,10 +22,48 @@ typedef struct {
 } XferTarget;
 
 
+//A single byte range of a transfer, served by its own transfer connection
+typedef struct {
+
+    int socketfd;               //0 until this stream's transfer connection has been registered
+    size_t offset;
+    size_t length;
+    size_t transferred;
+    unsigned int crc;           //Running checksum of the whole chunks received in this range (group uploads)
+    unsigned int chunk_crc;     //Running checksum of the chunk being received (group uploads)
+
+    //Group transfers: chunks that failed their check are moved again once the range is done. Only the chat thread adds to them
+    ChunkResend *resends;       //Oldest first
+    size_t resent;              //Bytes of the oldest of them moved so far
+
+    //Used by SENDERs of client-client transfers only. Pieces received from the sender, waiting to be forwarded to every recipient (oldest first)
+    RelayChunk *pieces;
+    unsigned int pieces_queued;
+    unsigned int window;        //Most pieces this stream may hold at once
+    int window_filled;          //The sender was held back by a full window since the receivers last caught up
+    size_t spooled;             //One-to-many transfers: prefix of the range that slower recipients read back from the spool file
+
+    //Compressed group transfers: the frame being moved. A download may send it from its blob's stored frames instead of frame.buffer
+    XferFrame frame;
+    int frame_stored;
+    off_t stored_offset;
+
+} XferStream_Server;
+
+
+//A user a client-client transfer was offered to. Kept in the sender's half
+typedef struct {
+
+    char username[USERNAME_LENG+1];
+    struct filexferargs_server *xferargs;       //The recipient's half, once accepted
+    int answered;                               //Accepted, declined or expired
+
+} XferRecipient;
+
+
 typedef struct filexferargs_server {
 
     //Myself
-    int xfer_socketfd;
     enum sendrecv_op operation;
     User *myself;
 
@@ -38,25 +80,75 @@ typedef struct filexferargs_server {
     size_t transferred;
     unsigned int checksum;
     char token[TRANSFER_TOKEN_SIZE+1];
+
+    //Parallel streams (byte ranges) of this transfer
+    unsigned int stream_count;
+    unsigned int streams_connected;
+    XferStream_Server *streams;
+
+    //Client-client transfers: the receiver's half points to the sender's half. Used by transfer threads, which cannot look it up in the user tables
+    struct filexferargs_server *peer;
     
     //Used by SENDERs only
     TimerEvent *timeout;
-    unsigned char* piece_buffer;
-    size_t piece_size;
-    size_t piece_transferred;
+
+    //Used by SENDERs of client-client transfers only. The file may be offered to several users at once, and is received from the sender only once
+    char recipients_name[XFER_RECIPIENTS_LENG+1];   //"user1+user2+..."
+    XferRecipient *recipients;
+    unsigned int recipient_count;
+    unsigned int recipients_pending;            //Recipients that haven't answered yet. The sender starts once all of them have
+    unsigned int recipients_receiving;          //Accepted recipients that are still receiving. Each piece is kept until all of them have it
+    int spool_fd;                               //One-to-many transfers: spool file (at target_file) for pieces slower recipients still need
 
     //For group-related transfers
     char target_file[MAX_FILE_PATH+1];
     FILE *file_fp;
     char *file_buffer;
+    struct blob *blob;                          //GET operations: the stored file being sent, mapped at file_buffer
+
+    //For group uploads: checksums of every XFER_CHUNK_SIZE chunk of the file, sent by the uploader. They are the leaves of a hash tree, announced by its root
+    unsigned int chunk_count;                   //0 if the file is only verified as a whole
+    unsigned int chunk_root;
+    unsigned int *chunk_crcs;
+    unsigned int chunks_known;                  //Checksums received so far, in order
+    int chunk_tree_valid;                       //All checksums are known and match the root. Chunks are only checked from then on
+    XferChunk *chunks;                          //How each chunk was received
+    unsigned int chunks_failed;                 //Chunks that failed their check, and have not been received again yet
+
+    //For compressed group transfers (enum xfer_codec). The file is moved one frame (block) at a time
+    unsigned char codec;
+    int frames_fd;                              //GETs: the blob's stored frames. Uploads: every frame received, at target_file + BLOB_FRAMES_SUFFIX
+    StoredFrame *frames;                        //Uploads: where the last frame received for each block is stored. Taken over by the blob, if it has none yet
+    size_t frames_size;
+
+    //For resumable group uploads
+    int resumable;                              //Cleared when the upload is cancelled on purpose
+    char owner_name[USERNAME_LENG+1];           //The uploader, remembered while the upload is suspended
+
+    //For group uploads, which are listed in the group (as fileid) while in progress. Downloads that started early follow them
+    unsigned int fileid;
+    struct filexferargs_server *tails;
+
+    //For GET operations of a file still being uploaded. Only what the upload has written so far can be sent
+    struct filexferargs_server *upload;
+    struct filexferargs_server *next_tail;
+    char thread_token[TRANSFER_TOKEN_SIZE+1];   //Served by the upload's transfer thread. Empty for other transfers, which use their own token
+
+    UT_hash_handle hh;          //Key: token. Each side of a transfer is kept in its own user's Client->file_transfers, or in resumable_transfers while suspended
 
 } FileXferArgs_Server;
 
 
+extern FileXferArgs_Server *resumable_transfers;
+
+
+FileXferArgs_Server* find_transfer(Client *c, char *token);
 void cleanup_transfer_connection(Client *c);
-int close_associated_xfer_connection(Client *c);
+void cancel_transfer_direct(Client *owner, FileXferArgs_Server *xferargs);
 void cancel_user_transfer(Client *c);
-void transfer_invite_expired(Client *c);
+void transfer_invite_expired(TimerEvent *event);
+void resumable_transfer_expired(TimerEvent *event);
+void cancel_group_transfers(Group *group);
 
 int register_recv_transfer_connection();
 int register_send_transfer_connection();
@@ -66,12 +158,18 @@ int new_client_transfer();
 int accepted_file_transfer();
 int rejected_file_transfer();
 int user_cancelled_transfer();
+int forward_checksum_trailer();
+int upload_chunk_checksums();
+int resend_download_chunk();
+void upload_chunk_failed(FileXferArgs_Server *xferargs, unsigned int chunk);
 
-int client_data_forward_recver_ready();
-int client_data_forward_sender_ready();
+int client_data_forward_recver_ready(Client *c);
+int client_data_forward_sender_ready(Client *c);
+void transfer_connection_completed(Client *c);
 
 int put_new_file_to_group();
 int get_new_file_from_group();
+int resume_file_to_group();
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,321 @@
+#include "flood_control.h"
+#include "server.h"
+
+
+static uint64_t user_rate = FLOOD_DEFAULT_USER_RATE, user_burst = FLOOD_DEFAULT_USER_BURST;
+static uint64_t group_rate = FLOOD_DEFAULT_GROUP_RATE, group_burst = FLOOD_DEFAULT_GROUP_BURST;
+static enum flood_penalty penalty = FLOOD_DROP;
+static unsigned int mute_seconds = FLOOD_DEFAULT_MUTE;
+
+static const char *penalty_names[] = {"drop", "delay", "mute", "disconnect"};
+
+//Totals since the server started, shown by !floodstats
+static uint64_t user_msgs_dropped, group_msgs_dropped, users_delayed, users_muted, users_disconnected;
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+//Flood timers need finer steps than create_timerfd()'s whole seconds, so they are set again in milliseconds
+static TimerEvent* start_flood_timer(Client *c, enum timer_event_type type, uint64_t ms)
+{
+    TimerEvent *event;
+    struct itimerspec timer_value;
+
+    event = calloc(1, sizeof(TimerEvent));
+    event->event_type = type;
+    event->c = c;
+    event->timerfd = create_timerfd(1, 0, timers_epollfd);
+    if(!event->timerfd)
+    {
+        free(event);
+        return NULL;
+    }
+
+    memset(&timer_value, 0, sizeof(struct itimerspec));
+    timer_value.it_value.tv_sec = ms / 1000;
+    timer_value.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if(ms > 0 && timerfd_settime(event->timerfd, 0, &timer_value, NULL) < 0)
+        perror("Failed to set a flood timer");
+
+    HASH_ADD_INT(timers, timerfd, event);
+    c->user->flood_timer = event;
+    return event;
+}
+
+//Stops reading from the user until a message's worth of tokens has been refilled. Whatever it sends meanwhile waits in the socket
+static void pause_reading(Client *c)
+{
+    if(c->user->flood_timer || c->user->msg_bucket.rate == 0)
+        return;
+
+    if(!start_flood_timer(c, FLOOD_RESUME, (1000 + c->user->msg_bucket.rate - 1) / c->user->msg_bucket.rate))
+        return;
+
+    c->user->flood_paused = 1;
+    update_epoll_events(connections_epollfd, c->socketfd, client_epoll_events(c));
+    ++users_delayed;
+}
+
+static void resume_reading(Client *c)
+{
+    c->user->flood_paused = 0;
+    update_epoll_events(connections_epollfd, c->socketfd, client_epoll_events(c));
+}
+
+//Takes CAN_TALK away from one of a muted user's memberships. Only the memberships it was taken from get it back
+void flood_mute_member(User *user, Group_Member *member)
+{
+    if(!user->flood_muted || !(member->permissions & GRP_PERM_CAN_TALK))
+        return;
+
+    member->permissions &= ~GRP_PERM_CAN_TALK;
+    member->flood_muted = 1;
+}
+
+//Takes CAN_TALK away in every group the user has joined. Groups it joins while muted are muted as it joins them
+static void mute_user(Client *c)
+{
+    char mute_msg[MAX_MSG_LENG+1];
+    GroupList *joined;
+    Group_Member *member;
+
+    if(c->user->flood_muted || c->user->flood_timer)
+        return;
+
+    if(!start_flood_timer(c, FLOOD_UNMUTE, (uint64_t)mute_seconds * 1000))
+        return;
+    c->user->flood_muted = 1;
+
+    LL_FOREACH(c->user->groups_joined, joined)
+    {
+        HASH_FIND_PTR(joined->group->members, &c, member);
+        if(member)
+            flood_mute_member(c->user, member);
+    }
+
+    printf("User \"%s\" is flooding. Muted for %u seconds.\n", c->user->username, mute_seconds);
+    sprintf(mute_msg, "You have been muted for %u seconds for sending messages too fast.", mute_seconds);
+    send_msg(c, mute_msg, strlen(mute_msg)+1);
+    ++users_muted;
+}
+
+static void unmute_user(Client *c)
+{
+    char unmute_msg[MAX_MSG_LENG+1];
+    GroupList *joined;
+    Group_Member *member;
+
+    LL_FOREACH(c->user->groups_joined, joined)
+    {
+        HASH_FIND_PTR(joined->group->members, &c, member);
+        if(member && member->flood_muted)
+        {
+            member->permissions |= GRP_PERM_CAN_TALK;
+            member->flood_muted = 0;
+        }
+    }
+    c->user->flood_muted = 0;
+
+    printf("User \"%s\" is no longer muted.\n", c->user->username);
+    sprintf(unmute_msg, "You are no longer muted.");
+    send_msg(c, unmute_msg, strlen(unmute_msg)+1);
+}
+
+
+
+/******************************/
+/*        Rate Limiting       */
+/******************************/
+
+void flood_add_user(User *user)
+{
+    token_bucket_init(&user->msg_bucket, user_rate, user_burst);
+    user->flood_warned = 0;
+    user->flood_paused = 0;
+    user->flood_muted = 0;
+    user->flood_timer = NULL;
+}
+
+void flood_add_group(Group *group)
+{
+    token_bucket_init(&group->msg_bucket, group_rate, group_burst);
+}
+
+//Checks a registered user's message once it has been received in full, before it is parsed. Returns 0 if it is to be dropped
+int flood_admit_user(Client *c)
+{
+    User *user = c->user;
+
+    if(user->is_admin || token_bucket_available(&user->msg_bucket) > 0)
+    {
+        //Admins are never limited, and don't run their bucket into debt either
+        if(!user->is_admin)
+            token_bucket_consume(&user->msg_bucket, 1);
+        user->flood_warned = 0;
+
+        //With the delay penalty, the user is not read from again until it may send another message
+        if(penalty == FLOOD_DELAY && !user->is_admin && user->msg_bucket.tokens == 0)
+            pause_reading(c);
+        return 1;
+    }
+
+    switch(penalty)
+    {
+        //Only a message that had arrived before reading was paused gets here
+        case FLOOD_DELAY:
+            pause_reading(c);
+            return 1;
+
+        case FLOOD_DISCONNECT:
+            printf("User \"%s\" is flooding. Disconnecting...\n", user->username);
+            ++users_disconnected;
+            disconnect_client(c, "Flooding");
+            return 0;
+
+        case FLOOD_MUTE:
+            mute_user(c);
+            user->flood_warned = 1;
+            break;
+
+        default:
+            break;
+    }
+
+    ++user_msgs_dropped;
+    if(!user->flood_warned)
+    {
+        printf("Dropping messages from \"%s\", who is sending them too fast.\n", user->username);
+        send_error_code(c, ERR_FLOODING, user->username);
+        user->flood_warned = 1;
+    }
+    return 0;
+}
+
+//Checks a message about to be fanned out to a group. Returns 0 if the group has had too many messages lately
+int flood_admit_group(Client *c, Group *group)
+{
+    if(token_bucket_available(&group->msg_bucket) > 0)
+    {
+        token_bucket_consume(&group->msg_bucket, 1);
+        return 1;
+    }
+
+    ++group_msgs_dropped;
+    printf("Dropping message from \"%s\" to group \"%s\", which is over its message rate limit.\n", c->user->username, group->groupname);
+    send_error_code(c, ERR_FLOODING, group->groupname);
+    return 0;
+}
+
+void flood_timer_expired(TimerEvent *event)
+{
+    Client *c = event->c;
+
+    c->user->flood_timer = NULL;
+    if(event->event_type == FLOOD_RESUME)
+        resume_reading(c);
+    else
+        unmute_user(c);
+}
+
+void flood_remove_user(User *user)
+{
+    if(user->flood_timer)
+        cleanup_timer_event(user->flood_timer);
+    user->flood_timer = NULL;
+}
+
+
+
+/******************************/
+/*       Administration       */
+/******************************/
+
+//Sets the message rate limit of every user ("users") or every group ("groups"). A burst of 0 allows two seconds worth at once
+int flood_set_limit(char *target, uint64_t rate, uint64_t burst)
+{
+    User *user, *user_tmp;
+    Group *group, *group_tmp;
+
+    if(burst == 0)
+        burst = (rate > 0)? rate * 2 : 1;
+
+    if(strcmp(target, "users") == 0)
+    {
+        user_rate = rate;
+        user_burst = burst;
+        HASH_ITER(hh, active_users, user, user_tmp)
+            token_bucket_init(&user->msg_bucket, user_rate, user_burst);
+    }
+    else if(strcmp(target, "groups") == 0)
+    {
+        group_rate = rate;
+        group_burst = burst;
+        HASH_ITER(hh, groups, group, group_tmp)
+            token_bucket_init(&group->msg_bucket, group_rate, group_burst);
+    }
+    else
+    {
+        printf("Flood limits are set for \"users\" or \"groups\".\n");
+        return 0;
+    }
+
+    printf("Messages of each of the %s are now limited to %lu/s, %lu at once (0 is unlimited).\n", target, rate, burst);
+    return 1;
+}
+
+int flood_set_penalty(char *penalty_name, unsigned int mute_time)
+{
+    unsigned int i;
+
+    for(i=0; i<sizeof(penalty_names)/sizeof(penalty_names[0]); i++)
+    {
+        if(strcmp(penalty_name, penalty_names[i]) == 0)
+        {
+            penalty = i;
+            if(mute_time > 0)
+                mute_seconds = mute_time;
+
+            printf("Users sending messages too fast are now penalized with \"%s\"", penalty_names[i]);
+            if(penalty == FLOOD_MUTE)
+                printf(" (%u seconds)", mute_seconds);
+            printf(".\n");
+            return 1;
+        }
+    }
+
+    printf("Unknown flood penalty \"%s\". Use drop, delay, mute or disconnect.\n", penalty_name);
+    return 0;
+}
+
+//Prints the flood limits, what they have held back so far, and the users being penalized right now. Also sent back to a remote admin
+void flood_stats()
+{
+    char *stats_msg;
+    int msg_size = 0, printed = 0;
+    User *curr, *tmp;
+
+    stats_msg = malloc((total_users + 4) * (USERNAME_LENG+1 + 128));
+
+    sprintf(stats_msg, "Flood limits: %lu msgs/s per user (burst: %lu), %lu msgs/s per group (burst: %lu), penalty: %s (mute: %u s)\n"
+            "Dropped: %lu user messages, %lu group messages. Penalized: %lu delays, %lu mutes, %lu disconnects%n",
+            user_rate, user_burst, group_rate, group_burst, penalty_names[penalty], mute_seconds,
+            user_msgs_dropped, group_msgs_dropped, users_delayed, users_muted, users_disconnected, &msg_size);
+
+    HASH_ITER(hh, active_users, curr, tmp)
+    {
+        if(!curr->flood_paused && !curr->flood_muted)
+            continue;
+
+        sprintf(&stats_msg[msg_size], "\n  \"%s\": %s%n", curr->username, (curr->flood_muted)? "muted" : "delayed", &printed);
+        msg_size += printed;
+    }
+
+    printf("%s\n", stats_msg);
+    if(current_client && current_client->connection_type == USER_CONNECTION)
+        send_long_msg(current_client, stats_msg, msg_size+1);
+
+    free(stats_msg);
+}
@@ -0,0 +1,39 @@
+#ifndef _FLOOD_CONTROL_H_
+#define _FLOOD_CONTROL_H_
+
+#include "server_common.h"
+
+#define FLOOD_DEFAULT_USER_RATE     10                  //Messages per second each user may send. 0 is unlimited
+#define FLOOD_DEFAULT_USER_BURST    20                  //Messages a quiet user may send at once
+#define FLOOD_DEFAULT_GROUP_RATE    100                 //Messages per second each group may fan out to its members. 0 is unlimited
+#define FLOOD_DEFAULT_GROUP_BURST   200
+#define FLOOD_DEFAULT_MUTE          30                  //Seconds a flooding user stays muted, with the "mute" penalty
+
+
+//What happens to a user who sends faster than the user limit allows
+enum flood_penalty {
+    FLOOD_DROP = 0,             //Messages over the limit are dropped. The user is told once per flood
+    FLOOD_DELAY,                //The connection is not read from until the user may send again, which pushes back on the sender
+    FLOOD_MUTE,                 //The user loses CAN_TALK in every joined group for a while (messages over the limit are dropped too)
+    FLOOD_DISCONNECT
+};
+
+
+struct group;
+struct groupmember;
+
+
+void flood_add_user(User *user);
+void flood_add_group(struct group *group);
+int flood_admit_user(Client *c);
+int flood_admit_group(Client *c, struct group *group);
+void flood_mute_member(User *user, struct groupmember *member);
+void flood_timer_expired(TimerEvent *event);
+void flood_remove_user(User *user);
+
+int flood_set_limit(char *target, uint64_t rate, uint64_t burst);
+int flood_set_penalty(char *penalty, unsigned int mute_seconds);
+void flood_stats();
+
+
+#endif
@@ -2,6 +2,8 @@
 #include "group.h"
 #include "server.h"
 
+#include <sys/random.h>
+
 
 Group *groups = NULL;                               //Hashtable of all user created private chatrooms (key = groupname)                      
 Group *lobby = NULL;                                //Lobby group for untargeted messages
@@ -27,6 +29,7 @@ int create_lobby_group()
 
     lobby->default_user_permissions = LOBBY_USER_PERM;
     lobby->group_flags = LOBBY_FLAGS;
+    lobby->history_id = 0;
 
     return 1;
 }
@@ -52,6 +55,7 @@ unsigned int send_group(Group* group, char* buffer, size_t size)
         else
             ++members_sent;
     }
+    metrics_fanout(members_sent);
 
     return members_sent;
 }
@@ -63,9 +67,19 @@ unsigned int send_lobby(Client *c, char* buffer, size_t size)
     HASH_FIND_PTR(lobby->members, &c, sending_member);
     if(!sending_member)
         return 0;
+
+    //Users muted in the lobby (or for flooding) cannot talk there either
+    if(!(sending_member->permissions & GRP_PERM_CAN_TALK))
+    {
+        send_error_code(c, ERR_NO_PERMISSION, lobby->groupname);
+        return 0;
+    }
+    if(!flood_admit_group(c, lobby))
+        return 0;
     
     sprintf(bcast_buffer, "%s (%s): %s", c->user->username, lobby->groupname, buffer);
     send_group(lobby, bcast_buffer, strlen(bcast_buffer)+1);
+    archive_group_msg(lobby, c->user->username, buffer);
 }
 
 unsigned int send_all_joined_groups(Client *c, char *buffer, size_t size)
@@ -118,9 +132,13 @@ int group_msg()
         return 0;
     }
 
+    if(!flood_admit_group(current_client, target))
+        return 0;
+
     //Forward message to the target
     sprintf(gmsg, "%s (%s): %s", current_client->user->username, target->groupname, msg_body);
     send_group(target, gmsg, strlen(gmsg)+1);
+    archive_group_msg(target, current_client->user->username, msg_body);
 
     return 1;
 }
@@ -163,6 +181,7 @@ Group_Member* allocate_group_member(Group *group, Client *c, int permissions)
     newmember = calloc(1, sizeof(Group_Member));
     newmember->c = c;
     newmember->permissions = permissions;
+    flood_mute_member(c->user, newmember);
 
     //Add the new user's entry to the group's userlist
     HASH_ADD_PTR(group->members, c, newmember);
@@ -189,13 +208,12 @@ void remove_group(Group *group)
     File_List *cur_file, *tmp_file;
     char group_files_directory[MAX_FILE_PATH+1];
 
-    IP_List *cur_ip, *tmp_ip;
-
     if(group->group_flags & GRP_FLAG_PERSISTENT)
     {
         printf("Group \"%s\" has a persistent flag. Skip deleting.\n", group->groupname);
         return;
     }
+    journal_group_removed(group);
     
     mcount = HASH_COUNT(group->members);
     if(mcount > 0)
@@ -232,19 +250,18 @@ void remove_group(Group *group)
     }
 
     //Free the banned IP list
-    HASH_ITER(hh, group->banned_ips, cur_ip, tmp_ip)
-    {
-        free(cur_ip);
-    }
+    ip_trie_clear(&group->banned_ips);
+
+    //Stop every upload and download of the group's files before they are freed
+    cancel_group_transfers(group);
 
     //Delete all files uploaded to this group
     HASH_ITER(hh, group->filelist, cur_file, tmp_file)
     {
-        printf("Removing local file \"%s\" from deleted group \"%s\"\n", cur_file->target_file, group->groupname);
+        printf("Removing file \"%s\" from deleted group \"%s\"\n", cur_file->filename, group->groupname);
         
-        if(remove(cur_file->target_file) < 0)
-            perror("Failed to delete file.");
-
+        if(cur_file->blob)
+            release_blob(cur_file->blob);
         free(cur_file);
     }
     
@@ -412,6 +429,19 @@ int userlist_group(char *group_name)
     return mcount;
 }
 
+//A group's history is only readable by the group it was started for. Ids are random, so that they are not reused even by a
+//server that has lost track of the groups it removed
+static uint64_t new_history_id()
+{
+    uint64_t id = 0;
+
+    while(!id)
+        if(getrandom(&id, sizeof(id), 0) != sizeof(id))
+            id = (uint64_t)time(NULL) << 32 ^ monotonic_ms() ^ (uint64_t)rand() << 16;
+
+    return id;
+}
+
 static Group* create_new_group_direct(char *groupname, int skip_name_check)
 {
     Group *newgroup;
@@ -436,11 +466,28 @@ static Group* create_new_group_direct(char *groupname, int skip_name_check)
     strcpy(newgroup->groupname, groupname);
     newgroup->default_user_permissions = GRP_PERM_DEFAULT;
     newgroup->group_flags = GRP_FLAG_DEFAULT;
+    newgroup->storage_quota = GROUP_STORAGE_QUOTA;
+    newgroup->file_ttl = GROUP_FILE_TTL;
+    newgroup->history_id = new_history_id();
+    flood_add_group(newgroup);
     HASH_ADD_STR(groups, groupname, newgroup);
+    journal_group(newgroup);
 
     return newgroup;
 }
 
+//Returns the group of that name, created with default settings if it doesn't exist yet. Used while the server's state is restored (see state_journal.c)
+Group* restore_group(char *groupname)
+{
+    Group *group;
+
+    HASH_FIND_STR(groups, groupname, group);
+    if(!group)
+        group = create_new_group_direct(groupname, 1);
+
+    return group;
+}
+
 static int invite_to_group_direct(Group *group, User *user);
 int create_new_group()
 {
@@ -580,7 +627,8 @@ int join_group()
 
     Group *group;
     Group_Member *newmember = NULL;
-    IP_List *ban_record;
+    IPPrefix addr;
+    IPTrieNode *ban_record;
 
     sscanf(buffer, "!join %s", groupname);
     groupname_plain = plain_name(groupname);
@@ -595,7 +643,8 @@ int join_group()
     }
 
     //Check if the user's IP has been banned from the group already
-    HASH_FIND_INT(group->banned_ips, &current_client->sockaddr.sin_addr.s_addr, ban_record);
+    sockaddr_prefix(&current_client->sockaddr, &addr);
+    ban_record = ip_trie_match(&group->banned_ips, &addr);
 
     //Check if a member entry already exists in this group
     HASH_FIND_PTR(group->members, &current_client, newmember);
@@ -740,16 +789,59 @@ int invite_to_group()
 }
 
 
-static int kick_ban_from_group(int ban_users)
+static void ban_prefix_from_group(Group *group, IPPrefix *range)
+{
+    int created;
+
+    ip_trie_insert(&group->banned_ips, range, &created);
+    if(created)
+        journal_ban(group, range, 1);
+}
+
+static void kick_member(Group *group, Group_Member *target_member, int ban_users, char *reason)
 {
     char kick_msg[MAX_MSG_LENG+1];
+
+    //Announce to other members about the kick
+    sprintf(kick_msg, "%s=%s,from=%s,by=%s,reason=%s", 
+            (ban_users)? "!banned":"!kicked", target_member->c->user->username, group->groupname, current_client->user->username, reason);
+    printf("%s\n", kick_msg);
+    send_group(group, kick_msg, strlen(kick_msg)+1);
+
+    //Remove the member from the group
+    leave_group_direct(group, target_member->c, (ban_users)? "Banned" : "Kicked", 1);
+}
+
+//Bans an IP address range, and kicks the joined members connected from inside it. The calling member is spared,
+//so that the group outlives the ban
+static void ban_range_from_group(Group *group, IPPrefix *range)
+{
+    char ban_msg[MAX_MSG_LENG+1], range_str[IP_PREFIX_STRLEN];
+    IPPrefix addr;
+    Group_Member *member, *tmp;
+
+    ban_prefix_from_group(group, range);
+    format_ip_prefix(range, range_str);
+
+    sprintf(ban_msg, "IP range \"%s\" has been banned by \"%s\" from group \"%s\"", range_str, current_client->user->username, group->groupname);
+    printf("%s\n", ban_msg);
+    send_group(group, ban_msg, strlen(ban_msg)+1);
+
+    HASH_ITER(hh, group->members, member, tmp)
+    {
+        sockaddr_prefix(&member->c->sockaddr, &addr);
+        if(member->c != current_client && (member->permissions & GRP_PERM_HAS_JOINED) && ip_prefix_contains(range, &addr))
+            kick_member(group, member, 1, range_str);
+    }
+}
+
+static int kick_ban_from_group(int ban_users)
+{
     char *newbuffer = msg_body, *token;
-    char *leave_reason = "Kicked";
 
     Group* group;
     Group_Member* target_member;
-    User *target_user;
-    IP_List *ban_entry;
+    IPPrefix range;
 
     if(!msg_target)
         return 0;
@@ -776,34 +868,24 @@ static int kick_ban_from_group(int ban_users)
         target_member = find_member_from_name(group, token);
         if(!target_member)
         {
-            send_error_code(current_client, ERR_USER_NOT_FOUND, token);
+            //Bans may also be given as an IP address or range (CIDR)
+            if(ban_users && parse_ip_prefix(token, &range))
+                ban_range_from_group(group, &range);
+            else
+                send_error_code(current_client, ERR_USER_NOT_FOUND, token);
+
             token = strtok(NULL, " ");
             continue;
         }
 
-        //Add the user's associated IP address to the ban list, if requested
+        //Add the member's associated IP address to the ban list, if requested
         if(ban_users)
         {
-            HASH_FIND_INT(group->banned_ips, &(uint32_t){current_client->sockaddr.sin_addr.s_addr}, ban_entry);
-            if(!ban_entry)
-            {
-                ban_entry = calloc(1, sizeof(IP_List));
-                ban_entry->ipaddr = current_client->sockaddr.sin_addr.s_addr;
-                HASH_ADD_INT(group->banned_ips, ipaddr, ban_entry);
-            }
-
-            leave_reason = "Banned";
-        }    
-
-        //Announce to other members about the kick
-        sprintf(kick_msg, "%s=%s,from=%s,by=%s,reason=%s", 
-                (ban_users)? "!banned":"!kicked", target_member->c->user->username, group->groupname, current_client->user->username, "none");
-        printf("%s\n", kick_msg);
-        send_group(group, kick_msg, strlen(kick_msg)+1);
-
-        //Remove the member from the group
-        leave_group_direct(group, target_member->c, leave_reason, 1);
+            sockaddr_prefix(&target_member->c->sockaddr, &range);
+            ban_prefix_from_group(group, &range);
+        }
 
+        kick_member(group, target_member, ban_users, "none");
         token = strtok(NULL, " ");
     }
 
@@ -828,9 +910,8 @@ int unban_from_group()
     Group_Member* calling_member;
     User *unban_user;
 
-    IP_List *ban_entry;
-    uint32_t target_ipaddr;
-    char ipaddr_str[INET_ADDRSTRLEN];
+    IPPrefix range;
+    char range_str[IP_PREFIX_STRLEN];
 
     if(!msg_target)
         return 0;
@@ -853,16 +934,9 @@ int unban_from_group()
     token = strtok(NULL, " ");
     while(token)
     {
-        //Locate the member to be unbanned (from the global list of users)
-        HASH_FIND_STR(active_users, token, unban_user);
-        if(unban_user)
-            target_ipaddr = unban_user->c->sockaddr.sin_addr.s_addr;
-
-        //We also allowed banned hostname/IP addresses to be entered 
-        else if(hostname_to_ip(token, "0", ipaddr_str))
-            target_ipaddr = inet_addr(ipaddr_str);
-
-        else
+        //Locate the member to be unbanned (from the global list of users). We also allow banned IP addresses/ranges
+        //and hostnames to be entered
+        if(!ban_target_prefix(token, &range, &unban_user))
         {
             printf("Target \"%s\" was not found or not banned.\n", token);
             send_error_code(current_client, ERR_USER_NOT_FOUND, token);
@@ -870,12 +944,10 @@ int unban_from_group()
             continue;
         }
 
-        //Unban the IP address, if an entry was located
-        HASH_FIND_INT(group->banned_ips, &target_ipaddr, ban_entry);
-        if(ban_entry)
+        //Unban the IP address/range, if an entry was located
+        if(ip_trie_remove(&group->banned_ips, &range))
         {
-            HASH_DEL(group->banned_ips, ban_entry);
-            free(ban_entry);
+            journal_ban(group, &range, 0);
             
             //Announce the user/IP has been unbanned
             if(unban_user)
@@ -883,7 +955,7 @@ int unban_from_group()
                         unban_user->username, current_client->user->username, group->groupname);
             else
                 sprintf(unban_msg, "IP address \"%s\" has been unbanned by \"%s\" from group \"%s\"", 
-                        ipaddr_str, current_client->user->username, group->groupname);
+                        format_ip_prefix(&range, range_str), current_client->user->username, group->groupname);
                 
             printf("%s\n", unban_msg);
             send_group(group, unban_msg, strlen(unban_msg)+1);
@@ -920,12 +992,19 @@ static inline void set_member_permission_single(int *target_permission, enum Set
     }
 }
 
+//Setting a member's CAN_TALK by hand overrides its flood mute. When the mute ends, the member keeps what it was set to
+static inline void override_flood_mute(Group_Member *member, enum SetPermActions action, int permission_mask)
+{
+    if(action == SET_PERM || (permission_mask & GRP_PERM_CAN_TALK))
+        member->flood_muted = 0;
+}
+
 int set_member_permission()
 {
     char change_msg[MAX_MSG_LENG+1];
     char *newbuffer = msg_body, *token , *target;
     Group* group;
-    Group_Member *target_member, *tmp;
+    Group_Member *target_member, *tmp, *changed_member = NULL;
 
     int *target_permission = NULL;
     int all_targets = 0;
@@ -984,6 +1063,7 @@ int set_member_permission()
         }
 
         target_permission = &target_member->permissions;
+        changed_member = target_member;
     }
     target = token;
 
@@ -1082,6 +1162,7 @@ int set_member_permission()
                 
                 target_permission = &target_member->permissions;
                 set_member_permission_single(target_permission, action, permission_mask);
+                override_flood_mute(target_member, action, permission_mask);
             }
             sprintf(change_msg, "Applied permission change \"%s\" to ALL USERS in group \"%s\", by \"%s\"",
                 token, group->groupname, current_client->user->username);
@@ -1089,6 +1170,8 @@ int set_member_permission()
         else
         {
             set_member_permission_single(target_permission, action, permission_mask);
+            if(changed_member)
+                override_flood_mute(changed_member, action, permission_mask);
             sprintf(change_msg, "Applied permission change \"%s\" to user \"%s\" in group \"%s\", by \"%s\"",
                 token, target, group->groupname, current_client->user->username);
         }
@@ -1099,6 +1182,10 @@ int set_member_permission()
         token = strtok(NULL, " ");
     }
 
+    //Members' own permissions last as long as their connection, but the template for new members is kept
+    if(target_permission == &group->default_user_permissions)
+        journal_group(group);
+
     return 1;
 }
 
@@ -1161,12 +1248,13 @@ int set_group_permission()
         token = strtok(NULL, " ");
     }
 
+    journal_group(group);
     return 1;
 }
 
 int group_namechange(char *groupname, char *newname)
 {
-    char namechange_msg[MAX_MSG_LENG+1];
+    char namechange_msg[MAX_MSG_LENG+1], oldname[USERNAME_LENG+1];
     Group *current_group, *exiting_group;
     Group_Member *calling_member;
 
@@ -1200,9 +1288,11 @@ int group_namechange(char *groupname, char *newname)
     sprintf(namechange_msg, "!namechange=%s,%s,g", current_group->groupname, newname);
 
     //Update the group from the list of groups on the server
+    strcpy(oldname, current_group->groupname);
     HASH_DEL(groups, current_group);
     strcpy(current_group->groupname, newname);
     HASH_ADD_STR(groups, groupname, current_group);
+    journal_group_renamed(oldname, current_group);
     send_group(current_group, namechange_msg, strlen(namechange_msg)+1);
 
     return 1;
@@ -1225,6 +1315,7 @@ int group_filelist()
 
     unsigned int file_count;
     File_List *curr, *temp;
+    size_t received;
 
     if(!msg_target)
         return 0;
@@ -1249,8 +1340,17 @@ int group_filelist()
     //Iterate through the list of available files and append them to the buffer one at a time
     HASH_ITER(hh, group->filelist, curr, temp)
     {
-        sprintf(&filelist_msg[msg_size], ",[%u,%s,%zu,%s]%n", 
-                curr->fileid, curr->filename, curr->filesize, curr->uploader, &printed);
+        //Files still being uploaded also show how much of them has arrived
+        received = curr->filesize;
+        if(curr->upload)
+        {
+            xfer_thread_lock_transfer(curr->upload);
+            received = curr->upload->transferred;
+            xfer_thread_unlock_transfer(curr->upload);
+        }
+
+        sprintf(&filelist_msg[msg_size], ",[%u,%s,%zu,%s,%zu]%n", 
+                curr->fileid, curr->filename, curr->filesize, curr->uploader, received, &printed);
         
         msg_size += printed;
     }
@@ -1261,29 +1361,89 @@ int group_filelist()
     return file_count;
 }
 
-int add_file_to_group(Group *group, char *uploader, char *filename, size_t filesize, unsigned int checksum, char *target_file)
+static File_List* new_group_file(Group *group, char *uploader, char *filename, size_t filesize, unsigned int checksum)
 {
     File_List *new_file = calloc(1, sizeof(File_List));
-    char new_file_msg[MAX_MSG_LENG+1];
 
     strcpy(new_file->uploader, uploader);
     strcpy(new_file->filename, filename);
-    strcpy(new_file->target_file, target_file);
     new_file->filesize = filesize;
     new_file->checksum = checksum;
     new_file->fileid = ++group->last_fileid;
+    new_file->stored_at = new_file->last_download = time(NULL);
 
+    //Expired files are unlisted by the periodic storage sweep (see group_storage.c)
     HASH_ADD_INT(group->filelist, fileid, new_file);
 
-    //TODO: Expiry timer for files uploaded to groups
+    return new_file;
+}
+
+static void announce_group_file(Group *group, File_List *file, char *announcement)
+{
+    char new_file_msg[MAX_MSG_LENG+1];
 
-    sprintf(new_file_msg, "!putfile=%s,filename=%s,id=%u,size=%zu,uploader=%s", 
-                group->groupname, new_file->filename, new_file->fileid, new_file->filesize, new_file->uploader);
+    sprintf(new_file_msg, "!%s=%s,filename=%s,id=%u,size=%zu,uploader=%s", 
+                announcement, group->groupname, file->filename, file->fileid, file->filesize, file->uploader);
     send_group(group, new_file_msg, strlen(new_file_msg)+1);
+}
+
+int add_file_to_group(Group *group, char *uploader, char *filename, Blob *blob)
+{
+    File_List *new_file = new_group_file(group, uploader, filename, blob->filesize, blob->checksum);
+
+    //Files with identical contents share a single stored copy
+    new_file->blob = blob;
+    acquire_blob(blob);
+    journal_file(group, new_file);
+
+    announce_group_file(group, new_file, "putfile");
+    return new_file->fileid;
+}
+
+//Lists a file as soon as its upload starts, so members can download it while it arrives
+int add_uploading_file_to_group(Group *group, char *uploader, char *filename, size_t filesize, unsigned int checksum, struct filexferargs_server *upload)
+{
+    File_List *new_file = new_group_file(group, uploader, filename, filesize, checksum);
+
+    new_file->upload = upload;
 
+    announce_group_file(group, new_file, "uploading");
     return new_file->fileid;
 }
 
+//The upload of a listed file has been verified and stored. Returns 0 if the file is no longer listed
+int complete_uploading_file(Group *group, unsigned int fileid, Blob *blob)
+{
+    File_List *file;
+
+    HASH_FIND_INT(group->filelist, &fileid, file);
+    if(!file || !file->upload)
+        return 0;
+
+    file->upload = NULL;
+    file->blob = blob;
+    file->stored_at = time(NULL);
+    acquire_blob(blob);
+    journal_file(group, file);
+
+    announce_group_file(group, file, "putfile");
+    return 1;
+}
+
+//The upload of a listed file failed, or was cancelled
+void remove_uploading_file(Group *group, unsigned int fileid)
+{
+    File_List *file;
+
+    HASH_FIND_INT(group->filelist, &fileid, file);
+    if(!file || !file->upload)
+        return;
+
+    printf("Unlisting \"%s\" (fileid: %u) from group \"%s\", as its upload did not complete.\n", file->filename, file->fileid, group->groupname);
+    HASH_DEL(group->filelist, file);
+    free(file);
+}
+
 int remove_file_from_group()
 {
     Group *group;
@@ -1320,13 +1480,22 @@ int remove_file_from_group()
         return 0;
     }
 
+    //A file still being uploaded is removed by cancelling its upload instead
+    if(requested_file->upload)
+    {
+        printf("File %u in group \"%s\" is still being uploaded.\n", fileid, group->groupname);
+        send_error_code(current_client, ERR_INCORRECT_INFO, NULL);
+        return 0;
+    }
+
     //Announce the deletion to the group
     sprintf(del_msg, "File \"%s\" (fileid: %d, uploader: \"%s\") has been deleted by \"%s\".", 
                 requested_file->filename, requested_file->fileid,  requested_file->uploader, target_member->c->user->username);
     send_group(group, del_msg, strlen(del_msg)+1);
 
-    //Delete the physical file and remove it from the file list
-    remove(requested_file->target_file);
+    //Remove the file from the file list. Its contents are deleted once no other group refers to them
+    journal_file_removed(group, requested_file);
+    release_blob(requested_file->blob);
     HASH_DEL(group->filelist, requested_file);
     free(requested_file);
 
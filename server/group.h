@@ -1,6 +1,8 @@
 #ifndef _GROUP_H_
 #define _GROUP_H_
 
+#include "ip_trie.h"
+
 /*Permisison flags for group members*/
 #define GRP_PERM_HAS_JOINED     0x1
 #define GRP_PERM_CAN_TALK       0x2
@@ -32,23 +34,27 @@
 
 /*Data structures*/
 
-typedef struct {
+typedef struct filelist {
 
     unsigned int fileid;
     char uploader[USERNAME_LENG+1];
     char filename[MAX_FILENAME+1];
     size_t filesize;
     unsigned int checksum;
-    char target_file[MAX_FILE_PATH+1];
+    struct blob *blob;                  //The stored contents of this file, which may be shared with other groups
+    struct filexferargs_server *upload; //Set (instead of blob) while the file is still being uploaded. Members may download it as it arrives
+    time_t stored_at;                   //When the upload completed. The file expires a group's file_ttl after this
+    time_t last_download;               //Least recently downloaded files are evicted first when storage runs out
 
     UT_hash_handle hh;
 
 } File_List;
 
 
-typedef struct {
+typedef struct groupmember {
     Client *c;
     int permissions;
+    unsigned int flood_muted :1;        //CAN_TALK was taken away for flooding, and is given back once the mute is over
 
     UT_hash_handle hh;
 } Group_Member;
@@ -60,12 +66,20 @@ typedef struct group {
     int group_flags;
     int default_user_permissions;
 
-    //Banned IPs from joining this group
-    IP_List *banned_ips;
+    //Banned IPs (and ranges) from joining this group
+    IPTrie banned_ips;
     
     //For group file sharing
     unsigned int last_fileid;
     File_List *filelist;
+    uint64_t storage_quota;             //Bytes of files this group may list. 0 is unlimited
+    unsigned int file_ttl;              //Seconds a stored file stays listed. 0 never expires
+
+    //Messages fanned out to the members, limited by flood_control.c
+    TokenBucket msg_bucket;
+
+    //Names the group's chat history (see chat_history.c). Random for every new group, and kept through renames. 0 for the lobby
+    uint64_t history_id;
 
     UT_hash_handle hh;
 } Group;
@@ -100,6 +114,7 @@ int grouplist();
 int userlist_group(char *group_name);
 
 int create_new_group();
+Group* restore_group(char *groupname);
 int leave_group_direct(Group *group, Client *c, char *reason, int delete_group_joined_entry);
 int leave_group();
 int join_group();
@@ -112,7 +127,10 @@ int set_group_permission();
 int group_namechange(char *groupname, char *newname);
 
 int group_filelist();
-int add_file_to_group(Group *group, char *uploader, char *filename, size_t filesize, unsigned int checksum, char *target_file);
+int add_file_to_group(Group *group, char *uploader, char *filename, struct blob *blob);
+int add_uploading_file_to_group(Group *group, char *uploader, char *filename, size_t filesize, unsigned int checksum, struct filexferargs_server *upload);
+int complete_uploading_file(Group *group, unsigned int fileid, struct blob *blob);
+void remove_uploading_file(Group *group, unsigned int fileid);
 int remove_file_from_group();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,291 @@
+#include "group_storage.h"
+#include "server.h"
+
+
+uint64_t global_storage_quota = GLOBAL_STORAGE_QUOTA;
+TimerEvent *storage_sweep_timer;
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+//Bytes of files listed in a group, including files still being uploaded
+static size_t group_listed_size(Group *group)
+{
+    File_List *file, *tmp;
+    size_t total = 0;
+
+    HASH_ITER(hh, group->filelist, file, tmp)
+        total += file->filesize;
+
+    return total;
+}
+
+//Bytes stored on the server for all groups: every stored blob once, and the uploads being received
+static size_t global_storage_size()
+{
+    Group *group, *group_tmp;
+    File_List *file, *tmp;
+    size_t total = blob_store_size;
+
+    HASH_ITER(hh, groups, group, group_tmp)
+        HASH_ITER(hh, group->filelist, file, tmp)
+            if(file->upload)
+                total += file->filesize;
+
+    return total;
+}
+
+//Files still being uploaded, and files holding the "keep" contents, are never evicted.
+//For the server's quota only the last reference to some contents frees any space, so "sole_copy" skips the others
+static int file_is_evictable(File_List *file, Blob *keep, int sole_copy)
+{
+    if(!file->blob || file->blob == keep)
+        return 0;
+
+    return !sole_copy || file->blob->refcount == 1;
+}
+
+static size_t evictable_size(Group *group, Blob *keep, int sole_copy)
+{
+    Group *curr, *group_tmp;
+    File_List *file, *tmp;
+    size_t total = 0;
+
+    HASH_ITER(hh, groups, curr, group_tmp)
+    {
+        if(group && curr != group)
+            continue;
+
+        HASH_ITER(hh, curr->filelist, file, tmp)
+            if(file_is_evictable(file, keep, sole_copy))
+                total += file->filesize;
+    }
+
+    return total;
+}
+
+//Finds the least recently downloaded file that may be evicted, in a single group (or in every group, if NULL)
+static File_List* least_recently_used(Group *group, Blob *keep, int sole_copy, Group **group_ret)
+{
+    Group *curr, *group_tmp;
+    File_List *file, *tmp, *lru = NULL;
+
+    HASH_ITER(hh, groups, curr, group_tmp)
+    {
+        if(group && curr != group)
+            continue;
+
+        HASH_ITER(hh, curr->filelist, file, tmp)
+        {
+            if(!file_is_evictable(file, keep, sole_copy))
+                continue;
+
+            if(!lru || file->last_download < lru->last_download)
+            {
+                lru = file;
+                *group_ret = curr;
+            }
+        }
+    }
+
+    return lru;
+}
+
+//Unlists a stored file, and tells the group why. Its contents are deleted once no other group refers to them
+static void evict_file(Group *group, File_List *file, char *reason)
+{
+    char evict_msg[MAX_MSG_LENG+1];
+
+    sprintf(evict_msg, "File \"%s\" (fileid: %u, uploader: \"%s\") has been removed from group \"%s\". Reason: \"%s\"",
+            file->filename, file->fileid, file->uploader, group->groupname, reason);
+    printf("%s\n", evict_msg);
+    send_group(group, evict_msg, strlen(evict_msg)+1);
+
+    journal_file_removed(group, file);
+    release_blob(file->blob);
+    HASH_DEL(group->filelist, file);
+    free(file);
+}
+
+static void enforce_group_quota(Group *group, size_t incoming, Blob *keep)
+{
+    Group *victim_group;
+    File_List *victim;
+
+    while(group->storage_quota && group_listed_size(group) + incoming > group->storage_quota)
+    {
+        victim = least_recently_used(group, keep, 0, &victim_group);
+        if(!victim)
+            break;
+
+        evict_file(victim_group, victim, "GroupQuotaExceeded");
+    }
+}
+
+static void enforce_global_quota(size_t incoming)
+{
+    Group *victim_group;
+    File_List *victim;
+
+    while(global_storage_quota && global_storage_size() + incoming > global_storage_quota)
+    {
+        victim = least_recently_used(NULL, NULL, 1, &victim_group);
+        if(!victim)
+            break;
+
+        evict_file(victim_group, victim, "ServerQuotaExceeded");
+    }
+}
+
+
+
+/******************************/
+/*    Admission and Sweeps    */
+/******************************/
+
+int group_storage_init()
+{
+    storage_sweep_timer = calloc(1, sizeof(TimerEvent));
+    storage_sweep_timer->event_type = STORAGE_SWEEP;
+
+    storage_sweep_timer->timerfd = create_timerfd(STORAGE_SWEEP_PERIOD, 1, timers_epollfd);
+    if(!storage_sweep_timer->timerfd)
+    {
+        free(storage_sweep_timer);
+        return 0;
+    }
+    HASH_ADD_INT(timers, timerfd, storage_sweep_timer);
+
+    return 1;
+}
+
+//Makes room for a new group file before any of its bytes are accepted, evicting the least recently downloaded files if needed.
+//"stored" is set if the server already has the file's contents, which then take no more space on the server. Returns 0 if the file cannot fit
+int admit_group_upload(Group *group, size_t filesize, Blob *stored)
+{
+    //Don't evict anything for a file that would not fit anyway
+    if(group->storage_quota && group_listed_size(group) - evictable_size(group, stored, 0) + filesize > group->storage_quota)
+    {
+        printf("File of %zu bytes does not fit in the storage quota of group \"%s\" (%lu bytes).\n", filesize, group->groupname, group->storage_quota);
+        return 0;
+    }
+
+    if(!stored && global_storage_quota && global_storage_size() - evictable_size(NULL, NULL, 1) + filesize > global_storage_quota)
+    {
+        printf("File of %zu bytes does not fit in the server's storage quota (%lu bytes).\n", filesize, global_storage_quota);
+        return 0;
+    }
+
+    enforce_group_quota(group, filesize, stored);
+    if(!stored)
+        enforce_global_quota(filesize);
+
+    return 1;
+}
+
+//Runs periodically on the timer thread. Unlists expired files, and evicts files from groups (or the server) over their quota
+void group_storage_sweep()
+{
+    Group *group, *group_tmp;
+    File_List *file, *tmp;
+    time_t now = time(NULL);
+
+    HASH_ITER(hh, groups, group, group_tmp)
+    {
+        if(group->file_ttl)
+        {
+            HASH_ITER(hh, group->filelist, file, tmp)
+                if(file->blob && now - file->stored_at >= group->file_ttl)
+                    evict_file(group, file, "Expired");
+        }
+
+        enforce_group_quota(group, 0, NULL);
+    }
+
+    enforce_global_quota(0);
+}
+
+
+
+/******************************/
+/*       Admin Settings       */
+/******************************/
+
+int storage_set_quota(char *groupname, uint64_t quota)
+{
+    Group *group;
+
+    if(strcmp(groupname, "*") == 0)
+    {
+        global_storage_quota = quota;
+        journal_storage_quota();
+        printf("Group files stored on the server are now limited to %lu bytes (0 is unlimited).\n", quota);
+    }
+    else
+    {
+        HASH_FIND_STR(groups, groupname, group);
+        if(!group)
+        {
+            printf("Group \"%s\" was not found.\n", groupname);
+            return 0;
+        }
+
+        group->storage_quota = quota;
+        journal_group(group);
+        printf("Files listed in group \"%s\" are now limited to %lu bytes (0 is unlimited).\n", group->groupname, quota);
+    }
+
+    //A lowered quota applies to the files stored already
+    group_storage_sweep();
+    return 1;
+}
+
+int storage_set_ttl(char *groupname, unsigned int ttl)
+{
+    Group *group;
+
+    HASH_FIND_STR(groups, groupname, group);
+    if(!group)
+    {
+        printf("Group \"%s\" was not found.\n", groupname);
+        return 0;
+    }
+
+    group->file_ttl = ttl;
+    journal_group(group);
+    printf("Files in group \"%s\" now expire %u seconds after they were uploaded (0 never expires).\n", group->groupname, ttl);
+
+    group_storage_sweep();
+    return 1;
+}
+
+void storage_stats()
+{
+    char *stats_msg;
+    int msg_size = 0, printed = 0;
+    Group *curr, *tmp;
+
+    stats_msg = malloc((HASH_COUNT(groups) + 2) * (USERNAME_LENG+1 + 128));
+
+    sprintf(stats_msg, "Group file storage: %zu bytes (quota: %lu bytes, stored contents: %zu bytes)%n",
+            global_storage_size(), global_storage_quota, blob_store_size, &msg_size);
+
+    HASH_ITER(hh, groups, curr, tmp)
+    {
+        if(!curr->filelist)
+            continue;
+
+        sprintf(&stats_msg[msg_size], "\n  \"%s\": %u files, %zu bytes (quota: %lu bytes, ttl: %u seconds)%n",
+                curr->groupname, HASH_COUNT(curr->filelist), group_listed_size(curr), curr->storage_quota, curr->file_ttl, &printed);
+        msg_size += printed;
+    }
+
+    printf("%s\n", stats_msg);
+    if(current_client && current_client->connection_type == USER_CONNECTION)
+        send_long_msg(current_client, stats_msg, msg_size+1);
+
+    free(stats_msg);
+}
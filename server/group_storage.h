@@ -0,0 +1,28 @@
+#ifndef _GROUP_STORAGE_H_
+#define _GROUP_STORAGE_H_
+
+#include "server_common.h"
+
+#define GROUP_STORAGE_QUOTA         2147483648ULL       //Bytes of files each group may list by default. 0 is unlimited
+#define GLOBAL_STORAGE_QUOTA        17179869184ULL      //Bytes the server may store for all groups. Contents shared by several groups count once. 0 is unlimited
+#define GROUP_FILE_TTL              604800              //Seconds a stored group file stays listed by default (a week). 0 never expires
+#define STORAGE_SWEEP_PERIOD        60                  //Seconds between sweeps for expired files and exceeded quotas
+
+
+struct group;
+struct blob;
+
+
+extern uint64_t global_storage_quota;
+
+
+int group_storage_init();
+int admit_group_upload(struct group *group, size_t filesize, struct blob *stored);
+void group_storage_sweep();
+
+int storage_set_quota(char *groupname, uint64_t quota);
+int storage_set_ttl(char *groupname, unsigned int ttl);
+void storage_stats();
+
+
+#endif
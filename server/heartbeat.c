@@ -0,0 +1,259 @@
+#include "heartbeat.h"
+#include "server.h"
+
+
+//Registered connections, by the tick they are checked next (linked through hb_prev/hb_next). Traffic on a connection only
+//stamps its last_activity. It is moved on the wheel when its slot comes up, so a busy connection costs one move per idle period
+static Client *wheel[HEARTBEAT_WHEEL_SLOTS];
+static uint64_t next_tick;                          //The first tick not swept yet
+static unsigned int tracked_connections;
+static TimerEvent *heartbeat_timer;
+
+static unsigned int idle_seconds = HEARTBEAT_IDLE;
+static unsigned int timeout_seconds = HEARTBEAT_TIMEOUT;
+static unsigned int stall_seconds = HEARTBEAT_STALL_TIMEOUT;
+
+//Totals since the server started, shown by !heartbeatstats
+static uint64_t pings_sent, users_timed_out, transfers_stalled, last_sweep_checked;
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static inline uint64_t last_activity(Client *c)
+{
+    return __atomic_load_n(&c->last_activity, __ATOMIC_RELAXED);
+}
+
+static inline Client** wheel_slot(uint64_t due)
+{
+    return &wheel[(due / HEARTBEAT_TICK_MS) % HEARTBEAT_WHEEL_SLOTS];
+}
+
+//Puts the connection in the slot of the tick it is due in. Ticks past the end of the wheel use its last slot, and are put back from there
+static void schedule(Client *c, uint64_t due)
+{
+    uint64_t first = next_tick * HEARTBEAT_TICK_MS, last = (next_tick + HEARTBEAT_WHEEL_SLOTS - 1) * HEARTBEAT_TICK_MS;
+
+    if(due < first)
+        due = first;
+    else if(due > last)
+        due = last;
+
+    c->heartbeat_due = due;
+    DL_APPEND2(*wheel_slot(due), c, hb_prev, hb_next);
+    ++tracked_connections;
+}
+
+static void unschedule(Client *c)
+{
+    DL_DELETE2(*wheel_slot(c->heartbeat_due), c, hb_prev, hb_next);
+    c->heartbeat_due = 0;
+    --tracked_connections;
+}
+
+//A user that has been silent for a while is pinged. Anything it sends afterwards counts as the answer
+static void check_user_connection(Client *c, uint64_t now)
+{
+    uint64_t last = last_activity(c);
+
+    //Pings are only sent after the last activity, so anything stamped since (even within the same millisecond) came after it
+    if(c->ping_sent_at && last >= c->ping_sent_at)
+        c->ping_sent_at = 0;
+
+    if(c->ping_sent_at)
+    {
+        if(now < c->ping_sent_at + timeout_seconds * 1000)
+        {
+            schedule(c, c->ping_sent_at + timeout_seconds * 1000);
+            return;
+        }
+
+        printf("User \"%s\" has not answered for %lu seconds. Disconnecting...\n", c->user->username, (now - last) / 1000);
+        ++users_timed_out;
+        disconnect_client(c, "Timed out");
+        return;
+    }
+
+    if(now < last + idle_seconds * 1000)
+    {
+        schedule(c, last + idle_seconds * 1000);
+        return;
+    }
+
+    //A ping that cannot be sent behind a pending long message still starts the timeout. Progress on that message counts as activity
+    c->ping_sent_at = now;
+    schedule(c, now + timeout_seconds * 1000);
+    ++pings_sent;
+    send_msg(c, "!ping", 6);
+}
+
+//A transfer connection waiting on the other end of its transfer (or for its bandwidth share) is not stalled itself
+static void check_transfer_connection(Client *c, uint64_t now)
+{
+    uint64_t last = last_activity(c);
+
+    if(__atomic_load_n(&c->xfer_waiting, __ATOMIC_RELAXED))
+        last = now;
+
+    if(now < last + stall_seconds * 1000)
+    {
+        schedule(c, last + stall_seconds * 1000);
+        return;
+    }
+
+    printf("Transfer connection (fd=%d) has not moved anything for %lu seconds. Closing...\n", c->socketfd, (now - last) / 1000);
+    ++transfers_stalled;
+    disconnect_client(c, "Transfer stalled");
+}
+
+
+
+/******************************/
+/*         Heartbeats         */
+/******************************/
+
+int heartbeat_init()
+{
+    next_tick = monotonic_ms() / HEARTBEAT_TICK_MS;
+
+    heartbeat_timer = calloc(1, sizeof(TimerEvent));
+    heartbeat_timer->event_type = HEARTBEAT_SWEEP;
+
+    heartbeat_timer->timerfd = create_timerfd(HEARTBEAT_TICK_MS / 1000, 1, timers_epollfd);
+    if(!heartbeat_timer->timerfd)
+    {
+        free(heartbeat_timer);
+        return 0;
+    }
+    HASH_ADD_INT(timers, timerfd, heartbeat_timer);
+
+    return 1;
+}
+
+//Starts watching a connection once it has registered as a user or transfer connection
+void heartbeat_track(Client *c)
+{
+    if(c->heartbeat_due)
+        return;
+
+    heartbeat_seen(c);
+    c->ping_sent_at = 0;
+    c->xfer_waiting = 0;
+    schedule(c, c->last_activity + ((c->connection_type == TRANSFER_CONNECTION)? stall_seconds : idle_seconds) * 1000);
+}
+
+void heartbeat_untrack(Client *c)
+{
+    if(!c->heartbeat_due)
+        return;
+
+    unschedule(c);
+}
+
+//Called on every read or write the connection makes. Transfer threads call it too, without client_lock
+void heartbeat_seen(Client *c)
+{
+    __atomic_store_n(&c->last_activity, monotonic_ms(), __ATOMIC_RELAXED);
+}
+
+//Transfer threads mark a connection as waiting while it has nothing to move through no fault of its own
+void heartbeat_waiting(Client *c, int waiting)
+{
+    __atomic_store_n(&c->xfer_waiting, waiting, __ATOMIC_RELAXED);
+    if(waiting)
+        heartbeat_seen(c);
+}
+
+//Checks the connections of every tick that has passed. Only connections due now are touched
+void heartbeat_sweep()
+{
+    uint64_t now = monotonic_ms(), now_tick = now / HEARTBEAT_TICK_MS;
+    int *due = NULL;
+    unsigned int due_count = 0, due_capacity = 0, ticks, i;
+    Client *c, *tmp;
+
+    for(ticks = 0; next_tick <= now_tick && ticks < HEARTBEAT_WHEEL_SLOTS; next_tick++, ticks++)
+    {
+        DL_FOREACH_SAFE2(wheel[next_tick % HEARTBEAT_WHEEL_SLOTS], c, tmp, hb_next)
+        {
+            if(c->heartbeat_due / HEARTBEAT_TICK_MS > now_tick)
+                continue;
+
+            if(due_count == due_capacity)
+            {
+                due_capacity = (due_capacity)? due_capacity * 2 : 64;
+                due = realloc(due, due_capacity * sizeof(int));
+            }
+            due[due_count++] = c->socketfd;
+            unschedule(c);
+        }
+    }
+    next_tick = now_tick + 1;
+
+    //Disconnecting a user also closes its transfer connections, so each one is looked up again before it is checked
+    for(i=0; i<due_count; i++)
+    {
+        HASH_FIND_INT(active_connections, &due[i], c);
+        if(!c || c->heartbeat_due)
+            continue;
+
+        if(c->connection_type == USER_CONNECTION)
+            check_user_connection(c, now);
+        else if(c->connection_type == TRANSFER_CONNECTION)
+            check_transfer_connection(c, now);
+    }
+
+    last_sweep_checked = due_count;
+    free(due);
+}
+
+
+
+/******************************/
+/*       Administration       */
+/******************************/
+
+//Sets one of the heartbeat timeouts: "idle" (silence before a user is pinged), "timeout" (time to answer a ping)
+//or "stall" (time a transfer connection may move nothing). Connections already waiting keep the time they were given
+int heartbeat_set_limit(char *limit, unsigned int seconds)
+{
+    if(seconds == 0)
+    {
+        printf("Heartbeat timeouts must be at least a second.\n");
+        return 0;
+    }
+
+    if(strcmp(limit, "idle") == 0)
+        idle_seconds = seconds;
+    else if(strcmp(limit, "timeout") == 0)
+        timeout_seconds = seconds;
+    else if(strcmp(limit, "stall") == 0)
+        stall_seconds = seconds;
+    else
+    {
+        printf("Heartbeat timeouts are \"idle\", \"timeout\" or \"stall\".\n");
+        return 0;
+    }
+
+    printf("Heartbeat \"%s\" timeout is now %u seconds.\n", limit, seconds);
+    return 1;
+}
+
+//Prints the heartbeat timeouts, and what they have caught so far. Also sent back to a remote admin
+void heartbeat_stats()
+{
+    char stats_msg[512];
+    int msg_size = 0;
+
+    sprintf(stats_msg, "Heartbeats: users pinged after %u s idle, dropped %u s later. Transfers dropped after %u s stalled\n"
+            "Watching %u connections (%lu checked in the last sweep). Pings sent: %lu, users timed out: %lu, transfers stalled: %lu%n",
+            idle_seconds, timeout_seconds, stall_seconds, tracked_connections, last_sweep_checked,
+            pings_sent, users_timed_out, transfers_stalled, &msg_size);
+
+    printf("%s\n", stats_msg);
+    if(current_client && current_client->connection_type == USER_CONNECTION)
+        send_long_msg(current_client, stats_msg, msg_size+1);
+}
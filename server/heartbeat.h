@@ -0,0 +1,24 @@
+#ifndef _HEARTBEAT_H_
+#define _HEARTBEAT_H_
+
+#include "server_common.h"
+
+#define HEARTBEAT_IDLE              10                  //Seconds a user connection may be silent before it is pinged
+#define HEARTBEAT_TIMEOUT           5                   //Seconds a pinged user has to answer (or send anything else) before it is disconnected
+#define HEARTBEAT_STALL_TIMEOUT     60                  //Seconds a transfer connection may go without moving any bytes of its own
+#define HEARTBEAT_TICK_MS           1000                //How often the wheel is swept
+#define HEARTBEAT_WHEEL_SLOTS       64                  //One slot per tick. Connections due further ahead wait in the last slot and are put back
+
+
+int heartbeat_init();
+void heartbeat_track(Client *c);
+void heartbeat_untrack(Client *c);
+void heartbeat_seen(Client *c);
+void heartbeat_waiting(Client *c, int waiting);
+void heartbeat_sweep();
+
+int heartbeat_set_limit(char *limit, unsigned int seconds);
+void heartbeat_stats();
+
+
+#endif
@@ -0,0 +1,323 @@
+#include "ip_trie.h"
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static inline int prefix_bit(uint8_t *addr, unsigned int bit)
+{
+    return (addr[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+//Leading bits "a" and "b" have in common, up to "limit"
+static unsigned int common_bits(uint8_t *a, uint8_t *b, unsigned int limit)
+{
+    unsigned int bits, i;
+    uint8_t diff;
+
+    for(i = 0, bits = 0; i < 16 && bits < limit; i++, bits += 8)
+    {
+        diff = a[i] ^ b[i];
+        if(diff)
+        {
+            while(!(diff & 0x80))
+            {
+                diff <<= 1;
+                ++bits;
+            }
+            break;
+        }
+    }
+
+    return (bits < limit)? bits : limit;
+}
+
+//"outer" is the same range as "inner", or a larger one containing it
+static inline int prefix_covers(IPPrefix *outer, IPPrefix *inner)
+{
+    return outer->length <= inner->length && common_bits(outer->addr, inner->addr, outer->length) == outer->length;
+}
+
+static void mask_prefix(IPPrefix *prefix)
+{
+    unsigned int i;
+
+    for(i = prefix->length; i < IP_ADDR_BITS; i++)
+        prefix->addr[i / 8] &= ~(0x80 >> (i % 8));
+}
+
+static int is_ipv4_mapped(uint8_t *addr)
+{
+    static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return memcmp(addr, mapped, sizeof(mapped)) == 0;
+}
+
+static IPTrieNode* new_node(IPPrefix *prefix, unsigned int length)
+{
+    IPTrieNode *node = calloc(1, sizeof(IPTrieNode));
+
+    node->prefix = *prefix;
+    node->prefix.length = length;
+    mask_prefix(&node->prefix);
+    return node;
+}
+
+static IPTrieNode* make_entry(IPTrie *trie, IPTrieNode *node, int *created_ret)
+{
+    if(created_ret)
+        *created_ret = !node->is_entry;
+
+    if(!node->is_entry)
+    {
+        node->is_entry = 1;
+        ++trie->count;
+    }
+    return node;
+}
+
+
+
+/******************************/
+/*     Addresses and Ranges   */
+/******************************/
+
+//"ipaddr" is in network order, like sockaddr_in's
+void ipv4_prefix(uint32_t ipaddr, unsigned int length, IPPrefix *prefix_ret)
+{
+    memset(prefix_ret, 0, sizeof(IPPrefix));
+    prefix_ret->addr[10] = 0xff;
+    prefix_ret->addr[11] = 0xff;
+    memcpy(&prefix_ret->addr[12], &ipaddr, sizeof(uint32_t));
+    prefix_ret->length = IP_V4_MAPPED_BITS + length;
+    mask_prefix(prefix_ret);
+}
+
+void sockaddr_prefix(struct sockaddr_in *sockaddr, IPPrefix *prefix_ret)
+{
+    ipv4_prefix(sockaddr->sin_addr.s_addr, 32, prefix_ret);
+}
+
+//Parses an IPv4 or IPv6 address, optionally followed by "/<prefix length>". Returns 0 if it is not one
+int parse_ip_prefix(char *str, IPPrefix *prefix_ret)
+{
+    char addr_str[INET6_ADDRSTRLEN+1], *slash, *length_end;
+    unsigned long length;
+    unsigned int addr_length, max_length;
+    struct in_addr addr_v4;
+
+    slash = strchr(str, '/');
+    addr_length = (slash)? (unsigned int)(slash - str) : strlen(str);
+    if(addr_length == 0 || addr_length > INET6_ADDRSTRLEN)
+        return 0;
+
+    memcpy(addr_str, str, addr_length);
+    addr_str[addr_length] = '\0';
+
+    memset(prefix_ret, 0, sizeof(IPPrefix));
+    if(inet_pton(AF_INET, addr_str, &addr_v4) == 1)
+    {
+        ipv4_prefix(addr_v4.s_addr, 32, prefix_ret);
+        max_length = 32;
+    }
+    else if(inet_pton(AF_INET6, addr_str, prefix_ret->addr) == 1)
+        max_length = IP_ADDR_BITS;
+    else
+        return 0;
+
+    length = max_length;
+    if(slash)
+    {
+        length = strtoul(&slash[1], &length_end, 10);
+        if(slash[1] < '0' || slash[1] > '9' || *length_end != '\0' || length > max_length)
+            return 0;
+    }
+
+    prefix_ret->length = IP_ADDR_BITS - max_length + length;
+    mask_prefix(prefix_ret);
+    return 1;
+}
+
+int ip_prefix_contains(IPPrefix *range, IPPrefix *addr)
+{
+    return prefix_covers(range, addr);
+}
+
+//IPv4 ranges are written as such. A single address has no prefix length
+char* format_ip_prefix(IPPrefix *prefix, char *str_ret)
+{
+    unsigned int length = prefix->length, max_length = IP_ADDR_BITS;
+
+    if(length >= IP_V4_MAPPED_BITS && is_ipv4_mapped(prefix->addr))
+    {
+        inet_ntop(AF_INET, &prefix->addr[12], str_ret, INET6_ADDRSTRLEN);
+        length -= IP_V4_MAPPED_BITS;
+        max_length = 32;
+    }
+    else
+        inet_ntop(AF_INET6, prefix->addr, str_ret, INET6_ADDRSTRLEN);
+
+    if(length != max_length)
+        sprintf(&str_ret[strlen(str_ret)], "/%u", length);
+    return str_ret;
+}
+
+
+
+/******************************/
+/*          IP Tries          */
+/******************************/
+
+//Returns the node of the prefix, which is made an entry if it wasn't one
+IPTrieNode* ip_trie_insert(IPTrie *trie, IPPrefix *prefix, int *created_ret)
+{
+    IPTrieNode **link = &trie->root, *node, *leaf, *glue;
+    unsigned int common;
+
+    while((node = *link))
+    {
+        common = common_bits(node->prefix.addr, prefix->addr, (node->prefix.length < prefix->length)? node->prefix.length : prefix->length);
+
+        //The prefix branches off above this node. It either contains the node, or joins it at a new node where they part
+        if(common < node->prefix.length)
+        {
+            leaf = new_node(prefix, prefix->length);
+            if(common == prefix->length)
+            {
+                leaf->child[prefix_bit(node->prefix.addr, common)] = node;
+                *link = leaf;
+            }
+            else
+            {
+                glue = new_node(prefix, common);
+                glue->child[prefix_bit(prefix->addr, common)] = leaf;
+                glue->child[prefix_bit(node->prefix.addr, common)] = node;
+                *link = glue;
+            }
+            return make_entry(trie, leaf, created_ret);
+        }
+
+        if(node->prefix.length == prefix->length)
+            return make_entry(trie, node, created_ret);
+
+        link = &node->child[prefix_bit(prefix->addr, node->prefix.length)];
+    }
+
+    *link = leaf = new_node(prefix, prefix->length);
+    return make_entry(trie, leaf, created_ret);
+}
+
+//Returns the entry of exactly this prefix, if there is one
+IPTrieNode* ip_trie_find(IPTrie *trie, IPPrefix *prefix)
+{
+    IPTrieNode *node = trie->root;
+
+    while(node && prefix_covers(&node->prefix, prefix))
+    {
+        if(node->prefix.length == prefix->length)
+            return (node->is_entry)? node : NULL;
+        node = node->child[prefix_bit(prefix->addr, node->prefix.length)];
+    }
+    return NULL;
+}
+
+static IPTrieNode* remove_from(IPTrie *trie, IPTrieNode *node, IPPrefix *prefix, int *removed_ret)
+{
+    IPTrieNode *child;
+    int bit;
+
+    if(!node || !prefix_covers(&node->prefix, prefix))
+        return node;
+
+    if(node->prefix.length < prefix->length)
+    {
+        bit = prefix_bit(prefix->addr, node->prefix.length);
+        node->child[bit] = remove_from(trie, node->child[bit], prefix, removed_ret);
+    }
+    else if(node->is_entry)
+    {
+        node->is_entry = 0;
+        node->data = NULL;
+        --trie->count;
+        *removed_ret = 1;
+    }
+
+    //Nodes without an entry are only kept where two subtrees meet
+    if(node->is_entry || (node->child[0] && node->child[1]))
+        return node;
+
+    child = (node->child[0])? node->child[0] : node->child[1];
+    free(node);
+    return child;
+}
+
+int ip_trie_remove(IPTrie *trie, IPPrefix *prefix)
+{
+    int removed = 0;
+
+    trie->root = remove_from(trie, trie->root, prefix, &removed);
+    return removed;
+}
+
+//Returns the longest entry containing the address (or range), if any
+IPTrieNode* ip_trie_match(IPTrie *trie, IPPrefix *addr)
+{
+    IPTrieNode *node = trie->root, *best = NULL;
+
+    while(node && prefix_covers(&node->prefix, addr))
+    {
+        if(node->is_entry)
+            best = node;
+        if(node->prefix.length == addr->length)
+            break;
+        node = node->child[prefix_bit(addr->addr, node->prefix.length)];
+    }
+    return best;
+}
+
+static void walk_from(IPTrieNode *node, ip_trie_visitor visit, void *arg)
+{
+    if(!node)
+        return;
+
+    if(node->is_entry)
+        visit(arg, node);
+    walk_from(node->child[0], visit, arg);
+    walk_from(node->child[1], visit, arg);
+}
+
+//Visits every entry inside the range "within" (or every entry, if NULL), without going through the others.
+//The visitor must not change the trie
+void ip_trie_walk(IPTrie *trie, IPPrefix *within, ip_trie_visitor visit, void *arg)
+{
+    IPTrieNode *node = trie->root;
+
+    while(within && node && node->prefix.length < within->length)
+    {
+        if(!prefix_covers(&node->prefix, within))
+            return;
+        node = node->child[prefix_bit(within->addr, node->prefix.length)];
+    }
+
+    if(node && (!within || prefix_covers(within, &node->prefix)))
+        walk_from(node, visit, arg);
+}
+
+static void clear_from(IPTrieNode *node)
+{
+    if(!node)
+        return;
+
+    clear_from(node->child[0]);
+    clear_from(node->child[1]);
+    free(node);
+}
+
+//Frees every node. Data held by the entries is left to the caller
+void ip_trie_clear(IPTrie *trie)
+{
+    clear_from(trie->root);
+    trie->root = NULL;
+    trie->count = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _IP_TRIE_H_
+#define _IP_TRIE_H_
+
+#include "server_common.h"
+
+#define IP_ADDR_BITS            128                 //IPv4 addresses are kept as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d)
+#define IP_V4_MAPPED_BITS       96
+#define IP_PREFIX_STRLEN        (INET6_ADDRSTRLEN + 4)
+
+
+//An address range in CIDR form. Bits past "length" are always 0
+typedef struct {
+    uint8_t addr[16];
+    uint8_t length;
+} IPPrefix;
+
+
+//Path-compressed binary trie of address ranges. Nodes without an entry only join two subtrees
+typedef struct iptrienode {
+    IPPrefix prefix;
+    int is_entry;
+    void *data;
+    struct iptrienode *child[2];
+} IPTrieNode;
+
+typedef struct {
+    IPTrieNode *root;
+    unsigned int count;                             //Entries
+} IPTrie;
+
+
+typedef void (*ip_trie_visitor)(void *arg, IPTrieNode *node);
+
+
+void ipv4_prefix(uint32_t ipaddr, unsigned int length, IPPrefix *prefix_ret);
+void sockaddr_prefix(struct sockaddr_in *sockaddr, IPPrefix *prefix_ret);
+int parse_ip_prefix(char *str, IPPrefix *prefix_ret);
+char* format_ip_prefix(IPPrefix *prefix, char *str_ret);
+int ip_prefix_contains(IPPrefix *range, IPPrefix *addr);
+
+IPTrieNode* ip_trie_insert(IPTrie *trie, IPPrefix *prefix, int *created_ret);
+IPTrieNode* ip_trie_find(IPTrie *trie, IPPrefix *prefix);
+int ip_trie_remove(IPTrie *trie, IPPrefix *prefix);
+IPTrieNode* ip_trie_match(IPTrie *trie, IPPrefix *addr);
+void ip_trie_walk(IPTrie *trie, IPPrefix *within, ip_trie_visitor visit, void *arg);
+void ip_trie_clear(IPTrie *trie);
+
+
+#endif
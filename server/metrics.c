@@ -0,0 +1,355 @@
+#include "metrics.h"
+#include "server.h"
+
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+
+
+static MetricsShard *shards = NULL;                 //Every thread's shard, added the first time it records something. Threads live as long as the server, so do shards
+static __thread MetricsShard *thread_shard = NULL;
+
+static int metrics_socketfd = -1;
+static pthread_t metrics_thread;
+
+//Upper bounds of the fan-out histogram's buckets, in recipients
+static const unsigned int fanout_bounds[METRICS_FANOUT_BUCKETS] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000};
+
+typedef struct {
+    char *name;
+    char *help;
+} MetricInfo;
+
+static const MetricInfo counter_info[METRIC_COUNTERS] = {
+    {"messages_received_total",         "Messages received from users"},
+    {"received_bytes_total",            "Bytes of messages received from users"},
+    {"messages_sent_total",             "Messages sent to users"},
+    {"sent_bytes_total",                "Bytes of messages sent to users"},
+    {"frames_dropped_total",            "Messages not sent to a user that still had a long message pending"},
+    {"transfer_bytes_relayed_total",    "File transfer bytes moved through the server"},
+};
+
+static const MetricInfo gauge_info[METRIC_GAUGES] = {
+    {"connections",                     "Open connections, by type"},
+    {NULL, NULL},
+    {NULL, NULL},
+    {"transfer_streams_active",         "Transfer connections being served by transfer threads"},
+    {"outbound_queue_depth",            "Users with a long message partly sent"},
+};
+
+static const char *connection_type_names[] = {"unregistered", "user", "transfer"};
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+//The first time a thread records something, its shard is pushed onto the list without taking a lock
+static MetricsShard* this_shard()
+{
+    MetricsShard *shard = thread_shard;
+
+    if(shard)
+        return shard;
+
+    shard = aligned_alloc(64, sizeof(MetricsShard));
+    memset(shard, 0, sizeof(MetricsShard));
+
+    shard->next = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&shards, &shard->next, shard, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+
+    thread_shard = shard;
+    return shard;
+}
+
+//Adds up every thread's shard. Values recorded meanwhile may or may not be included
+static void collect_metrics(MetricsShard *totals)
+{
+    MetricsShard *shard;
+    unsigned int i;
+
+    memset(totals, 0, sizeof(MetricsShard));
+
+    for(shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next)
+    {
+        for(i=0; i<METRIC_COUNTERS; i++)
+            totals->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        for(i=0; i<METRIC_GAUGES; i++)
+            totals->gauges[i] += __atomic_load_n(&shard->gauges[i], __ATOMIC_RELAXED);
+        for(i=0; i<=METRICS_FANOUT_BUCKETS; i++)
+            totals->fanout_buckets[i] += __atomic_load_n(&shard->fanout_buckets[i], __ATOMIC_RELAXED);
+        totals->fanout_sum += __atomic_load_n(&shard->fanout_sum, __ATOMIC_RELAXED);
+    }
+}
+
+//Text of a scrape being rendered. Grows as needed
+typedef struct {
+    char *text;
+    size_t size;
+    size_t capacity;
+} MetricsText;
+
+static void metrics_append(MetricsText *out, const char *format, ...)
+{
+    va_list args;
+    int printed;
+
+    while(1)
+    {
+        va_start(args, format);
+        printed = vsnprintf(&out->text[out->size], out->capacity - out->size, format, args);
+        va_end(args);
+
+        if(printed < 0)
+            return;
+        if((size_t)printed < out->capacity - out->size)
+            break;
+
+        //Did not fit. Make room for it (and then some), and print it again
+        out->capacity = (out->capacity + printed) * 2;
+        out->text = realloc(out->text, out->capacity);
+    }
+    out->size += printed;
+}
+
+//Writes every metric in the Prometheus text format. Returns the text (to be freed)
+static char* render_metrics(size_t *size_ret)
+{
+    MetricsText out = {.text = malloc(8192), .size = 0, .capacity = 8192};
+    MetricsShard totals;
+    uint64_t cumulative = 0;
+    unsigned int i;
+
+    collect_metrics(&totals);
+
+    for(i=0; i<METRIC_COUNTERS; i++)
+        metrics_append(&out, "# HELP "METRICS_PREFIX"%s %s.\n# TYPE "METRICS_PREFIX"%s counter\n"METRICS_PREFIX"%s %lu\n",
+                counter_info[i].name, counter_info[i].help, counter_info[i].name, counter_info[i].name, totals.counters[i]);
+
+    for(i=0; i<METRIC_GAUGES; i++)
+    {
+        if(gauge_info[i].name)
+            metrics_append(&out, "# HELP "METRICS_PREFIX"%s %s.\n# TYPE "METRICS_PREFIX"%s gauge\n",
+                    gauge_info[i].name, gauge_info[i].help, gauge_info[i].name);
+
+        if(i <= METRIC_TRANSFER_CONNECTIONS)
+            metrics_append(&out, METRICS_PREFIX"connections{type=\"%s\"} %ld\n", connection_type_names[i], totals.gauges[i]);
+        else
+            metrics_append(&out, METRICS_PREFIX"%s %ld\n", gauge_info[i].name, totals.gauges[i]);
+    }
+
+    metrics_append(&out, "# HELP "METRICS_PREFIX"fanout_recipients Users each message to a group (or everyone) was sent to.\n"
+            "# TYPE "METRICS_PREFIX"fanout_recipients histogram\n");
+    for(i=0; i<METRICS_FANOUT_BUCKETS; i++)
+    {
+        cumulative += totals.fanout_buckets[i];
+        metrics_append(&out, METRICS_PREFIX"fanout_recipients_bucket{le=\"%u\"} %lu\n", fanout_bounds[i], cumulative);
+    }
+    cumulative += totals.fanout_buckets[METRICS_FANOUT_BUCKETS];
+    metrics_append(&out, METRICS_PREFIX"fanout_recipients_bucket{le=\"+Inf\"} %lu\n"
+            METRICS_PREFIX"fanout_recipients_sum %lu\n"METRICS_PREFIX"fanout_recipients_count %lu\n", cumulative, totals.fanout_sum, cumulative);
+
+    *size_ret = out.size;
+    return out.text;
+}
+
+static int send_all(int socketfd, char *data, size_t size)
+{
+    ssize_t bytes;
+
+    while(size > 0)
+    {
+        bytes = send(socketfd, data, size, MSG_NOSIGNAL);
+        if(bytes <= 0)
+            return 0;
+        data += bytes;
+        size -= bytes;
+    }
+    return 1;
+}
+
+//An HTTP request ("curl --unix-socket") gets an HTTP reply. Anything else, or nothing at all, gets the bare text
+static void serve_scrape(int socketfd)
+{
+    struct timeval timeout = {METRICS_SCRAPE_TIMEOUT, 0};
+    char request[METRICS_REQUEST_LENG+1], header[128];
+    size_t received = 0, size;
+    ssize_t bytes;
+    char *text;
+
+    setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socketfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    //Read the request up to its blank line, so that closing the connection doesn't cut the reply short
+    request[0] = '\0';
+    while(received < METRICS_REQUEST_LENG)
+    {
+        bytes = recv(socketfd, &request[received], METRICS_REQUEST_LENG - received, 0);
+        if(bytes <= 0)
+            break;
+        received += bytes;
+        request[received] = '\0';
+
+        if(strncmp(request, "GET ", 4) != 0 || strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    text = render_metrics(&size);
+    if(strncmp(request, "GET ", 4) == 0)
+    {
+        sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+        if(!send_all(socketfd, header, strlen(header)))
+        {
+            free(text);
+            return;
+        }
+    }
+
+    send_all(socketfd, text, size);
+    free(text);
+}
+
+static void* metrics_loop(void *arg)
+{
+    int socketfd;
+
+    while(1)
+    {
+        socketfd = accept(metrics_socketfd, NULL, NULL);
+        if(socketfd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            //Running out of descriptors (or memory) passes. Back off for a moment rather than spinning on the error
+            perror("Failed to accept a metrics scrape");
+            sleep(1);
+            continue;
+        }
+
+        serve_scrape(socketfd);
+        close(socketfd);
+    }
+
+    return NULL;
+}
+
+
+
+/******************************/
+/*          Metrics           */
+/******************************/
+
+//Serves the metrics on a UNIX socket, if METRICS_SOCKET_ENV names one. A stale socket left at the path is replaced.
+//Without it the server still runs, and the metrics are still shown by !stats
+int metrics_init()
+{
+    char *path = getenv(METRICS_SOCKET_ENV);
+    struct sockaddr_un addr;
+    struct stat path_stat;
+
+    if(!path || !path[0])
+        return 1;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Metrics socket path \"%s\" is too long. Metrics are not served.\n", path);
+        return 1;
+    }
+
+    if(lstat(path, &path_stat) == 0)
+    {
+        if(!S_ISSOCK(path_stat.st_mode))
+        {
+            printf("\"%s\" exists and is not a socket. Metrics are not served.\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    metrics_socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(metrics_socketfd < 0 || bind(metrics_socketfd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0 || listen(metrics_socketfd, 8) < 0)
+    {
+        perror("Failed to open the metrics socket");
+        if(metrics_socketfd >= 0)
+            close(metrics_socketfd);
+        metrics_socketfd = -1;
+        return 1;
+    }
+
+    if(pthread_create(&metrics_thread, NULL, &metrics_loop, NULL) != 0)
+    {
+        printf("Failed to create metrics thread\n");
+        return 0;
+    }
+
+    printf("Serving metrics on \"%s\".\n", path);
+    return 1;
+}
+
+//Only the calling thread writes its shard, so a plain add stored atomically is enough for readers on other threads
+void metrics_count(enum metric_counter counter, uint64_t amount)
+{
+    MetricsShard *shard = this_shard();
+    __atomic_store_n(&shard->counters[counter], shard->counters[counter] + amount, __ATOMIC_RELAXED);
+}
+
+void metrics_gauge_add(enum metric_gauge gauge, int64_t change)
+{
+    MetricsShard *shard = this_shard();
+    __atomic_store_n(&shard->gauges[gauge], shard->gauges[gauge] + change, __ATOMIC_RELAXED);
+}
+
+//Records how many users a message to a group (or to everyone) was sent to
+void metrics_fanout(unsigned int recipients)
+{
+    MetricsShard *shard = this_shard();
+    unsigned int bucket = 0;
+
+    while(bucket < METRICS_FANOUT_BUCKETS && recipients > fanout_bounds[bucket])
+        ++bucket;
+
+    __atomic_store_n(&shard->fanout_buckets[bucket], shard->fanout_buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->fanout_sum, shard->fanout_sum + recipients, __ATOMIC_RELAXED);
+}
+
+
+
+/******************************/
+/*       Administration       */
+/******************************/
+
+//Prints the metrics added up from every thread. Also sent back to a remote admin
+void metrics_stats()
+{
+    char stats_msg[1024];
+    int msg_size = 0;
+    MetricsShard totals;
+    uint64_t fanouts = 0;
+    unsigned int i;
+
+    collect_metrics(&totals);
+    for(i=0; i<=METRICS_FANOUT_BUCKETS; i++)
+        fanouts += totals.fanout_buckets[i];
+
+    sprintf(stats_msg, "Messages: %lu received (%lu bytes), %lu sent (%lu bytes), %lu dropped behind a pending long message\n"
+            "Fan-out: %lu messages to groups, %.1f recipients each on average\n"
+            "Connections: %ld unregistered, %ld users, %ld transfers (%ld on transfer threads). Users with a long message queued: %ld\n"
+            "File transfers: %lu bytes relayed%n",
+            totals.counters[METRIC_MSGS_IN], totals.counters[METRIC_BYTES_IN], totals.counters[METRIC_MSGS_OUT], totals.counters[METRIC_BYTES_OUT],
+            totals.counters[METRIC_FRAMES_DROPPED],
+            fanouts, (fanouts)? (double) totals.fanout_sum / fanouts : 0.0,
+            totals.gauges[METRIC_UNREGISTERED_CONNECTIONS], totals.gauges[METRIC_USER_CONNECTIONS], totals.gauges[METRIC_TRANSFER_CONNECTIONS],
+            totals.gauges[METRIC_XFER_STREAMS], totals.gauges[METRIC_OUTBOUND_QUEUED],
+            totals.counters[METRIC_XFER_BYTES], &msg_size);
+
+    printf("%s\n", stats_msg);
+    if(current_client && current_client->connection_type == USER_CONNECTION)
+        send_long_msg(current_client, stats_msg, msg_size+1);
+}
@@ -0,0 +1,54 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "server_common.h"
+#include <pthread.h>
+
+#define METRICS_SOCKET_ENV          "TERMINALCHAT_METRICS_SOCKET"   //Path of the UNIX socket metrics are scraped from. Not served if unset
+#define METRICS_PREFIX              "terminalchat_"
+#define METRICS_SCRAPE_TIMEOUT      2                   //Seconds a scraper has to send its request, and to take the reply
+#define METRICS_REQUEST_LENG        1024                //Bytes of a scraper's request that are read. The rest is ignored
+#define METRICS_FANOUT_BUCKETS      10                  //Bounded buckets of the fan-out histogram (see metrics.c), plus one for larger fan-outs
+
+
+//Only ever go up
+enum metric_counter {
+    METRIC_MSGS_IN = 0,
+    METRIC_BYTES_IN,
+    METRIC_MSGS_OUT,
+    METRIC_BYTES_OUT,
+    METRIC_FRAMES_DROPPED,              //Messages not sent to a user, as it still had a long message pending
+    METRIC_XFER_BYTES,                  //File transfer bytes moved through the server
+    METRIC_COUNTERS
+};
+
+//Go up and down. Each thread keeps its own share of the changes, which are added up when read
+enum metric_gauge {
+    METRIC_UNREGISTERED_CONNECTIONS = 0,    //Indexed by connection_type
+    METRIC_USER_CONNECTIONS,
+    METRIC_TRANSFER_CONNECTIONS,
+    METRIC_XFER_STREAMS,                    //Transfer connections being served by transfer threads
+    METRIC_OUTBOUND_QUEUED,                 //Users with part of a long message still waiting to be sent
+    METRIC_GAUGES
+};
+
+//One thread's metrics. Only that thread writes them, so recording needs no lock and no atomic read-modify-write.
+//Readers add up every thread's
+typedef struct metricsshard {
+    uint64_t counters[METRIC_COUNTERS];
+    int64_t gauges[METRIC_GAUGES];
+    uint64_t fanout_buckets[METRICS_FANOUT_BUCKETS+1];
+    uint64_t fanout_sum;
+    struct metricsshard *next;
+} __attribute__((aligned(64))) MetricsShard;
+
+
+int metrics_init();
+void metrics_count(enum metric_counter counter, uint64_t amount);
+void metrics_gauge_add(enum metric_gauge gauge, int64_t change);
+void metrics_fanout(unsigned int recipients);
+
+void metrics_stats();
+
+
+#endif
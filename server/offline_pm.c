@@ -0,0 +1,347 @@
+#include "offline_pm.h"
+#include "server.h"
+
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+static OfflineQueue *offline_queues;            //Hashtable of usernames with queued PMs (key = username)
+static size_t offline_pm_size;                  //Bytes of all queue files
+TimerEvent *offline_pm_timer;
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static void queue_path(char *username, char *path_ret)
+{
+    sprintf(path_ret, "%s/%s", OFFLINE_PM_ROOT, username);
+}
+
+//A queue being rewritten. '~' cannot appear in usernames
+static void queue_tmp_path(char *username, char *path_ret)
+{
+    sprintf(path_ret, "%s/~%s", OFFLINE_PM_ROOT, username);
+}
+
+//Returns the size of the PM at "offset" of a queue file, or 0 if there is no complete PM there
+static size_t parse_offline_record(char *data, size_t size, size_t offset, OfflinePMRecord *record, char **sender_ret, char **text_ret)
+{
+    char *payload, *nul;
+
+    if(offset > size || size - offset < sizeof(OfflinePMRecord))
+        return 0;
+
+    memcpy(record, &data[offset], sizeof(OfflinePMRecord));
+    if(record->length < 2 || record->length > size - offset - sizeof(OfflinePMRecord))
+        return 0;
+
+    //Both the sender and the text must be NUL terminated
+    payload = &data[offset + sizeof(OfflinePMRecord)];
+    nul = memchr(payload, '\0', record->length);
+    if(!nul || nul == &payload[record->length-1] || payload[record->length-1] != '\0')
+        return 0;
+
+    *sender_ret = payload;
+    *text_ret = nul + 1;
+    return sizeof(OfflinePMRecord) + record->length;
+}
+
+//Reads a whole queue file. Returns NULL if it is empty or cannot be read
+static char* read_queue_file(char *username, size_t *size_ret)
+{
+    char path[MAX_FILE_PATH+1], *data;
+    struct stat file_stat;
+    ssize_t bytes;
+    size_t total = 0;
+    int fd;
+
+    queue_path(username, path);
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &file_stat) < 0 || file_stat.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    data = malloc(file_stat.st_size);
+    while(total < (size_t)file_stat.st_size && (bytes = read(fd, &data[total], file_stat.st_size - total)) > 0)
+        total += bytes;
+    close(fd);
+
+    *size_ret = total;
+    return data;
+}
+
+static void remove_queue(OfflineQueue *queue)
+{
+    char path[MAX_FILE_PATH+1];
+
+    queue_path(queue->username, path);
+    if(remove(path) < 0 && errno != ENOENT)
+        perror("Failed to remove offline PM queue.");
+
+    offline_pm_size -= queue->size;
+    HASH_DEL(offline_queues, queue);
+    free(queue);
+}
+
+//Keeps only the queued PMs that have not expired, cutting off anything torn at the end of the file. Removes the queue if none are left
+static void rewrite_queue(OfflineQueue *queue, time_t now)
+{
+    char path[MAX_FILE_PATH+1], tmp_path[MAX_FILE_PATH+1], *data, *sender, *text;
+    size_t size = 0, offset, record_size, kept_size = 0;
+    OfflinePMRecord record;
+    int fd;
+
+    data = read_queue_file(queue->username, &size);
+
+    offline_pm_size -= queue->size;
+    queue->count = 0;
+    for(offset = 0; data && (record_size = parse_offline_record(data, size, offset, &record, &sender, &text)) > 0; offset += record_size)
+    {
+        if(record.queued_at + OFFLINE_PM_TTL <= now)
+            continue;
+
+        //PMs are queued in order, so the first one kept is the oldest
+        if(queue->count++ == 0)
+            queue->oldest = record.queued_at;
+        memmove(&data[kept_size], &data[offset], record_size);
+        kept_size += record_size;
+    }
+    queue->size = kept_size;
+    offline_pm_size += kept_size;
+
+    if(queue->count == 0)
+    {
+        free(data);
+        remove_queue(queue);
+        return;
+    }
+
+    //Replace the file at once, so a crash leaves either the old or the new queue
+    if(kept_size != size)
+    {
+        queue_path(queue->username, path);
+        queue_tmp_path(queue->username, tmp_path);
+
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if(fd < 0 || write(fd, data, kept_size) != (ssize_t)kept_size || rename(tmp_path, path) < 0)
+            perror("Failed to rewrite offline PM queue.");
+        if(fd >= 0)
+            close(fd);
+    }
+
+    free(data);
+}
+
+
+
+/******************************/
+/*   Queueing and Delivery    */
+/******************************/
+
+int offline_pm_init()
+{
+    struct dirent *dir_entry;
+    OfflineQueue *queue, *tmp;
+    char path[MAX_FILE_PATH+1];
+    unsigned int count = 0;
+    time_t now = time(NULL);
+    int retval;
+    DIR *dir;
+
+    retval = mkdir(OFFLINE_PM_ROOT, S_IRWXU);
+    if(retval < 0 && errno != EEXIST)
+    {
+        perror("Failed to create directory for offline PMs.");
+        return 0;
+    }
+
+    //Every file is the queue of one username. Queues being rewritten when the server stopped are left over as "~<username>"
+    dir = opendir(OFFLINE_PM_ROOT);
+    while(dir && (dir_entry = readdir(dir)))
+    {
+        if(dir_entry->d_name[0] == '~')
+        {
+            sprintf(path, "%s/%s", OFFLINE_PM_ROOT, dir_entry->d_name);
+            remove(path);
+        }
+        else if(strcmp(dir_entry->d_name, ".") != 0 && strcmp(dir_entry->d_name, "..") != 0 && strlen(dir_entry->d_name) <= USERNAME_LENG)
+        {
+            queue = calloc(1, sizeof(OfflineQueue));
+            strcpy(queue->username, dir_entry->d_name);
+            HASH_ADD_STR(offline_queues, username, queue);
+        }
+    }
+    if(dir)
+        closedir(dir);
+
+    HASH_ITER(hh, offline_queues, queue, tmp)
+    {
+        rewrite_queue(queue, now);
+    }
+    HASH_ITER(hh, offline_queues, queue, tmp)
+    {
+        count += queue->count;
+    }
+    if(count > 0)
+        printf("Restored %u PMs queued for %u offline users.\n", count, HASH_COUNT(offline_queues));
+
+    offline_pm_timer = calloc(1, sizeof(TimerEvent));
+    offline_pm_timer->event_type = OFFLINE_PM_SWEEP;
+
+    offline_pm_timer->timerfd = create_timerfd(OFFLINE_PM_SWEEP_PERIOD, 1, timers_epollfd);
+    if(!offline_pm_timer->timerfd)
+    {
+        free(offline_pm_timer);
+        return 0;
+    }
+    HASH_ADD_INT(timers, timerfd, offline_pm_timer);
+
+    return 1;
+}
+
+//Queues a PM for a username that is not connected. Returns 0 (and tells the sender why) if it cannot be queued
+int queue_offline_pm(char *sender, char *recipient, char *text)
+{
+    OfflineQueue *queue;
+    OfflinePMRecord record = {0};
+    struct iovec parts[3];
+    char path[MAX_FILE_PATH+1];
+    size_t sender_length = strlen(sender) + 1, text_length = strlen(text) + 1;
+    size_t record_size = sizeof(OfflinePMRecord) + sender_length + text_length;
+    int fd;
+
+    HASH_FIND_STR(offline_queues, recipient, queue);
+    if(offline_pm_size + record_size > OFFLINE_PM_BUDGET || (queue && (queue->count >= OFFLINE_PM_USER_COUNT || queue->size + record_size > OFFLINE_PM_USER_SIZE)))
+    {
+        printf("No room to queue more PMs for offline user \"%s\".\n", recipient);
+        send_error_code(current_client, ERR_QUEUE_FULL, recipient);
+        return 0;
+    }
+
+    record.queued_at = time(NULL);
+    record.length = sender_length + text_length;
+
+    parts[0] = (struct iovec){&record, sizeof(OfflinePMRecord)};
+    parts[1] = (struct iovec){sender, sender_length};
+    parts[2] = (struct iovec){text, text_length};
+
+    queue_path(recipient, path);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if(fd < 0 || writev(fd, parts, 3) != (ssize_t)record_size)
+    {
+        perror("Failed to queue offline PM.");
+
+        //Don't leave a torn PM in front of the next one
+        if(fd >= 0 && ftruncate(fd, (queue)? queue->size : 0) < 0)
+            perror("Failed to truncate offline PM queue.");
+        if(fd >= 0)
+            close(fd);
+
+        send_error_code(current_client, ERR_QUEUE_FULL, recipient);
+        return 0;
+    }
+    close(fd);
+
+    if(!queue)
+    {
+        queue = calloc(1, sizeof(OfflineQueue));
+        strcpy(queue->username, recipient);
+        queue->oldest = record.queued_at;
+        HASH_ADD_STR(offline_queues, username, queue);
+    }
+    ++queue->count;
+    queue->size += record_size;
+    offline_pm_size += record_size;
+
+    return 1;
+}
+
+int has_offline_pms(char *username)
+{
+    OfflineQueue *queue;
+
+    HASH_FIND_STR(offline_queues, username, queue);
+    return queue != NULL;
+}
+
+//Sends every PM queued for the user in one long message, and empties its queue once they are sent.
+//If they could not be sent, the queue is kept: for the next message the user sends, or its next login if it was disconnected
+void deliver_offline_pms(User *user)
+{
+    OfflineQueue *queue;
+    OfflinePMRecord record;
+    char *data, *lines, *pm_msg, *sender, *text, time_str[32];
+    size_t size = 0, offset, record_size;
+    unsigned int count = 0;
+    int lines_size = 0, msg_size, printed, sent = 1;
+    time_t now = time(NULL);
+    struct tm tm;
+
+    HASH_FIND_STR(offline_queues, user->username, queue);
+    if(!queue)
+        return;
+
+    data = read_queue_file(queue->username, &size);
+    lines = malloc(queue->count * (USERNAME_LENG + MAX_MSG_LENG + 64) + 1);
+
+    for(offset = 0; data && count < queue->count && (record_size = parse_offline_record(data, size, offset, &record, &sender, &text)) > 0; offset += record_size)
+    {
+        if(record.queued_at + OFFLINE_PM_TTL <= now)
+            continue;
+
+        localtime_r(&(time_t){record.queued_at}, &tm);
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+        sprintf(&lines[lines_size], "[%s] %.*s (PM): %.*s\n%n", time_str, USERNAME_LENG, sender, MAX_MSG_LENG, text, &printed);
+        lines_size += printed;
+        ++count;
+    }
+
+    if(count > 0)
+    {
+        pm_msg = malloc(lines_size + 32);
+        sprintf(pm_msg, "!offlinepms=%u\n%n", count, &msg_size);
+        memcpy(&pm_msg[msg_size], lines, lines_size);
+        msg_size += lines_size;
+        pm_msg[msg_size] = '\0';
+
+        //The user is freed if sending fails on its connection, so only the queue's copy of its name is used afterwards
+        sent = (int)send_long_msg(user->c, pm_msg, msg_size+1);
+        if(sent > 0)
+            printf("Delivered %u PMs queued for \"%s\".\n", count, queue->username);
+        else if(sent == 0)
+        {
+            printf("Could not deliver the PMs queued for \"%s\" yet. Keeping them...\n", queue->username);
+            user->offline_pms_waiting = 1;
+        }
+        else
+            printf("Lost the connection of \"%s\" while delivering its queued PMs. Keeping them...\n", queue->username);
+        free(pm_msg);
+    }
+
+    free(lines);
+    free(data);
+    if(sent > 0)
+        remove_queue(queue);
+}
+
+void offline_pm_sweep()
+{
+    OfflineQueue *queue, *tmp;
+    time_t now = time(NULL);
+
+    HASH_ITER(hh, offline_queues, queue, tmp)
+    {
+        if(queue->oldest + OFFLINE_PM_TTL <= now)
+            rewrite_queue(queue, now);
+    }
+}
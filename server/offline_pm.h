@@ -0,0 +1,38 @@
+#ifndef _OFFLINE_PM_H_
+#define _OFFLINE_PM_H_
+
+#include "server_common.h"
+
+#define OFFLINE_PM_ROOT             "OFFLINE_PM"
+#define OFFLINE_PM_USER_COUNT       100                 //PMs queued for each offline username. Further ones are refused until it connects
+#define OFFLINE_PM_USER_SIZE        65536               //Bytes of PMs queued for each offline username
+#define OFFLINE_PM_BUDGET           16777216            //Bytes of PMs queued for all offline usernames together
+#define OFFLINE_PM_TTL              604800              //Seconds a queued PM waits for its recipient (a week), before it is dropped
+#define OFFLINE_PM_SWEEP_PERIOD     3600                //Seconds between sweeps for expired PMs
+
+
+//Header of every queued PM in a queue file. The sender and text follow, both NUL terminated
+typedef struct {
+    int64_t queued_at;
+    uint32_t length;            //Bytes of sender and text
+    uint32_t reserved;
+} OfflinePMRecord;
+
+//PMs waiting for a username that is not connected. The PMs themselves are only kept on disk, in OFFLINE_PM_ROOT/<username>
+typedef struct {
+    char username[USERNAME_LENG+1];
+    unsigned int count;
+    size_t size;                //Bytes of the queue file
+    time_t oldest;              //When its oldest PM was queued
+    UT_hash_handle hh;          //Key: username
+} OfflineQueue;
+
+
+int offline_pm_init();
+int queue_offline_pm(char *sender, char *recipient, char *text);
+int has_offline_pms(char *username);
+void deliver_offline_pms(User *user);
+void offline_pm_sweep();
+
+
+#endif
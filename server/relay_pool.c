@@ -0,0 +1,84 @@
+#include "relay_pool.h"
+
+
+RelayChunk *spare_chunks = NULL;                //Idle chunks, reused before allocating new ones
+unsigned int spare_count = 0;
+size_t chunks_in_use = 0;
+pthread_mutex_t relay_pool_lock = PTHREAD_MUTEX_INITIALIZER;        //Chunks are taken by transfer threads, and returned by both them and the chat thread
+
+
+
+//Returns NULL once the pool's budget is used up. The sender must wait for other transfers to drain their chunks
+RelayChunk* relay_chunk_alloc()
+{
+    RelayChunk *chunk = NULL;
+
+    pthread_mutex_lock(&relay_pool_lock);
+
+    if((chunks_in_use + 1) * sizeof(RelayChunk) > RELAY_POOL_BUDGET)
+    {
+        pthread_mutex_unlock(&relay_pool_lock);
+        return NULL;
+    }
+
+    if(spare_chunks)
+    {
+        chunk = spare_chunks;
+        LL_DELETE(spare_chunks, chunk);
+        --spare_count;
+    }
+    else
+        chunk = malloc(sizeof(RelayChunk));
+
+    if(chunk)
+        ++chunks_in_use;
+    pthread_mutex_unlock(&relay_pool_lock);
+
+    if(chunk)
+    {
+        chunk->size = 0;
+        chunk->offset = 0;
+        chunk->pending = 0;
+        chunk->next = NULL;
+    }
+
+    return chunk;
+}
+
+//Keeps a few idle chunks for the next transfers, and frees the rest so the pool shrinks after a burst
+void relay_chunk_release(RelayChunk *chunk)
+{
+    pthread_mutex_lock(&relay_pool_lock);
+
+    --chunks_in_use;
+    if(spare_count < RELAY_POOL_SPARE)
+    {
+        LL_PREPEND(spare_chunks, chunk);
+        ++spare_count;
+        chunk = NULL;
+    }
+
+    pthread_mutex_unlock(&relay_pool_lock);
+
+    if(chunk)
+        free(chunk);
+}
+
+void relay_chunks_release(RelayChunk **queue)
+{
+    RelayChunk *curr, *tmp;
+
+    LL_FOREACH_SAFE(*queue, curr, tmp)
+    {
+        LL_DELETE(*queue, curr);
+        relay_chunk_release(curr);
+    }
+}
+
+void relay_pool_stats(size_t *in_use_ret, size_t *spare_ret)
+{
+    pthread_mutex_lock(&relay_pool_lock);
+    *in_use_ret = chunks_in_use * sizeof(RelayChunk);
+    *spare_ret = spare_count * sizeof(RelayChunk);
+    pthread_mutex_unlock(&relay_pool_lock);
+}
@@ -0,0 +1,31 @@
+#ifndef _RELAY_POOL_H_
+#define _RELAY_POOL_H_
+
+#include "server_common.h"
+#include <pthread.h>
+
+#define RELAY_CHUNK_SIZE        65536                   //Bytes held by a single pooled chunk
+#define RELAY_POOL_BUDGET       268435456               //Bytes all chunks may use together. Senders wait for free chunks beyond this
+#define RELAY_POOL_SPARE        64                      //Idle chunks kept for reuse. Chunks released beyond this are freed
+#define RELAY_WINDOW_MIN        2                       //Chunks a relayed stream may have in flight, adapted to how fast its receiver drains them
+#define RELAY_WINDOW_INITIAL    4
+#define RELAY_WINDOW_MAX        32
+
+
+//A piece received from a sender, waiting to be written out
+typedef struct relaychunk {
+    size_t size;
+    size_t offset;              //Position of the piece within its stream's range
+    unsigned int pending;       //Recipients that haven't forwarded the whole piece yet
+    struct relaychunk *next;
+    unsigned char data[RELAY_CHUNK_SIZE];
+} RelayChunk;
+
+
+RelayChunk* relay_chunk_alloc();
+void relay_chunk_release(RelayChunk *chunk);
+void relay_chunks_release(RelayChunk **queue);
+void relay_pool_stats(size_t *in_use_ret, size_t *spare_ret);
+
+
+#endif
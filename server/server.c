@@ -28,7 +28,7 @@ pthread_t timer_event_thread, network_event_thread;
 Client *active_connections = NULL;                  //Hashtable of all active client sockets (key = socketfd)
 User *active_users = NULL;                          //Hashtable of all active users (key = username), mapped to their client descriptors
 unsigned int total_users = 0;
-IP_List *banned_ips;                                //All IPs that are banned from connecting to the server    
+IPTrie banned_ips;                                  //All IPs (and ranges) that are banned from connecting to the server
 
 //Client/Event being served right now
 Client *current_client;                             //Descriptor for the client being serviced right now
@@ -92,6 +92,9 @@ static inline void cleanup_user_connection(Client *c, char *reason)
     disconnect_client_group_cleanup(c, reason);
         
     //Free up resources used by the user
+    if(c->user->pending_msg.pending_op == SENDING_OP)
+        metrics_gauge_add(METRIC_OUTBOUND_QUEUED, -1);
+    flood_remove_user(c->user);
     HASH_FIND_STR(active_users, c->user->username, user);
     HASH_DEL(active_users, user);
     free(user);
@@ -110,7 +113,7 @@ void disconnect_client(Client *c, char *reason)
         cleanup_unregistered_connection(c);
         
     //Check if the connection is for a file transfer
-    else if(current_client->connection_type == TRANSFER_CONNECTION)
+    else if(c->connection_type == TRANSFER_CONNECTION)
         cleanup_transfer_connection(c);
 
     /*The connection is for a regular user*/
@@ -120,13 +123,38 @@ void disconnect_client(Client *c, char *reason)
     //Destroy the connection's idle timer, if it exists
     if(c->idle_timer)
         cleanup_timer_event(c->idle_timer);
+    heartbeat_untrack(c);
     
 
     //Free objects used by this connection
+    unindex_connection(c);
     HASH_DEL(active_connections, c);
     free(c);
 }
 
+
+//Resolves what a ban applies to: a connected user's address, an IP address or range (CIDR), or a hostname.
+//Usernames are tried first, as they may look like addresses. Returns 0 if the target is none of them
+int ban_target_prefix(char *target, IPPrefix *prefix_ret, User **user_ret)
+{
+    char ipaddr_str[INET_ADDRSTRLEN];
+    User *user;
+
+    HASH_FIND_STR(active_users, plain_name(target), user);
+    if(user_ret)
+        *user_ret = user;
+
+    if(user)
+        sockaddr_prefix(&user->c->sockaddr, prefix_ret);
+    else if(!parse_ip_prefix(target, prefix_ret))
+    {
+        if(!hostname_to_ip(target, "0", ipaddr_str))
+            return 0;
+        ipv4_prefix(inet_addr(ipaddr_str), 32, prefix_ret);
+    }
+    return 1;
+}
+
 unsigned int handle_new_username(char *requested_name, char *new_username_ret)
 {
     unsigned int duplicates = 0, max_duplicates_allowed;
@@ -179,18 +207,37 @@ unsigned int handle_new_username(char *requested_name, char *new_username_ret)
 /*        Send/Receive        */
 /******************************/
 
+//Events a client connection is waited on for. Reading stays paused while a flooding user is being delayed
+int client_epoll_events(Client *c)
+{
+    int events = CLIENT_EPOLL_DEFAULT_EVENTS;
+
+    if(c->user && c->user->flood_paused)
+        events &= ~EPOLLIN;
+    if(c->user && c->user->pending_msg.pending_op == SENDING_OP)
+        events |= EPOLLOUT;
+
+    return events;
+}
+
 static unsigned int transfer_next_pending(Client *c)
 {
-    int retval;
+    int retval, sending;
 
+    sending = (c->user->pending_msg.pending_op == SENDING_OP);
     retval = transfer_next_common(c->socketfd, &c->user->pending_msg);
     if(retval <= 0)
+    {
         disconnect_client(c, "Connection Failed");
+        return retval;
+    }
     
     //Remove the EPOLLOUT notification once long send has completed
     if(c->user->pending_msg.pending_op == NO_XFER_OP)
     {
-        update_epoll_events(connections_epollfd, c->socketfd, CLIENT_EPOLL_DEFAULT_EVENTS);
+        if(sending)
+            metrics_gauge_add(METRIC_OUTBOUND_QUEUED, -1);
+        update_epoll_events(connections_epollfd, c->socketfd, client_epoll_events(c));
         printf("Completed partial transfer.\n");
     }
     
@@ -207,13 +254,24 @@ unsigned int send_msg(Client *c, char* buffer, size_t size)
     retval = send_msg_common(c->socketfd, buffer, size, &c->user->pending_msg);
     
     if(retval < 0)
+    {
         disconnect_client(c, "Connection Failed");
+        return retval;
+    }
     else if(retval == 0)
+    {
+        metrics_count(METRIC_FRAMES_DROPPED, 1);
         return 0;
+    }
+    metrics_count(METRIC_MSGS_OUT, 1);
+    metrics_count(METRIC_BYTES_OUT, size);
 
     //Start of a new long send. Register the client's FD to signal on EPOLLOUT
     if(c->user->pending_msg.pending_op == SENDING_OP)
-        update_epoll_events(connections_epollfd, c->socketfd, CLIENT_EPOLL_DEFAULT_EVENTS | EPOLLOUT);
+    {
+        metrics_gauge_add(METRIC_OUTBOUND_QUEUED, 1);
+        update_epoll_events(connections_epollfd, c->socketfd, client_epoll_events(c));
+    }
 
     return retval;
 }
@@ -228,13 +286,24 @@ unsigned int send_long_msg(Client *c, char* buffer, size_t size)
     retval = send_msg_notruncate(c->socketfd, buffer, size, &c->user->pending_msg);
     
     if(retval < 0)
+    {
         disconnect_client(c, "Connection Failed");
+        return retval;
+    }
     else if(retval == 0)
+    {
+        metrics_count(METRIC_FRAMES_DROPPED, 1);
         return 0;
+    }
+    metrics_count(METRIC_MSGS_OUT, 1);
+    metrics_count(METRIC_BYTES_OUT, size);
 
     //Start of a new long send. Register the client's FD to signal on EPOLLOUT
     if(c->user->pending_msg.pending_op == SENDING_OP)
-        update_epoll_events(connections_epollfd, c->socketfd, CLIENT_EPOLL_DEFAULT_EVENTS | EPOLLOUT);
+    {
+        metrics_gauge_add(METRIC_OUTBOUND_QUEUED, 1);
+        update_epoll_events(connections_epollfd, c->socketfd, client_epoll_events(c));
+    }
 
     return retval;
 }
@@ -250,6 +319,7 @@ unsigned int send_bcast(char* buffer, size_t size)
         send_long_msg(curr->c, buffer, strlen(buffer)+1);
         ++count;
     }
+    metrics_fanout(count);
     
     return count;
 }
@@ -316,6 +386,8 @@ static int register_client_connection()
     char username[USERNAME_LENG+1];
     User *registered_user;
     char reg_msg[MAX_MSG_LENG+1];
+    char *codec;
+    int use_codec = 0;
 
     if(current_client->connection_type != UNREGISTERED_CONNECTION)
     {
@@ -328,6 +400,14 @@ static int register_client_connection()
     cleanup_timer_event(current_client->idle_timer);
     current_client->idle_timer = NULL;
     
+    //Does the client offer to compress its messages? ("!regid=<name>,codec=<codec>")
+    codec = strstr(&buffer[7], ",codec=");
+    if(codec)
+    {
+        *codec = '\0';
+        use_codec = (strcmp(&codec[7], XFER_CODEC_NAME) == 0);
+    }
+
     //Check for name validity and then check for duplicates
     if(!handle_new_username(&buffer[7], username))                     //Skips the "!regid=" header
     {
@@ -340,16 +420,24 @@ static int register_client_connection()
     registered_user = malloc(sizeof(User));
     registered_user->c = current_client;
     strcpy(registered_user->username, username);
+    memset(&registered_user->pending_msg, 0, sizeof(Pending_Msg));
+    registered_user->offline_pms_waiting = has_offline_pms(username);
+    xfer_scheduler_add_user(registered_user);
+    flood_add_user(registered_user);
     HASH_ADD_STR(active_users, username, registered_user);
     ++total_users;
 
     //Update the client descriptor
-    current_client->connection_type = USER_CONNECTION;
+    set_connection_type(current_client, USER_CONNECTION);
     current_client->user = registered_user;
+    heartbeat_track(current_client);
 
-    //Reply to the new user with its new requested username
-    sprintf(reg_msg, "!regid=%s", current_client->user->username);
+    //Reply to the new user with its new requested username, and accept its codec if the server supports it.
+    //Only messages sent after the reply are compressed
+    sprintf(reg_msg, "!regid=%s%s", current_client->user->username, (use_codec)? ",codec="XFER_CODEC_NAME : "");
     send_direct(current_client->socketfd, reg_msg, strlen(reg_msg)+1);
+    if(use_codec)
+        registered_user->pending_msg.codec = XFER_CODEC_LZ;
     
     printf("User \"%s\" has connected. Total users: %d\n", current_client->user->username, total_users); 
     
@@ -371,9 +459,21 @@ static int client_pm()
     HASH_FIND_STR(active_users, msg_target, target);
     if(!target)
     {
-        printf("User \"%s\" not found\n", msg_target);
-        send_error_code(current_client, ERR_USER_NOT_FOUND, msg_target);
-        return 0;
+        if(!name_is_valid(msg_target))
+        {
+            printf("User \"%s\" not found\n", msg_target);
+            send_error_code(current_client, ERR_USER_NOT_FOUND, msg_target);
+            return 0;
+        }
+
+        //Keep the message until someone connects with that username
+        if(!queue_offline_pm(current_client->user->username, msg_target, msg_body))
+            return 0;
+
+        sprintf(pmsg, "%s (PM to %s, offline - queued): %s", current_client->user->username, msg_target, msg_body);
+        send_msg(current_client, pmsg, strlen(pmsg)+1);
+        archive_pm(current_client->user->username, msg_target, msg_body);
+        return 1;
     }
 
     //Forward message to the target
@@ -384,6 +484,7 @@ static int client_pm()
     //Echo back to the sender
     sprintf(pmsg, "%s (PM to %s): %s", current_client->user->username, msg_target, msg_body);
     send_msg(current_client, pmsg, strlen(pmsg)+1);
+    archive_pm(current_client->user->username, target->username, msg_body);
     
     return 1;
 }
@@ -398,6 +499,8 @@ static int client_pm()
 static void exit_cleanup()
 {
     close(server_socketfd);
+    state_journal_close();
+    history_close();
     pthread_cancel(timer_event_thread);
     pthread_cancel(network_event_thread);
 }
@@ -405,37 +508,28 @@ static void exit_cleanup()
 
 static int handle_new_connection()
 {    
-    Client *new_client = calloc(1, sizeof(Client));
-    IP_List *ban_entry;
+    Client *new_client;
+    struct sockaddr_in sockaddr;
+    int socketfd;
+
+    //Connections turned away are closed before anything is allocated for them
+    socketfd = accept_connection(&sockaddr);
+    if(socketfd < 0)
+        return 0;
 
+    new_client = calloc(1, sizeof(Client));
     current_client = new_client;
     new_client->connection_type = UNREGISTERED_CONNECTION;
     new_client->sockaddr_leng = sizeof(struct sockaddr_in);
-    new_client->socketfd = accept(server_socketfd, (struct sockaddr*) &new_client->sockaddr, &new_client->sockaddr_leng);
+    new_client->sockaddr = sockaddr;
+    new_client->socketfd = socketfd;
 
-    if(new_client->socketfd < 0)
-    {
-        perror("Error accepting client!");
-        free(new_client);
-        return 0;
-    }
     printf("Accepted new connection %s:%d (fd=%d)\n", 
             inet_ntoa(new_client->sockaddr.sin_addr), ntohs(new_client->sockaddr.sin_port), new_client->socketfd);
 
-    //Check if this user is currently in the server's global banned list
-    HASH_FIND_INT(banned_ips, &(uint32_t){new_client->sockaddr.sin_addr.s_addr}, ban_entry);
-    if(ban_entry)
-    {
-        printf("Dropping new connection on %s:%d. IP address has been banned.\n", 
-                inet_ntoa(new_client->sockaddr.sin_addr), ntohs(new_client->sockaddr.sin_port));
-        
-        kill_connection(&new_client->socketfd);
-        free(new_client);
-        return 0;
-    }
-
     //Add the client into active_connections, and use its socketfd as the key.
     HASH_ADD_INT(active_connections, socketfd, new_client);
+    index_connection(new_client);
 
     //Register the new client's FD into epoll's event list, and mark it as nonblocking
     fcntl(new_client->socketfd, F_SETFL, O_NONBLOCK);
@@ -446,18 +540,23 @@ static int handle_new_connection()
     if(!send_direct(new_client->socketfd, "Hello World!", 13))
         return 0;
 
-    //Set a timer that disconnects the unregistered client after a certain period of no registration
-    new_client->idle_timer = calloc(1, sizeof(TimerEvent));
-    new_client->idle_timer->event_type = EXPIRING_UNREGISTERED_CONNECTION;
-    new_client->idle_timer->c = new_client;
-    new_client->idle_timer->timerfd = create_timerfd(UNREGISTERED_CONNECTION_TIMEOUT, 0, timers_epollfd);
+    return start_registration_timer(new_client);
+} 
 
-    if(!new_client->idle_timer->timerfd)
+//Set a timer that disconnects the unregistered client after a certain period of no registration
+int start_registration_timer(Client *c)
+{
+    c->idle_timer = calloc(1, sizeof(TimerEvent));
+    c->idle_timer->event_type = EXPIRING_UNREGISTERED_CONNECTION;
+    c->idle_timer->c = c;
+    c->idle_timer->timerfd = create_timerfd(UNREGISTERED_CONNECTION_TIMEOUT, 0, timers_epollfd);
+
+    if(!c->idle_timer->timerfd)
         return 0;
-    HASH_ADD_INT(timers, timerfd, new_client->idle_timer);
+    HASH_ADD_INT(timers, timerfd, c->idle_timer);
     
     return 1;
-} 
+}
 
 static inline int handle_unregistered_client_msg()
 {
@@ -487,6 +586,20 @@ static inline int handle_unregistered_client_msg()
     return 0;
 }
 
+//PMs queued while a user was offline are delivered once its first message after registering is handled.
+//For the client, that is joining the lobby, which must be answered first
+static void deliver_after_registration(int socketfd)
+{
+    Client *c;
+
+    HASH_FIND_INT(active_connections, &socketfd, c);
+    if(!c || !c->user || !c->user->offline_pms_waiting)
+        return;
+
+    c->user->offline_pms_waiting = 0;
+    deliver_offline_pms(c->user);
+}
+
 static int handle_client_msg(int use_pending_msg)
 {
     int bytes;
@@ -495,10 +608,6 @@ static int handle_client_msg(int use_pending_msg)
     if(current_client->connection_type == UNREGISTERED_CONNECTION)
         return handle_unregistered_client_msg();
     
-    //If this connection is a transfer connection, forward the data contained directly to its target
-    else if(current_client->connection_type == TRANSFER_CONNECTION)
-        return client_data_forward_sender_ready(); 
-    
     //Read regular user's message
     if(use_pending_msg)
     {
@@ -525,6 +634,17 @@ static int handle_client_msg(int use_pending_msg)
             return 1;
     }
 
+    metrics_count(METRIC_MSGS_IN, 1);
+    metrics_count(METRIC_BYTES_IN, bytes);
+
+    //Answers to heartbeat pings only need to arrive. They don't count against the message rate limit
+    if(strcmp(buffer, "!pong") == 0)
+        return 1;
+
+    //Hold back users sending faster than the message rate limit, before anything is parsed or fanned out
+    if(!flood_admit_user(current_client))
+        return 0;
+
     printf("Received from %s: \"%.*s\"\n", current_client->user->username, bytes, buffer);
     seperate_target_command(buffer, &msg_target, &msg_body);
 
@@ -595,9 +715,46 @@ static void handle_timer_events()
             }
             else if (current_timer_event->event_type == EXPIRING_TRANSFER_REQ)
             {
-                transfer_invite_expired(current_timer_event->c);
+                transfer_invite_expired(current_timer_event);
                 current_timer_event = NULL;
             }
+            else if (current_timer_event->event_type == EXPIRING_RESUMABLE_XFER)
+            {
+                resumable_transfer_expired(current_timer_event);
+                current_timer_event = NULL;
+            }
+            else if (current_timer_event->event_type == STORAGE_SWEEP)
+            {
+                group_storage_sweep();
+                current_timer_event = NULL;     //Periodic, keep it
+            }
+            else if (current_timer_event->event_type == STATE_JOURNAL_SYNC)
+            {
+                state_journal_sync();
+                current_timer_event = NULL;     //Periodic, keep it
+            }
+            else if (current_timer_event->event_type == OFFLINE_PM_SWEEP)
+            {
+                offline_pm_sweep();
+                current_timer_event = NULL;     //Periodic, keep it
+            }
+            else if (current_timer_event->event_type == UPGRADE_DRAIN)
+            {
+                upgrade_drain_check();
+                current_timer_event = NULL;     //Removed by the check itself, once the upgrade is done waiting
+            }
+            else if (current_timer_event->event_type == ADMISSION_SWEEP)
+            {
+                admission_sweep();
+                current_timer_event = NULL;     //Periodic, keep it
+            }
+            else if (current_timer_event->event_type == HEARTBEAT_SWEEP)
+            {
+                heartbeat_sweep();
+                current_timer_event = NULL;     //Periodic, keep it
+            }
+            else if (current_timer_event->event_type == FLOOD_RESUME || current_timer_event->event_type == FLOOD_UNMUTE)
+                flood_timer_expired(current_timer_event);
                 
             
             else
@@ -623,7 +780,7 @@ handle_timer_events_continue:
 static inline void server_main_loop()
 {
     struct epoll_event events[MAX_EPOLL_EVENTS];
-    int ready_count, i;
+    int ready_count, registered, i;
     
     while(1)
     {
@@ -644,6 +801,14 @@ static inline void server_main_loop()
             if(events[i].data.fd == server_socketfd)
                 handle_new_connection();
 
+            //Transfer threads have finished with some transfer connections. Registered transfer connections are never served here
+            else if(events[i].data.fd == xfer_events_fd)
+                handle_transfer_events();
+
+            //The search thread has answered some queries
+            else if(events[i].data.fd == search_events_fd)
+                handle_search_results();
+
             //When an event is occuring on an existing client connection
             else
             {                
@@ -660,9 +825,12 @@ static inline void server_main_loop()
                     disconnect_client(current_client, NULL);
                     continue;
                 }    
+
+                //Anything moving on the connection shows its peer is still there
+                heartbeat_seen(current_client);
                 
                 //Handles EPOLLIN (ready for reading)
-                else if(events[i].events & EPOLLIN)
+                if(events[i].events & EPOLLIN)
                 {
                     if(current_client->user && current_client->user->pending_msg.pending_op == RECVING_OP)
                     {
@@ -670,21 +838,24 @@ static inline void server_main_loop()
                         
                         //Check if the entire message has been received
                         if(current_client->user->pending_msg.pending_op == NO_XFER_OP)
+                        {
                             handle_client_msg(1);
+                            deliver_after_registration(events[i].data.fd);
+                        }
                         continue;
                     }
                         
+                    registered = (current_client->connection_type != UNREGISTERED_CONNECTION);
                     handle_client_msg(0);
+                    if(registered)
+                        deliver_after_registration(events[i].data.fd);
                 }
                     
 
                 //Handle EPOLLOUT (ready for writing) if the client has pending long messages
                 else if(events[i].events & EPOLLOUT)
                 {
-                    if(current_client->connection_type == TRANSFER_CONNECTION)
-                        client_data_forward_recver_ready();
-                    
-                    else if(current_client->user->pending_msg.pending_op == SENDING_OP)
+                    if(current_client->user && current_client->user->pending_msg.pending_op == SENDING_OP)
                     {
                         transfer_next_pending(current_client);
 
@@ -722,7 +893,8 @@ static int handle_stdin()
         if(strlen(str) < 1 || str[0] == '\n')
              goto handle_client_input_cleanup;
 
-        //Admin only commands
+        //Admin only commands. No remote client is being served
+        current_client = NULL;
         handle_admin_commands(str);
 
     handle_client_input_cleanup:
@@ -738,31 +910,16 @@ static int handle_stdin()
 
 
 
-void server(const char* hostname, const unsigned int port)
-{   
+static int create_server_socket(const char* hostname, const unsigned int port)
+{
     char ipaddr_used[INET_ADDRSTRLEN], port_str[8];
 
-    atexit(exit_cleanup);
-
-    /*Initialize network buffer*/
-    buffer = calloc(BUFSIZE, sizeof(char));
-
-    /*Setup epoll to allow multiplexed IO to serve multiple clients, and to use timerfd's*/
-    connections_epollfd = epoll_create1(0);
-    timers_epollfd = epoll_create1(0);
-
-    if(connections_epollfd < 0 || timers_epollfd < 0)
-    {
-        perror("Failed to create epoll!");
-        return;
-    }
-    
     /*Create a TCP server socket*/
     server_socketfd = socket(AF_INET, SOCK_STREAM, 0);
     if(server_socketfd < 0)
     {
         perror("Error creating socket!");
-        return;
+        return 0;
     }
 
     memset(&server_addr, 0, sizeof(struct sockaddr_in));
@@ -774,7 +931,7 @@ void server(const char* hostname, const unsigned int port)
     {
         sprintf(port_str, "%u", port);
         if(!hostname_to_ip(hostname, port_str, ipaddr_used))
-            return;
+            return 0;
         server_addr.sin_addr.s_addr = inet_addr(ipaddr_used);
     }
     else
@@ -791,25 +948,83 @@ void server(const char* hostname, const unsigned int port)
     {
         printf("Failed to bind socket at %s:%u. \n", ipaddr_used, ntohs(server_addr.sin_port));
         perror("");
-        return;
+        return 0;
     }
 
     /*Register the server socket to the epoll list, and also mark it as nonblocking*/
     fcntl(server_socketfd, F_SETFL, O_NONBLOCK);
     if(!register_fd_with_epoll(connections_epollfd, server_socketfd, EPOLLIN))
-        return;   
+        return 0;   
+
+    return 1;
+}
+
+
+void server(const char* hostname, const unsigned int port)
+{   
+    char ipaddr_used[INET_ADDRSTRLEN];
+    int handoff_fd;
+
+    atexit(exit_cleanup);
+
+    /*Started by an upgrade? The old binary hands over its sockets, instead of a new server socket being bound*/
+    upgrade_init(hostname, port);
+    handoff_fd = upgrade_handoff_fd();
+
+    /*Initialize network buffer*/
+    buffer = calloc(BUFSIZE, sizeof(char));
+
+    /*Setup epoll to allow multiplexed IO to serve multiple clients, and to use timerfd's*/
+    connections_epollfd = epoll_create1(0);
+    timers_epollfd = epoll_create1(0);
+
+    if(connections_epollfd < 0 || timers_epollfd < 0)
+    {
+        perror("Failed to create epoll!");
+        return;
+    }
+    
+    if(!handoff_fd && !create_server_socket(hostname, port))
+        return;
 
     /*Initialize other server components before listening for connections*/
     if(!create_lobby_group())
         return;
+    if(!state_journal_init())
+        return;
+    xfer_scheduler_init();
+    if(!xfer_threads_init())
+        return;
+    if(!group_storage_init())
+        return;
+    if(!history_init())
+        return;
+    if(!chat_search_init())
+        return;
+    if(!offline_pm_init())
+        return;
+    if(!admission_init())
+        return;
+    if(!heartbeat_init())
+        return;
+    if(!metrics_init())
+        return;
+
+    /*The handed over server socket is already listening, and every connection goes on where the old binary left it*/
+    if(handoff_fd)
+    {
+        if(!resume_upgrade(handoff_fd))
+            return;
+    }
 
     /*Begin listening for incoming connections on the server socket*/
-    if(listen(server_socketfd, MAX_CONNECTION_BACKLOG) < 0)
+    else if(listen(server_socketfd, MAX_CONNECTION_BACKLOG) < 0)
     {
         perror("Failed to listen to the socket!");
         return;
     }
 
+    inet_ntop(AF_INET, &server_addr.sin_addr, ipaddr_used, INET_ADDRSTRLEN);
     printf("Listening for new client connections at %s:%u...\n", ipaddr_used, ntohs(server_addr.sin_port));
 
     /*Spawn a new thread that monitors timer events*/
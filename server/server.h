@@ -4,6 +4,19 @@
 #include "server_common.h"
 #include "group.h"
 #include "file_transfer_server.h"
+#include "blob_store.h"
+#include "xfer_scheduler.h"
+#include "xfer_threads.h"
+#include "group_storage.h"
+#include "state_journal.h"
+#include "chat_history.h"
+#include "chat_search.h"
+#include "offline_pm.h"
+#include "upgrade.h"
+#include "flood_control.h"
+#include "admission.h"
+#include "heartbeat.h"
+#include "metrics.h"
 
 
 #define UNREGISTERED_CONNECTION_TIMEOUT     30
@@ -22,7 +35,7 @@ extern char *msg_body;
 extern Client *active_connections;                  //Hashtable of all active client sockets (key = socketfd)
 extern User *active_users;                          //Hashtable of all active users (key = username), mapped to their client descriptors
 extern Group* groups;                               //Hashtable of all user created private chatrooms (key = groupname)
-extern IP_List *banned_ips;                         //Hashtable of all banned IPs
+extern IPTrie banned_ips;                           //All IPs (and ranges) banned from the server
 extern unsigned int total_users;    
 
 extern Client *current_client;                      //Descriptor for the client being serviced right now
@@ -37,5 +50,9 @@ unsigned int send_long_msg(Client *c, char* buffer, size_t size);
 unsigned int send_bcast(char* buffer, size_t size);
 unsigned int recv_msg(Client *c, char* buffer, size_t size);
 
+int start_registration_timer(Client *c);
+int client_epoll_events(Client *c);
+int ban_target_prefix(char *target, IPPrefix *prefix_ret, User **user_ret);
+
 
 #endif
\ No newline at end of file
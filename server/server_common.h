@@ -11,7 +11,7 @@ struct timerevent;
 enum connection_type {UNREGISTERED_CONNECTION = 0, USER_CONNECTION, TRANSFER_CONNECTION};
 
 //Abstracts each active client participating in the server
-typedef struct {
+typedef struct client {
     
     /*Connection info*/
     int socketfd;                        //Key used for the main active client hash table
@@ -21,13 +21,32 @@ typedef struct {
 
     /*Descriptors for other server components*/
     struct user *user;
-    struct filexferargs_server *file_transfers;
+    struct filexferargs_server *file_transfers;     //USER_CONNECTION: Hashtable of the user's pending and ongoing transfers (key = token)
+    struct filexferargs_server *xferargs;           //TRANSFER_CONNECTION: The transfer served by this connection
+    unsigned int xfer_stream;                       //TRANSFER_CONNECTION: Index of the stream (byte range) served by this connection
+    struct xferthread *xfer_thread;                 //TRANSFER_CONNECTION: The transfer thread it was handed off to, until the chat thread reclaims it
     struct timerevent *idle_timer;
 
+    /*Liveness of registered connections (see heartbeat.c)*/
+    uint64_t last_activity;                         //Monotonic time (ms) the connection last moved anything. Transfer threads write it too
+    uint64_t ping_sent_at;                          //USER_CONNECTION: when its unanswered ping was sent, or 0
+    uint64_t heartbeat_due;                         //When it is checked next, or 0 if it is not on the heartbeat wheel
+    int xfer_waiting;                               //TRANSFER_CONNECTION: waiting on the other end of its transfer, or for bandwidth tokens
+    struct client *hb_prev, *hb_next;               //Other connections due in the same tick
+
+    struct client *ip_prev, *ip_next;               //Other connections from the same address
     UT_hash_handle hh;
 } Client;
 
 
+//Measures a transfer rate over windows of about a second
+typedef struct {
+    uint64_t window_start;      //Monotonic time (ms)
+    uint64_t window_bytes;
+    uint64_t bytes_per_sec;     //Rate measured over the last complete window
+} XferRate;
+
+
 //Maps a username to a client object
 typedef struct user {
 
@@ -39,19 +58,36 @@ typedef struct user {
     /*Pending Long Message (if any)*/
     Pending_Msg pending_msg;
 
+    /*PMs queued while the user was offline, delivered after its first message*/
+    unsigned int offline_pms_waiting :1;
+
     /*Descriptors for other server components*/
     struct grouplist *groups_joined;
+
+    /*Bandwidth share of the user's file transfers*/
+    TokenBucket xfer_bucket;
+    unsigned int xfer_weight;
+    XferRate xfer_rate;
+    unsigned int xfer_connections;                  //Transfer connections being served by transfer threads
+
+    /*Message rate limit (see flood_control.c)*/
+    TokenBucket msg_bucket;
+    unsigned int flood_warned :1;                   //Told that its messages are being dropped, since its last admitted one
+    unsigned int flood_paused :1;                   //Not read from until flood_timer fires
+    unsigned int flood_muted :1;
+    struct timerevent *flood_timer;
     
     UT_hash_handle hh;
 } User;
 
 
-enum timer_event_type {NO_EVENT = 0, EXPIRING_UNREGISTERED_CONNECTION, EXPIRING_TRANSFER_REQ};
+enum timer_event_type {NO_EVENT = 0, EXPIRING_UNREGISTERED_CONNECTION, EXPIRING_TRANSFER_REQ, EXPIRING_RESUMABLE_XFER, STORAGE_SWEEP, STATE_JOURNAL_SYNC, OFFLINE_PM_SWEEP, UPGRADE_DRAIN, FLOOD_RESUME, FLOOD_UNMUTE, ADMISSION_SWEEP, HEARTBEAT_SWEEP};
 
 typedef struct timerevent{
     int timerfd;
     enum timer_event_type event_type;
     Client *c;
+    struct filexferargs_server *xferargs;           //For EXPIRING_TRANSFER_REQ and EXPIRING_RESUMABLE_XFER only
 
     UT_hash_handle hh;
 } TimerEvent;
@@ -0,0 +1,919 @@
+#include "state_journal.h"
+#include "server.h"
+
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+static FILE *journal;                           //Not open while the state is being restored (or if it cannot be written), which leaves changes unrecorded
+static uint64_t journal_generation;
+static size_t journal_size;
+static int journal_dirty;                       //Records were appended since the last sync
+static Group *restored_group;                   //Group of the last record restored. A snapshot lists each group's files right after it
+static Blob **restored_blobs;                   //Blobs in the order of their records, which a snapshot's files refer to
+static unsigned int restored_blob_count, restored_blob_capacity;
+static int restored_without_history_id;         //Groups of older journals were restored, with a new history id that is not recorded yet
+TimerEvent *state_sync_timer;
+
+
+
+/******************************/
+/*       Record Writing       */
+/******************************/
+
+//Writes a record made of the given parts. Returns the bytes written, or 0 on failure
+static size_t write_record(FILE *out, enum state_record_type type, struct iovec *parts, int part_count)
+{
+    StateRecordHeader header = {0};
+    int i;
+
+    header.type = type;
+    header.crc = CRC_INIT;
+    for(i = 0; i < part_count; i++)
+    {
+        header.length += parts[i].iov_len;
+        header.crc = xcrc32(parts[i].iov_base, parts[i].iov_len, header.crc);
+    }
+
+    if(fwrite(&header, sizeof(StateRecordHeader), 1, out) != 1)
+        return 0;
+
+    for(i = 0; i < part_count; i++)
+        if(parts[i].iov_len > 0 && fwrite(parts[i].iov_base, parts[i].iov_len, 1, out) != 1)
+            return 0;
+
+    return sizeof(StateRecordHeader) + header.length;
+}
+
+static size_t write_group(FILE *out, Group *group)
+{
+    StateGroup record = {group->group_flags, group->default_user_permissions, group->storage_quota, group->file_ttl, group->last_fileid};
+    struct iovec parts[] = {{&record, sizeof(StateGroup)}, {group->groupname, strlen(group->groupname)+1}, {&group->history_id, sizeof(uint64_t)}};
+
+    return write_record(out, STATE_GROUP, parts, 3);
+}
+
+static size_t write_ban(FILE *out, enum state_record_type type, Group *group, IPPrefix *range)
+{
+    StateBanRange record = {{0}};
+    struct iovec parts[] = {{&record, sizeof(StateBanRange)}, {group->groupname, strlen(group->groupname)+1}};
+
+    memcpy(record.addr, range->addr, sizeof(record.addr));
+    record.length = range->length;
+    return write_record(out, type, parts, 2);
+}
+
+typedef struct {
+    FILE *out;
+    Group *group;
+    size_t written;
+} SnapshotBans;
+
+static void write_snapshot_ban(void *arg, IPTrieNode *node)
+{
+    SnapshotBans *snapshot = arg;
+
+    if(snapshot->written)
+        snapshot->written = write_ban(snapshot->out, STATE_BAN_RANGE, snapshot->group, &node->prefix);
+}
+
+static size_t write_blob(FILE *out, Blob *blob)
+{
+    StateBlob record = {blob->filesize, blob->checksum, 0, 0, 0, 0};
+    struct iovec parts[4];
+
+    //Chunk checksums and stored frames are optional
+    if(blob->chunk_crcs)
+    {
+        record.chunk_count = blob->chunk_count;
+        record.chunk_root = blob->chunk_root;
+    }
+    if(blob->frames)
+    {
+        record.frame_count = (blob->filesize + XFER_FRAME_BLOCK - 1) / XFER_FRAME_BLOCK;
+        record.frames_size = blob->frames_size;
+    }
+
+    parts[0] = (struct iovec){&record, sizeof(StateBlob)};
+    parts[1] = (struct iovec){blob->chunk_crcs, record.chunk_count * sizeof(unsigned int)};
+    parts[2] = (struct iovec){blob->frames, record.frame_count * sizeof(StoredFrame)};
+    parts[3] = (struct iovec){blob->key, strlen(blob->key)+1};
+
+    return write_record(out, STATE_BLOB, parts, 4);
+}
+
+//Snapshots refer to the file's blob by its position ("blob_index"), which spares looking up its key for every file on startup
+static size_t write_file(FILE *out, Group *group, File_List *file, unsigned int blob_index)
+{
+    StateFile record = {file->fileid, blob_index, file->stored_at, file->last_download};
+    char *key = (blob_index)? "" : file->blob->key;
+    struct iovec parts[] = {
+        {&record, sizeof(StateFile)},
+        {group->groupname, strlen(group->groupname)+1},
+        {file->uploader, strlen(file->uploader)+1},
+        {file->filename, strlen(file->filename)+1},
+        {key, strlen(key)+1}
+    };
+
+    return write_record(out, STATE_FILE, parts, 5);
+}
+
+static size_t write_storage_quota(FILE *out)
+{
+    struct iovec parts[] = {{&global_storage_quota, sizeof(uint64_t)}};
+
+    return write_record(out, STATE_STORAGE_QUOTA, parts, 1);
+}
+
+
+
+/******************************/
+/*    Snapshot and Journal    */
+/******************************/
+
+//Makes renames in the state directory durable
+static void sync_state_root()
+{
+    int fd = open(STATE_ROOT, O_RDONLY | O_DIRECTORY);
+
+    if(fd < 0)
+        return;
+
+    fsync(fd);
+    close(fd);
+}
+
+//Creates a file from scratch, and replaces the old one only once it is complete on disk
+static FILE* create_state_file(char *tmp_path, uint64_t generation)
+{
+    StateFileHeader header = {STATE_MAGIC, STATE_VERSION, generation};
+    FILE *out;
+
+    out = fopen(tmp_path, "w");
+    if(!out)
+    {
+        perror("Failed to create state file.");
+        return NULL;
+    }
+
+    if(fwrite(&header, sizeof(StateFileHeader), 1, out) != 1)
+    {
+        perror("Failed to write state file.");
+        fclose(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+static int commit_state_file(FILE *out, char *tmp_path, char *path)
+{
+    if(fflush(out) != 0 || fsync(fileno(out)) < 0)
+    {
+        perror("Failed to write state file.");
+        fclose(out);
+        remove(tmp_path);
+        return 0;
+    }
+    fclose(out);
+
+    if(rename(tmp_path, path) < 0)
+    {
+        perror("Failed to replace state file.");
+        remove(tmp_path);
+        return 0;
+    }
+
+    sync_state_root();
+    return 1;
+}
+
+//Writes the records that rebuild the current state. Journals older than "generation" are no longer replayed on top of it
+static int write_snapshot(uint64_t generation)
+{
+    FILE *out;
+    Group *group, *group_tmp;
+    File_List *file, *file_tmp;
+    SnapshotBans bans;
+    Blob *blob, *blob_tmp;
+    size_t written;
+    unsigned int file_count = 0, blob_count = 0;
+
+    out = create_state_file(STATE_SNAPSHOT_FILE ".tmp", generation);
+    if(!out)
+        return 0;
+    setvbuf(out, NULL, _IOFBF, 1048576);
+
+    written = write_storage_quota(out);
+
+    //Blobs first, so the files listing them find them
+    HASH_ITER(hh, blobs, blob, blob_tmp)
+    {
+        if(written && blob->refcount > 0)
+        {
+            written = write_blob(out, blob);
+            blob->snapshot_index = ++blob_count;
+        }
+    }
+
+    HASH_ITER(hh, groups, group, group_tmp)
+    {
+        if(!written)
+            break;
+        written = write_group(out, group);
+
+        bans = (SnapshotBans){out, group, written};
+        ip_trie_walk(&group->banned_ips, NULL, write_snapshot_ban, &bans);
+        written = bans.written;
+
+        //Files still being uploaded are not kept
+        HASH_ITER(hh, group->filelist, file, file_tmp)
+        {
+            if(written && file->blob)
+            {
+                written = write_file(out, group, file, file->blob->snapshot_index);
+                ++file_count;
+            }
+        }
+    }
+
+    if(!written)
+    {
+        perror("Failed to write state snapshot.");
+        fclose(out);
+        remove(STATE_SNAPSHOT_FILE ".tmp");
+        return 0;
+    }
+
+    if(!commit_state_file(out, STATE_SNAPSHOT_FILE ".tmp", STATE_SNAPSHOT_FILE))
+        return 0;
+
+    printf("Wrote state snapshot: %u groups, %u files, %u blobs.\n", HASH_COUNT(groups), file_count, blob_count);
+    return 1;
+}
+
+//Starts an empty journal of the given generation, replacing the current one
+static int start_journal(uint64_t generation)
+{
+    FILE *out;
+
+    if(journal)
+    {
+        fclose(journal);
+        journal = NULL;
+    }
+
+    out = create_state_file(STATE_JOURNAL_FILE ".tmp", generation);
+    if(!out || !commit_state_file(out, STATE_JOURNAL_FILE ".tmp", STATE_JOURNAL_FILE))
+        return 0;
+
+    journal = fopen(STATE_JOURNAL_FILE, "a");
+    if(!journal)
+    {
+        perror("Failed to open state journal.");
+        return 0;
+    }
+
+    journal_generation = generation;
+    journal_size = sizeof(StateFileHeader);
+    journal_dirty = 0;
+    return 1;
+}
+
+//Folds the journal into a new snapshot, and starts the journal over
+static void compact_state()
+{
+    //A crash between the two leaves an older journal behind, which the new snapshot already includes
+    if(!write_snapshot(journal_generation + 1))
+        return;
+
+    if(!start_journal(journal_generation + 1))
+        printf("State changes are no longer recorded!\n");
+}
+
+static void journal_written(size_t written)
+{
+    if(!written || fflush(journal) != 0)
+    {
+        perror("Failed to append to the state journal.");
+        return;
+    }
+
+    journal_size += written;
+    journal_dirty = 1;
+}
+
+
+
+/******************************/
+/*     Recording Changes      */
+/******************************/
+
+//Called wherever the state changes. Records are written through right away (so a crash of the server loses none of them), and synced to disk every STATE_SYNC_PERIOD seconds
+
+void journal_group(Group *group)
+{
+    if(journal)
+        journal_written(write_group(journal, group));
+}
+
+void journal_group_removed(Group *group)
+{
+    struct iovec parts[] = {{group->groupname, strlen(group->groupname)+1}};
+
+    if(journal)
+        journal_written(write_record(journal, STATE_GROUP_REMOVED, parts, 1));
+}
+
+void journal_group_renamed(char *oldname, Group *group)
+{
+    struct iovec parts[] = {{oldname, strlen(oldname)+1}, {group->groupname, strlen(group->groupname)+1}};
+
+    if(journal)
+        journal_written(write_record(journal, STATE_GROUP_RENAMED, parts, 2));
+}
+
+void journal_ban(Group *group, IPPrefix *range, int banned)
+{
+    if(journal)
+        journal_written(write_ban(journal, (banned)? STATE_BAN_RANGE : STATE_UNBAN_RANGE, group, range));
+}
+
+void journal_blob(Blob *blob)
+{
+    if(journal)
+        journal_written(write_blob(journal, blob));
+}
+
+void journal_blob_removed(Blob *blob)
+{
+    struct iovec parts[] = {{blob->key, strlen(blob->key)+1}};
+
+    if(journal)
+        journal_written(write_record(journal, STATE_BLOB_REMOVED, parts, 1));
+}
+
+void journal_file(Group *group, File_List *file)
+{
+    if(journal)
+        journal_written(write_file(journal, group, file, 0));
+}
+
+void journal_file_removed(Group *group, File_List *file)
+{
+    StateFile record = {file->fileid, 0, 0, 0};
+    struct iovec parts[] = {{&record, sizeof(StateFile)}, {group->groupname, strlen(group->groupname)+1}};
+
+    if(journal)
+        journal_written(write_record(journal, STATE_FILE_REMOVED, parts, 2));
+}
+
+void journal_storage_quota()
+{
+    if(journal)
+        journal_written(write_storage_quota(journal));
+}
+
+
+
+/******************************/
+/*      Restoring State       */
+/******************************/
+
+//Returns the next NUL terminated string of a record, or NULL if there is none
+static char* next_record_string(char **cursor, char *end)
+{
+    char *str = *cursor, *nul;
+
+    if(str >= end)
+        return NULL;
+
+    nul = memchr(str, '\0', end - str);
+    if(!nul || nul - str > MAX_FILENAME)
+        return NULL;
+
+    *cursor = nul + 1;
+    return str;
+}
+
+static Group* find_restored_group(char *groupname)
+{
+    Group *group;
+
+    if(restored_group && strcmp(restored_group->groupname, groupname) == 0)
+        return restored_group;
+
+    HASH_FIND_STR(groups, groupname, group);
+    if(!group)
+        printf("State record for unknown group \"%s\". Skipping.\n", groupname);
+
+    restored_group = group;
+    return group;
+}
+
+//Files are removed from memory only. Their blobs are deleted (on disk) by their own records
+static void drop_restored_file(Group *group, File_List *file)
+{
+    --file->blob->refcount;
+    HASH_DEL(group->filelist, file);
+    free(file);
+}
+
+static void drop_restored_group(Group *group)
+{
+    File_List *file, *file_tmp;
+
+    ip_trie_clear(&group->banned_ips);
+
+    HASH_ITER(hh, group->filelist, file, file_tmp)
+        drop_restored_file(group, file);
+
+    HASH_DEL(groups, group);
+    free(group);
+    restored_group = NULL;
+}
+
+//Returns the blob of the record, or NULL if the record is malformed
+static Blob* restore_blob_record(char *payload, char *end)
+{
+    StateBlob record;
+    Blob *blob;
+    char *cursor = payload + sizeof(StateBlob), *key;
+    size_t crcs_size, frames_size;
+
+    memcpy(&record, payload, sizeof(StateBlob));
+    crcs_size = (size_t)record.chunk_count * sizeof(unsigned int);
+    frames_size = (size_t)record.frame_count * sizeof(StoredFrame);
+    if((size_t)(end - cursor) < crcs_size + frames_size)
+        return NULL;
+
+    cursor += crcs_size + frames_size;
+    key = next_record_string(&cursor, end);
+    if(!key || strlen(key) > BLOB_KEY_SIZE)
+        return NULL;
+
+    HASH_FIND_STR(blobs, key, blob);
+    if(blob)
+        return blob;
+
+    blob = restore_blob(key, record.filesize, record.checksum);
+
+    if(record.chunk_count > 0)
+    {
+        blob->chunk_crcs = malloc(crcs_size);
+        memcpy(blob->chunk_crcs, payload + sizeof(StateBlob), crcs_size);
+        blob->chunk_count = record.chunk_count;
+        blob->chunk_root = record.chunk_root;
+    }
+
+    if(record.frame_count > 0)
+    {
+        blob->frames = malloc(frames_size);
+        memcpy(blob->frames, payload + sizeof(StateBlob) + crcs_size, frames_size);
+        blob->frames_size = record.frames_size;
+    }
+
+    return blob;
+}
+
+static void add_restored_blob(Blob *blob)
+{
+    if(restored_blob_count == restored_blob_capacity)
+    {
+        restored_blob_capacity = (restored_blob_capacity)? restored_blob_capacity * 2 : 1024;
+        restored_blobs = realloc(restored_blobs, restored_blob_capacity * sizeof(Blob*));
+    }
+
+    restored_blobs[restored_blob_count++] = blob;
+}
+
+static void clear_restored_blobs()
+{
+    free(restored_blobs);
+    restored_blobs = NULL;
+    restored_blob_count = restored_blob_capacity = 0;
+}
+
+static int restore_file_record(char *payload, char *end)
+{
+    StateFile record;
+    Group *group;
+    Blob *blob;
+    File_List *file;
+    char *cursor = payload + sizeof(StateFile), *groupname, *uploader, *filename, *key;
+
+    memcpy(&record, payload, sizeof(StateFile));
+    groupname = next_record_string(&cursor, end);
+    uploader = next_record_string(&cursor, end);
+    filename = next_record_string(&cursor, end);
+    key = next_record_string(&cursor, end);
+    if(!key || strlen(uploader) > USERNAME_LENG || strlen(key) > BLOB_KEY_SIZE)
+        return 0;
+
+    group = find_restored_group(groupname);
+    if(!group)
+        return 1;
+
+    if(record.blob_index)
+        blob = (record.blob_index <= restored_blob_count)? restored_blobs[record.blob_index-1] : NULL;
+    else
+        HASH_FIND_STR(blobs, key, blob);
+
+    if(!blob)
+    {
+        printf("Contents of file \"%s\" in group \"%s\" are no longer stored. Skipping.\n", filename, groupname);
+        return 1;
+    }
+
+    HASH_FIND_INT(group->filelist, &record.fileid, file);
+    if(file)
+        return 1;
+
+    file = calloc(1, sizeof(File_List));
+    file->fileid = record.fileid;
+    strcpy(file->uploader, uploader);
+    strcpy(file->filename, filename);
+    file->filesize = blob->filesize;
+    file->checksum = blob->checksum;
+    file->blob = blob;
+    file->stored_at = record.stored_at;
+    file->last_download = record.last_download;
+    ++blob->refcount;
+
+    HASH_ADD_INT(group->filelist, fileid, file);
+    if(file->fileid > group->last_fileid)
+        group->last_fileid = file->fileid;
+
+    return 1;
+}
+
+//Applies one record to the state being restored. Returns 0 if it is malformed
+static int restore_record(uint16_t type, char *payload, uint32_t length)
+{
+    char *end = payload + length, *cursor, *groupname, *newname;
+    Group *group;
+    Blob *blob;
+    File_List *file;
+    IPPrefix range;
+    StateGroup group_record;
+    StateBan ban_record;
+    StateBanRange range_record;
+    StateFile file_record;
+
+    switch(type)
+    {
+        case STATE_GROUP:
+            if(length < sizeof(StateGroup))
+                return 0;
+            memcpy(&group_record, payload, sizeof(StateGroup));
+            cursor = payload + sizeof(StateGroup);
+            groupname = next_record_string(&cursor, end);
+            if(!groupname || strlen(groupname) > USERNAME_LENG)
+                return 0;
+
+            group = restored_group = restore_group(groupname);
+            group->group_flags = group_record.group_flags;
+            group->default_user_permissions = group_record.default_user_permissions;
+            group->storage_quota = group_record.storage_quota;
+            group->file_ttl = group_record.file_ttl;
+            if(group_record.last_fileid > group->last_fileid)
+                group->last_fileid = group_record.last_fileid;
+
+            //Groups of older journals keep the history id they were just given. Their archives were kept by name, and are left behind
+            if(end - cursor >= (ptrdiff_t)sizeof(uint64_t))
+                memcpy(&group->history_id, cursor, sizeof(uint64_t));
+            else
+                restored_without_history_id = 1;
+            return 1;
+
+        case STATE_GROUP_REMOVED:
+            cursor = payload;
+            groupname = next_record_string(&cursor, end);
+            if(!groupname)
+                return 0;
+
+            group = find_restored_group(groupname);
+            if(group && group != lobby)
+                drop_restored_group(group);
+            return 1;
+
+        case STATE_GROUP_RENAMED:
+            cursor = payload;
+            groupname = next_record_string(&cursor, end);
+            newname = next_record_string(&cursor, end);
+            if(!newname || strlen(newname) > USERNAME_LENG)
+                return 0;
+
+            group = find_restored_group(groupname);
+            if(group && group != lobby)
+            {
+                HASH_DEL(groups, group);
+                strcpy(group->groupname, newname);
+                HASH_ADD_STR(groups, groupname, group);
+            }
+            return 1;
+
+        case STATE_BAN:
+        case STATE_UNBAN:
+            if(length < sizeof(StateBan))
+                return 0;
+            memcpy(&ban_record, payload, sizeof(StateBan));
+            ipv4_prefix(ban_record.ipaddr, 32, &range);
+            cursor = payload + sizeof(StateBan);
+            groupname = next_record_string(&cursor, end);
+            if(!groupname)
+                return 0;
+
+            group = find_restored_group(groupname);
+            if(!group)
+                return 1;
+
+            if(type == STATE_BAN)
+                ip_trie_insert(&group->banned_ips, &range, NULL);
+            else
+                ip_trie_remove(&group->banned_ips, &range);
+            return 1;
+
+        case STATE_BAN_RANGE:
+        case STATE_UNBAN_RANGE:
+            if(length < sizeof(StateBanRange))
+                return 0;
+            memcpy(&range_record, payload, sizeof(StateBanRange));
+            if(range_record.length > IP_ADDR_BITS)
+                return 0;
+            memcpy(range.addr, range_record.addr, sizeof(range.addr));
+            range.length = range_record.length;
+            cursor = payload + sizeof(StateBanRange);
+            groupname = next_record_string(&cursor, end);
+            if(!groupname)
+                return 0;
+
+            group = find_restored_group(groupname);
+            if(!group)
+                return 1;
+
+            if(type == STATE_BAN_RANGE)
+                ip_trie_insert(&group->banned_ips, &range, NULL);
+            else
+                ip_trie_remove(&group->banned_ips, &range);
+            return 1;
+
+        case STATE_BLOB:
+            blob = (length < sizeof(StateBlob))? NULL : restore_blob_record(payload, end);
+
+            //Even a malformed record keeps the positions of the blobs after it
+            add_restored_blob(blob);
+            return blob != NULL;
+
+        case STATE_BLOB_REMOVED:
+            cursor = payload;
+            newname = next_record_string(&cursor, end);
+            if(!newname)
+                return 0;
+
+            //Removed only once nothing refers to it, which its files' records have made sure of
+            HASH_FIND_STR(blobs, newname, blob);
+            if(blob && blob->refcount == 0)
+                forget_blob(blob);
+            return 1;
+
+        case STATE_FILE:
+            if(length < sizeof(StateFile))
+                return 0;
+            return restore_file_record(payload, end);
+
+        case STATE_FILE_REMOVED:
+            if(length < sizeof(StateFile))
+                return 0;
+            memcpy(&file_record, payload, sizeof(StateFile));
+            cursor = payload + sizeof(StateFile);
+            groupname = next_record_string(&cursor, end);
+            if(!groupname)
+                return 0;
+
+            group = find_restored_group(groupname);
+            if(!group)
+                return 1;
+
+            HASH_FIND_INT(group->filelist, &file_record.fileid, file);
+            if(file)
+                drop_restored_file(group, file);
+            return 1;
+
+        case STATE_STORAGE_QUOTA:
+            if(length < sizeof(uint64_t))
+                return 0;
+            memcpy(&global_storage_quota, payload, sizeof(uint64_t));
+            return 1;
+    }
+
+    printf("Unknown state record type %u. Skipping.\n", type);
+    return 1;
+}
+
+//Maps a snapshot or journal. Returns 1 with a NULL mapping if the file does not exist yet, and 0 if it cannot be read
+static int map_state_file(char *path, char **map_ret, size_t *size_ret, uint64_t *generation_ret)
+{
+    StateFileHeader header;
+    struct stat file_stat;
+    int fd;
+
+    *map_ret = NULL;
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        if(errno == ENOENT)
+            return 1;
+
+        perror("Failed to open state file.");
+        return 0;
+    }
+
+    if(fstat(fd, &file_stat) < 0 || file_stat.st_size < (off_t)sizeof(StateFileHeader))
+    {
+        printf("State file \"%s\" is truncated.\n", path);
+        close(fd);
+        return 0;
+    }
+
+    *size_ret = file_stat.st_size;
+    *map_ret = mmap(NULL, *size_ret, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(*map_ret == MAP_FAILED)
+    {
+        perror("Failed to map state file to memory.");
+        *map_ret = NULL;
+        return 0;
+    }
+
+    memcpy(&header, *map_ret, sizeof(StateFileHeader));
+    if(header.magic != STATE_MAGIC || header.version != STATE_VERSION)
+    {
+        printf("State file \"%s\" has an unknown format.\n", path);
+        munmap(*map_ret, *size_ret);
+        *map_ret = NULL;
+        return 0;
+    }
+
+    *generation_ret = header.generation;
+    return 1;
+}
+
+//Applies every intact record of a mapped state file. Returns the size of the file up to the last intact record.
+//Only the journal's records are checked: a snapshot replaces the last one only once it was completely written, so none of its records are torn
+static size_t restore_records(char *map, size_t size, int check_crcs, unsigned int *count_ret)
+{
+    StateRecordHeader header;
+    size_t offset = sizeof(StateFileHeader);
+
+    *count_ret = 0;
+    while(size - offset >= sizeof(StateRecordHeader))
+    {
+        memcpy(&header, &map[offset], sizeof(StateRecordHeader));
+
+        //A record torn by a crash ends the file
+        if(header.length > size - offset - sizeof(StateRecordHeader) ||
+            (check_crcs && xcrc32((unsigned char*)&map[offset + sizeof(StateRecordHeader)], header.length, CRC_INIT) != header.crc))
+            break;
+
+        if(!restore_record(header.type, &map[offset + sizeof(StateRecordHeader)], header.length))
+            printf("Malformed state record (type %u) at offset %zu. Skipping.\n", header.type, offset);
+
+        offset += sizeof(StateRecordHeader) + header.length;
+        ++*count_ret;
+    }
+
+    return offset;
+}
+
+//Blobs stored right before a crash, before any file listed them
+static void remove_unreferenced_blobs()
+{
+    Blob *blob, *tmp;
+
+    HASH_ITER(hh, blobs, blob, tmp)
+    {
+        if(blob->refcount > 0)
+            continue;
+
+        ++blob->refcount;
+        release_blob(blob);
+    }
+}
+
+//Rebuilds the groups, their bans and file lists, and the blob store from the last snapshot and the journal after it. Then records every change from here on
+int state_journal_init()
+{
+    char *snapshot_map, *journal_map;
+    size_t snapshot_size = 0, journal_map_size = 0, journal_valid_size = 0;
+    uint64_t snapshot_generation = 0, generation = 0;
+    unsigned int snapshot_records = 0, journal_records = 0;
+    struct timespec start, end;
+    int retval;
+
+    retval = mkdir(STATE_ROOT, S_IRWXU);
+    if(retval < 0 && errno != EEXIST)
+    {
+        perror("Failed to create directory for the server's state.");
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    //Refuse to start over a state that cannot be read, rather than replace it
+    if(!map_state_file(STATE_SNAPSHOT_FILE, &snapshot_map, &snapshot_size, &snapshot_generation))
+        return 0;
+    if(!map_state_file(STATE_JOURNAL_FILE, &journal_map, &journal_map_size, &generation))
+    {
+        if(snapshot_map)
+            munmap(snapshot_map, snapshot_size);
+        return 0;
+    }
+
+    if(snapshot_map)
+    {
+        restore_records(snapshot_map, snapshot_size, 0, &snapshot_records);
+        munmap(snapshot_map, snapshot_size);
+        clear_restored_blobs();
+    }
+
+    //A journal older than the snapshot was already folded into it
+    if(journal_map && generation >= snapshot_generation)
+        journal_valid_size = restore_records(journal_map, journal_map_size, 1, &journal_records);
+    if(journal_map)
+        munmap(journal_map, journal_map_size);
+    clear_restored_blobs();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Restored %u groups, %u blobs (%u snapshot and %u journal records) in %.3f seconds.\n",
+            HASH_COUNT(groups), HASH_COUNT(blobs), snapshot_records, journal_records,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    //Keep appending to the journal, without its torn end (if any)
+    if(journal_valid_size)
+    {
+        if(journal_valid_size < journal_map_size)
+        {
+            printf("Dropping %zu bytes of torn records at the end of the state journal.\n", journal_map_size - journal_valid_size);
+            if(truncate(STATE_JOURNAL_FILE, journal_valid_size) < 0)
+                perror("Failed to truncate state journal.");
+        }
+
+        journal = fopen(STATE_JOURNAL_FILE, "a");
+        if(!journal)
+        {
+            perror("Failed to open state journal.");
+            return 0;
+        }
+        journal_generation = generation;
+        journal_size = journal_valid_size;
+    }
+    else if(!start_journal((snapshot_generation)? snapshot_generation : 1))
+        return 0;
+
+    remove_unreferenced_blobs();
+
+    //Record the history ids given to groups of an older journal, or they would get other ones on the next start
+    if(restored_without_history_id)
+        compact_state();
+
+    state_sync_timer = calloc(1, sizeof(TimerEvent));
+    state_sync_timer->event_type = STATE_JOURNAL_SYNC;
+
+    state_sync_timer->timerfd = create_timerfd(STATE_SYNC_PERIOD, 1, timers_epollfd);
+    if(!state_sync_timer->timerfd)
+    {
+        free(state_sync_timer);
+        return 0;
+    }
+    HASH_ADD_INT(timers, timerfd, state_sync_timer);
+
+    return 1;
+}
+
+//Runs periodically on the timer thread
+void state_journal_sync()
+{
+    if(!journal)
+        return;
+
+    if(journal_dirty)
+    {
+        if(fdatasync(fileno(journal)) < 0)
+            perror("Failed to sync state journal.");
+        journal_dirty = 0;
+    }
+
+    if(journal_size >= STATE_COMPACT_SIZE)
+        compact_state();
+}
+
+void state_journal_close()
+{
+    if(!journal)
+        return;
+
+    fflush(journal);
+    fdatasync(fileno(journal));
+}
@@ -0,0 +1,102 @@
+#ifndef _STATE_JOURNAL_H_
+#define _STATE_JOURNAL_H_
+
+#include "server_common.h"
+#include "ip_trie.h"
+
+#define STATE_ROOT                  "SERVER_STATE"
+#define STATE_SNAPSHOT_FILE         STATE_ROOT "/snapshot"
+#define STATE_JOURNAL_FILE          STATE_ROOT "/journal"
+#define STATE_MAGIC                 0x54435354          //"TCST"
+#define STATE_VERSION               1
+#define STATE_SYNC_PERIOD           10                  //Seconds between flushing the journal to disk. A crash of the server itself loses nothing, a crash of the machine at most this much
+#define STATE_COMPACT_SIZE          16777216            //Bytes of journal that make the next sync write a new snapshot, and start the journal over
+
+
+//Every state change is appended to the journal as one record. A snapshot holds the records that rebuild the whole state at once, in the same format
+enum state_record_type {
+    STATE_GROUP = 1,            //A group was created, or its flags, default permissions or storage settings changed
+    STATE_GROUP_REMOVED,
+    STATE_GROUP_RENAMED,
+    STATE_BAN,                  //Older journals only: a single IPv4 address. Bans are now written as STATE_BAN_RANGE
+    STATE_UNBAN,
+    STATE_BLOB,                 //Contents entered the blob store (on their first reference)
+    STATE_BLOB_REMOVED,
+    STATE_FILE,                 //A stored file was listed in a group
+    STATE_FILE_REMOVED,
+    STATE_STORAGE_QUOTA,        //The server's storage quota changed
+    STATE_BAN_RANGE,            //An IP address or range was banned from a group
+    STATE_UNBAN_RANGE
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;        //Journal: its generation. Snapshot: the first journal generation it does not include
+} StateFileHeader;
+
+typedef struct {
+    uint32_t length;            //Bytes of payload following the header
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t crc;               //Of the payload. A torn record at the end of the journal is dropped
+} StateRecordHeader;
+
+
+//Fixed part of each record's payload. Names follow it as NUL terminated strings
+typedef struct {
+    int32_t group_flags;
+    int32_t default_user_permissions;
+    uint64_t storage_quota;
+    uint32_t file_ttl;
+    uint32_t last_fileid;
+} StateGroup;                   //+ groupname, history_id (uint64_t. Not in older journals)
+
+typedef struct {
+    uint32_t ipaddr;
+} StateBan;                     //+ groupname
+
+typedef struct {
+    uint8_t addr[16];           //IPv4 addresses are IPv4-mapped
+    uint8_t length;
+    uint8_t reserved[3];
+} StateBanRange;                //+ groupname
+
+typedef struct {
+    uint64_t filesize;
+    uint32_t checksum;
+    uint32_t chunk_count;
+    uint32_t chunk_root;
+    uint32_t frame_count;
+    uint64_t frames_size;
+} StateBlob;                    //+ chunk_crcs[chunk_count], frames[frame_count], key
+
+typedef struct {
+    uint32_t fileid;
+    uint32_t blob_index;        //Snapshots only: position of the file's blob among the snapshot's blob records (from 1), which leaves the blob key empty. 0 finds it by key
+    int64_t stored_at;
+    int64_t last_download;
+} StateFile;                    //+ groupname, uploader, filename, blob key (filesize and checksum are the blob's)
+
+
+struct group;
+struct blob;
+struct filelist;
+
+
+int state_journal_init();
+void state_journal_sync();
+void state_journal_close();
+
+void journal_group(struct group *group);
+void journal_group_removed(struct group *group);
+void journal_group_renamed(char *oldname, struct group *group);
+void journal_ban(struct group *group, IPPrefix *range, int banned);
+void journal_blob(struct blob *blob);
+void journal_blob_removed(struct blob *blob);
+void journal_file(struct group *group, struct filelist *file);
+void journal_file_removed(struct group *group, struct filelist *file);
+void journal_storage_quota();
+
+
+#endif
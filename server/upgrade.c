@@ -0,0 +1,702 @@
+#include "upgrade.h"
+#include "server.h"
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <readline/readline.h>
+
+
+extern TokenBucket server_xfer_bucket;              //Defined in xfer_scheduler.c
+
+int upgrade_draining;                               //Set while an upgrade waits for transfers to finish. No new ones are started meanwhile
+static char server_binary[MAX_FILE_PATH+1];         //The binary this server was started from
+static char server_address[INET_ADDRSTRLEN+8];      //And the address it was started with, passed on to the next binary
+static char upgrade_binary[MAX_FILE_PATH+1];        //The binary being upgraded to
+static TimerEvent *upgrade_timer;
+static uint64_t drain_started;
+
+//Set when this binary was started by an upgrade
+static pid_t keeper_pid;                            //Child of the old binary, holding the state and sockets until they are taken
+static int handoff_attempt;
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static void put_state(UpgradeState *state, void *data, size_t size)
+{
+    if(size == 0)
+        return;
+
+    if(state->size + size > state->capacity)
+    {
+        state->capacity = (state->size + size) * 2;
+        state->data = realloc(state->data, state->capacity);
+    }
+
+    memcpy(&state->data[state->size], data, size);
+    state->size += size;
+}
+
+//Copies the next "size" bytes of the state. Returns 0 if the state ends before that
+static int take_state(char **cursor, char *end, void *data_ret, size_t size)
+{
+    if((size_t)(end - *cursor) < size)
+        return 0;
+
+    memcpy(data_ret, *cursor, size);
+    *cursor += size;
+    return 1;
+}
+
+static int send_all(int socketfd, void *data, size_t size)
+{
+    ssize_t bytes;
+    size_t sent = 0;
+
+    while(sent < size)
+    {
+        bytes = send(socketfd, (char*)data + sent, size - sent, MSG_NOSIGNAL);
+        if(bytes <= 0)
+            return 0;
+        sent += bytes;
+    }
+    return 1;
+}
+
+static int recv_all(int socketfd, void *data, size_t size)
+{
+    ssize_t bytes;
+    size_t received = 0;
+
+    while(received < size)
+    {
+        bytes = recv(socketfd, (char*)data + received, size - received, 0);
+        if(bytes <= 0)
+            return 0;
+        received += bytes;
+    }
+    return 1;
+}
+
+//Sockets are passed UPGRADE_FDS_PER_MSG at a time, each batch attached to a single byte
+static int send_fds(int handoff_fd, int *fds, unsigned int fd_count)
+{
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec part = {"F", 1};
+    unsigned int sent, batch;
+
+    for(sent = 0; sent < fd_count; sent += batch)
+    {
+        batch = (fd_count - sent < UPGRADE_FDS_PER_MSG)? fd_count - sent : UPGRADE_FDS_PER_MSG;
+
+        memset(&msg, 0, sizeof(struct msghdr));
+        memset(&control, 0, sizeof(control));
+        msg.msg_iov = &part;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+        memcpy(CMSG_DATA(cmsg), &fds[sent], sizeof(int) * batch);
+
+        if(sendmsg(handoff_fd, &msg, MSG_NOSIGNAL) != 1)
+            return 0;
+    }
+    return 1;
+}
+
+//The sockets received are closed if this binary has to start the old one again, which takes them once more
+static int recv_fds(int handoff_fd, int *fds, unsigned int fd_count)
+{
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    char marker;
+    struct iovec part = {&marker, 1};
+    unsigned int received = 0, count;
+
+    while(received < fd_count)
+    {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = &part;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        if(recvmsg(handoff_fd, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC))
+            return 0;
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            return 0;
+
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if(count == 0 || count > fd_count - received)
+            return 0;
+
+        memcpy(&fds[received], CMSG_DATA(cmsg), sizeof(int) * count);
+        received += count;
+    }
+    return 1;
+}
+
+//Marks every descriptor but stdin/stdout/stderr and "keep_fd" to be closed once another binary starts
+static void close_on_exec(int keep_fd)
+{
+    struct dirent *dir_entry;
+    DIR *dir;
+    int fd;
+
+    dir = opendir("/proc/self/fd");
+    while(dir && (dir_entry = readdir(dir)))
+    {
+        fd = atoi(dir_entry->d_name);
+        if(fd > 2 && fd != keep_fd)
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    if(dir)
+        closedir(dir);
+}
+
+//Transfers in progress, or waiting to be accepted or resumed. Their state (and connections) is not handed over
+static unsigned int transfers_left()
+{
+    unsigned int count = HASH_COUNT(resumable_transfers);
+    Client *c, *tmp;
+
+    HASH_ITER(hh, active_connections, c, tmp)
+    {
+        if(c->connection_type == USER_CONNECTION)
+            count += HASH_COUNT(c->file_transfers);
+    }
+    return count;
+}
+
+static void stop_draining()
+{
+    upgrade_draining = 0;
+    if(upgrade_timer)
+        cleanup_timer_event(upgrade_timer);
+    upgrade_timer = NULL;
+}
+
+
+
+/******************************/
+/*   Handing Over the State   */
+/******************************/
+
+static void save_user(UpgradeState *state, User *user)
+{
+    UpgradeUser record;
+    UpgradeMembership membership;
+    Pending_Msg *pending = &user->pending_msg;
+    Group_Member *member;
+    GroupList *joined;
+
+    memset(&record, 0, sizeof(UpgradeUser));
+    strcpy(record.username, user->username);
+    record.is_admin = user->is_admin;
+    record.offline_pms_waiting = user->offline_pms_waiting;
+    record.codec = pending->codec;
+    record.xfer_weight = user->xfer_weight;
+    record.xfer_bucket = user->xfer_bucket;
+    LL_COUNT(user->groups_joined, joined, record.group_count);
+
+    //A long message still being sent or received goes on from where it was
+    if(pending->pending_op != NO_XFER_OP && pending->pending_buffer)
+    {
+        record.pending_op = pending->pending_op;
+        record.segmented_msg = (pending->segmented_msg != 0);
+        record.compressed_msg = (pending->compressed_msg != 0);
+        record.pending_size = pending->pending_size;
+        record.pending_transferred = pending->pending_transferred;
+    }
+
+    put_state(state, &record, sizeof(UpgradeUser));
+    put_state(state, pending->pending_buffer, record.pending_size);
+
+    //Groups are restored from the state journal. Only who is in them (or invited to them) is not kept there
+    LL_FOREACH(user->groups_joined, joined)
+    {
+        HASH_FIND_PTR(joined->group->members, &user->c, member);
+
+        memset(&membership, 0, sizeof(UpgradeMembership));
+        strcpy(membership.groupname, joined->group->groupname);
+        membership.permissions = (member)? member->permissions : 0;
+
+        //Mutes for flooding are lifted, as their timers are not handed over
+        if(member && member->flood_muted)
+            membership.permissions |= GRP_PERM_CAN_TALK;
+        put_state(state, &membership, sizeof(UpgradeMembership));
+    }
+}
+
+static void save_ban(void *arg, IPTrieNode *node)
+{
+    put_state(arg, &node->prefix, sizeof(IPPrefix));
+}
+
+//Returns the sockets to hand over: the server socket, then one per connection in the state
+static int* save_state(UpgradeState *state, uint64_t started_at, unsigned int *fd_count_ret)
+{
+    UpgradeHeader header;
+    UpgradeConnection connection;
+    unsigned int fd_count = 0;
+    Client *c, *tmp;
+    int *fds;
+
+    fds = malloc((HASH_COUNT(active_connections) + 1) * sizeof(int));
+    fds[fd_count++] = server_socketfd;
+
+    memset(&header, 0, sizeof(UpgradeHeader));
+    header.magic = UPGRADE_MAGIC;
+    header.version = UPGRADE_VERSION;
+    header.started_at = started_at;
+    header.ban_count = banned_ips.count;
+    header.xfer_bucket = server_xfer_bucket;
+    put_state(state, &header, sizeof(UpgradeHeader));
+
+    HASH_ITER(hh, active_connections, c, tmp)
+    {
+        //Transfer connections have nothing left to do once every transfer has finished
+        if(c->connection_type == TRANSFER_CONNECTION)
+            continue;
+
+        memset(&connection, 0, sizeof(UpgradeConnection));
+        connection.sockaddr = c->sockaddr;
+        connection.connection_type = c->connection_type;
+        put_state(state, &connection, sizeof(UpgradeConnection));
+
+        if(c->connection_type == USER_CONNECTION)
+            save_user(state, c->user);
+        fds[fd_count++] = c->socketfd;
+    }
+
+    ip_trie_walk(&banned_ips, NULL, save_ban, state);
+
+    ((UpgradeHeader*)state->data)->connection_count = fd_count - 1;
+    *fd_count_ret = fd_count;
+    return fds;
+}
+
+//Runs in a child of the old binary, which holds on to the state and sockets until the new binary has them.
+//Only makes system calls, as none of the old binary's other threads were copied into it
+static void serve_handoff(int handoff_fd, UpgradeState *state, int *fds, unsigned int fd_count)
+{
+    struct timeval timeout = {UPGRADE_HANDOFF_TIMEOUT, 0};
+    uint64_t size = state->size;
+    uint32_t count = fd_count;
+    char request = 0;
+
+    setsockopt(handoff_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+
+    //The new binary asks for the state ('S'), and acknowledges it ('A') once it serves every connection.
+    //If it can't, it starts the old binary again, which asks for the same state. The state's size and the number of
+    //sockets come first, so a binary that doesn't understand the state can still take all of it off the socket
+    while(read(handoff_fd, &request, 1) == 1 && request == 'S')
+    {
+        if(!send_all(handoff_fd, &size, sizeof(uint64_t)) || !send_all(handoff_fd, &count, sizeof(uint32_t)) 
+            || !send_all(handoff_fd, state->data, state->size) || !send_fds(handoff_fd, fds, fd_count))
+            break;
+    }
+
+    _exit((request == 'A')? 0 : 1);
+}
+
+//Starts the new binary in place of this one, so it keeps the server's pid and console. Only returns if it could not be started
+static void handoff()
+{
+    UpgradeState state = {0};
+    unsigned int fd_count;
+    int *fds, sockets[2], terminal_prepped;
+    char env[64], *argv[3];
+    uint64_t started_at = monotonic_ms();
+    pid_t keeper;
+
+    //Everything the new binary restores from disk must be there first
+    state_journal_close();
+    history_close();
+
+    fds = save_state(&state, started_at, &fd_count);
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+    {
+        perror("Failed to create upgrade handoff socket");
+        goto handoff_cleanup;
+    }
+
+    fflush(NULL);
+    keeper = fork();
+    if(keeper < 0)
+    {
+        perror("Failed to start upgrade handoff");
+        close(sockets[0]);
+        close(sockets[1]);
+        goto handoff_cleanup;
+    }
+    if(keeper == 0)
+    {
+        close(sockets[0]);
+        serve_handoff(sockets[1], &state, fds, fd_count);
+    }
+    close(sockets[1]);
+
+    //The new binary gets every socket from the keeper. Nothing else of this one is left open for it
+    close_on_exec(sockets[0]);
+    sprintf(env, "%d:%d:1", sockets[0], keeper);
+    setenv(UPGRADE_ENV, env, 1);
+
+    argv[0] = upgrade_binary;
+    argv[1] = server_address;
+    argv[2] = NULL;
+
+    printf("Upgrading to \"%s\". Handing over %u connections...\n", upgrade_binary, fd_count - 1);
+    fflush(stdout);
+
+    //Leave the console as it was before the prompt, for the new binary's own
+    terminal_prepped = RL_ISSTATE(RL_STATE_TERMPREPPED);
+    if(terminal_prepped)
+        rl_deprep_terminal();
+
+    execv(upgrade_binary, argv);
+
+    //Still the old binary. Keep serving
+    perror("Failed to start the new binary");
+    if(terminal_prepped)
+        rl_prep_terminal(0);
+    unsetenv(UPGRADE_ENV);
+    close(sockets[0]);                  //Lets the keeper exit
+    waitpid(keeper, NULL, 0);
+
+handoff_cleanup:
+
+    printf("Upgrade failed. The server keeps running as it was.\n");
+    free(state.data);
+    free(fds);
+}
+
+
+
+/******************************/
+/*     Taking Over a State    */
+/******************************/
+
+static int restore_user(Client *c, char **cursor, char *end)
+{
+    UpgradeUser record;
+    UpgradeMembership membership;
+    unsigned int i;
+    Group *group;
+    User *user;
+
+    if(!take_state(cursor, end, &record, sizeof(UpgradeUser)) || (uint64_t)(end - *cursor) < record.pending_size)
+        return 0;
+    record.username[USERNAME_LENG] = '\0';
+
+    user = calloc(1, sizeof(User));
+    strcpy(user->username, record.username);
+    user->c = c;
+    user->is_admin = record.is_admin;
+    user->offline_pms_waiting = record.offline_pms_waiting;
+    xfer_scheduler_add_user(user);
+    flood_add_user(user);
+    user->xfer_weight = record.xfer_weight;
+    user->xfer_bucket = record.xfer_bucket;
+
+    user->pending_msg.codec = record.codec;
+    if(record.pending_size > 0)
+    {
+        user->pending_msg.pending_op = record.pending_op;
+        user->pending_msg.segmented_msg = record.segmented_msg;
+        user->pending_msg.compressed_msg = record.compressed_msg;
+        user->pending_msg.pending_size = record.pending_size;
+        user->pending_msg.pending_transferred = record.pending_transferred;
+        user->pending_msg.pending_buffer = malloc(record.pending_size);
+        take_state(cursor, end, user->pending_msg.pending_buffer, record.pending_size);
+    }
+
+    c->user = user;
+    HASH_ADD_STR(active_users, username, user);
+    ++total_users;
+
+    for(i=0; i<record.group_count; i++)
+    {
+        if(!take_state(cursor, end, &membership, sizeof(UpgradeMembership)))
+            return 0;
+        membership.groupname[USERNAME_LENG] = '\0';
+
+        HASH_FIND_STR(groups, membership.groupname, group);
+        if(!group)
+        {
+            printf("Group \"%s\" of user \"%s\" was not restored. Skipping.\n", membership.groupname, user->username);
+            continue;
+        }
+        allocate_group_member(group, c, membership.permissions);
+    }
+
+    return 1;
+}
+
+static int restore_state(char *data, size_t size, int *fds, unsigned int *users_ret)
+{
+    char *cursor = data + sizeof(UpgradeHeader), *end = data + size;
+    UpgradeHeader header;
+    UpgradeConnection connection;
+    IPPrefix range;
+    uint32_t ipaddr;
+    unsigned int i;
+    int events;
+    Client *c;
+
+    memcpy(&header, data, sizeof(UpgradeHeader));
+    server_xfer_bucket = header.xfer_bucket;
+
+    //Connections waiting to be accepted were queued on the server socket all along
+    server_socketfd = fds[0];
+    getsockname(server_socketfd, (struct sockaddr*) &server_addr, &(socklen_t){sizeof(struct sockaddr_in)});
+    if(!register_fd_with_epoll(connections_epollfd, server_socketfd, EPOLLIN))
+        return 0;
+
+    for(i=0; i<header.connection_count; i++)
+    {
+        if(!take_state(&cursor, end, &connection, sizeof(UpgradeConnection)))
+            return 0;
+        if(connection.connection_type != UNREGISTERED_CONNECTION && connection.connection_type != USER_CONNECTION)
+            return 0;
+
+        c = calloc(1, sizeof(Client));
+        c->socketfd = fds[i+1];
+        c->sockaddr = connection.sockaddr;
+        c->sockaddr_leng = sizeof(struct sockaddr_in);
+        c->connection_type = connection.connection_type;
+        HASH_ADD_INT(active_connections, socketfd, c);
+        index_connection(c);
+
+        events = CLIENT_EPOLL_DEFAULT_EVENTS;
+        if(c->connection_type == USER_CONNECTION)
+        {
+            if(!restore_user(c, &cursor, end))
+                return 0;
+            heartbeat_track(c);
+            if(c->user->pending_msg.pending_op == SENDING_OP)
+            {
+                events |= EPOLLOUT;
+                metrics_gauge_add(METRIC_OUTBOUND_QUEUED, 1);
+            }
+            ++*users_ret;
+        }
+
+        //Unregistered connections get the full time to register again
+        else if(!start_registration_timer(c))
+            return 0;
+
+        if(!register_fd_with_epoll(connections_epollfd, c->socketfd, events))
+            return 0;
+    }
+
+    //Version 1 only banned single IPv4 addresses
+    for(i=0; i<header.ban_count; i++)
+    {
+        if(header.version == 1)
+        {
+            if(!take_state(&cursor, end, &ipaddr, sizeof(uint32_t)))
+                return 0;
+            ipv4_prefix(ipaddr, 32, &range);
+        }
+        else if(!take_state(&cursor, end, &range, sizeof(IPPrefix)) || range.length > IP_ADDR_BITS)
+            return 0;
+
+        ip_trie_insert(&banned_ips, &range, NULL);
+    }
+
+    return 1;
+}
+
+
+
+/******************************/
+/*          Upgrades          */
+/******************************/
+
+void upgrade_init(const char *hostname, const unsigned int port)
+{
+    ssize_t length;
+
+    sprintf(server_address, "%.*s:%u", INET_ADDRSTRLEN-1, (hostname)? hostname : "0.0.0.0", port);
+
+    length = readlink("/proc/self/exe", server_binary, MAX_FILE_PATH);
+    server_binary[(length > 0)? length : 0] = '\0';
+}
+
+//"!upgrade [binary]" starts the given binary (by default, the one the server was started from) in place of the server,
+//once every file transfer has finished. "!upgrade cancel" stops waiting for them
+void upgrade_server(char *args)
+{
+    unsigned int left;
+
+    while(*args == ' ')
+        ++args;
+
+    if(strcmp(args, "cancel") == 0)
+    {
+        if(!upgrade_draining)
+        {
+            printf("No upgrade is waiting.\n");
+            return;
+        }
+
+        stop_draining();
+        printf("Upgrade cancelled. File transfers may start again.\n");
+        return;
+    }
+
+    if(upgrade_draining)
+    {
+        printf("An upgrade to \"%s\" is already waiting for file transfers to finish.\n", upgrade_binary);
+        return;
+    }
+
+    if(strlen(args) > MAX_FILE_PATH || (!args[0] && !server_binary[0]))
+    {
+        printf("Usage: !upgrade [binary]\n");
+        return;
+    }
+    strcpy(upgrade_binary, (args[0])? args : server_binary);
+
+    if(access(upgrade_binary, X_OK) < 0)
+    {
+        printf("Cannot upgrade to \"%s\": %s.\n", upgrade_binary, strerror(errno));
+        return;
+    }
+
+    left = transfers_left();
+    if(left == 0)
+    {
+        handoff();
+        return;
+    }
+
+    //Transfers are not handed over. Wait for them to finish, without starting new ones
+    upgrade_timer = calloc(1, sizeof(TimerEvent));
+    upgrade_timer->event_type = UPGRADE_DRAIN;
+
+    upgrade_timer->timerfd = create_timerfd(UPGRADE_DRAIN_PERIOD, 1, timers_epollfd);
+    if(!upgrade_timer->timerfd)
+    {
+        free(upgrade_timer);
+        upgrade_timer = NULL;
+        return;
+    }
+    HASH_ADD_INT(timers, timerfd, upgrade_timer);
+
+    upgrade_draining = 1;
+    drain_started = monotonic_ms();
+    printf("Upgrading to \"%s\" once %u file transfers have finished. No new transfers are started until then.\n", upgrade_binary, left);
+}
+
+//Runs periodically on the timer thread while an upgrade is waiting
+void upgrade_drain_check()
+{
+    unsigned int left = transfers_left();
+
+    if(left == 0)
+    {
+        stop_draining();
+        handoff();
+    }
+    else if(monotonic_ms() - drain_started >= UPGRADE_DRAIN_TIMEOUT * 1000)
+    {
+        stop_draining();
+        printf("Upgrade given up: %u file transfers are still going after %d seconds.\n", left, UPGRADE_DRAIN_TIMEOUT);
+    }
+}
+
+//The handoff socket, if this binary was started by an upgrade. 0 otherwise
+int upgrade_handoff_fd()
+{
+    char *env = getenv(UPGRADE_ENV);
+    int handoff_fd = 0;
+
+    if(env && sscanf(env, "%d:%d:%d", &handoff_fd, &keeper_pid, &handoff_attempt) < 3)
+        handoff_fd = 0;
+    unsetenv(UPGRADE_ENV);
+
+    return handoff_fd;
+}
+
+//Takes over the state and every connection of the old binary. If that fails, starts the old binary again, so it can take them back
+int resume_upgrade(int handoff_fd)
+{
+    struct timeval timeout = {UPGRADE_HANDOFF_TIMEOUT, 0};
+    UpgradeHeader header;
+    char *data = NULL, env[64], old_binary[32];
+    uint64_t size = 0;
+    uint32_t fd_count = 0;
+    unsigned int users = 0;
+    int *fds = NULL;
+
+    setsockopt(handoff_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+
+    if(!send_all(handoff_fd, "S", 1) || !recv_all(handoff_fd, &size, sizeof(uint64_t)) || !recv_all(handoff_fd, &fd_count, sizeof(uint32_t))
+        || size < sizeof(UpgradeHeader) || fd_count == 0)
+        goto resume_upgrade_failed;
+
+    data = malloc(size);
+    fds = malloc(fd_count * sizeof(int));
+    if(!recv_all(handoff_fd, data, size) || !recv_fds(handoff_fd, fds, fd_count))
+        goto resume_upgrade_failed;
+
+    memcpy(&header, data, sizeof(UpgradeHeader));
+    if(header.magic != UPGRADE_MAGIC || header.version < 1 || header.version > UPGRADE_VERSION || header.connection_count + 1 != fd_count)
+    {
+        printf("The old binary handed over an unknown state (version %u).\n", header.version);
+        goto resume_upgrade_failed;
+    }
+
+    if(!restore_state(data, size, fds, &users))
+        goto resume_upgrade_failed;
+
+    //The keeper exits once it is acknowledged
+    send_all(handoff_fd, "A", 1);
+    close(handoff_fd);
+    waitpid(keeper_pid, NULL, 0);
+
+    printf("Upgrade %s. Resumed %u connections (%u users) after %lu ms.\n", (handoff_attempt > 1)? "rolled back" : "completed", header.connection_count, users, monotonic_ms() - header.started_at);
+    free(data);
+    free(fds);
+    return 1;
+
+resume_upgrade_failed:
+
+    printf("Failed to take over the server's state.\n");
+    if(handoff_attempt > 1)
+        return 0;
+
+    //The keeper still holds everything, and its binary is the old one, even if it was replaced on disk since
+    sprintf(old_binary, "/proc/%d/exe", keeper_pid);
+    sprintf(env, "%d:%d:%d", handoff_fd, keeper_pid, handoff_attempt + 1);
+    setenv(UPGRADE_ENV, env, 1);
+    close_on_exec(handoff_fd);
+
+    printf("Starting the old binary again...\n");
+    fflush(stdout);
+    execv(old_binary, (char*[]){old_binary, server_address, NULL});
+
+    perror("Failed to start the old binary");
+    return 0;
+}
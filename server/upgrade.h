@@ -0,0 +1,70 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+#include "server_common.h"
+
+#define UPGRADE_ENV                 "TERMINALCHAT_UPGRADE"  //Set for the new binary: "<handoff socket>:<keeper pid>:<attempt>"
+#define UPGRADE_MAGIC               0x54435550          //"TCUP"
+#define UPGRADE_VERSION             2
+#define UPGRADE_DRAIN_PERIOD        1                   //Seconds between checks for the transfers an upgrade waits for
+#define UPGRADE_DRAIN_TIMEOUT       120                 //Seconds an upgrade waits for transfers to finish, before it is given up
+#define UPGRADE_HANDOFF_TIMEOUT     60                  //Seconds either side of the handoff waits for the other
+#define UPGRADE_FDS_PER_MSG         64                  //Sockets passed in a single message
+
+
+//The server's state, as handed to the new binary. The sockets are passed alongside it in the same order:
+//the server socket first, then one per UpgradeConnection
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t started_at;        //Monotonic time (ms) the old binary stopped serving. The upgrade's downtime is measured from here
+    uint32_t connection_count;
+    uint32_t ban_count;         //Server bans follow the connections: IPPrefix ranges (version 1: uint32_t IPv4 addresses)
+    TokenBucket xfer_bucket;    //The server's transfer rate limit
+} UpgradeHeader;
+
+typedef struct {
+    struct sockaddr_in sockaddr;
+    int32_t connection_type;    //Unregistered or user connections only. Transfers are finished before the handoff
+} UpgradeConnection;            //+ UpgradeUser for user connections
+
+typedef struct {
+    char username[USERNAME_LENG+1];
+    uint8_t is_admin;
+    uint8_t offline_pms_waiting;
+    uint8_t codec;
+    uint8_t pending_op;
+    uint8_t segmented_msg;
+    uint8_t compressed_msg;
+    uint32_t xfer_weight;
+    TokenBucket xfer_bucket;
+    uint64_t pending_size;
+    uint64_t pending_transferred;
+    uint32_t group_count;
+} UpgradeUser;                  //+ pending_buffer[pending_size], UpgradeMembership[group_count]
+
+typedef struct {
+    char groupname[USERNAME_LENG+1];
+    int32_t permissions;
+} UpgradeMembership;
+
+
+//The serialized state, kept by the old binary until the new one has taken it
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} UpgradeState;
+
+
+extern int upgrade_draining;
+
+
+void upgrade_init(const char *hostname, const unsigned int port);
+void upgrade_server(char *args);
+void upgrade_drain_check();
+int upgrade_handoff_fd();
+int resume_upgrade(int handoff_fd);
+
+
+#endif
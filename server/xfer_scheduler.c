@@ -0,0 +1,216 @@
+#include "xfer_scheduler.h"
+#include "server.h"
+
+
+TokenBucket server_xfer_bucket;                 //Shared by all file transfers on the server
+XferRate server_xfer_rate;
+pthread_mutex_t xfer_scheduler_lock = PTHREAD_MUTEX_INITIALIZER;       //Guards the buckets and rates, which are used by every transfer thread
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+static uint64_t bucket_burst(uint64_t rate)
+{
+    uint64_t burst = rate * XFER_BURST_MS / 1000;
+    return (burst < XFER_MIN_QUANTUM)? XFER_MIN_QUANTUM : burst;
+}
+
+static void update_rate(XferRate *rate, size_t bytes)
+{
+    uint64_t now = monotonic_ms();
+
+    rate->window_bytes += bytes;
+    if(now - rate->window_start >= 1000)
+    {
+        rate->bytes_per_sec = rate->window_bytes * 1000 / (now - rate->window_start);
+        rate->window_start = now;
+        rate->window_bytes = 0;
+    }
+}
+
+//A rate that hasn't been updated for a while belongs to an idle user
+static uint64_t current_rate(XferRate *rate)
+{
+    return (monotonic_ms() - rate->window_start >= 2000)? 0 : rate->bytes_per_sec;
+}
+
+static User* transfer_owner(Client *c)
+{
+    return (c->xferargs)? c->xferargs->myself : NULL;
+}
+
+
+
+/******************************/
+/*         Scheduling         */
+/******************************/
+
+void xfer_scheduler_init()
+{
+    token_bucket_init(&server_xfer_bucket, XFER_DEFAULT_GLOBAL_RATE, bucket_burst(XFER_DEFAULT_GLOBAL_RATE));
+}
+
+void xfer_scheduler_add_user(User *user)
+{
+    token_bucket_init(&user->xfer_bucket, XFER_DEFAULT_USER_RATE, bucket_burst(XFER_DEFAULT_USER_RATE));
+    user->xfer_weight = XFER_DEFAULT_WEIGHT;
+    user->xfer_connections = 0;
+    memset(&user->xfer_rate, 0, sizeof(XferRate));
+}
+
+//Returns how many bytes a transfer connection may move for its current event. 0 if the connection must wait for more tokens
+size_t xfer_quantum(Client *c)
+{
+    User *user = transfer_owner(c);
+    uint64_t quantum = XFER_QUANTUM_SIZE, available, user_available;
+    unsigned int connections;
+
+    pthread_mutex_lock(&xfer_scheduler_lock);
+
+    //Split the user's weighted share among all of its transfer connections, so one user's many transfers can't crowd out other users
+    connections = (user)? user->xfer_connections : 0;
+    if(user)
+        quantum = quantum * user->xfer_weight / XFER_MAX_WEIGHT / ((connections > 0)? connections : 1);
+    if(quantum < XFER_MIN_QUANTUM)
+        quantum = XFER_MIN_QUANTUM;
+
+    //Stay within the user's and the server's rate limits
+    available = token_bucket_available(&server_xfer_bucket);
+    if(user && (user_available = token_bucket_available(&user->xfer_bucket)) < available)
+        available = user_available;
+
+    if(available < quantum)
+        quantum = (available < XFER_MIN_QUANTUM)? 0 : available;
+
+    pthread_mutex_unlock(&xfer_scheduler_lock);
+    return quantum;
+}
+
+void xfer_charge(Client *c, size_t bytes)
+{
+    User *user = transfer_owner(c);
+
+    pthread_mutex_lock(&xfer_scheduler_lock);
+
+    token_bucket_consume(&server_xfer_bucket, bytes);
+    update_rate(&server_xfer_rate, bytes);
+
+    if(user)
+    {
+        token_bucket_consume(&user->xfer_bucket, bytes);
+        update_rate(&user->xfer_rate, bytes);
+    }
+
+    pthread_mutex_unlock(&xfer_scheduler_lock);
+    metrics_count(METRIC_XFER_BYTES, bytes);
+}
+
+//Tracks how many transfer connections split each user's share of the bandwidth
+void xfer_scheduler_count_connection(User *user, int change)
+{
+    if(!user)
+        return;
+
+    pthread_mutex_lock(&xfer_scheduler_lock);
+    user->xfer_connections += change;
+    pthread_mutex_unlock(&xfer_scheduler_lock);
+}
+
+
+
+/******************************/
+/*       Administration       */
+/******************************/
+
+//Sets the rate limit of a user, or of the whole server if "username" is "*"
+int xfer_set_rate(char *username, uint64_t rate)
+{
+    User *user;
+
+    if(strcmp(username, "*") == 0)
+    {
+        pthread_mutex_lock(&xfer_scheduler_lock);
+        token_bucket_init(&server_xfer_bucket, rate, bucket_burst(rate));
+        pthread_mutex_unlock(&xfer_scheduler_lock);
+        printf("File transfers on the server are now limited to %lu bytes/s (0 is unlimited).\n", rate);
+        return 1;
+    }
+
+    HASH_FIND_STR(active_users, username, user);
+    if(!user)
+    {
+        printf("User \"%s\" was not found.\n", username);
+        return 0;
+    }
+
+    pthread_mutex_lock(&xfer_scheduler_lock);
+    token_bucket_init(&user->xfer_bucket, rate, bucket_burst(rate));
+    pthread_mutex_unlock(&xfer_scheduler_lock);
+    printf("File transfers of user \"%s\" are now limited to %lu bytes/s (0 is unlimited).\n", user->username, rate);
+    return 1;
+}
+
+int xfer_set_weight(char *username, unsigned int weight)
+{
+    User *user;
+
+    if(weight < 1 || weight > XFER_MAX_WEIGHT)
+    {
+        printf("Transfer weights must be between 1 and %u.\n", XFER_MAX_WEIGHT);
+        return 0;
+    }
+
+    HASH_FIND_STR(active_users, username, user);
+    if(!user)
+    {
+        printf("User \"%s\" was not found.\n", username);
+        return 0;
+    }
+
+    pthread_mutex_lock(&xfer_scheduler_lock);
+    user->xfer_weight = weight;
+    pthread_mutex_unlock(&xfer_scheduler_lock);
+    printf("Transfer weight of user \"%s\" is now %u/%u.\n", user->username, weight, XFER_MAX_WEIGHT);
+    return 1;
+}
+
+//Prints the live transfer rates of the server and every transferring user. Also sent back to a remote admin
+void xfer_stats()
+{
+    char *stats_msg;
+    int msg_size = 0, printed = 0;
+    User *curr, *tmp;
+    unsigned int connections, served_count, throttled_count;
+    size_t pool_in_use, pool_spare;
+
+    xfer_threads_count(&served_count, &throttled_count);
+    relay_pool_stats(&pool_in_use, &pool_spare);
+    stats_msg = malloc((total_users + 2) * (USERNAME_LENG+1 + 128));
+
+    pthread_mutex_lock(&xfer_scheduler_lock);
+
+    sprintf(stats_msg, "File transfers: %lu bytes/s (limit: %lu bytes/s, connections: %u, throttled: %u)\nRelay buffers: %zu bytes in use, %zu bytes spare (budget: %d bytes)%n", 
+            current_rate(&server_xfer_rate), server_xfer_bucket.rate, served_count, throttled_count, pool_in_use, pool_spare, RELAY_POOL_BUDGET, &msg_size);
+
+    HASH_ITER(hh, active_users, curr, tmp)
+    {
+        connections = curr->xfer_connections;
+        if(connections == 0 && curr->xfer_bucket.rate == 0 && curr->xfer_weight == XFER_DEFAULT_WEIGHT)
+            continue;
+
+        sprintf(&stats_msg[msg_size], "\n  \"%s\": %lu bytes/s (limit: %lu bytes/s, weight: %u/%u, connections: %u)%n", 
+                curr->username, current_rate(&curr->xfer_rate), curr->xfer_bucket.rate, curr->xfer_weight, XFER_MAX_WEIGHT, connections, &printed);
+        msg_size += printed;
+    }
+
+    pthread_mutex_unlock(&xfer_scheduler_lock);
+
+    printf("%s\n", stats_msg);
+    if(current_client && current_client->connection_type == USER_CONNECTION)
+        send_long_msg(current_client, stats_msg, msg_size+1);
+
+    free(stats_msg);
+}
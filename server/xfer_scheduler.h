@@ -0,0 +1,27 @@
+#ifndef _XFER_SCHEDULER_H_
+#define _XFER_SCHEDULER_H_
+
+#include "server_common.h"
+#include <pthread.h>
+
+#define XFER_DEFAULT_USER_RATE      0                   //Bytes per second each user may transfer by default. 0 is unlimited
+#define XFER_DEFAULT_GLOBAL_RATE    0                   //Bytes per second all file transfers may use together. 0 is unlimited
+#define XFER_MAX_WEIGHT             8                   //A user with weight w moves w/XFER_MAX_WEIGHT of the full quantum per event
+#define XFER_DEFAULT_WEIGHT         XFER_MAX_WEIGHT
+#define XFER_BURST_MS               100                 //Buckets hold this many milliseconds worth of their rate
+#define XFER_MIN_QUANTUM            16384               //Never split a connection's quantum smaller than this
+#define XFER_SCHEDULER_TICK_MS      10                  //How often transfer threads retry connections that are waiting for tokens
+
+
+void xfer_scheduler_init();
+void xfer_scheduler_add_user(User *user);
+size_t xfer_quantum(Client *c);
+void xfer_charge(Client *c, size_t bytes);
+void xfer_scheduler_count_connection(User *user, int change);
+
+int xfer_set_rate(char *username, uint64_t rate);
+int xfer_set_weight(char *username, unsigned int weight);
+void xfer_stats();
+
+
+#endif
@@ -0,0 +1,417 @@
+#include "xfer_threads.h"
+#include "server.h"
+
+#include <sys/eventfd.h>
+
+
+XferThread xfer_threads[XFER_THREAD_COUNT];
+int xfer_events_fd;                             //Signals the chat thread that xfer_events has new entries
+XferEvent *xfer_events = NULL;                  //Completed or closed transfer connections, waiting to be cleaned up by the chat thread
+pthread_mutex_t xfer_events_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/******************************/
+/*          Helpers           */
+/******************************/
+
+//Both halves of a client-client transfer share a token, so they are always served by the same thread. So do a group upload and the downloads following it
+static XferThread* transfer_thread(FileXferArgs_Server *xferargs)
+{
+    char *token = (xferargs->thread_token[0])? xferargs->thread_token : xferargs->token;
+    unsigned int hash = 5381;
+
+    while(*token)
+        hash = hash * 33 + (unsigned char) *token++;
+
+    return &xfer_threads[hash % XFER_THREAD_COUNT];
+}
+
+static inline uint64_t epoll_key(XferConnection *conn)
+{
+    return ((uint64_t) conn->generation << 32) | (uint32_t) conn->socketfd;
+}
+
+static void remove_connection(XferThread *thread, XferConnection *conn)
+{
+    if(epoll_ctl(thread->epollfd, EPOLL_CTL_DEL, conn->socketfd, NULL) < 0)
+        perror("Failed to unregister transfer connection from epoll!");
+
+    xfer_scheduler_count_connection(conn->c->xferargs->myself, -1);
+    metrics_gauge_add(METRIC_XFER_STREAMS, -1);
+    HASH_DEL(thread->connections, conn);
+    free(conn);
+}
+
+static void post_transfer_event(int socketfd, FileXferArgs_Server *xferargs, enum xfer_event_type event_type, unsigned int chunk)
+{
+    XferEvent *event = malloc(sizeof(XferEvent));
+
+    event->socketfd = socketfd;
+    event->xferargs = xferargs;
+    event->event_type = event_type;
+    event->chunk = chunk;
+
+    pthread_mutex_lock(&xfer_events_lock);
+    LL_APPEND(xfer_events, event);
+    pthread_mutex_unlock(&xfer_events_lock);
+
+    if(eventfd_write(xfer_events_fd, 1) < 0)
+        perror("Failed to signal transfer events.");
+}
+
+//Stops serving a connection on this thread, and passes it back to the chat thread for cleanup
+static void release_connection(XferThread *thread, XferConnection *conn, enum xfer_event_type event_type)
+{
+    int socketfd = conn->socketfd;
+    FileXferArgs_Server *xferargs = conn->c->xferargs;
+
+    //The chat thread may free the connection as soon as it sees the event
+    remove_connection(thread, conn);
+    post_transfer_event(socketfd, xferargs, event_type, 0);
+}
+
+
+
+/******************************/
+/*      Transfer Threads      */
+/******************************/
+
+//Moves at most one quantum on a connection. Returns 1 if any bytes were moved
+static int serve_connection(XferThread *thread, XferConnection *conn)
+{
+    uint32_t direction = (conn->c->xferargs->operation == SENDING_OP)? EPOLLIN : EPOLLOUT;
+    int result;
+
+    if(!(conn->ready & direction))
+        return 0;
+
+    if(direction == EPOLLIN)
+        result = client_data_forward_sender_ready(conn->c);
+    else
+        result = client_data_forward_recver_ready(conn->c);
+
+    //Moving bytes keeps the connection from being timed out as stalled, and so does waiting through no fault of its own
+    switch(result)
+    {
+        case XFER_IO_PROGRESS:
+            heartbeat_waiting(conn->c, 0);
+            heartbeat_seen(conn->c);
+            return 1;
+
+        case XFER_IO_WOULDBLOCK:
+            heartbeat_waiting(conn->c, 0);
+            conn->ready &= ~direction;
+            return 0;
+
+        case XFER_IO_WAITING:
+            heartbeat_waiting(conn->c, 1);
+            return 0;
+
+        case XFER_IO_THROTTLED:
+            heartbeat_waiting(conn->c, 1);
+            ++thread->throttled;
+            return 0;
+
+        case XFER_IO_COMPLETED:
+            release_connection(thread, conn, XFER_EVENT_COMPLETED);
+            return 1;
+
+        case XFER_IO_FAILED:
+            release_connection(thread, conn, XFER_EVENT_FAILED);
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+static void* transfer_thread_loop(void *arg)
+{
+    XferThread *thread = arg;
+    struct epoll_event events[XFER_THREAD_MAX_EVENTS];
+    XferConnection *conn, *tmp;
+    int ready_count, i, rounds, progress = 0, timeout = -1;
+    int socketfd;
+    eventfd_t wakeups;
+
+    while(1)
+    {
+        ready_count = epoll_wait(thread->epollfd, events, XFER_THREAD_MAX_EVENTS, timeout);
+        if(ready_count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait failed!");
+            return NULL;
+        }
+
+        pthread_mutex_lock(&thread->lock);
+
+        //Edge triggered: remember which directions became ready, until the socket returns EAGAIN
+        for(i=0; i<ready_count; i++)
+        {
+            //Woken up by the chat thread. Serve the connections again, as some of them have more to move
+            if(events[i].data.u64 == (uint64_t) thread->wakefd)
+            {
+                eventfd_read(thread->wakefd, &wakeups);
+                continue;
+            }
+
+            socketfd = (int) (events[i].data.u64 & 0xFFFFFFFF);
+            HASH_FIND_INT(thread->connections, &socketfd, conn);
+            if(!conn || conn->generation != (uint32_t) (events[i].data.u64 >> 32))
+                continue;
+
+            if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                release_connection(thread, conn, XFER_EVENT_CLOSED);
+                continue;
+            }
+
+            conn->ready |= events[i].events & (EPOLLIN | EPOLLOUT);
+        }
+
+        //Take turns moving one quantum per connection, so a single fast transfer cannot starve the others on this thread
+        for(rounds = 0, progress = 1; progress && rounds < XFER_THREAD_ROUNDS; rounds++)
+        {
+            progress = 0;
+            thread->throttled = 0;
+
+            HASH_ITER(hh, thread->connections, conn, tmp)
+            {
+                if(serve_connection(thread, conn))
+                    progress = 1;
+            }
+        }
+
+        //Poll again right away if there is more to move, or after a tick if some connections are waiting for tokens
+        if(progress)
+            timeout = 0;
+        else
+            timeout = (thread->throttled)? XFER_SCHEDULER_TICK_MS : -1;
+
+        pthread_mutex_unlock(&thread->lock);
+    }
+
+    return NULL;
+}
+
+int xfer_threads_init()
+{
+    struct epoll_event event;
+    int i;
+
+    xfer_events_fd = eventfd(0, EFD_NONBLOCK);
+    if(xfer_events_fd < 0)
+    {
+        perror("Failed to create transfer event fd.");
+        return 0;
+    }
+
+    if(!register_fd_with_epoll(connections_epollfd, xfer_events_fd, EPOLLIN))
+        return 0;
+
+    for(i=0; i<XFER_THREAD_COUNT; i++)
+    {
+        memset(&xfer_threads[i], 0, sizeof(XferThread));
+        pthread_mutex_init(&xfer_threads[i].lock, NULL);
+
+        xfer_threads[i].epollfd = epoll_create1(0);
+        if(xfer_threads[i].epollfd < 0)
+        {
+            perror("Failed to create epoll!");
+            return 0;
+        }
+
+        //Connections are keyed with a generation above 0 in epoll, so the wake up fd (keyed by itself) is never mistaken for one
+        xfer_threads[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        if(xfer_threads[i].wakefd < 0)
+        {
+            perror("Failed to create transfer thread wake up fd.");
+            return 0;
+        }
+
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = (uint64_t) xfer_threads[i].wakefd;
+        if(epoll_ctl(xfer_threads[i].epollfd, EPOLL_CTL_ADD, xfer_threads[i].wakefd, &event) < 0)
+        {
+            perror("Failed to register transfer thread wake up fd with epoll!");
+            return 0;
+        }
+
+        if(pthread_create(&xfer_threads[i].thread, NULL, &transfer_thread_loop, &xfer_threads[i]) != 0)
+        {
+            printf("Failed to create transfer thread\n");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/******************************/
+/*  Handoff from Chat Thread  */
+/******************************/
+
+//Moves a newly registered transfer connection from the chat thread's epoll to its transfer thread
+void xfer_thread_handoff(Client *c)
+{
+    XferThread *thread = transfer_thread(c->xferargs);
+    XferConnection *conn;
+    struct epoll_event event;
+
+    epoll_ctl(connections_epollfd, EPOLL_CTL_DEL, c->socketfd, NULL);
+
+    pthread_mutex_lock(&thread->lock);
+
+    conn = calloc(1, sizeof(XferConnection));
+    conn->socketfd = c->socketfd;
+    conn->c = c;
+    conn->generation = ++thread->generation;
+    HASH_ADD_INT(thread->connections, socketfd, conn);
+    xfer_scheduler_count_connection(c->xferargs->myself, 1);
+    metrics_gauge_add(METRIC_XFER_STREAMS, 1);
+    c->xfer_thread = thread;
+
+    //Registration is persistent. A socket that is already readable/writable reports its first edge right away
+    event.events = XFER_THREAD_EPOLL_EVENTS;
+    event.data.u64 = epoll_key(conn);
+    if(epoll_ctl(thread->epollfd, EPOLL_CTL_ADD, c->socketfd, &event) < 0)
+    {
+        perror("Failed to register transfer connection with epoll!");
+        release_connection(thread, conn, XFER_EVENT_FAILED);
+    }
+
+    pthread_mutex_unlock(&thread->lock);
+}
+
+//Takes a transfer connection back from its transfer thread. Must be done before the chat thread modifies or closes it
+void xfer_thread_reclaim(Client *c)
+{
+    XferThread *thread = c->xfer_thread;
+    XferConnection *conn;
+
+    if(!thread)
+        return;
+
+    pthread_mutex_lock(&thread->lock);
+
+    //The thread may have already released it
+    HASH_FIND_INT(thread->connections, &c->socketfd, conn);
+    if(conn && conn->c == c)
+        remove_connection(thread, conn);
+    c->xfer_thread = NULL;
+
+    pthread_mutex_unlock(&thread->lock);
+}
+
+static void reclaim_transfer_streams(FileXferArgs_Server *xferargs)
+{
+    Client *stream_connection;
+    unsigned int i;
+
+    for(i=0; xferargs->streams && i<xferargs->stream_count; i++)
+    {
+        if(!xferargs->streams[i].socketfd)
+            continue;
+
+        HASH_FIND_INT(active_connections, &xferargs->streams[i].socketfd, stream_connection);
+        if(stream_connection)
+            xfer_thread_reclaim(stream_connection);
+    }
+}
+
+//Takes back every connection of a transfer, and of its recipients' halves for the sender's half, so that no transfer thread touches them anymore
+void xfer_thread_reclaim_transfer(FileXferArgs_Server *xferargs)
+{
+    unsigned int i;
+
+    reclaim_transfer_streams(xferargs);
+    for(i=0; i<xferargs->recipient_count; i++)
+        if(xferargs->recipients[i].xferargs)
+            reclaim_transfer_streams(xferargs->recipients[i].xferargs);
+}
+
+//For updating a transfer's streams while its other streams are still being served
+void xfer_thread_lock_transfer(FileXferArgs_Server *xferargs)
+{
+    pthread_mutex_lock(&transfer_thread(xferargs)->lock);
+}
+
+void xfer_thread_unlock_transfer(FileXferArgs_Server *xferargs)
+{
+    pthread_mutex_unlock(&transfer_thread(xferargs)->lock);
+}
+
+//Has the transfer's thread serve its connections again. For work added by the chat thread, which the connections' epoll events won't announce
+void xfer_thread_wake_transfer(FileXferArgs_Server *xferargs)
+{
+    if(eventfd_write(transfer_thread(xferargs)->wakefd, 1) < 0)
+        perror("Failed to wake transfer thread.");
+}
+
+//A chunk of a group upload failed its check. Runs on the transfer thread. The chat thread asks the uploader for the chunk again
+void xfer_thread_chunk_failed(Client *c, unsigned int chunk)
+{
+    post_transfer_event(c->socketfd, c->xferargs, XFER_EVENT_CHUNK_FAILED, chunk);
+}
+
+void xfer_threads_count(unsigned int *connections_ret, unsigned int *throttled_ret)
+{
+    int i;
+
+    *connections_ret = 0;
+    *throttled_ret = 0;
+
+    for(i=0; i<XFER_THREAD_COUNT; i++)
+    {
+        pthread_mutex_lock(&xfer_threads[i].lock);
+        *connections_ret += HASH_COUNT(xfer_threads[i].connections);
+        *throttled_ret += xfer_threads[i].throttled;
+        pthread_mutex_unlock(&xfer_threads[i].lock);
+    }
+}
+
+//Handles connections released by the transfer threads. Runs on the chat thread, with client_lock held
+void handle_transfer_events()
+{
+    XferEvent *events, *curr, *tmp;
+    eventfd_t count;
+
+    if(eventfd_read(xfer_events_fd, &count) < 0 && errno != EAGAIN)
+        perror("Failed to read transfer events.");
+
+    pthread_mutex_lock(&xfer_events_lock);
+    events = xfer_events;
+    xfer_events = NULL;
+    pthread_mutex_unlock(&xfer_events_lock);
+
+    LL_FOREACH_SAFE(events, curr, tmp)
+    {
+        //The transfer may have been cancelled by the chat thread in the meantime
+        HASH_FIND_INT(active_connections, &curr->socketfd, current_client);
+        if(current_client && current_client->connection_type == TRANSFER_CONNECTION && current_client->xferargs == curr->xferargs)
+        {
+            //The connection is still served by its transfer thread
+            if(curr->event_type == XFER_EVENT_CHUNK_FAILED)
+                upload_chunk_failed(current_client->xferargs, curr->chunk);
+            else
+            {
+                current_client->xfer_thread = NULL;
+
+                if(curr->event_type == XFER_EVENT_COMPLETED)
+                    transfer_connection_completed(current_client);
+                else
+                    disconnect_client(current_client, (curr->event_type == XFER_EVENT_FAILED)? "Connection Failed" : NULL);
+            }
+        }
+
+        LL_DELETE(events, curr);
+        free(curr);
+    }
+
+    current_client = NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef _XFER_THREADS_H_
+#define _XFER_THREADS_H_
+
+#include "server_common.h"
+#include <pthread.h>
+
+#define XFER_THREAD_COUNT           2                   //Threads serving registered transfer connections, apart from the chat thread
+#define XFER_THREAD_EPOLL_EVENTS    (EPOLLRDHUP | EPOLLIN | EPOLLOUT | EPOLLET)
+#define XFER_THREAD_MAX_EVENTS      64
+#define XFER_THREAD_ROUNDS          16                  //Quanta served per connection before the thread polls (and releases its lock) again
+
+
+//Outcome of a single read or write attempt on a transfer connection
+enum xfer_io_result {
+    XFER_IO_WAITING = 0,        //Nothing to do until the other side of the transfer catches up
+    XFER_IO_WOULDBLOCK,         //The socket has no more data/space. Wait for its next edge
+    XFER_IO_THROTTLED,          //The user is out of bandwidth tokens. Retry after XFER_SCHEDULER_TICK_MS
+    XFER_IO_PROGRESS,
+    XFER_IO_COMPLETED,          //A group upload has received all of its bytes
+    XFER_IO_FAILED
+};
+
+//Sent from transfer threads back to the chat thread, which owns the cleanup of transfers (and the users' connections)
+enum xfer_event_type {XFER_EVENT_COMPLETED = 0, XFER_EVENT_CLOSED, XFER_EVENT_FAILED, XFER_EVENT_CHUNK_FAILED};
+
+typedef struct xferevent {
+    int socketfd;
+    struct filexferargs_server *xferargs;       //Validates the connection, as its fd may be reused by the time the event is handled
+    enum xfer_event_type event_type;
+    unsigned int chunk;                         //XFER_EVENT_CHUNK_FAILED: the chunk of a group upload to ask the uploader for again. The connection stays on its thread
+    struct xferevent *next;
+} XferEvent;
+
+
+//A transfer connection owned by a transfer thread
+typedef struct xferconnection {
+    int socketfd;                               //Key
+    Client *c;
+    uint32_t generation;                        //Tells this connection's epoll events apart from an earlier connection with the same fd
+    uint32_t ready;                             //EPOLLIN/EPOLLOUT seen since the socket last returned EAGAIN
+
+    UT_hash_handle hh;
+} XferConnection;
+
+typedef struct xferthread {
+    pthread_t thread;
+    int epollfd;
+    int wakefd;                                 //Lets the chat thread wake the thread up, when a connection has new work without an epoll event
+    pthread_mutex_t lock;                       //Held while the thread serves its connections. The chat thread takes it to hand off or reclaim connections
+    XferConnection *connections;                //Hashtable of connections served by this thread (key = socketfd)
+    uint32_t generation;
+    unsigned int throttled;                     //Connections waiting for tokens after the last round
+} XferThread;
+
+
+extern int xfer_events_fd;
+
+
+int xfer_threads_init();
+void xfer_thread_handoff(Client *c);
+void xfer_thread_reclaim(Client *c);
+void xfer_thread_reclaim_transfer(struct filexferargs_server *xferargs);
+void xfer_thread_lock_transfer(struct filexferargs_server *xferargs);
+void xfer_thread_unlock_transfer(struct filexferargs_server *xferargs);
+void xfer_thread_wake_transfer(struct filexferargs_server *xferargs);
+void xfer_thread_chunk_failed(Client *c, unsigned int chunk);
+void xfer_threads_count(unsigned int *connections_ret, unsigned int *throttled_ret);
+void handle_transfer_events();
+
+
+#endif